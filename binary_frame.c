@@ -0,0 +1,204 @@
+
+#include "binary_frame.h"
+
+#include <endian.h>
+#include <string.h>
+
+/* --------------------------------------------------------------------------- */
+void
+frame_encode_header( char * out,
+                     const FrameHeader * hdr )
+{
+    const uint32_t len = htobe32( hdr->len );
+    const uint64_t seq = htobe64( hdr->seq );
+
+    out[0] = (char)hdr->type;
+    out[1] = (char)hdr->flags;
+    out[2] = 0;
+    out[3] = 0;
+    memcpy( out + 4, &len, sizeof( len ) );
+    memcpy( out + 8, &seq, sizeof( seq ) );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+frame_decode_header( const char * in,
+                     const size_t len,
+                     FrameHeader * hdr )
+{
+    if ( len < FRAME_HEADER_SIZE )
+    {
+        return 0;
+    }
+
+    uint32_t payload_len;
+    uint64_t seq;
+    memcpy( &payload_len, in + 4, sizeof( payload_len ) );
+    memcpy( &seq, in + 8, sizeof( seq ) );
+
+    hdr->type = (uint8_t)in[0];
+    hdr->flags = (uint8_t)in[1];
+    hdr->len = be32toh( payload_len );
+    hdr->seq = be64toh( seq );
+
+    if ( hdr->len > MAX_FRAME_PAYLOAD )
+    {
+        return -1;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+size_t
+frame_encode( char * out,
+              const size_t size,
+              const FrameType type,
+              const uint8_t flags,
+              const uint64_t seq,
+              const char * payload,
+              const size_t len )
+{
+    if ( len > MAX_FRAME_PAYLOAD
+         || size < FRAME_HEADER_SIZE + len )
+    {
+        return 0;
+    }
+
+    const FrameHeader hdr = { .type = (uint8_t)type, .flags = flags, .len = (uint32_t)len, .seq = seq };
+    frame_encode_header( out, &hdr );
+    memcpy( out + FRAME_HEADER_SIZE, payload, len );
+    return FRAME_HEADER_SIZE + len;
+}
+
+/* --------------------------------------------------------------------------- */
+size_t
+frame_encode_room_message( char * out,
+                           const size_t size,
+                           const uint64_t seq,
+                           const char * room,
+                           const size_t room_len,
+                           const char * msg,
+                           const size_t len )
+{
+    const size_t payload_len = 1 + room_len + len;
+    if ( room_len > UINT8_MAX
+         || payload_len > MAX_FRAME_PAYLOAD
+         || size < FRAME_HEADER_SIZE + payload_len )
+    {
+        return 0;
+    }
+
+    const FrameHeader hdr = { .type = FRAME_MSG, .flags = FRAME_FLAG_ROOM, .len = (uint32_t)payload_len, .seq = seq };
+    frame_encode_header( out, &hdr );
+
+    char *p = out + FRAME_HEADER_SIZE;
+    p[0] = (char)room_len;
+    memcpy( p + 1, room, room_len );
+    memcpy( p + 1 + room_len, msg, len );
+    return FRAME_HEADER_SIZE + payload_len;
+}
+
+/* --------------------------------------------------------------------------- */
+size_t
+frame_encode_message( char * out,
+                      const size_t size,
+                      const uint64_t seq,
+                      const time_t msg_time,
+                      const int sender_id,
+                      const char * room,
+                      const size_t room_len,
+                      const char * msg,
+                      const size_t len )
+{
+    const size_t room_size = ( room_len > 0 ? 1 + room_len : 0 );
+    const size_t payload_len = FRAME_MESSAGE_PREFIX_SIZE + room_size + len;
+    if ( room_len > UINT8_MAX
+         || payload_len > MAX_FRAME_PAYLOAD
+         || size < FRAME_HEADER_SIZE + payload_len )
+    {
+        return 0;
+    }
+
+    const FrameHeader hdr = {
+        .type = FRAME_MSG,
+        .flags = ( room_len > 0 ? FRAME_FLAG_ROOM : 0 ),
+        .len = (uint32_t)payload_len,
+        .seq = seq,
+    };
+    frame_encode_header( out, &hdr );
+
+    char *p = out + FRAME_HEADER_SIZE;
+    const uint64_t t = htobe64( (uint64_t)(int64_t)msg_time );
+    const uint32_t id = htobe32( (uint32_t)sender_id );
+    memcpy( p, &t, sizeof( t ) );
+    memcpy( p + 8, &id, sizeof( id ) );
+    p += FRAME_MESSAGE_PREFIX_SIZE;
+    if ( room_len > 0 )
+    {
+        p[0] = (char)room_len;
+        memcpy( p + 1, room, room_len );
+        p += room_size;
+    }
+    memcpy( p, msg, len );
+    return FRAME_HEADER_SIZE + payload_len;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+frame_decode_message( const FrameHeader * hdr,
+                      const char * payload,
+                      time_t * msg_time,
+                      int * sender_id,
+                      const char ** room,
+                      size_t * room_len,
+                      const char ** msg,
+                      size_t * msg_len )
+{
+    const size_t len = hdr->len;
+    if ( len < FRAME_MESSAGE_PREFIX_SIZE )
+    {
+        return 0;
+    }
+
+    uint64_t t;
+    uint32_t id;
+    memcpy( &t, payload, sizeof( t ) );
+    memcpy( &id, payload + 8, sizeof( id ) );
+
+    *msg_time = (time_t)(int64_t)be64toh( t );
+    *sender_id = (int)be32toh( id );
+
+    if ( hdr->flags & FRAME_FLAG_ROOM )
+    {
+        return frame_split_room( payload + FRAME_MESSAGE_PREFIX_SIZE, len - FRAME_MESSAGE_PREFIX_SIZE,
+                                 room, room_len, msg, msg_len );
+    }
+
+    *room = NULL;
+    *room_len = 0;
+    *msg = payload + FRAME_MESSAGE_PREFIX_SIZE;
+    *msg_len = len - FRAME_MESSAGE_PREFIX_SIZE;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+frame_split_room( const char * payload,
+                  const size_t len,
+                  const char ** room,
+                  size_t * room_len,
+                  const char ** body,
+                  size_t * body_len )
+{
+    if ( len < 1
+         || len < 1 + (size_t)(uint8_t)payload[0] )
+    {
+        return 0;
+    }
+
+    *room_len = (uint8_t)payload[0];
+    *room = payload + 1;
+    *body = payload + 1 + *room_len;
+    *body_len = len - 1 - *room_len;
+    return 1;
+}
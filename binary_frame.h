@@ -0,0 +1,97 @@
+#ifndef BINARY_FRAME_H
+#define BINARY_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*!
+  ¥brief バイナリモードで送受信するフレームの形式。
+  クライアントが (hello binary) を送ると、その返信より後のやり取りはすべてフレームになる。
+  各フレームは固定長のヘッダ（種類・ペイロード長・シーケンス番号）とペイロードからなり、
+  ペイロードは引用符で囲んだりエスケープしたりせずそのまま置くので、受け手は走査せずに切り出せる。
+  ヘッダの整数はビッグエンディアン。
+
+  +------+-------+----------+--------+--------+
+  | type | flags | reserved | length |  seq   |
+  |  1   |   1   |    2     |   4    |   8    |
+  +------+-------+----------+--------+--------+
+ */
+
+#define FRAME_HEADER_SIZE 16
+#define MAX_FRAME_PAYLOAD ( 16 * 1024 )
+#define FRAME_MESSAGE_PREFIX_SIZE 12 // サーバからの FRAME_MSG で本文の前に置く時刻 (8) と送信者 (4)
+
+// FRAME_MSG が部屋宛てであることを表す。本文の直前に部屋名の長さ (1) と部屋名が入る
+#define FRAME_FLAG_ROOM 0x01
+
+typedef enum {
+    FRAME_TEXT = 1, //!< テキストモードの1行（改行は含まない）。(history n) などのコマンドやその返信
+    FRAME_MSG = 2, //!< クライアントからは (部屋名と) 本文。サーバからは時刻・送信者・(部屋名・) 本文で、seq はログのシーケンス番号
+    FRAME_OK = 3, //!< FRAME_MSG を受け付けた返信。ペイロードは本文
+    FRAME_FIND = 4, //!< 検索するキーワード。見つかったメッセージは FRAME_MSG で返る
+} FrameType;
+
+typedef struct {
+    uint8_t type;
+    uint8_t flags; //!< FRAME_FLAG_* の組み合わせ
+    uint32_t len; //!< ペイロードの長さ
+    uint64_t seq; //!< クライアントからは要求ごとに付ける番号で、返信はそれをそのまま返す
+} FrameHeader;
+
+/*!
+  ¥brief ヘッダを FRAME_HEADER_SIZE バイトに書き出す
+ */
+void frame_encode_header( char * out, const FrameHeader * hdr );
+
+/*!
+  ¥brief 受信データの先頭にあるヘッダを読む
+  ¥param in 受信データ
+  ¥param len 受信済みの長さ
+  ¥return 読めた場合は1、ヘッダがまだ揃っていない場合は0、ペイロード長が上限を超える場合は-1
+ */
+int frame_decode_header( const char * in, const size_t len, FrameHeader * hdr );
+
+/*!
+  ¥brief ヘッダとペイロードを out に書き出す
+  ¥return フレーム全体の長さ。size に入り切らない場合は0
+ */
+size_t frame_encode( char * out, const size_t size, const FrameType type, const uint8_t flags,
+                     const uint64_t seq, const char * payload, const size_t len );
+
+/*!
+  ¥brief クライアントから部屋宛てに送る FRAME_MSG を out に書き出す
+  ¥return フレーム全体の長さ。size に入り切らない場合は0
+ */
+size_t frame_encode_room_message( char * out, const size_t size, const uint64_t seq,
+                                  const char * room, const size_t room_len, const char * msg, const size_t len );
+
+/*!
+  ¥brief サーバから配信する FRAME_MSG を out に書き出す
+  ¥param seq ログでのシーケンス番号
+  ¥param room 部屋名。全員宛ての場合は NULL
+  ¥return フレーム全体の長さ。size に入り切らない場合は0
+ */
+size_t frame_encode_message( char * out, const size_t size, const uint64_t seq,
+                             const time_t msg_time, const int sender_id,
+                             const char * room, const size_t room_len, const char * msg, const size_t len );
+
+/*!
+  ¥brief サーバからの FRAME_MSG のペイロードを時刻・送信者・部屋名・本文に分ける
+  ¥param room 部屋名。全員宛ての場合は長さ0
+  ¥param msg 本文の先頭。payload の中を指す
+  ¥return ペイロードが短すぎなければ1
+ */
+int frame_decode_message( const FrameHeader * hdr, const char * payload,
+                          time_t * msg_time, int * sender_id,
+                          const char ** room, size_t * room_len, const char ** msg, size_t * msg_len );
+
+/*!
+  ¥brief FRAME_FLAG_ROOM の付いたペイロードの先頭から部屋名を切り出す
+  ¥param body 部屋名に続く本文の先頭
+  ¥return ペイロードが短すぎなければ1
+ */
+int frame_split_room( const char * payload, const size_t len,
+                      const char ** room, size_t * room_len, const char ** body, size_t * body_len );
+
+#endif
@@ -0,0 +1,642 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netdb.h>
+
+#include "command_parser.h"
+#include "histogram.h"
+
+/*
+  多数のクライアントから1つの epoll ループで負荷をかけ、ブロードキャストの配送遅延を測る。
+  msg の本文には送信時刻（CLOCK_MONOTONIC のナノ秒）を埋め込み、受信したクライアントがその差を記録する。
+  時刻を比べるので、サーバと同じホストで動かすこと。
+  history と find の返信は配送されたメッセージと同じ (msg ...) 行で区別できないので、
+  問い合わせは専用の接続から送り、その接続では配送遅延を数えない。
+  問い合わせの直後に (time) を送り、その返信が届いた時点を問い合わせの完了とする。
+  接続はノンブロッキングの connect で一斉に張り、つながった接続から (time) を送る。
+  すべての返信が揃うまでを、サーバが接続を受け付けるのにかかった時間とする。
+ */
+
+#define MAX_EVENTS 256
+#define IN_BUFSIZE 8192
+#define MAX_PENDING 64 // 1つの接続で返信を待っている問い合わせの上限
+#define N_KEYWORDS 10000 // find で探す語の種類。本文に1つずつ埋め込む
+#define DRAIN_SEC 2.0 // 送信を終えてから遅れて届く分を待つ時間
+#define ACCEPT_TIMEOUT_SEC 30.0 // 全接続が受け付けられるのを待つ上限
+
+typedef enum {
+    KIND_MSG,
+    KIND_HISTORY,
+    KIND_FIND,
+    KIND_TIME,
+    N_KINDS,
+} Kind;
+
+static const char *kind_names[N_KINDS] = { "msg", "history", "find", "time" };
+
+typedef struct {
+    int fd;
+    int query; // 問い合わせ専用の接続
+    int connected;
+    int ready; // 最初の (time) の返信が届いた
+
+    char in_buf[IN_BUFSIZE];
+    size_t in_len;
+
+    // 返信を待っている問い合わせ（リングバッファ）
+    Kind pending_kind[MAX_PENDING];
+    uint64_t pending_ns[MAX_PENDING];
+    int pending_head;
+    int pending_count;
+} BenchConn;
+
+typedef struct {
+    uint64_t sent[N_KINDS];
+    uint64_t dropped; // ソケットバッファが一杯などで送れなかった要求
+    uint64_t delivered;
+    uint64_t errors; // (error ...) の返信
+    uint64_t rate_limited; // errors のうち (error rate_limited ...)
+    uint64_t gaps; // (gap n) の n の合計。サーバが捨てたメッセージの数
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    int n_connected;
+    int n_ready; // 最初の (time) の返信が届いた接続数
+    double connect_sec; // connect をすべて終えるまで
+    double accept_sec; // すべての接続で最初の (time) の返信が届くまで
+    Histogram delivery; // 送信から他のクライアントに届くまで
+    Histogram replies[N_KINDS]; // 送信から返信が届くまで。msg は (ok msg ...)
+} BenchStats;
+
+static BenchStats stats;
+static uint64_t rng_state = 88172645463325252ULL;
+
+/* ------------------------------------------------------- */
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------- */
+static uint64_t
+next_random()
+{
+    // xorshift64。実行ごとに同じ列になるので結果を比べやすい
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* ------------------------------------------------------- */
+static void
+raise_fd_limit( const int n_conns )
+{
+    const rlim_t wanted = (rlim_t)n_conns + 64;
+    struct rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) != 0
+         || rl.rlim_cur >= wanted )
+    {
+        return;
+    }
+
+    rl.rlim_cur = ( rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= wanted ? wanted : rl.rlim_max );
+    if ( setrlimit( RLIMIT_NOFILE, &rl ) != 0 )
+    {
+        perror( "setrlimit" );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  "msg=70,history=10,find=10,time=10" の形式で各コマンドの割合を読む。
+  書かれていないコマンドは0になる。
+ */
+static int
+parse_mix( const char *spec,
+           int *weights )
+{
+    char buf[256];
+    snprintf( buf, sizeof( buf ), "%s", spec );
+    memset( weights, 0, N_KINDS * sizeof( int ) );
+
+    int total = 0;
+    char *save = NULL;
+    for ( char *item = strtok_r( buf, ",", &save ); item != NULL; item = strtok_r( NULL, ",", &save ) )
+    {
+        char *eq = strchr( item, '=' );
+        if ( eq == NULL )
+        {
+            return 0;
+        }
+        *eq = '\0';
+
+        int k = 0;
+        while ( k < N_KINDS && strcmp( item, kind_names[k] ) != 0 ) ++k;
+        if ( k == N_KINDS
+             || atoi( eq + 1 ) < 0 )
+        {
+            return 0;
+        }
+        weights[k] = atoi( eq + 1 );
+        total += weights[k];
+    }
+    return total > 0;
+}
+
+/* ------------------------------------------------------- */
+static Kind
+choose_kind( const int *weights,
+             const int total )
+{
+    int r = (int)( next_random() % (uint64_t)total );
+    for ( int k = 0; k < N_KINDS; ++k )
+    {
+        if ( r < weights[k] )
+        {
+            return (Kind)k;
+        }
+        r -= weights[k];
+    }
+    return KIND_MSG;
+}
+
+/* ------------------------------------------------------- */
+static int
+send_all( BenchConn *conn,
+          const char *buf,
+          const size_t len )
+{
+    // 負荷をかける側が詰まっても送信時刻がずれるだけなので、送り切れない要求は捨てて数える
+    const ssize_t n = send( conn->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL );
+    if ( n != (ssize_t)len )
+    {
+        ++stats.dropped;
+        return 0;
+    }
+    stats.bytes_out += n;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+static void
+send_message( BenchConn *conn,
+              const int msg_size )
+{
+    // 本文は "bench 送信時刻 語 詰め物"。語は find の検索対象になる
+    char msg[512];
+    int len = snprintf( msg, sizeof( msg ), "bench %llu k%04d ",
+                        (unsigned long long)now_ns(), (int)( next_random() % N_KEYWORDS ) );
+    while ( len < msg_size && len < (int)sizeof( msg ) - 1 )
+    {
+        msg[len++] = 'x';
+    }
+    msg[len] = '\0';
+
+    char line[600];
+    snprintf( line, sizeof( line ), "(msg \"%s\")\n", msg );
+    if ( send_all( conn, line, strlen( line ) ) )
+    {
+        ++stats.sent[KIND_MSG];
+    }
+}
+
+/* ------------------------------------------------------- */
+static void
+send_query( BenchConn *conn,
+            const Kind kind )
+{
+    if ( conn->pending_count >= MAX_PENDING )
+    {
+        ++stats.dropped;
+        return;
+    }
+
+    // 返信の終わりが分かるよう、問い合わせの後ろに (time) を付ける
+    char line[128];
+    switch ( kind ) {
+    case KIND_HISTORY:
+        snprintf( line, sizeof( line ), "(history 20)\n(time)\n" );
+        break;
+    case KIND_FIND:
+        snprintf( line, sizeof( line ), "(find \"k%04d\")\n(time)\n", (int)( next_random() % N_KEYWORDS ) );
+        break;
+    default:
+        snprintf( line, sizeof( line ), "(time)\n" );
+        break;
+    }
+
+    const uint64_t sent_ns = now_ns();
+    if ( send_all( conn, line, strlen( line ) ) )
+    {
+        const int i = ( conn->pending_head + conn->pending_count ) % MAX_PENDING;
+        conn->pending_kind[i] = kind;
+        conn->pending_ns[i] = sent_ns;
+        ++conn->pending_count;
+        ++stats.sent[kind];
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  本文に埋め込んだ送信時刻を取り出す。ベンチマークのメッセージでなければ0を返す
+ */
+static uint64_t
+parse_sent_ns( const ParsedCommand *cmd,
+               const int arg )
+{
+    char text[512];
+    unsigned long long sent_ns;
+    if ( command_arg_string( cmd, arg, text, sizeof( text ) ) < 0
+         || sscanf( text, "bench %llu ", &sent_ns ) != 1 )
+    {
+        return 0;
+    }
+    return (uint64_t)sent_ns;
+}
+
+/* ------------------------------------------------------- */
+static void
+handle_line( BenchConn *conn,
+             const char *line,
+             const size_t len,
+             const uint64_t received_ns )
+{
+    ParsedCommand cmd;
+    if ( ! command_parse( line, len, &cmd ) )
+    {
+        return;
+    }
+
+    if ( cmd.command == CMD_MESSAGE )
+    {
+        // 問い合わせ用の接続に届く (msg ...) は history や find の返信と混ざるので数えない
+        if ( conn->query
+             || cmd.n_args < 4 )
+        {
+            return;
+        }
+        // (msg 時刻 送信者 "本文" シーケンス番号)
+        const uint64_t sent_ns = parse_sent_ns( &cmd, cmd.n_args - 2 );
+        if ( sent_ns != 0 )
+        {
+            histogram_record( &stats.delivery, received_ns - sent_ns );
+            ++stats.delivered;
+        }
+    }
+    else if ( cmd.command == CMD_TIME )
+    {
+        if ( ! conn->ready )
+        {
+            conn->ready = 1;
+            ++stats.n_ready;
+        }
+        else if ( conn->pending_count > 0 )
+        {
+            const int i = conn->pending_head;
+            histogram_record( &stats.replies[conn->pending_kind[i]], received_ns - conn->pending_ns[i] );
+            conn->pending_head = ( conn->pending_head + 1 ) % MAX_PENDING;
+            --conn->pending_count;
+        }
+    }
+    else if ( cmd.command == CMD_PING )
+    {
+        // 長い計測で無通信の接続が切断されないよう応答する
+        send_all( conn, "(pong)\n", strlen( "(pong)\n" ) );
+    }
+    else if ( cmd.name.len == strlen( "ok" )
+              && memcmp( cmd.name.ptr, "ok", strlen( "ok" ) ) == 0 )
+    {
+        // (ok msg "本文")
+        const uint64_t sent_ns = ( cmd.n_args >= 2 ? parse_sent_ns( &cmd, cmd.n_args - 1 ) : 0 );
+        if ( sent_ns != 0 )
+        {
+            histogram_record( &stats.replies[KIND_MSG], received_ns - sent_ns );
+        }
+    }
+    else if ( cmd.name.len == strlen( "gap" )
+              && memcmp( cmd.name.ptr, "gap", strlen( "gap" ) ) == 0 )
+    {
+        long n;
+        if ( cmd.n_args == 1
+             && command_arg_long( &cmd, 0, &n ) )
+        {
+            stats.gaps += n;
+        }
+    }
+    else if ( cmd.name.len == strlen( "error" )
+              && memcmp( cmd.name.ptr, "error", strlen( "error" ) ) == 0 )
+    {
+        ++stats.errors;
+        if ( cmd.n_args >= 1
+             && cmd.args[0].text.len == strlen( "rate_limited" )
+             && memcmp( cmd.args[0].text.ptr, "rate_limited", strlen( "rate_limited" ) ) == 0 )
+        {
+            ++stats.rate_limited;
+        }
+    }
+}
+
+/* ------------------------------------------------------- */
+static int
+receive( BenchConn *conn )
+{
+    const ssize_t n = recv( conn->fd, conn->in_buf + conn->in_len, sizeof( conn->in_buf ) - conn->in_len, 0 );
+    if ( n < 0 )
+    {
+        return errno == EAGAIN || errno == EINTR;
+    }
+    if ( n == 0 )
+    {
+        return 0;
+    }
+    conn->in_len += n;
+    stats.bytes_in += n;
+
+    const uint64_t received_ns = now_ns();
+    size_t consumed = 0;
+    for ( ;; )
+    {
+        char *p = conn->in_buf + consumed;
+        char *nl = memchr( p, '\n', conn->in_len - consumed );
+        if ( nl == NULL )
+        {
+            break;
+        }
+        handle_line( conn, p, nl - p, received_ns );
+        consumed += nl - p + 1;
+    }
+
+    memmove( conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed );
+    conn->in_len -= consumed;
+    if ( conn->in_len == sizeof( conn->in_buf ) )
+    {
+        conn->in_len = 0; // 長すぎる行は捨てる
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+static void
+report_histogram( const char *name,
+                  const Histogram *h )
+{
+    printf( " %s_count=%llu %s_p50_us=%.1f %s_p99_us=%.1f %s_p999_us=%.1f %s_max_us=%.1f",
+            name, (unsigned long long)h->count,
+            name, histogram_percentile( h, 50.0 ) / 1000.0,
+            name, histogram_percentile( h, 99.0 ) / 1000.0,
+            name, histogram_percentile( h, 99.9 ) / 1000.0,
+            name, h->max / 1000.0 );
+}
+
+/* ------------------------------------------------------- */
+static void
+report( const int n_conns,
+        const int n_query,
+        const int rate,
+        const double sec )
+{
+    // 比較しやすいように1行1回の key=value 形式で出力する
+    uint64_t total_sent = 0;
+    for ( int k = 0; k < N_KINDS; ++k ) total_sent += stats.sent[k];
+
+    printf( "connections=%d query_connections=%d target_rate=%d seconds=%.3f connect_seconds=%.3f"
+            " accept_seconds=%.3f accepts_per_sec=%.0f sent=%llu sent_per_sec=%.0f",
+            n_conns, n_query, rate, sec, stats.connect_sec, stats.accept_sec,
+            ( stats.accept_sec > 0 ? n_conns / stats.accept_sec : 0.0 ),
+            (unsigned long long)total_sent, total_sent / sec );
+    for ( int k = 0; k < N_KINDS; ++k )
+    {
+        printf( " sent_%s=%llu", kind_names[k], (unsigned long long)stats.sent[k] );
+    }
+    printf( " dropped=%llu errors=%llu rate_limited=%llu gaps=%llu delivered=%llu delivered_per_sec=%.0f"
+            " bytes_in=%llu bytes_out=%llu",
+            (unsigned long long)stats.dropped, (unsigned long long)stats.errors,
+            (unsigned long long)stats.rate_limited, (unsigned long long)stats.gaps,
+            (unsigned long long)stats.delivered, stats.delivered / sec,
+            (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out );
+
+    report_histogram( "delivery", &stats.delivery );
+    for ( int k = 0; k < N_KINDS; ++k )
+    {
+        report_histogram( kind_names[k], &stats.replies[k] );
+    }
+    printf( "\n" );
+}
+
+/* ------------------------------------------------------- */
+int
+main( int argc, char **argv )
+{
+    const char *host = "127.0.0.1";
+    const char *port = "21044";
+    int n_conns = 1000;
+    int n_query = -1;
+    int rate = 1000;
+    double duration = 10.0;
+    int msg_size = 64;
+    const char *mix = "msg=70,history=10,find=10,time=10";
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "s:p:c:q:r:d:l:m:h" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 's': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'c': n_conns = atoi( optarg ); break;
+        case 'q': n_query = atoi( optarg ); break;
+        case 'r': rate = atoi( optarg ); break;
+        case 'd': duration = atof( optarg ); break;
+        case 'l': msg_size = atoi( optarg ); break;
+        case 'm': mix = optarg; break;
+        default:
+            fprintf( stderr, "Usage: %s [-s host] [-p port] [-c connections] [-q query_connections]\n"
+                     "          [-r requests_per_sec] [-d seconds] [-l msg_size] [-m mix]\n"
+                     "  mix: e.g. msg=70,history=10,find=10,time=10\n", argv[0] );
+            return 1;
+        }
+    }
+
+    int weights[N_KINDS];
+    if ( n_query < 0 )
+    {
+        n_query = ( n_conns >= 10 ? n_conns / 10 : 1 );
+    }
+    if ( n_conns < 2 || n_query < 1 || n_query >= n_conns
+         || rate <= 0 || duration <= 0 || msg_size <= 0 || msg_size > 511
+         || ! parse_mix( mix, weights ) )
+    {
+        fprintf( stderr, "illegal arguments\n" );
+        return 1;
+    }
+    int total_weight = 0;
+    for ( int k = 0; k < N_KINDS; ++k ) total_weight += weights[k];
+
+    raise_fd_limit( n_conns );
+
+    BenchConn *conns = calloc( n_conns, sizeof( BenchConn ) );
+    const int epoll_fd = epoll_create( MAX_EVENTS );
+    if ( conns == NULL
+         || epoll_fd == -1 )
+    {
+        perror( "setup" );
+        return 1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *dest = NULL;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    const int gai_err = getaddrinfo( host, port, &hints, &dest );
+    if ( gai_err != 0 )
+    {
+        fprintf( stderr, "getaddrinfo: %s\n", gai_strerror( gai_err ) );
+        return 1;
+    }
+
+    // 再接続が殺到した状況を再現するため、つながるのを待たずに全部の connect を出す。
+    // 先頭の n_query 本を問い合わせ用にする
+    const uint64_t connect_start = now_ns();
+    for ( int i = 0; i < n_conns; ++i )
+    {
+        BenchConn *conn = &conns[i];
+        conn->query = ( i < n_query );
+        conn->fd = socket( dest->ai_family, dest->ai_socktype | SOCK_NONBLOCK, dest->ai_protocol );
+        if ( conn->fd < 0
+             || ( connect( conn->fd, dest->ai_addr, dest->ai_addrlen ) != 0
+                  && errno != EINPROGRESS ) )
+        {
+            perror( "connect" );
+            fprintf( stderr, "connected only %d of %d\n", i, n_conns );
+            return 1;
+        }
+
+        struct epoll_event ev;
+        memset( &ev, 0, sizeof( ev ) );
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.ptr = conn;
+        if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev ) == -1 )
+        {
+            perror( "epoll_ctl" );
+            return 1;
+        }
+    }
+    freeaddrinfo( dest );
+
+    // connect は待受のキューに入った時点で終わるので、サーバが受け付けたことは (time) の返信で確かめる
+    struct epoll_event events[MAX_EVENTS];
+    const uint64_t accept_deadline = now_ns() + (uint64_t)( ACCEPT_TIMEOUT_SEC * 1e9 );
+    while ( stats.n_ready < n_conns
+            && now_ns() < accept_deadline )
+    {
+        const int nfds = epoll_wait( epoll_fd, events, MAX_EVENTS, 100 );
+        for ( int i = 0; i < nfds; ++i )
+        {
+            BenchConn *conn = events[i].data.ptr;
+            if ( ! conn->connected
+                 && ( events[i].events & ( EPOLLOUT | EPOLLERR ) ) )
+            {
+                int err = 0;
+                socklen_t len = sizeof( err );
+                getsockopt( conn->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+                if ( err != 0 )
+                {
+                    fprintf( stderr, "connect: %s\n", strerror( err ) );
+                    return 1;
+                }
+
+                conn->connected = 1;
+                if ( ++stats.n_connected == n_conns )
+                {
+                    stats.connect_sec = ( now_ns() - connect_start ) / 1e9;
+                }
+                send_all( conn, "(time)\n", strlen( "(time)\n" ) );
+
+                struct epoll_event ev;
+                memset( &ev, 0, sizeof( ev ) );
+                ev.events = EPOLLIN;
+                ev.data.ptr = conn;
+                epoll_ctl( epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev );
+            }
+            if ( events[i].events & EPOLLIN )
+            {
+                receive( conn );
+            }
+        }
+    }
+    stats.accept_sec = ( now_ns() - connect_start ) / 1e9;
+    if ( stats.n_ready < n_conns )
+    {
+        fprintf( stderr, "WARNING: only %d of %d connections were accepted\n", stats.n_ready, n_conns );
+    }
+    fprintf( stderr, "connected %d clients (%d for queries)\n", stats.n_ready, n_query );
+
+    // 経過時間から送るべき件数を求め、遅れている分をまとめて送る
+    const uint64_t start = now_ns();
+    const uint64_t send_end = start + (uint64_t)( duration * 1e9 );
+    const uint64_t drain_end = send_end + (uint64_t)( DRAIN_SEC * 1e9 );
+    uint64_t n_issued = 0;
+    int n_lost = 0;
+    for ( ;; )
+    {
+        const uint64_t now = now_ns();
+        if ( now >= drain_end )
+        {
+            break;
+        }
+
+        if ( now < send_end )
+        {
+            const uint64_t due = (uint64_t)( ( now - start ) / 1e9 * rate );
+            for ( ; n_issued < due; ++n_issued )
+            {
+                const Kind kind = choose_kind( weights, total_weight );
+                if ( kind == KIND_MSG )
+                {
+                    const int i = n_query + (int)( next_random() % (uint64_t)( n_conns - n_query ) );
+                    send_message( &conns[i], msg_size );
+                }
+                else
+                {
+                    send_query( &conns[next_random() % (uint64_t)n_query], kind );
+                }
+            }
+        }
+
+        const int nfds = epoll_wait( epoll_fd, events, MAX_EVENTS, 1 );
+        for ( int i = 0; i < nfds; ++i )
+        {
+            BenchConn *conn = events[i].data.ptr;
+            if ( ! receive( conn ) )
+            {
+                epoll_ctl( epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL );
+                ++n_lost;
+            }
+        }
+    }
+
+    if ( n_lost > 0 )
+    {
+        fprintf( stderr, "WARNING: %d connections were closed by the server\n", n_lost );
+    }
+    report( n_conns, n_query, rate, duration );
+
+    for ( int i = 0; i < n_conns; ++i )
+    {
+        close( conns[i].fd );
+    }
+    free( conns );
+    close( epoll_fd );
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <ctype.h>
 #include <time.h>
 #include <unistd.h>
@@ -7,32 +9,96 @@
 #include <sys/socket.h>
 #include <sys/epoll.h>
 #include <signal.h>
+#include <getopt.h>
 
 #include "my_netlib.h"
+#include "command_parser.h"
+#include "binary_frame.h"
 
 #define MAX_EVENTS 4
-#define BUFSIZE 1024
+#define BUFSIZE 2048
+#define RECV_BUFSIZE ( 2 * ( FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD ) )
+#define RECONNECT_MIN_SEC 1 // 切断されてから再接続するまでの最初の待ち時間。失敗するたびに倍にする
+#define RECONNECT_MAX_SEC 30
+#define MAX_TOKEN_LENGTH 64
 
 /* --------------------------------------------------------------------------- */
+int start_session( const int socket_fd );
 void run( const int socket_fd );
 
 /* ------------------------------------------------------- */
 void read_stdin();
 
+/* ------------------------------------------------------- */
+void send_frame( const int socket_fd, const FrameType type, const char * payload, const size_t len );
+
 /* ------------------------------------------------------- */
 void receive( const int socket_fd );
 
 /* ------------------------------------------------------- */
-void parse_message( const char * msg );
+void parse_message( const int socket_fd, const char * msg );
+void parse_hello( const char * msg );
+void send_line( const int socket_fd, const char * line );
+
+/* ------------------------------------------------------- */
+void parse_frame( const int socket_fd, const FrameHeader * hdr, const char * payload );
+
+/* ------------------------------------------------------- */
+void show_message( const uint64_t seq, const time_t msg_time, const int client_id, const char * room,
+                   const size_t room_len, const char * msg, const size_t len );
+void hold_message( const uint64_t seq, const time_t msg_time, const int client_id, const char * room,
+                   const size_t room_len, const char * msg, const size_t len );
+void finish_resume( const int resumed );
+int compare_held( const void * a, const void * b );
+
+/* ------------------------------------------------------- */
+void print_message( const time_t msg_time, const int client_id, const char * room, const size_t room_len,
+                    const char * msg, const size_t len );
 
 /* ------------------------------------------------------- */
 static int session_alive = 0;
+static int stopping = 0; // (quit) か Ctrl-C で終える。それ以外で切断されたら再接続する
+
+// -b を指定すると (hello binary) を送り、その返信以降はフレームでやり取りする
+static int binary_requested = 0;
+static int binary_mode = 0;
+static int mode_decided = 0; // hello への返信（またはエラー）を受け取ったか
+static uint64_t request_seq = 0;
+
+// (hello) で受け取ったセッション。再接続したら (resume トークン last_seq) で続きを受け取る
+static char session_token[MAX_TOKEN_LENGTH + 1] = "";
+static uint64_t last_seq = 0; // 受け取ったメッセージの最大のシーケンス番号
+static char hello_token[MAX_TOKEN_LENGTH + 1] = ""; // 最後の (hello) で発行されたトークン。引き継げなければこちらを使う
+static uint64_t hello_seq = 0;
+
+// 再接続してから (resumed ...) か (error unknown_session) が届くまでのメッセージ。
+// (resume) を処理するより前に届いたブロードキャストは送り直しにも含まれるので、
+// 引き継げたらシーケンス番号の順に重複を除いて、引き継げなければ届いた順に表示する
+typedef struct {
+    uint64_t seq;
+    time_t time;
+    int client_id;
+    char *room; // room と msg をまとめて1つの領域に確保する
+    size_t room_len;
+    char *msg;
+    size_t len;
+} HeldMessage;
+
+static int resuming = 0;
+static HeldMessage *held = NULL;
+static int n_held = 0;
+static int held_capacity = 0;
+
+// 受信バッファ。行またはフレームが揃うまで溜めておく
+static char in_buf[RECV_BUFSIZE];
+static size_t in_len = 0;
 
 void
 sigint_handle( int sig )
 {
     (void)sig;
     session_alive = 0;
+    stopping = 1;
     fprintf( stderr, "\nKilled. exiting...\n" );
 }
 
@@ -46,33 +112,122 @@ main( int argc, char **argv )
     // Ctrl-Cの割り込みシグナル(SIGINT)で呼び出される関数を登録
     signal( SIGINT, &sigint_handle );
 
+    // サーバが落ちたソケットへの send でプロセスが終了しないようにする。再接続して続ける
+    signal( SIGPIPE, SIG_IGN );
+
     strcpy( hostname, "localhost" );
     strcpy( port_number, "21044" ); // 自分の学籍番号に含まれる数字列に変更する
 
-    if ( argc != 3 )
+    int opt;
+    while ( ( opt = getopt( argc, argv, "b" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 'b':
+            binary_requested = 1;
+            break;
+        default:
+            fprintf( stderr, "Usage: %s [-b] hostname port\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( argc - optind != 2 )
     {
-        fprintf( stderr, "Usage: %s hostname port\n", argv[0] );
+        fprintf( stderr, "Usage: %s [-b] hostname port\n", argv[0] );
         return 1;
     }
 
-    strncpy( hostname, argv[1], sizeof( hostname ) - 1 );
-    strncpy( port_number, argv[2], sizeof( port_number ) - 1 );
+    strncpy( hostname, argv[optind], sizeof( hostname ) - 1 );
+    strncpy( port_number, argv[optind + 1], sizeof( port_number ) - 1 );
 
-    fprintf( stderr, "INFO: host=%s port_number=%s\n", hostname, port_number );
+    fprintf( stderr, "INFO: host=%s port_number=%s mode=%s\n",
+             hostname, port_number, ( binary_requested ? "binary" : "text" ) );
 
     int socket_fd = connect_to_server( hostname, port_number );
     if ( socket_fd < 0 )
     {
         return 1;
     }
-    session_alive = 1;
 
-    run( socket_fd );
-    close( socket_fd );
+    int delay = RECONNECT_MIN_SEC;
+    for ( ;; )
+    {
+        if ( socket_fd >= 0 )
+        {
+            if ( start_session( socket_fd ) )
+            {
+                delay = RECONNECT_MIN_SEC;
+                run( socket_fd );
+            }
+            close( socket_fd );
+        }
+        if ( stopping )
+        {
+            break;
+        }
+
+        // 切断されたら待ち時間を倍にしながら再接続する
+        fprintf( stderr, "reconnecting in %d seconds...\n", delay );
+        sleep( delay );
+        if ( stopping )
+        {
+            break;
+        }
+        delay = ( delay * 2 < RECONNECT_MAX_SEC ? delay * 2 : RECONNECT_MAX_SEC );
+        socket_fd = connect_to_server( hostname, port_number );
+    }
 
     return 0;
 }
 
+/* --------------------------------------------------------------------------- */
+/*!
+  接続直後に (hello) を送り、セッションのトークンを受け取る。
+  前の接続のセッションがあれば (resume トークン last_seq) で切断中に届いたメッセージを受け取る。
+  ¥return 続けて入力を読んでよければ1
+ */
+int
+start_session( const int socket_fd )
+{
+    session_alive = 1;
+    binary_mode = 0;
+    mode_decided = 0;
+    in_len = 0;
+
+    // 前の接続で引き継ぎ中だったものは、もう一度送り直される
+    for ( int i = 0; i < n_held; ++i ) free( held[i].room );
+    n_held = 0;
+    resuming = ( session_token[0] != '\0' );
+
+    // バイナリモードも hello で要求する
+    send_line( socket_fd, ( binary_requested ? "(hello binary)" : "(hello)" ) );
+
+    // 返信が届くまではどちらの形式で送ればよいか決まらないので、入力を読まずに待つ
+    while ( session_alive && ! mode_decided )
+    {
+        receive( socket_fd );
+    }
+    if ( ! session_alive )
+    {
+        return 0;
+    }
+
+    if ( session_token[0] != '\0' )
+    {
+        // 続きは (resumed ...) の前に通常のメッセージと同じ形で届く
+        char line[BUFSIZE];
+        snprintf( line, sizeof( line ), "(resume %s %llu)", session_token, (unsigned long long)last_seq );
+        fprintf( stderr, "resume the session from seq %llu\n", (unsigned long long)last_seq );
+        send_line( socket_fd, line );
+    }
+    else
+    {
+        strcpy( session_token, hello_token );
+        if ( last_seq < hello_seq ) last_seq = hello_seq;
+    }
+    return 1;
+}
+
 /* --------------------------------------------------------------------------- */
 void
 run( const int socket_fd )
@@ -118,8 +273,12 @@ run( const int socket_fd )
 
         if ( nfds < 0 )
         {
-            perror( "epoll_wait" );
-            return;
+            if ( errno != EINTR )
+            {
+                perror( "epoll_wait" );
+                session_alive = 0;
+            }
+            continue;
         }
         else if ( nfds == 0 )
         {
@@ -147,6 +306,7 @@ run( const int socket_fd )
             }
         }
     }
+    close( epoll_fd );
 }
 
 /* ------------------------------------------------------- */
@@ -162,32 +322,128 @@ read_stdin( const int socket_fd )
     }
 
     buf[strcspn( buf, "\r\n" )] = '\0';
+    fprintf( stderr, "send to server [%s]\n", buf );
 
-    int len = send( socket_fd, buf, strlen( buf ), 0 );
-    if ( len < 0 )
+    if ( binary_mode )
     {
-        perror( "send" );
-    }
+        // msg と find は本文をそのままペイロードに載せ、それ以外は1行を FRAME_TEXT で送る。
+        // (msg room "...") は部屋名をペイロードの先頭に付ける
+        ParsedCommand cmd;
+        char payload[BUFSIZE];
+        long payload_len = -1;
+        const int parsed = command_parse( buf, strlen( buf ), &cmd );
+        if ( parsed
+             && ( cmd.command == CMD_MESSAGE || cmd.command == CMD_FIND )
+             && cmd.n_args == 1 )
+        {
+            payload_len = command_arg_string( &cmd, 0, payload, sizeof( payload ) );
+        }
+        else if ( parsed
+                  && cmd.command == CMD_MESSAGE
+                  && cmd.n_args == 2
+                  && cmd.args[0].type == TOKEN_ATOM )
+        {
+            payload_len = command_arg_string( &cmd, 1, payload, sizeof( payload ) );
+        }
 
-    fprintf( stderr, "send to server [%s]\n", buf );
+        if ( payload_len >= 0
+             && cmd.n_args == 2 )
+        {
+            char frame[FRAME_HEADER_SIZE + BUFSIZE];
+            const size_t frame_len = frame_encode_room_message( frame, sizeof( frame ), ++request_seq,
+                                                                cmd.args[0].text.ptr, cmd.args[0].text.len,
+                                                                payload, payload_len );
+            if ( frame_len == 0 )
+            {
+                fprintf( stderr, "too long to send (%ld bytes)\n", payload_len );
+            }
+            else if ( send( socket_fd, frame, frame_len, 0 ) < 0 )
+            {
+                perror( "send" );
+            }
+        }
+        else if ( payload_len >= 0 )
+        {
+            send_frame( socket_fd, ( cmd.command == CMD_MESSAGE ? FRAME_MSG : FRAME_FIND ), payload, payload_len );
+        }
+        else
+        {
+            send_frame( socket_fd, FRAME_TEXT, buf, strlen( buf ) );
+        }
+    }
+    else
+    {
+        // サーバは改行でコマンドを区切るので行末を付けて送る
+        strcat( buf, "\n" );
+        int len = send( socket_fd, buf, strlen( buf ), 0 );
+        if ( len < 0 )
+        {
+            perror( "send" );
+        }
+    }
 
     if ( strncmp( buf, "(quit)", strlen( "(quit)" ) ) == 0 )
     {
         session_alive = 0;
+        stopping = 1;
     }
 }
 
 /* ------------------------------------------------------- */
+/*!
+  改行を含まない1行を、今のモードに合わせてそのまま、または FRAME_TEXT で送る
+ */
 void
-receive( const int socket_fd )
+send_line( const int socket_fd,
+           const char * line )
 {
+    if ( binary_mode )
+    {
+        send_frame( socket_fd, FRAME_TEXT, line, strlen( line ) );
+        return;
+    }
+
     char buf[BUFSIZE];
-    memset( buf, 0, BUFSIZE );
+    snprintf( buf, sizeof( buf ), "%s\n", line );
+    if ( send( socket_fd, buf, strlen( buf ), 0 ) < 0 )
+    {
+        perror( "send" );
+    }
+}
 
-    int len = recv( socket_fd, buf, sizeof( buf ), 0 );
+/* ------------------------------------------------------- */
+void
+send_frame( const int socket_fd,
+            const FrameType type,
+            const char * payload,
+            const size_t len )
+{
+    char frame[FRAME_HEADER_SIZE + BUFSIZE];
+    const size_t frame_len = frame_encode( frame, sizeof( frame ), type, 0, ++request_seq, payload, len );
+    if ( frame_len == 0 )
+    {
+        fprintf( stderr, "too long to send (%zu bytes)\n", len );
+        return;
+    }
+
+    if ( send( socket_fd, frame, frame_len, 0 ) < 0 )
+    {
+        perror( "send" );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+receive( const int socket_fd )
+{
+    int len = recv( socket_fd, in_buf + in_len, sizeof( in_buf ) - in_len - 1, 0 );
     if ( len == -1 )
     {
-        perror( "recv" );
+        if ( errno != EINTR )
+        {
+            perror( "recv" );
+            session_alive = 0;
+        }
         return;
     }
 
@@ -197,31 +453,71 @@ receive( const int socket_fd )
         session_alive = 0;
         return;
     }
+    in_len += len;
 
-    const char *p = buf;
-    while ( *p )
+    // 揃った行またはフレームを順に処理する。
+    // (hello N binary) を受け取った直後からはフレームとして読む
+    size_t consumed = 0;
+    while ( consumed < in_len )
     {
-        size_t nl = strcspn( p, "\r\n" );
-        if ( nl == 0 )
+        char *p = in_buf + consumed;
+        const size_t rest = in_len - consumed;
+
+        if ( binary_mode )
         {
-            break;
-        }
+            FrameHeader hdr;
+            const int ret = frame_decode_header( p, rest, &hdr );
+            if ( ret < 0 )
+            {
+                fprintf( stderr, "received an illegal frame (%u bytes)\n", (unsigned)hdr.len );
+                session_alive = 0;
+                return;
+            }
+            if ( ret == 0
+                 || rest < FRAME_HEADER_SIZE + hdr.len )
+            {
+                break;
+            }
 
-        char msg[BUFSIZE];
-        memset( msg, 0, BUFSIZE );
-        strncpy( msg, p, nl );
+            parse_frame( socket_fd, &hdr, p + FRAME_HEADER_SIZE );
+            consumed += FRAME_HEADER_SIZE + hdr.len;
+        }
+        else
+        {
+            char *nl = memchr( p, '\n', rest );
+            if ( nl == NULL )
+            {
+                break;
+            }
 
-        parse_message( msg );
+            consumed += nl - p + 1;
+            *nl = '\0';
+            if ( nl > p && *(nl - 1) == '\r' )
+            {
+                *--nl = '\0';
+            }
+            if ( nl > p )
+            {
+                parse_message( socket_fd, p );
+            }
+        }
+    }
 
-        p += nl; // skip the parsed message
-        while ( isspace( *p ) ) ++p; // skip space characters
+    // 残りを先頭へ詰める。行が長すぎてバッファが一杯なら捨てる
+    memmove( in_buf, in_buf + consumed, in_len - consumed );
+    in_len -= consumed;
+    if ( in_len >= sizeof( in_buf ) - 1 )
+    {
+        fprintf( stderr, "received too long line. discarded\n" );
+        in_len = 0;
     }
 }
 
 
 /* ------------------------------------------------------- */
 void
-parse_message( const char * msg )
+parse_message( const int socket_fd,
+               const char * msg )
 {
     char command[128];
     if ( sscanf( msg, "(%127[^)]", command ) != 1 )
@@ -232,20 +528,70 @@ parse_message( const char * msg )
 
     if ( strncmp( command, "msg", 3 ) == 0 )
     {
+        // 本文は \" と \\ でエスケープされている。部屋宛てなら先頭に部屋名が付き、末尾はシーケンス番号
+        ParsedCommand cmd;
         long raw_time;
-        int client_id;
-        char client_msg[512];
-        if ( sscanf( msg, "(msg %ld %d \"%511[^\"]\")", &raw_time, &client_id, client_msg ) != 3 )
+        long client_id;
+        long seq = 0;
+        char client_msg[BUFSIZE];
+        long msg_len = -1;
+        int room = 0;
+        if ( command_parse( msg, strlen( msg ), &cmd )
+             && ( cmd.n_args == 4
+                  || ( cmd.n_args == 5 && cmd.args[0].type == TOKEN_ATOM ) ) )
+        {
+            room = cmd.n_args - 4;
+            if ( command_arg_long( &cmd, room, &raw_time )
+                 && command_arg_long( &cmd, room + 1, &client_id )
+                 && command_arg_long( &cmd, room + 3, &seq ) )
+            {
+                msg_len = command_arg_string( &cmd, room + 2, client_msg, sizeof( client_msg ) );
+            }
+        }
+        if ( msg_len < 0 )
         {
             fprintf( stdout, "msg: illegal message [%s]\n", msg );
             return;
         }
 
-        time_t msg_time = (time_t)(raw_time);
-        struct tm *msg_tm = localtime( &msg_time );
-        char time_str[128];
-        strftime( time_str, 127, "%Y-%m-%d %H:%M:%S", msg_tm );
-        fprintf( stdout, "message from %d (%s): %s\n", client_id, time_str, client_msg );
+        show_message( (uint64_t)seq, (time_t)raw_time, (int)client_id,
+                      ( room ? cmd.args[0].text.ptr : NULL ), ( room ? cmd.args[0].text.len : 0 ),
+                      client_msg, msg_len );
+    }
+    else if ( strncmp( command, "match ", 6 ) == 0 )
+    {
+        // (match "kw" [ROOM] TIME SENDER "本文" SEQ)。(watch "kw") したキーワードを含むメッセージで、kw より後ろは msg と同じ
+        ParsedCommand cmd;
+        char keyword[BUFSIZE];
+        long raw_time;
+        long client_id;
+        char client_msg[BUFSIZE];
+        long keyword_len = -1;
+        long msg_len = -1;
+        int room = 0;
+        if ( command_parse( msg, strlen( msg ), &cmd )
+             && ( cmd.n_args == 5
+                  || ( cmd.n_args == 6 && cmd.args[1].type == TOKEN_ATOM ) ) )
+        {
+            room = cmd.n_args - 5;
+            if ( command_arg_long( &cmd, room + 1, &raw_time )
+                 && command_arg_long( &cmd, room + 2, &client_id ) )
+            {
+                keyword_len = command_arg_string( &cmd, 0, keyword, sizeof( keyword ) );
+                msg_len = command_arg_string( &cmd, room + 3, client_msg, sizeof( client_msg ) );
+            }
+        }
+        if ( keyword_len < 0
+             || msg_len < 0 )
+        {
+            fprintf( stdout, "match: illegal message [%s]\n", msg );
+            return;
+        }
+
+        fprintf( stdout, "watch \"%.*s\": ", (int)keyword_len, keyword );
+        print_message( (time_t)raw_time, (int)client_id,
+                       ( room ? cmd.args[1].text.ptr : NULL ), ( room ? cmd.args[1].text.len : 0 ),
+                       client_msg, msg_len );
     }
     else if ( strncmp( command, "time", 4 ) == 0 )
     {
@@ -260,17 +606,293 @@ parse_message( const char * msg )
     else if ( strncmp( command, "hello", 5 ) == 0 )
     {
         fprintf( stdout, "receive [%s]\n", msg );
+        parse_hello( msg );
+        mode_decided = 1;
+    }
+    else if ( strncmp( command, "resumed ", 8 ) == 0 )
+    {
+        // (resumed ID SEQ)。SEQ までは送り直しで、それより後は通常どおり届く
+        long id;
+        long seq;
+        if ( sscanf( command + 8, "%ld %ld", &id, &seq ) == 2 )
+        {
+            finish_resume( 1 );
+            if ( last_seq < (uint64_t)seq ) last_seq = (uint64_t)seq;
+            fprintf( stdout, "resumed the session as client %ld (up to seq %ld)\n", id, seq );
+        }
+    }
+    else if ( strcmp( command, "error unknown_session" ) == 0 )
+    {
+        // 期限切れなどで引き継げなかった。切断中のメッセージは (history n) で確かめる
+        fprintf( stdout, "error: could not resume the session. some messages may be missing\n" );
+        finish_resume( 0 );
+        strcpy( session_token, hello_token );
+        if ( last_seq < hello_seq ) last_seq = hello_seq;
+    }
+    else if ( strncmp( command, "stats", 5 ) == 0 )
+    {
+        fprintf( stdout, "%s\n", msg );
+    }
+    else if ( strcmp( command, "ping" ) == 0 )
+    {
+        // 無通信で切断されないよう、サーバからの生存確認にはすぐ応答する
+        const char *pong = "(pong)";
+        if ( binary_mode )
+        {
+            send_frame( socket_fd, FRAME_TEXT, pong, strlen( pong ) );
+        }
+        else if ( send( socket_fd, "(pong)\n", strlen( "(pong)\n" ), 0 ) < 0 )
+        {
+            perror( "send" );
+        }
+    }
+    else if ( strncmp( command, "gap ", 4 ) == 0 )
+    {
+        // 受信が追いつかず、サーバが古いメッセージを捨てた
+        fprintf( stdout, "gap: %s messages were dropped\n", command + 4 );
+    }
+    else if ( strncmp( command, "find-end ", 9 ) == 0 )
+    {
+        // 0 なら最後まで返した。それ以外は続きを要求するときの cursor
+        if ( strcmp( command + 9, "0" ) == 0 )
+        {
+            fprintf( stdout, "find: no more results\n" );
+        }
+        else
+        {
+            fprintf( stdout, "find: more results from cursor %s\n", command + 9 );
+        }
+    }
+    else if ( strcmp( command, "pong" ) == 0 )
+    {
+        fprintf( stdout, "pong\n" );
     }
     else if ( strncmp( command, "ok", 2 ) == 0 )
     {
         fprintf( stdout, "ok: [%s]\n", msg );
     }
+    else if ( strncmp( command, "error rate_limited ", 19 ) == 0 )
+    {
+        // 送りすぎたか、サーバが混んでいる
+        fprintf( stdout, "error: too many requests, retry after %s ms\n", command + 19 );
+    }
     else if ( strncmp( command, "error", 5 ) == 0 )
     {
         fprintf( stdout, "error: something wrong in your message [%s]\n", msg );
+        mode_decided = 1; // バイナリモードに対応していないサーバ
     }
     else
     {
         fprintf( stderr, "unknown command: [%s]\n", command );
     }
-}
\ No newline at end of file
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (hello ID [binary|text] [トークン シーケンス番号]) を読み、モードとセッションを決める
+ */
+void
+parse_hello( const char * msg )
+{
+    ParsedCommand cmd;
+    if ( ! command_parse( msg, strlen( msg ), &cmd )
+         || cmd.n_args < 1 )
+    {
+        return;
+    }
+
+    // モードは ID の次の語。トークンとシーケンス番号はその後に付く
+    int i = 1;
+    if ( cmd.n_args == 2
+         || cmd.n_args == 4 )
+    {
+        // 要求したモードが受け入れられたら、これより後はフレームで読み書きする
+        if ( binary_requested
+             && cmd.args[1].text.len == strlen( "binary" )
+             && memcmp( cmd.args[1].text.ptr, "binary", strlen( "binary" ) ) == 0 )
+        {
+            binary_mode = 1;
+        }
+        ++i;
+    }
+
+    long seq;
+    if ( cmd.n_args == i + 2
+         && cmd.args[i].text.len <= MAX_TOKEN_LENGTH
+         && command_arg_long( &cmd, i + 1, &seq ) )
+    {
+        memcpy( hello_token, cmd.args[i].text.ptr, cmd.args[i].text.len );
+        hello_token[cmd.args[i].text.len] = '\0';
+        hello_seq = (uint64_t)seq;
+    }
+    else
+    {
+        hello_token[0] = '\0'; // サーバがセッションを発行しなかった
+        hello_seq = 0;
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+parse_frame( const int socket_fd,
+             const FrameHeader * hdr,
+             const char * payload )
+{
+    switch ( hdr->type ) {
+    case FRAME_MSG:
+    {
+        time_t msg_time;
+        int client_id;
+        const char *room;
+        size_t room_len;
+        const char *msg;
+        size_t msg_len;
+        if ( ! frame_decode_message( hdr, payload, &msg_time, &client_id, &room, &room_len, &msg, &msg_len ) )
+        {
+            fprintf( stdout, "msg: illegal frame (%u bytes)\n", (unsigned)hdr->len );
+            return;
+        }
+        show_message( hdr->seq, msg_time, client_id, room, room_len, msg, msg_len );
+        break;
+    }
+    case FRAME_OK:
+        fprintf( stdout, "ok: [%.*s] (request %llu)\n", (int)hdr->len, payload, (unsigned long long)hdr->seq );
+        break;
+    case FRAME_TEXT:
+    {
+        // テキストモードと同じ1行なので、終端文字を付けて同じように解釈する
+        char line[BUFSIZE];
+        const size_t len = ( hdr->len < sizeof( line ) ? hdr->len : sizeof( line ) - 1 );
+        memcpy( line, payload, len );
+        line[len] = '\0';
+        parse_message( socket_fd, line );
+        break;
+    }
+    default:
+        fprintf( stderr, "unknown frame type: %d\n", hdr->type );
+        break;
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  受け取ったメッセージを表示し、最後に受け取ったシーケンス番号を進める。引き継ぎ中は表示を待つ
+ */
+void
+show_message( const uint64_t seq,
+              const time_t msg_time,
+              const int client_id,
+              const char * room,
+              const size_t room_len,
+              const char * msg,
+              const size_t len )
+{
+    if ( resuming )
+    {
+        hold_message( seq, msg_time, client_id, room, room_len, msg, len );
+        return;
+    }
+    if ( last_seq < seq ) last_seq = seq;
+    print_message( msg_time, client_id, room, room_len, msg, len );
+}
+
+/* ------------------------------------------------------- */
+void
+hold_message( const uint64_t seq,
+              const time_t msg_time,
+              const int client_id,
+              const char * room,
+              const size_t room_len,
+              const char * msg,
+              const size_t len )
+{
+    if ( n_held >= held_capacity )
+    {
+        const int new_capacity = ( held_capacity == 0 ? 64 : held_capacity * 2 );
+        HeldMessage *p = realloc( held, new_capacity * sizeof( HeldMessage ) );
+        if ( p == NULL )
+        {
+            perror( "realloc" );
+            return;
+        }
+        held = p;
+        held_capacity = new_capacity;
+    }
+
+    char *data = malloc( room_len + len + 1 );
+    if ( data == NULL )
+    {
+        perror( "malloc" );
+        return;
+    }
+    if ( room_len > 0 ) memcpy( data, room, room_len );
+    memcpy( data + room_len, msg, len );
+
+    HeldMessage *h = &held[n_held++];
+    h->seq = seq;
+    h->time = msg_time;
+    h->client_id = client_id;
+    h->room = data;
+    h->room_len = room_len;
+    h->msg = data + room_len;
+    h->len = len;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  引き継ぎを終え、溜めておいたメッセージを表示する
+  ¥param resumed 引き継げた。送り直しと重複しているものを除き、シーケンス番号の順に並べる
+ */
+void
+finish_resume( const int resumed )
+{
+    if ( resumed )
+    {
+        qsort( held, n_held, sizeof( HeldMessage ), compare_held );
+    }
+
+    resuming = 0;
+    for ( int i = 0; i < n_held; ++i )
+    {
+        const HeldMessage *h = &held[i];
+        if ( ! resumed
+             || i == 0
+             || h->seq != held[i - 1].seq )
+        {
+            show_message( h->seq, h->time, h->client_id, h->room, h->room_len, h->msg, h->len );
+        }
+    }
+    for ( int i = 0; i < n_held; ++i ) free( held[i].room );
+    n_held = 0;
+}
+
+/* ------------------------------------------------------- */
+int
+compare_held( const void * a,
+              const void * b )
+{
+    const uint64_t x = ( (const HeldMessage *)a )->seq;
+    const uint64_t y = ( (const HeldMessage *)b )->seq;
+    return ( x < y ? -1 : x > y );
+}
+
+/* ------------------------------------------------------- */
+void
+print_message( const time_t msg_time,
+               const int client_id,
+               const char * room,
+               const size_t room_len,
+               const char * msg,
+               const size_t len )
+{
+    struct tm *msg_tm = localtime( &msg_time );
+    char time_str[128];
+    strftime( time_str, 127, "%Y-%m-%d %H:%M:%S", msg_tm );
+    if ( room_len > 0 )
+    {
+        fprintf( stdout, "message from %d in %.*s (%s): %.*s\n",
+                 client_id, (int)room_len, room, time_str, (int)len, msg );
+        return;
+    }
+    fprintf( stdout, "message from %d (%s): %.*s\n", client_id, time_str, (int)len, msg );
+}
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE // accept4
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -9,735 +13,5672 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <limits.h>
 
 #include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "my_netlib.h"
+#include "mpsc_queue.h"
+#include "trigram_index.h"
+#include "message_log.h"
+#include "command_parser.h"
+#include "binary_frame.h"
+#include "room_table.h"
+#include "server_stats.h"
+#include "server_log.h"
+#include "uring.h"
+#include "timer_wheel.h"
+#include "work_pool.h"
+#include "session_table.h"
+#include "watch_index.h"
 
-#define MAX_EVENTS 16
-#define BUFSIZE 1024
-#define MAX_HISTORY 32
+#define MAX_EVENTS 256
+#define BUFSIZE 2048
+#define DEFAULT_MAX_CLIENTS 1024
+#define INITIAL_TABLE_SIZE 64
+#define RECV_CHUNK 4096
+#define MAX_LINE_LENGTH ( 64 * 1024 )
+#define MAX_PENDING_INPUT ( 1024 * 1024 ) // ワーカーの返信を待つ間に溜めておける受信データの上限
+#define MAX_IOV 64
+#define URING_MAX_IOV 1024 // io_uring の sendmsg 1回で送る要素数の上限。完了を待つ間に溜まる分をまとめて送る
+#define URING_SEND_STALL_MS 20 // io_uring の sendmsg がこれ以上完了しなければソケットが一杯とみなす
+#define INITIAL_OUT_QUEUE 16 // 送信キューの最初の要素数
+#define ACCEPT_BUDGET 64 // 1回のループで accept する接続数の上限
+#define CLIENT_POOL_CHUNK 256 // Client をまとめて確保する個数
+#define MAX_THREADS 256
+#define DEFAULT_WORKERS 4 // find や履歴の読み出しを行うワーカースレッドの数
+#define IDLE_TIMEOUT_MS ( 10 * 1000 )
+#define DEFAULT_CLIENT_TIMEOUT 300 // 無通信のクライアントを切断するまでの秒数。半分経ったら (ping) を送る
+#define DEFAULT_MAX_OUTPUT 1024 // 1クライアントの送信キューの上限（KB）
+#define DEFAULT_MAX_TOTAL_OUTPUT 512 // 全クライアントの送信キューの合計の上限（MB）
+#define PRESSURE_OUTPUT_LIMIT ( 64 * 1024 ) // 合計が上限を超えている間の1クライアントの上限
+#define DEFAULT_RATE_LIMIT 1000 // 1クライアントが1秒あたりに使えるトークン数。(time) が1トークン
+#define RATE_BURST_MS 2000 // トークンは RATE_BURST_MS 分まで貯められる
+#define DEFAULT_MAX_LAG 250 // ループの遅れがこれ（ミリ秒）を超えたら重いコマンドを断る
+#define EXPENSIVE_COMMAND_COST 20 // これ以上のコストのコマンドをループが遅れているときに断る
+#define DEFAULT_HISTORY_SIZE 1000
+#define MAX_MESSAGE_LENGTH 511
+#define MAX_HISTORY_QUERY 1000 // history-since / history-range で一度に返す上限
+#define MAX_FIND_PAGE 1000 // (find "kw" limit) の limit の上限
+#define MAX_RESUME_MESSAGES 10000 // (resume) で送り直すメッセージの上限。超えた分は (gap n) で知らせる
+#define RESUME_SCAN_PAGE 1024 // (resume) で部屋ごとの一覧から一度に読むシーケンス番号の数
+#define INITIAL_FIND_PAGE ( 16 * 1024 ) // ワーカーが返信をまとめるバッファの最初の大きさ
+#define MAX_JOINED_ROOMS 16 // 1クライアントが同時に参加できる部屋の数
+#define MAX_WATCHES 16 // 1クライアントが同時に (watch) できるキーワードの数
+#define MAX_WATCH_MATCHES 64 // 1つのメッセージについて (match) で知らせるキーワードの数の上限
+#define DEFAULT_STATS_INTERVAL 10 // --stats-file へ書き出す間隔（秒）
+#define DEFAULT_SESSION_TTL 300 // 切断したセッションを (resume) で引き継げる秒数
+#define SESSION_SWEEP_MS ( 10 * 1000 ) // 期限切れのセッションを捨てる間隔
+#define URING_ENTRIES 256 // io_uring の SQ の要素数
+#define URING_RECV_BUFFERS 512 // 提供バッファリングのバッファ数（2のべき乗）
 
-#define MESSAGE_LOG "message.log"
+#define MESSAGE_LOG_DIR "message-log"
+#define MESSAGE_INDEX "trigram.idx" // MESSAGE_LOG_DIR の中に置く
+#define LEGACY_MESSAGE_LOG "message.log" // ログが空のときに取り込む旧形式のログ
+#define ROOM_FILE "rooms" // MESSAGE_LOG_DIR の中に置く部屋の対応表
 
-// コマンドの先頭文字列をマクロで定義しておく
-#define COMMAND_MESSAGE "msg"
-#define COMMAND_FIND "find"
-#define COMMAND_HISTORY "history"
-#define COMMAND_TIME "time"
-#define COMMAND_HELLO "hello"
-#define COMMAND_QUIT "quit"
+// 送信データ本体。ブロードキャストでは1つを全受信者のキューで共有し、
+// 参照カウントが0になった時点で解放する。作成後は書き換えない
+typedef struct {
+    int refcount; // 複数スレッドから操作するので __atomic で増減する
+    size_t len;
+    char data[];
+} SharedBuf;
 
-// コマンドのタイプを列挙型で管理する
+// 送信キューの要素の種類。送信が遅いクライアントには OUT_BROADCAST だけを捨て、
+// 捨てた数を OUT_GAP の "(gap n)" で知らせる
 typedef enum {
-    CMD_UNKNOWN,
-    CMD_MESSAGE,
-    CMD_FIND,
-    CMD_HISTORY,
-    CMD_TIME,
-    CMD_HELLO,
-    CMD_QUIT,
-} Command;
+    OUT_REPLY,
+    OUT_BROADCAST,
+    OUT_GAP,
+} OutKind;
+
+// 送信キューの要素。sent までは送信済み
+typedef struct {
+    SharedBuf *buf;
+    size_t sent;
+    OutKind kind;
+    int gap; // OUT_GAP の場合に、この位置で捨てたメッセージの数
+} OutEntry;
 
+// (resume) の送り直しを待つ間に届いたブロードキャスト
 typedef struct {
+    SharedBuf *buf;
+    uint64_t seq;
+} HeldBroadcast;
+
+struct Shard;
+
+typedef struct Client {
     int id;
     int alive;
     int socket_fd;
+    int live_index; // ConnTable::live 内での位置
+    struct Shard *shard; // このクライアントを担当するイベントループ
+
+    // 受信バッファ。改行で区切られるまでコマンドを溜めておく
+    char *in_buf;
+    size_t in_len;
+    size_t in_cap;
+
+    // 送信キュー（リングバッファ）。ソケットが書き込み可能になるまでここに溜めておく
+    OutEntry *out_queue;
+    int out_head;
+    int out_count;
+    int out_cap;
+    size_t out_bytes;
+    int out_pending; // pending_fds に登録済みかどうか
+    int want_write; // EPOLLOUT を監視中かどうか
+    int admin; // ループバックから接続したクライアント。(stats) を使える
+
+    // (hello binary) 以降はフレームで送受信する
+    int binary;
+    uint64_t request_seq; // 処理中のフレームの seq。返信のフレームにそのまま付ける
+
+    // ワーカーに任せたコマンドの返信を待っている。返信を積むまで続きのコマンドを処理しないので、返信の順序が保たれる
+    int job_pending;
+
+    // (hello) で発行した再接続用のセッション。session_generation が0なら持っていない
+    char session_token[SESSION_TOKEN_LEN + 1];
+    uint64_t session_generation;
+    int started; // hello / ping / pong 以外のコマンドを受けた。(resume) はその前にしか使えない
+
+    // (resume) で送り直した最後のシーケンス番号。これ以下のブロードキャストは二重になるので届けない
+    uint64_t resumed_seq;
+    // ワーカーが送り直しを作っている間は、届いたブロードキャストを送信キューでなく held に溜めておく
+    int holding;
+    HeldBroadcast *held;
+    int n_held;
+    int held_capacity;
+    size_t held_bytes;
+
+    // 参加中の部屋と、シャードの RoomMembers::clients 内での位置
+    uint32_t joined[MAX_JOINED_ROOMS];
+    int joined_index[MAX_JOINED_ROOMS];
+    int n_joined;
+
+    // (watch) 中のキーワードの番号と、シャードの WatchMembers::clients 内での位置
+    uint32_t watching[MAX_WATCHES];
+    int watching_index[MAX_WATCHES];
+    int n_watching;
+
+    // io_uring の場合だけ使う。送信は sendmsg を1つずつ投入し、完了してから次を送るので順序が保たれる
+    int uring_ops; // 完了を待っている操作（受信と送信）の数
+    int send_inflight;
+    struct iovec *send_iov; // 投入中の sendmsg が参照するので完了まで書き換えない
+    int send_iov_cap;
+    struct msghdr send_msg;
+    uint64_t send_start_ms; // 投入中の sendmsg を投入した時刻
+    int closing; // close_client 済み。操作がすべて完了したら解放する
+    struct Client *zombie_prev; // closing のクライアントの一覧 Shard::zombies
+    struct Client *zombie_next;
+
+    // 最後に何か受信した時刻。idle_timer はこれを見て (ping) を送るか切断する
+    uint64_t last_active_ms;
+    int ping_sent; // 最後の受信の後に (ping) を送ったかどうか
+    TimerNode idle_timer;
+
+    // コマンドごとのコストを払うトークンバケツ。1000分の1トークン単位で、tokens_ms の時点の残り
+    int64_t tokens;
+    uint64_t tokens_ms;
+
+    struct Client *next_free; // 未使用のとき Shard::free_clients の次の要素
 } Client;
 
+// Client の割り当て単位。シャードが CLIENT_POOL_CHUNK 個ずつ確保し、終了するまで解放しない
+typedef struct ClientChunk {
+    struct ClientChunk *next;
+    Client clients[CLIENT_POOL_CHUNK];
+} ClientChunk;
+
+// ファイルディスクリプタを添字とする接続テーブル
+// by_fd で O(1) 検索、live は接続中クライアントの詰めた配列で、
+// 削除時は末尾と入れ替えることで O(1) に保つ
+typedef struct {
+    Client **by_fd;
+    int capacity; // by_fd の要素数
+    Client **live;
+    int count; // 接続中のクライアント数
+    int live_capacity;
+    int limit; // 同時接続数の上限
+} ConnTable;
+
+// 直近のメッセージを保持するリングバッファ。
+// 各要素は配信時に作った "(msg ...)" 行とバイナリのフレームをそのまま共有して持つ
+typedef struct {
+    uint64_t seq;
+    time_t time;
+    int sender_id;
+    SharedBuf *line;
+    SharedBuf *frame;
+} HistoryEntry;
+
+typedef struct {
+    HistoryEntry *entries;
+    int capacity; // 保持する件数で、(history n) の n の上限でもある
+    int head; // 次に書き込む位置
+    int count;
+    uint64_t floor_seq; // これより後の全員宛てのメッセージはすべて持っている。(resume) をメモリだけで返せるかの判断に使う
+} HistoryRing;
+
+// 1つの部屋の、あるシャードに属するメンバー。
+// 配送で走査するだけなので詰めた配列で持ち、削除は末尾と入れ替えて O(1) に保つ
+typedef struct {
+    Client **clients;
+    int count;
+    int capacity;
+} RoomMembers;
+
+// 1つのキーワードを (watch) している、あるシャードに属するクライアント。RoomMembers と同じく詰めた配列で持つ。
+// キーワードの番号は使い回されるので、どの登録の一覧かを serial で区別する
+typedef struct {
+    Client **clients;
+    int count;
+    int capacity;
+    uint64_t serial;
+} WatchMembers;
+
+// メッセージが (watch) のキーワードを含んでいたことの通知。キーワードごとに1つ作り、全シャードで共有する
+typedef struct {
+    uint32_t watch; // キーワードの番号
+    uint64_t serial;
+    SharedBuf *buf; // テキストモードの受信者へ送る "(match ...)" 行
+    SharedBuf *frame; // バイナリモードの受信者へ送る FRAME_TEXT
+} WatchMatch;
+
+// ブロードキャスト1件分。送信元のシャードから各シャードの inbox へ送られる
+typedef struct {
+    MpscNode node;
+    uint32_t room; // GLOBAL_ROOM なら接続中の全員へ、それ以外は部屋のメンバーへ配送する
+    SharedBuf *buf; // テキストモードの受信者へ送る行
+    SharedBuf *frame; // バイナリモードの受信者へ送るフレーム
+    int sender_id; // 送信者本人には配信しない
+    uint64_t seq;
+    int n_matches;
+    WatchMatch matches[]; // メッセージが含んでいた (watch) のキーワード
+} Broadcast;
+
+// broadcast_message で、メッセージが含んでいた (watch) のキーワードごとの通知を集める
+typedef struct {
+    const SharedBuf *line; // メッセージの "(msg ...)" 行
+    WatchMatch matches[MAX_WATCH_MATCHES];
+    int n_matches;
+} WatchMatchList;
+
+// ログの fsync を待っている (ok msg) の返信
+typedef struct {
+    int fd;
+    int client_id; // fd が再利用された場合に取り違えないため
+    uint64_t ticket;
+    SharedBuf *reply;
+} PendingAck;
+
+// ワーカーが作る返信。クライアントには触れないので、返信のモードと seq だけを写しておく。
+// 全体を1つの要素として送信キューに積むので、件数が多くても writev の要素は増えない
+typedef struct {
+    int binary;
+    uint64_t request_seq;
+    SharedBuf *buf; // len までが返信。cap まで書ける
+    size_t cap;
+    int failed; // メモリが足りず作れなかった。クライアントを切断する
+} ReplyPage;
+
+// (find) で検索する部屋と、結果を書き込む返信
+typedef struct {
+    uint32_t room;
+    int n_sent;
+    ReplyPage *page;
+} FindContext;
+
+// ワーカーに任せるコマンドの種類
+typedef enum {
+    JOB_FIND,
+    JOB_ROOM_HISTORY,
+    JOB_LOGGED_HISTORY,
+    JOB_RESUME,
+} JobKind;
+
+// ワーカーに任せたコマンド1件。ワーカーが page に返信を作り、依頼したシャードの done へ返す。
+// 返す先は PendingAck と同じく fd と id で探すので、待っている間に切断されてもよい
+typedef struct {
+    WorkItem work;
+    MpscNode done_node;
+    JobKind kind;
+    struct Shard *shard;
+    int fd;
+    int client_id;
+    Command command; // 返信を積んだ時点で所要時間を記録する
+    uint64_t start_ns;
+
+    // 問い合わせの内容
+    uint32_t room;
+    char keyword[MAX_MESSAGE_LENGTH + 1];
+    uint64_t cursor; // JOB_FIND で調べ始めるシーケンス番号。JOB_RESUME ではこれより後を送り直す
+    int limit;
+    time_t from;
+    time_t to;
+    uint64_t upto; // JOB_RESUME で送り直す最後のシーケンス番号。これより後はブロードキャストで届く
+    uint32_t rooms[MAX_JOINED_ROOMS]; // JOB_RESUME で全員宛てのほかに送り直す部屋
+    int n_rooms;
+
+    ReplyPage page;
+} Job;
+
+// 処理中のコマンド。ループの最後の送信を終えた時点で所要時間を記録する
+typedef struct {
+    Command command;
+    uint64_t start_ns;
+} CommandSample;
+
+// io_uring の user_data の下位ビットに入れる操作の種類。
+// クライアントの操作では残りのビットが Client のアドレスになる
+typedef enum {
+    URING_OP_ACCEPT = 1,
+    URING_OP_WAKEUP,
+    URING_OP_STDIN,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL,
+} UringOp;
+
+#define URING_OP_MASK 7
+
+// スレッド1つ分のイベントループ。SO_REUSEPORT で作った自分専用の待受ソケットと
+// epoll（または io_uring）・接続テーブルを持ち、自分のクライアントだけを扱う
+typedef struct Shard {
+    int index;
+    pthread_t thread;
+    int server_socket;
+    int epoll_fd;
+
+    // --io-backend uring の場合に epoll の代わりに使う
+    Uring uring;
+    UringBufRing recv_bufs;
+    Client *zombies; // 閉じたが操作の完了を待っているクライアント
+
+    // 他のシャードからのブロードキャストの受け口。
+    // wakeup_fd (eventfd) で起こし、wakeup_pending で通知の重複を抑える
+    MpscQueue inbox;
+    int wakeup_fd;
+    int wakeup_pending;
+
+    // ワーカーが処理し終えた Job。ワーカーも wakeup_fd で起こす
+    MpscQueue done;
+
+    ConnTable clients;
+
+    // 切断したクライアントは free_clients に戻し、受信バッファなどと一緒に使い回す
+    ClientChunk *client_chunks;
+    Client *free_clients;
+
+    // 送信キューにデータが積まれたクライアントのfd。ループの最後にまとめて送信する
+    int *pending_fds;
+    int pending_count;
+    int pending_capacity;
+
+    // FSYNC_BATCH でログの確定を待っている返信。
+    // acks_waiting を立てておくと、ログを書き出したスレッドが wakeup_fd で起こす
+    PendingAck *acks;
+    int n_acks;
+    int acks_capacity;
+    int acks_waiting;
+
+    // このループでログに追記した。ループの最後にログを書き出すスレッドを起こす
+    int log_appended;
+
+    // 部屋の番号を添字とする、このシャードのクライアントだけのメンバー集合
+    RoomMembers *rooms;
+    uint32_t n_rooms;
+
+    // キーワードの番号を添字とする、このシャードのクライアントだけの (watch) の登録者
+    WatchMembers *watches;
+    uint32_t n_watches;
+
+    // このループで処理したコマンド
+    CommandSample *samples;
+    int n_samples;
+    int samples_capacity;
+
+    // このシャードの計測値。このシャードのスレッドだけが更新する
+    ServerStats stats;
+
+    // クライアントの無通信の監視や定期的な処理のタイマー。now_ms はループが起きた時刻
+    TimerWheel timers;
+    uint64_t now_ms;
+    TimerNode stats_timer; // シャード0だけが --stats-file へ書き出す
+    TimerNode session_timer; // シャード0だけが期限切れのセッションを捨てる
+
+    // ループの所要時間の移動平均。これがループの遅れで、重いコマンドを受け付けるかどうかを決める
+    uint64_t loop_lag_ns;
+
+    // io_uring の CQ を最後に空にしたループが起きた時刻。これより前に投入して完了していない sendmsg は詰まっている
+    uint64_t reaped_ms;
+} Shard;
+
+/* ------------------------------------------------------- */
+void run( Shard *shard );
+void run_epoll( Shard *shard );
+void run_uring( Shard *shard );
+int loop_timeout( const Shard *shard );
+void finish_loop( Shard *shard, const uint64_t wake_ns, const int had_events );
+void stats_expired( TimerNode *timer, void *arg );
+void session_expired( TimerNode *timer, void *arg );
+void *shard_thread( void *arg );
+int shard_init( Shard *shard, const int index, const int server_socket );
+void shard_destroy( Shard *shard );
+void wake_shard( Shard *shard );
+void deliver_broadcasts( Shard *shard );
+void hold_broadcast( Client *client, SharedBuf *buf, const uint64_t seq );
+void release_held( Client *client, const uint64_t upto );
+void defer_ack( Client *client, const uint64_t ticket, SharedBuf *reply );
+void release_acks( Shard *shard );
+int start_log_writer();
+void stop_log_writer();
+void kick_log_writer();
+void wait_log_written( const uint64_t seq );
+void flush_room_table( void *arg );
+void *log_writer_main( void *arg );
+int join_room( Client *client, const uint32_t room );
+int leave_room( Client *client, const uint32_t room );
+void leave_all_rooms( Client *client );
+int find_joined( const Client *client, const uint32_t room );
+int watch_keyword( Client *client, const uint32_t watch, const uint64_t serial );
+void unwatch_keyword( Client *client, const int j );
+void unwatch_all( Client *client );
+int find_watching( const Client *client, const uint32_t watch );
+void deliver_watch_matches( Shard *shard, const Broadcast *b );
+void free_broadcast( Broadcast *b );
+void stop_server();
+
+/* ------------------------------------------------------- */
+uint64_t monotonic_ns();
+void record_command( Client *client, const Command command, const uint64_t start_ns );
+void finish_command_samples( Shard *shard, const uint64_t end_ns );
+void collect_stats( ServerStats *total );
+void reply_stats( Client *sender, const ParsedCommand *cmd );
+void send_stats_line( const char *line, void *arg );
+void print_stats_line( const char *line, void *arg );
+void dump_stats( const char *file );
+
+/* ------------------------------------------------------- */
+int read_stdin();
+
+/* ------------------------------------------------------- */
+int create_session( Shard *shard );
+int register_client( Shard *shard, const int socket_fd, const struct sockaddr_in *addr );
+void arm_idle_timer( Client *client );
+void idle_expired( TimerNode *timer, void *arg );
+
+/* ------------------------------------------------------- */
+void receive( Shard *shard, struct epoll_event *ev );
+int reserve_input( Client *cli, const size_t len );
+void process_input( Client *cli );
+void consume_input( Client *cli );
+size_t receive_line( Client *cli, char *data, const size_t len );
+size_t receive_frame( Client *cli, char *data, const size_t len );
+
+/* ------------------------------------------------------- */
+int admit_command( Client *cli, const Command command );
+void handle_command( Client *cli, const char *line, const size_t len );
+void handle_frame( Client *cli, const FrameHeader *hdr, const char *payload );
+
 /* ------------------------------------------------------- */
-void run( const int server_socket );
+SharedBuf *shared_buf_alloc( const size_t len );
+SharedBuf *shared_buf_new( const char *data, const size_t len );
+void shared_buf_unref( SharedBuf *buf );
 
 /* ------------------------------------------------------- */
-void read_stdin();
+void send_to_client( Client *client, const char *buf, const size_t len );
+void send_shared_to_client( Client *client, SharedBuf *buf );
+void send_broadcast_to_client( Client *client, SharedBuf *buf );
+SharedBuf *text_buf_new( const Client *client, const char *buf, const size_t len );
+int queue_output( Client *client, SharedBuf *buf, const OutKind kind );
+size_t output_limit( const Client *client );
+int enforce_output_limit( Client *client );
+int drop_broadcasts( Client *client, const size_t target );
+int set_gap( Client *client, const int i, const int gap );
+int mark_pending( Client *client );
+int flush_client( Client *client );
+void advance_out_queue( Client *client, size_t n );
+void flush_pending_clients( Shard *shard );
+void close_client( Client *client );
 
 /* ------------------------------------------------------- */
-int create_session( const int server_socket, const int epoll_fd );
+void handle_cqe( Shard *shard, const struct io_uring_cqe *cqe );
+void handle_recv_cqe( Client *cli, const struct io_uring_cqe *cqe );
+void handle_send_cqe( Client *cli, const struct io_uring_cqe *cqe );
+int arm_accept( Shard *shard );
+int arm_poll( Shard *shard, const int fd, const UringOp op );
+int arm_recv( Client *client );
+int submit_send( Client *client );
+void reap_client( Client *client );
 
 /* ------------------------------------------------------- */
-void receive( const int epoll_fd, struct epoll_event *ev );
+Job *job_new( Client *client, const JobKind kind, const Command command );
+void submit_job( Client *client, Job *job );
+void free_job( Job *job );
+void run_job( WorkItem *item );
+void run_find( Job *job );
+void run_room_history( Job *job );
+void run_logged_history( Job *job );
+void run_resume( Job *job );
+int compare_seq( const void *a, const void *b );
+void deliver_jobs( Shard *shard );
+char *reply_page_reserve( ReplyPage *page, const size_t len );
+int reply_page_add_record( ReplyPage *page, const LogRecord *rec );
+int reply_page_add_text( ReplyPage *page, const char *line, const size_t len );
 
 /* ------------------------------------------------------- */
-Command parse_command( const char * msg );
+void send_message_to_all( Client *sender, const ParsedCommand *cmd );
+void broadcast_message( Client *sender, const uint32_t room, const char *msg, const size_t len );
+void find_message( Client *sender, const ParsedCommand *cmd );
+void find_keyword( Client *sender, const uint32_t room, const char *keyword, const uint64_t from, const int limit );
+int reply_found_message( const LogRecord *rec, void *arg );
+void send_history( Client *sender, const ParsedCommand *cmd );
+void send_history_since( Client *sender, const ParsedCommand *cmd );
+void send_history_range( Client *sender, const ParsedCommand *cmd );
+void send_logged_messages( Client *sender, const Command command, const uint32_t room, const time_t from, const time_t to,
+                          const int limit );
+void reply_join( Client *sender, const ParsedCommand *cmd );
+void reply_leave( Client *sender, const ParsedCommand *cmd );
+void reply_watch( Client *sender, const ParsedCommand *cmd );
+void reply_unwatch( Client *sender, const ParsedCommand *cmd );
+int collect_watch_match( const uint32_t id, const uint64_t serial, const char *keyword, const size_t len, void *arg );
+int room_arg( Client *sender, const ParsedCommand *cmd, uint32_t *room );
+void reply_time_message( Client *sender, const ParsedCommand *cmd );
+void reply_hello( Client *sender, const ParsedCommand *cmd );
+void reply_resume( Client *sender, const ParsedCommand *cmd );
+int resume_from_history( Client *sender, const uint64_t cursor );
+void reply_ping( Client *sender, const ParsedCommand *cmd );
+void reply_illegal_command( Client *sender, const ParsedCommand *cmd );
+void reply_unknown_command( Client *sender, const ParsedCommand *cmd );
+void disable_client( Client *sender, const ParsedCommand *cmd );
 
-void send_message_to_all( Client *sender, const char *recv_msg );
-void find_message( Client *sender, const char *recv_msg );
-void send_history( Client *sender, const char *recv_msg );
-void reply_time_message( Client *sender, const char *recv_msg );
-void reply_hello( Client *sender, const char *recv_msg );
-void reply_unknown_command( Client *sender, const char *recv_msg );
-void disable_client( Client *sender, const char *recv_msg );
+uint64_t save_message( const time_t msg_time, const int sender_id, const uint32_t room,
+                       const char *msg, const size_t len );
+void format_message_line( char *buf, const size_t size, const LogRecord *rec );
+SharedBuf *message_line_new( const LogRecord *rec );
+SharedBuf *message_frame_new( const LogRecord *rec );
 
-void save_message( const time_t msg_time, const int sender_id, const char *msg );
+/* ------------------------------------------------------- */
+int history_ring_init( HistoryRing *ring, const int capacity );
+void history_ring_destroy( HistoryRing *ring );
+void history_ring_push( HistoryRing *ring, const uint64_t seq, const time_t msg_time, const int sender_id,
+                        SharedBuf *line, SharedBuf *frame );
+int history_ring_load( HistoryRing *ring, MessageLog *log );
+
+/* ------------------------------------------------------- */
+Client *create_client( Shard *shard, const int socket_fd );
+void destroy_client( Client *client );
+int client_pool_grow( Shard *shard );
+void client_pool_destroy( Shard *shard );
+
+/* ------------------------------------------------------- */
+int conn_table_init( ConnTable *table, const int limit );
+void conn_table_destroy( ConnTable *table );
+int conn_table_insert( ConnTable *table, Client *client );
+Client *conn_table_get( const ConnTable *table, const int fd );
+void conn_table_remove( ConnTable *table, Client *client );
 
 /* ------------------------------------------------------- */
-static int server_alive = 0;
-static int client_count = 0;
-static Client* clients[MAX_EVENTS-1];
+static volatile sig_atomic_t server_alive = 0;
+
+// 以下はすべてのシャードで共有するので __atomic で操作する
+static int client_count = 0; // 払い出し済みのクライアントIDの最大値
+static int total_clients = 0; // 全シャードの接続数の合計
+static int max_clients = DEFAULT_MAX_CLIENTS;
+
+static Shard *shards = NULL;
+static int n_shards = 1;
+
+// --io-backend uring。io_uring が使えなければ起動時に epoll へ戻す
+static int use_uring = 0;
+
+// メッセージの保存と各シャードへの配送をこのロックの中で行うことで、
+// すべてのクライアントが同じ順序でメッセージを受け取るようにする
+static pthread_mutex_t broadcast_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 直近のメッセージ。broadcast_lock で保護する
+static HistoryRing history;
+
+// (find) 用の 3-gram インデックス。追加は broadcast_lock の中で行う
+static TrigramIndex *find_index = NULL;
+
+// メッセージログ。追記は broadcast_lock の中で行い、書き出しと fsync は log_writer が行う
+static MessageLog *message_log = NULL;
+
+// ログを書き出すスレッド。シャードはループの最後に追記があれば起こすだけで、ログのファイルには触らない。
+// log_writer_requested と log_writer_stopping は log_writer_lock で保護する
+static pthread_t log_writer;
+static int log_writer_started = 0;
+static pthread_mutex_t log_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_writer_cond;
+static int log_writer_requested = 0;
+static int log_writer_stopping = 0;
+// 書き出しの回数。ワーカーが書き出しを待つのに使い、終えるたびに log_written_cond で知らせる
+static uint64_t log_writer_passes_started = 0;
+static uint64_t log_writer_passes_done = 0;
+static pthread_cond_t log_written_cond = PTHREAD_COND_INITIALIZER;
+
+// find や履歴の読み出しなど、ログを読むコマンドを処理するワーカー
+static WorkPool *work_pool = NULL;
+static int n_workers = DEFAULT_WORKERS;
+
+// 最後に保存したメッセージの時刻。broadcast_lock で保護する
+static time_t last_message_time = 0;
+
+// 部屋の名前と番号、部屋ごとのメッセージの一覧。メッセージの登録は broadcast_lock の中で行う
+static RoomTable *room_table = NULL;
+
+// 計測値を定期的に書き出すファイル。NULL なら書き出さない
+static const char *stats_file = NULL;
+static int stats_interval = DEFAULT_STATS_INTERVAL;
+static uint64_t start_time_ns = 0;
+
+// 無通信のクライアントを切断するまでの時間。0 なら切断しない
+static uint64_t client_timeout_ms = (uint64_t)DEFAULT_CLIENT_TIMEOUT * 1000;
+
+// 送信キューの上限。合計の上限はシャードの数で等分し、各シャードが自分の分だけを見る
+static size_t max_output = (size_t)DEFAULT_MAX_OUTPUT * 1024;
+static uint64_t max_total_output = (uint64_t)DEFAULT_MAX_TOTAL_OUTPUT * 1024 * 1024;
+static int slow_disconnect = 0; // 上限を超えたクライアントを、古いブロードキャストを捨てずに切断する
+
+// 1クライアントが1秒あたりに使えるトークン数。0 なら制限しない
+static int64_t rate_limit = DEFAULT_RATE_LIMIT;
+
+// ループの遅れの上限（ミリ秒）。超えている間は重いコマンドを断る。0 なら断らない
+static uint64_t max_lag_ms = DEFAULT_MAX_LAG;
+
+// (hello) で発行し (resume) で引き継ぐセッション
+static SessionTable *sessions = NULL;
+static uint64_t session_ttl_ms = (uint64_t)DEFAULT_SESSION_TTL * 1000;
+
+// (watch) で登録された全クライアントのキーワード。メッセージごとの照合は broadcast_lock の中で行う
+static WatchIndex *watch_index = NULL;
+
+// コマンドごとのコスト（トークン数）。全体を走査する find は (time) よりずっと重い
+static const int command_costs[N_COMMAND_TYPES] = {
+    [CMD_UNKNOWN] = 1,
+    [CMD_MESSAGE] = 5,
+    [CMD_FIND] = 100,
+    [CMD_HISTORY] = 20,
+    [CMD_HISTORY_SINCE] = 20,
+    [CMD_HISTORY_RANGE] = 20,
+    [CMD_TIME] = 1,
+    [CMD_HELLO] = 5,
+    [CMD_QUIT] = 0,
+    [CMD_JOIN] = 5,
+    [CMD_LEAVE] = 5,
+    [CMD_STATS] = 5,
+    [CMD_PING] = 0,
+    [CMD_PONG] = 0,
+    [CMD_RESUME] = 10,
+    [CMD_WATCH] = 5,
+    [CMD_UNWATCH] = 5,
+};
 
 void
 sigint_handle( int sig )
 {
     (void)sig;
-    server_alive = 0;
+    stop_server();
     fprintf( stderr, "\nKilled. exiting...\n" );
 }
 
+/* ------------------------------------------------------- */
+void
+usage( const char *prog )
+{
+    fprintf( stderr, "Usage: %s [--max-clients N] [--threads N] [--history-size N]\n"
+             "          [--fsync none|batch|MS] [--log-dir DIR] [--segment-size MB]\n"
+             "          [--stats-file FILE] [--stats-interval SEC] [--log-level SPEC]\n"
+             "          [--io-backend epoll|uring] [--idle-timeout SEC]\n"
+             "          [--max-output KB] [--max-total-output MB] [--slow-client drop|disconnect]\n"
+             "          [--rate-limit TOKENS] [--max-lag MS] [--workers N] [--session-ttl SEC] [port]\n"
+             "  SPEC: error|warn|info|debug for all categories, or e.g. conn=debug,broadcast=warn\n", prog );
+}
+
+/* ------------------------------------------------------- */
+void
+raise_fd_limit( const int max_clients )
+{
+    // 待受・標準入力・epoll・ログファイル等の分の余裕を持たせる
+    const rlim_t wanted = (rlim_t)max_clients + 64;
+    struct rlimit rl;
+    if ( getrlimit( RLIMIT_NOFILE, &rl ) != 0 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "getrlimit" );
+        return;
+    }
+
+    if ( rl.rlim_cur >= wanted )
+    {
+        return;
+    }
+
+    rl.rlim_cur = ( rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= wanted
+                    ? wanted
+                    : rl.rlim_max );
+    if ( setrlimit( RLIMIT_NOFILE, &rl ) != 0 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "setrlimit" );
+    }
+    if ( rl.rlim_cur < wanted )
+    {
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_WARN, "RLIMIT_NOFILE=%ld is lower than --max-clients %d",
+                    (long)rl.rlim_cur, max_clients );
+    }
+}
+
 /* ------------------------------------------------------- */
 int
 main( int argc, char **argv )
 {
     char port_number[8];
-    int server_socket = -1;
+    int history_size = DEFAULT_HISTORY_SIZE;
+    FsyncPolicy fsync_policy = FSYNC_NONE;
+    int fsync_interval_ms = 0;
+    const char *log_dir = MESSAGE_LOG_DIR;
+    uint64_t segment_size = DEFAULT_SEGMENT_SIZE;
 
-    // Ctrl-Cの割り込みシグナル(SIGINT)で呼び出される関数を登録
-    signal( SIGINT, &sigint_handle );
+    static const struct option long_options[] = {
+        { "max-clients", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "history-size", required_argument, NULL, 'H' },
+        { "fsync", required_argument, NULL, 'f' },
+        { "log-dir", required_argument, NULL, 'd' },
+        { "segment-size", required_argument, NULL, 's' },
+        { "stats-file", required_argument, NULL, 'S' },
+        { "stats-interval", required_argument, NULL, 'i' },
+        { "log-level", required_argument, NULL, 'L' },
+        { "io-backend", required_argument, NULL, 'b' },
+        { "idle-timeout", required_argument, NULL, 'T' },
+        { "max-output", required_argument, NULL, 'o' },
+        { "max-total-output", required_argument, NULL, 'O' },
+        { "slow-client", required_argument, NULL, 'w' },
+        { "rate-limit", required_argument, NULL, 'r' },
+        { "max-lag", required_argument, NULL, 'l' },
+        { "workers", required_argument, NULL, 'W' },
+        { "session-ttl", required_argument, NULL, 'e' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
 
-    for ( int i = 0; i < MAX_EVENTS-1; ++i )
+    int opt;
+    while ( ( opt = getopt_long( argc, argv, "c:t:H:f:d:s:S:i:L:b:T:o:O:w:r:l:W:e:h", long_options, NULL ) ) != -1 )
     {
-        clients[i] = NULL;
+        switch ( opt ) {
+        case 'c':
+            max_clients = atoi( optarg );
+            if ( max_clients <= 0 )
+            {
+                fprintf( stderr, "illegal --max-clients [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 't':
+            n_shards = atoi( optarg );
+            if ( n_shards <= 0
+                 || MAX_THREADS < n_shards )
+            {
+                fprintf( stderr, "illegal --threads [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'H':
+            history_size = atoi( optarg );
+            if ( history_size <= 0 )
+            {
+                fprintf( stderr, "illegal --history-size [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'f':
+            if ( ! message_log_parse_policy( optarg, &fsync_policy, &fsync_interval_ms ) )
+            {
+                fprintf( stderr, "illegal --fsync [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'd':
+            log_dir = optarg;
+            break;
+        case 's':
+            if ( atoi( optarg ) <= 0 )
+            {
+                fprintf( stderr, "illegal --segment-size [%s]\n", optarg );
+                return 1;
+            }
+            segment_size = (uint64_t)atoi( optarg ) * 1024 * 1024;
+            break;
+        case 'S':
+            stats_file = optarg;
+            break;
+        case 'i':
+            stats_interval = atoi( optarg );
+            if ( stats_interval <= 0 )
+            {
+                fprintf( stderr, "illegal --stats-interval [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'L':
+            if ( ! server_log_set_levels( optarg ) )
+            {
+                fprintf( stderr, "illegal --log-level [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'b':
+            if ( strcmp( optarg, "epoll" ) == 0 )
+            {
+                use_uring = 0;
+            }
+            else if ( strcmp( optarg, "uring" ) == 0 )
+            {
+                use_uring = 1;
+            }
+            else
+            {
+                fprintf( stderr, "illegal --io-backend [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'T':
+            if ( atoi( optarg ) < 0
+                 || ( atoi( optarg ) == 0 && strcmp( optarg, "0" ) != 0 ) )
+            {
+                fprintf( stderr, "illegal --idle-timeout [%s]\n", optarg );
+                return 1;
+            }
+            client_timeout_ms = (uint64_t)atoi( optarg ) * 1000;
+            break;
+        case 'o':
+            if ( atoi( optarg ) <= 0 )
+            {
+                fprintf( stderr, "illegal --max-output [%s]\n", optarg );
+                return 1;
+            }
+            max_output = (size_t)atoi( optarg ) * 1024;
+            break;
+        case 'O':
+            if ( atoi( optarg ) <= 0 )
+            {
+                fprintf( stderr, "illegal --max-total-output [%s]\n", optarg );
+                return 1;
+            }
+            max_total_output = (uint64_t)atoi( optarg ) * 1024 * 1024;
+            break;
+        case 'w':
+            if ( strcmp( optarg, "drop" ) == 0 )
+            {
+                slow_disconnect = 0;
+            }
+            else if ( strcmp( optarg, "disconnect" ) == 0 )
+            {
+                slow_disconnect = 1;
+            }
+            else
+            {
+                fprintf( stderr, "illegal --slow-client [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'r':
+            if ( atoi( optarg ) < 0 )
+            {
+                fprintf( stderr, "illegal --rate-limit [%s]\n", optarg );
+                return 1;
+            }
+            rate_limit = atoi( optarg );
+            break;
+        case 'l':
+            if ( atoi( optarg ) < 0 )
+            {
+                fprintf( stderr, "illegal --max-lag [%s]\n", optarg );
+                return 1;
+            }
+            max_lag_ms = (uint64_t)atoi( optarg );
+            break;
+        case 'W':
+            n_workers = atoi( optarg );
+            if ( n_workers <= 0
+                 || MAX_THREADS < n_workers )
+            {
+                fprintf( stderr, "illegal --workers [%s]\n", optarg );
+                return 1;
+            }
+            break;
+        case 'e':
+            if ( atoi( optarg ) <= 0 )
+            {
+                fprintf( stderr, "illegal --session-ttl [%s]\n", optarg );
+                return 1;
+            }
+            session_ttl_ms = (uint64_t)atoi( optarg ) * 1000;
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
     }
 
     memset( port_number, 0, sizeof( port_number ) );
     strcpy( port_number, "21044" ); // 自分の学籍番号に含まれる数字列に変更する
-    if ( argc > 1 )
+    if ( optind < argc )
     {
-        strncpy( port_number, argv[1], sizeof( port_number ) - 1 );
+        strncpy( port_number, argv[optind], sizeof( port_number ) - 1 );
     }
 
-    server_socket = create_server_socket( port_number );
+    // ここから後のログはバックグラウンドのスレッドが書き出す。終了時に残りを書き出す
+    if ( server_log_start( stderr ) )
+    {
+        atexit( server_log_stop );
+    }
 
-    if ( server_socket < 0 )
+    raise_fd_limit( max_clients );
+
+    // 古いカーネルやコンテナの制限で io_uring が使えなければ epoll で動かす
+    if ( use_uring
+         && ! uring_supported() )
     {
-        return 1;
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_WARN, "io_uring is not available (%s); falling back to epoll",
+                    strerror( errno ) );
+        use_uring = 0;
     }
 
-    fprintf( stderr, "Waiting a connection...\n" );
-    server_alive = 1;
-    run( server_socket );
-    close( server_socket );
+    message_log = message_log_open( log_dir, fsync_policy, fsync_interval_ms, segment_size );
+    if ( message_log == NULL )
+    {
+        return 1;
+    }
 
-    for ( int i = 0; i < MAX_EVENTS-1; ++i )
+    // 新しいログが空なら旧形式のテキストログを引き継ぐ
+    if ( message_log_last_seq( message_log ) == 0 )
     {
-        if ( clients[i] != NULL )
+        const long n_imported = message_log_import_text( message_log, LEGACY_MESSAGE_LOG );
+        if ( n_imported >= 0 )
         {
-            free( clients[i] );
-            clients[i] = NULL;
+            SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_INFO, "imported %ld messages from %s into %s",
+                        n_imported, LEGACY_MESSAGE_LOG, log_dir );
         }
     }
 
-    return 0;
-}
+    // 部屋ごとのメッセージの一覧はログを読んで作る
+    char room_file[PATH_MAX];
+    snprintf( room_file, sizeof( room_file ), "%s/%s", log_dir, ROOM_FILE );
+    room_table = room_table_open( room_file, message_log );
+    if ( room_table == NULL )
+    {
+        message_log_close( message_log );
+        return 1;
+    }
+    // 部屋の番号がログに残る前に対応表へ書いておく
+    message_log_set_flush_hook( message_log, &flush_room_table, room_table );
 
-/* ------------------------------------------------------- */
-void
-run( const int server_socket )
-{
-    struct epoll_event events[MAX_EVENTS];
+    // 起動時に一度だけログを読み、直近のメッセージをメモリに載せておく
+    if ( ! history_ring_init( &history, history_size ) )
+    {
+        room_table_close( room_table );
+        message_log_close( message_log );
+        return 1;
+    }
+    history_ring_load( &history, message_log );
 
-    const int epoll_fd = epoll_create( MAX_EVENTS );
-    if ( epoll_fd == -1 )
+    LogRecord last_record;
+    if ( message_log_read( message_log, message_log_last_seq( message_log ), &last_record ) )
     {
-        perror( "epoll_create" );
-        return;
+        last_message_time = last_record.time;
     }
 
+    char index_file[PATH_MAX];
+    snprintf( index_file, sizeof( index_file ), "%s/%s", log_dir, MESSAGE_INDEX );
+    find_index = trigram_index_open( index_file, message_log );
+    if ( find_index == NULL )
     {
-        struct epoll_event ev;
+        history_ring_destroy( &history );
+        room_table_close( room_table );
+        message_log_close( message_log );
+        return 1;
+    }
 
-        // 標準入力を登録する場合、ここに必要な処理を記述
-        memset( &ev, 0, sizeof( ev ) );
-        ev.events = EPOLLIN;
-        ev.data.fd = fileno( stdin );
-        if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fileno( stdin ), &ev ) == -1 )
-        {
-            perror( "epoll_ctl" );
-            close( epoll_fd );
-            return;
-        }
+    // 切断したクライアントのセッションも ttl の間は残るので、接続数の上限より多めに持つ
+    sessions = session_table_create( max_clients * 2, session_ttl_ms );
+    if ( sessions == NULL )
+    {
+        trigram_index_close( find_index );
+        history_ring_destroy( &history );
+        room_table_close( room_table );
+        message_log_close( message_log );
+        return 1;
+    }
 
-        // 待受ソケットをイベント登録
-        memset( &ev, 0, sizeof( ev ) );
-        ev.events = EPOLLIN;
-        ev.data.fd = server_socket;
-        ev.data.ptr = malloc( sizeof( Client ) );
-        if ( ev.data.ptr == NULL )
-        {
-            perror ( "malloc" );
-            return;
-        }
-        memset( ev.data.ptr, 0, sizeof( Client ) );
-        Client *cli = (Client *)(ev.data.ptr);
-        cli->socket_fd = server_socket;
+    watch_index = watch_index_create();
+    if ( watch_index == NULL )
+    {
+        session_table_destroy( sessions );
+        trigram_index_close( find_index );
+        history_ring_destroy( &history );
+        room_table_close( room_table );
+        message_log_close( message_log );
+        return 1;
+    }
+
+    // シャードごとに SO_REUSEPORT の待受ソケットを用意する
+    int server_sockets[MAX_THREADS];
+    if ( ! create_server_sockets( port_number, server_sockets, n_shards ) )
+    {
+        return 1;
+    }
+
+    shards = calloc( n_shards, sizeof( Shard ) );
+    if ( shards == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+        return 1;
+    }
 
-        if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, server_socket, &ev ) == -1 )
+    int n_ready = 0;
+    for ( ; n_ready < n_shards; ++n_ready )
+    {
+        if ( ! shard_init( &shards[n_ready], n_ready, server_sockets[n_ready] ) )
         {
-            perror( "epoll_ctl" );
-            close( epoll_fd );
-            return;
+            break;
         }
     }
 
-    int timeout_count = 0;
-    while ( server_alive )
+    if ( n_ready < n_shards )
     {
-        int nfds = epoll_wait( epoll_fd, events, MAX_EVENTS, 10 * 1000 );
+        for ( int i = 0; i < n_ready; ++i ) shard_destroy( &shards[i] );
+        for ( int i = n_ready; i < n_shards; ++i ) close( server_sockets[i] );
+        free( shards );
+        return 1;
+    }
 
-        if ( nfds < 0 )
+    // ログのファイルを読み書きする処理はシャードのループの外で行う
+    work_pool = work_pool_create( n_workers );
+    if ( work_pool == NULL
+         || ! start_log_writer() )
+    {
+        work_pool_destroy( work_pool );
+        for ( int i = 0; i < n_shards; ++i ) shard_destroy( &shards[i] );
+        free( shards );
+        return 1;
+    }
+
+    // Ctrl-Cの割り込みシグナル(SIGINT)で呼び出される関数を登録
+    signal( SIGINT, &sigint_handle );
+
+    // 相手が切断したソケットへの writev でプロセスが終了しないようにする。エラーは EPIPE で受け取る
+    signal( SIGPIPE, SIG_IGN );
+
+    SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_INFO, "Waiting a connection... (max clients = %d, threads = %d, workers = %d, %s)",
+                max_clients, n_shards, n_workers, ( use_uring ? "io_uring" : "epoll" ) );
+    server_alive = 1;
+    start_time_ns = monotonic_ns();
+
+    // シャード0はメインスレッドで動かし、残りはスレッドを起こす
+    int n_started = 1;
+    for ( ; n_started < n_shards; ++n_started )
+    {
+        int err = pthread_create( &shards[n_started].thread, NULL, shard_thread, &shards[n_started] );
+        if ( err != 0 )
         {
-            perror( "epoll_wait" );
-            server_alive = 0;
+            SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_ERROR, "pthread_create: %s", strerror( err ) );
+            stop_server();
+            break;
+        }
+    }
+
+    run( &shards[0] );
+
+    for ( int i = 1; i < n_started; ++i )
+    {
+        pthread_join( shards[i].thread, NULL );
+    }
+
+    // 残っている仕事を終えてからワーカーを止め、最後にログを書き出す。
+    // 処理し終えた Job は各シャードの done に残り、shard_destroy で捨てる
+    work_pool_destroy( work_pool );
+    work_pool = NULL;
+    stop_log_writer();
+
+    for ( int i = 0; i < n_shards; ++i )
+    {
+        shard_destroy( &shards[i] );
+    }
+    free( shards );
+    shards = NULL;
+
+    watch_index_destroy( watch_index );
+    session_table_destroy( sessions );
+    trigram_index_close( find_index );
+    history_ring_destroy( &history );
+    message_log_set_flush_hook( message_log, NULL, NULL );
+    room_table_close( room_table );
+    message_log_close( message_log );
+
+    return 0;
+}
+
+/* ------------------------------------------------------- */
+int
+shard_init( Shard *shard,
+            const int index,
+            const int server_socket )
+{
+    memset( shard, 0, sizeof( *shard ) );
+    shard->index = index;
+    shard->server_socket = server_socket;
+    shard->epoll_fd = -1;
+    shard->wakeup_fd = -1;
+    shard->uring.fd = -1;
+    mpsc_queue_init( &shard->inbox );
+    mpsc_queue_init( &shard->done );
+
+    // 計測値は決まった間隔で書き出す
+    shard->now_ms = monotonic_ns() / 1000000;
+    timer_wheel_init( &shard->timers, shard->now_ms );
+    timer_init( &shard->stats_timer, stats_expired, shard );
+    if ( index == 0
+         && stats_file != NULL )
+    {
+        timer_wheel_arm( &shard->timers, &shard->stats_timer, shard->now_ms + (uint64_t)stats_interval * 1000 );
+    }
+    timer_init( &shard->session_timer, session_expired, shard );
+    if ( index == 0 )
+    {
+        timer_wheel_arm( &shard->timers, &shard->session_timer, shard->now_ms + SESSION_SWEEP_MS );
+    }
+
+    if ( ! conn_table_init( &shard->clients, max_clients ) )
+    {
+        close( server_socket );
+        return 0;
+    }
+
+    // 接続が殺到したときに1件ずつ malloc しないよう、最初の分を確保しておく
+    if ( ! client_pool_grow( shard ) )
+    {
+        shard_destroy( shard );
+        return 0;
+    }
+
+    shard->wakeup_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    if ( shard->wakeup_fd == -1 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "eventfd" );
+        shard_destroy( shard );
+        return 0;
+    }
+
+    if ( use_uring )
+    {
+        // 待受ソケット・通知・標準入力の監視を投入しておき、最初の io_uring_enter で始める
+        if ( ! uring_init( &shard->uring, URING_ENTRIES )
+             || ! uring_buf_ring_init( &shard->uring, &shard->recv_bufs, 0, URING_RECV_BUFFERS, RECV_CHUNK ) )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "io_uring" );
+            shard_destroy( shard );
+            return 0;
+        }
+        if ( ! arm_accept( shard )
+             || ! arm_poll( shard, shard->wakeup_fd, URING_OP_WAKEUP )
+             || ( index == 0 && ! arm_poll( shard, fileno( stdin ), URING_OP_STDIN ) ) )
+        {
+            shard_destroy( shard );
+            return 0;
+        }
+        return 1;
+    }
+
+    // 取りこぼした接続で accept がブロックしないようにする
+    const int flags = fcntl( server_socket, F_GETFL, 0 );
+    if ( flags == -1
+         || fcntl( server_socket, F_SETFL, flags | O_NONBLOCK ) == -1 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "fcntl" );
+        shard_destroy( shard );
+        return 0;
+    }
+
+    shard->epoll_fd = epoll_create( MAX_EVENTS );
+    if ( shard->epoll_fd == -1 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_create" );
+        shard_destroy( shard );
+        return 0;
+    }
+
+    struct epoll_event ev;
+
+    // 標準入力はシャード0だけが扱う
+    if ( index == 0 )
+    {
+        memset( &ev, 0, sizeof( ev ) );
+        ev.events = EPOLLIN;
+        ev.data.fd = fileno( stdin );
+        if ( epoll_ctl( shard->epoll_fd, EPOLL_CTL_ADD, fileno( stdin ), &ev ) == -1 )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_ctl" );
+            shard_destroy( shard );
+            return 0;
+        }
+    }
+
+    // 待受ソケットをイベント登録
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN;
+    ev.data.fd = server_socket;
+    if ( epoll_ctl( shard->epoll_fd, EPOLL_CTL_ADD, server_socket, &ev ) == -1 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_ctl" );
+        shard_destroy( shard );
+        return 0;
+    }
+
+    // 他シャードからの通知をイベント登録
+    memset( &ev, 0, sizeof( ev ) );
+    ev.events = EPOLLIN;
+    ev.data.fd = shard->wakeup_fd;
+    if ( epoll_ctl( shard->epoll_fd, EPOLL_CTL_ADD, shard->wakeup_fd, &ev ) == -1 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_ctl" );
+        shard_destroy( shard );
+        return 0;
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+void
+shard_destroy( Shard *shard )
+{
+    // 配送されずに残ったブロードキャストを捨てる
+    MpscNode *node;
+    while ( ( node = mpsc_queue_pop( &shard->inbox ) ) != NULL )
+    {
+        free_broadcast( (Broadcast *)node );
+    }
+
+    // 返信先のクライアントはもういない
+    while ( ( node = mpsc_queue_pop( &shard->done ) ) != NULL )
+    {
+        free_job( (Job *)( (char *)node - offsetof( Job, done_node ) ) );
+    }
+
+    for ( int i = 0; i < shard->n_acks; ++i )
+    {
+        shared_buf_unref( shard->acks[i].reply );
+    }
+    free( shard->acks );
+    shard->acks = NULL;
+    shard->n_acks = shard->acks_capacity = 0;
+
+    // 処理中の操作はリングを閉じると取り消されるので、その後でクライアントを解放する
+    if ( shard->uring.fd != -1 )
+    {
+        uring_buf_ring_destroy( &shard->uring, &shard->recv_bufs );
+        uring_destroy( &shard->uring );
+    }
+    while ( shard->zombies != NULL )
+    {
+        Client *client = shard->zombies;
+        shard->zombies = client->zombie_next;
+        destroy_client( client );
+    }
+
+    conn_table_destroy( &shard->clients );
+    client_pool_destroy( shard );
+    for ( uint32_t i = 0; i < shard->n_rooms; ++i )
+    {
+        free( shard->rooms[i].clients );
+    }
+    free( shard->rooms );
+    shard->rooms = NULL;
+    shard->n_rooms = 0;
+    for ( uint32_t i = 0; i < shard->n_watches; ++i )
+    {
+        free( shard->watches[i].clients );
+    }
+    free( shard->watches );
+    shard->watches = NULL;
+    shard->n_watches = 0;
+    free( shard->pending_fds );
+    shard->pending_fds = NULL;
+    shard->pending_count = shard->pending_capacity = 0;
+    free( shard->samples );
+    shard->samples = NULL;
+    shard->n_samples = shard->samples_capacity = 0;
+
+    if ( shard->wakeup_fd != -1 ) close( shard->wakeup_fd );
+    if ( shard->epoll_fd != -1 ) close( shard->epoll_fd );
+    if ( shard->server_socket != -1 ) close( shard->server_socket );
+    shard->wakeup_fd = shard->epoll_fd = shard->server_socket = -1;
+}
+
+/* ------------------------------------------------------- */
+void *
+shard_thread( void *arg )
+{
+    // SIGINT はメインスレッドで受ける
+    sigset_t set;
+    sigemptyset( &set );
+    sigaddset( &set, SIGINT );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    run( (Shard *)arg );
+    return NULL;
+}
+
+/* ------------------------------------------------------- */
+void
+wake_shard( Shard *shard )
+{
+    // 既に通知済みなら eventfd への書き込みを省く
+    if ( __atomic_exchange_n( &shard->wakeup_pending, 1, __ATOMIC_ACQ_REL ) )
+    {
+        return;
+    }
+
+    const uint64_t one = 1;
+    if ( write( shard->wakeup_fd, &one, sizeof( one ) ) < 0
+         && errno != EAGAIN )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "write" );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+stop_server()
+{
+    // シグナルハンドラからも呼ばれるので非同期シグナル安全な処理だけを行う
+    server_alive = 0;
+    for ( int i = 0; shards != NULL && i < n_shards; ++i )
+    {
+        const uint64_t one = 1;
+        if ( shards[i].wakeup_fd != -1
+             && write( shards[i].wakeup_fd, &one, sizeof( one ) ) < 0 )
+        {
+            // 起こせなくても epoll_wait のタイムアウトで終了する
+        }
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+deliver_broadcasts( Shard *shard )
+{
+    MpscNode *node;
+    while ( ( node = mpsc_queue_pop( &shard->inbox ) ) != NULL )
+    {
+        Broadcast *b = (Broadcast *)node;
+
+        // 部屋宛てならこのシャードにいるメンバーだけを走査する
+        Client **targets = shard->clients.live;
+        int n_targets = shard->clients.count;
+        if ( b->room != GLOBAL_ROOM )
+        {
+            const int has_members = ( b->room < shard->n_rooms );
+            targets = ( has_members ? shard->rooms[b->room].clients : NULL );
+            n_targets = ( has_members ? shard->rooms[b->room].count : 0 );
+        }
+
+        // 生きている他のクライアントへメッセージ送信
+        for ( int i = 0; i < n_targets; ++i )
+        {
+            Client *cli = targets[i];
+            if ( cli->alive == 0 ) continue;
+            if ( cli->id == b->sender_id ) continue;
+            if ( b->seq <= cli->resumed_seq ) continue; // (resume) で送り直し済み
+
+            SERVER_LOG( LOG_CAT_BROADCAST, LOG_LEVEL_DEBUG, "send message to client:%d", cli->id );
+
+            if ( cli->holding )
+            {
+                hold_broadcast( cli, ( cli->binary ? b->frame : b->buf ), b->seq );
+            }
+            else
+            {
+                send_broadcast_to_client( cli, ( cli->binary ? b->frame : b->buf ) );
+            }
+        }
+
+        deliver_watch_matches( shard, b );
+        free_broadcast( b );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  メッセージが含んでいたキーワードを (watch) しているこのシャードのクライアントへ (match ...) を送る。
+  部屋宛てのメッセージは、その部屋のメンバーにだけ知らせる
+ */
+void
+deliver_watch_matches( Shard *shard,
+                       const Broadcast *b )
+{
+    for ( int m = 0; m < b->n_matches; ++m )
+    {
+        const WatchMatch *match = &b->matches[m];
+
+        // 照合の後で全員が (unwatch) し、番号が別のキーワードに使い回されていれば届けない
+        if ( match->watch >= shard->n_watches
+             || shard->watches[match->watch].serial != match->serial )
+        {
+            continue;
+        }
+
+        const WatchMembers *members = &shard->watches[match->watch];
+        for ( int i = 0; i < members->count; ++i )
+        {
+            Client *cli = members->clients[i];
+            if ( cli->alive == 0 ) continue;
+            if ( cli->id == b->sender_id ) continue;
+            if ( b->room != GLOBAL_ROOM
+                 && find_joined( cli, b->room ) < 0 ) continue;
+
+            send_broadcast_to_client( cli, ( cli->binary ? match->frame : match->buf ) );
+            STATS_ADD( shard->stats.watch_matches, 1 );
+        }
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+free_broadcast( Broadcast *b )
+{
+    shared_buf_unref( b->buf );
+    shared_buf_unref( b->frame );
+    for ( int m = 0; m < b->n_matches; ++m )
+    {
+        shared_buf_unref( b->matches[m].buf );
+        shared_buf_unref( b->matches[m].frame );
+    }
+    free( b );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (resume) の送り直しを待っているクライアントへのブロードキャストを溜めておく。
+  溜まった量が送信キューの上限を超えたら切断する。クライアントはもう一度 (resume) すればよい
+ */
+void
+hold_broadcast( Client *client,
+                SharedBuf *buf,
+                const uint64_t seq )
+{
+    if ( client->held_bytes + buf->len > max_output )
+    {
+        SERVER_LOG( LOG_CAT_BROADCAST, LOG_LEVEL_WARN, "[client:%d] too many broadcasts while resuming", client->id );
+        STATS_ADD( client->shard->stats.slow_closed, 1 );
+        client->alive = 0;
+        mark_pending( client );
+        return;
+    }
+
+    if ( client->n_held >= client->held_capacity )
+    {
+        const int new_capacity = ( client->held_capacity == 0 ? 16 : client->held_capacity * 2 );
+        HeldBroadcast *p = realloc( client->held, new_capacity * sizeof( HeldBroadcast ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            client->alive = 0;
+            mark_pending( client );
+            return;
+        }
+        client->held = p;
+        client->held_capacity = new_capacity;
+    }
+
+    __atomic_add_fetch( &buf->refcount, 1, __ATOMIC_RELAXED );
+    client->held[client->n_held].buf = buf;
+    client->held[client->n_held].seq = seq;
+    ++client->n_held;
+    client->held_bytes += buf->len;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送り直しを積んだ後に、溜めておいたブロードキャストのうち upto より後のものを積む
+ */
+void
+release_held( Client *client,
+              const uint64_t upto )
+{
+    for ( int i = 0; i < client->n_held; ++i )
+    {
+        if ( client->held[i].seq > upto )
+        {
+            send_broadcast_to_client( client, client->held[i].buf );
+        }
+        shared_buf_unref( client->held[i].buf );
+    }
+    client->n_held = 0;
+    client->held_bytes = 0;
+    client->holding = 0;
+    client->resumed_seq = upto;
+}
+
+/* ------------------------------------------------------- */
+int
+conn_table_init( ConnTable *table,
+                 const int limit )
+{
+    memset( table, 0, sizeof( *table ) );
+    table->limit = limit;
+    table->capacity = INITIAL_TABLE_SIZE;
+    table->live_capacity = INITIAL_TABLE_SIZE;
+    table->by_fd = calloc( table->capacity, sizeof( Client * ) );
+    table->live = calloc( table->live_capacity, sizeof( Client * ) );
+    if ( table->by_fd == NULL
+         || table->live == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+        free( table->by_fd );
+        free( table->live );
+        return 0;
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+void
+conn_table_destroy( ConnTable *table )
+{
+    for ( int i = 0; i < table->count; ++i )
+    {
+        destroy_client( table->live[i] );
+    }
+    free( table->by_fd );
+    free( table->live );
+    memset( table, 0, sizeof( *table ) );
+}
+
+/* ------------------------------------------------------- */
+int
+conn_table_insert( ConnTable *table,
+                   Client *client )
+{
+    const int fd = client->socket_fd;
+
+    if ( table->count >= table->limit )
+    {
+        return 0;
+    }
+
+    // 配列は倍々で拡張するので挿入はならしO(1)
+    if ( fd >= table->capacity )
+    {
+        int new_capacity = table->capacity;
+        while ( fd >= new_capacity ) new_capacity *= 2;
+
+        Client **p = realloc( table->by_fd, new_capacity * sizeof( Client * ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        memset( p + table->capacity, 0, ( new_capacity - table->capacity ) * sizeof( Client * ) );
+        table->by_fd = p;
+        table->capacity = new_capacity;
+    }
+
+    if ( table->count >= table->live_capacity )
+    {
+        const int new_capacity = table->live_capacity * 2;
+        Client **p = realloc( table->live, new_capacity * sizeof( Client * ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        table->live = p;
+        table->live_capacity = new_capacity;
+    }
+
+    table->by_fd[fd] = client;
+    client->live_index = table->count;
+    table->live[table->count++] = client;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+Client *
+conn_table_get( const ConnTable *table,
+                const int fd )
+{
+    if ( fd < 0
+         || fd >= table->capacity )
+    {
+        return NULL;
+    }
+    return table->by_fd[fd];
+}
+
+/* ------------------------------------------------------- */
+void
+conn_table_remove( ConnTable *table,
+                   Client *client )
+{
+    const int i = client->live_index;
+    if ( i < 0
+         || i >= table->count
+         || table->live[i] != client )
+    {
+        return;
+    }
+
+    // 末尾の要素を空いた位置へ移動して詰める
+    Client *last = table->live[--table->count];
+    table->live[i] = last;
+    last->live_index = i;
+    table->live[table->count] = NULL;
+
+    table->by_fd[client->socket_fd] = NULL;
+    client->live_index = -1;
+}
+
+/* ------------------------------------------------------- */
+void
+defer_ack( Client *client,
+           const uint64_t ticket,
+           SharedBuf *reply )
+{
+    Shard *shard = client->shard;
+    if ( shard->n_acks >= shard->acks_capacity )
+    {
+        const int new_capacity = ( shard->acks_capacity == 0 ? INITIAL_TABLE_SIZE : shard->acks_capacity * 2 );
+        PendingAck *p = realloc( shard->acks, new_capacity * sizeof( PendingAck ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            client->alive = 0;
+            return;
+        }
+        shard->acks = p;
+        shard->acks_capacity = new_capacity;
+    }
+
+    __atomic_add_fetch( &reply->refcount, 1, __ATOMIC_RELAXED );
+    PendingAck *ack = &shard->acks[shard->n_acks++];
+    ack->fd = client->socket_fd;
+    ack->client_id = client->id;
+    ack->ticket = ticket;
+    ack->reply = reply;
+}
+
+/* ------------------------------------------------------- */
+void
+release_acks( Shard *shard )
+{
+    if ( shard->n_acks == 0 )
+    {
+        return;
+    }
+
+    // 確定したものは順に返信し、まだのものは順序を保って残す
+    const uint64_t durable = message_log_durable( message_log );
+    int n_keep = 0;
+    for ( int i = 0; i < shard->n_acks; ++i )
+    {
+        PendingAck *ack = &shard->acks[i];
+        if ( ack->ticket > durable )
+        {
+            shard->acks[n_keep++] = *ack;
+            continue;
+        }
+
+        Client *cli = conn_table_get( &shard->clients, ack->fd );
+        if ( cli != NULL
+             && cli->id == ack->client_id )
+        {
+            send_shared_to_client( cli, ack->reply );
+        }
+        shared_buf_unref( ack->reply );
+    }
+    shard->n_acks = n_keep;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ログを書き出すスレッドを起動する。--fsync MS の待ち合わせに使うので、条件変数は単調時計で待つ
+ */
+int
+start_log_writer()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &log_writer_cond, &attr );
+    pthread_condattr_destroy( &attr );
+
+    const int err = pthread_create( &log_writer, NULL, log_writer_main, NULL );
+    if ( err != 0 )
+    {
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_ERROR, "pthread_create: %s", strerror( err ) );
+        pthread_cond_destroy( &log_writer_cond );
+        return 0;
+    }
+    log_writer_started = 1;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ログを書き出すスレッドを止める。止める前に残りを書き出す
+ */
+void
+stop_log_writer()
+{
+    if ( ! log_writer_started )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &log_writer_lock );
+    log_writer_stopping = 1;
+    pthread_cond_signal( &log_writer_cond );
+    pthread_mutex_unlock( &log_writer_lock );
+
+    pthread_join( log_writer, NULL );
+    pthread_cond_destroy( &log_writer_cond );
+    log_writer_started = 0;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  追記した分の書き出しを頼む。書き出し中に頼まれた分は、終わり次第もう一度書き出す
+ */
+void
+kick_log_writer()
+{
+    pthread_mutex_lock( &log_writer_lock );
+    log_writer_requested = 1;
+    pthread_cond_signal( &log_writer_cond );
+    pthread_mutex_unlock( &log_writer_lock );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  頼まれるたびにログを書き出し、方針に従って fsync する。
+  --fsync MS では頼まれなくても間隔ごとに起きて、追記が途絶えても期限どおりに fsync する。
+  書き出した後は、確定を待つ返信があるシャードを起こして release_acks させる。
+ */
+void *
+log_writer_main( void *arg )
+{
+    (void)arg;
+
+    // SIGINT はメインスレッドで受ける
+    sigset_t set;
+    sigemptyset( &set );
+    sigaddset( &set, SIGINT );
+    pthread_sigmask( SIG_BLOCK, &set, NULL );
+
+    FsyncPolicy policy = FSYNC_NONE;
+    int interval_ms = 0;
+    message_log_policy( message_log, &policy, &interval_ms );
+
+    pthread_mutex_lock( &log_writer_lock );
+    for ( ;; )
+    {
+        while ( ! log_writer_requested
+                && ! log_writer_stopping )
+        {
+            if ( policy != FSYNC_INTERVAL )
+            {
+                pthread_cond_wait( &log_writer_cond, &log_writer_lock );
+                continue;
+            }
+
+            struct timespec deadline;
+            clock_gettime( CLOCK_MONOTONIC, &deadline );
+            deadline.tv_sec += interval_ms / 1000;
+            deadline.tv_nsec += (long)( interval_ms % 1000 ) * 1000000;
+            if ( deadline.tv_nsec >= 1000000000 )
+            {
+                ++deadline.tv_sec;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if ( pthread_cond_timedwait( &log_writer_cond, &log_writer_lock, &deadline ) == ETIMEDOUT )
+            {
+                break;
+            }
+        }
+        const int stopping = log_writer_stopping;
+        log_writer_requested = 0;
+        ++log_writer_passes_started;
+        pthread_mutex_unlock( &log_writer_lock );
+
+        if ( ! message_log_flush( message_log ) )
+        {
+            SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_ERROR, "could not write the message log" );
+        }
+        if ( ! trigram_index_flush( find_index ) )
+        {
+            SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_ERROR, "could not write the search index" );
+        }
+        for ( int i = 0; i < n_shards; ++i )
+        {
+            if ( __atomic_exchange_n( &shards[i].acks_waiting, 0, __ATOMIC_SEQ_CST ) )
+            {
+                wake_shard( &shards[i] );
+            }
+        }
+
+        pthread_mutex_lock( &log_writer_lock );
+        ++log_writer_passes_done;
+        pthread_cond_broadcast( &log_written_cond );
+        if ( stopping )
+        {
+            break;
+        }
+    }
+    pthread_mutex_unlock( &log_writer_lock );
+    return NULL;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  シーケンス番号 seq までがログに書き出されるのを待つ。まだなら log_writer に書き出しを頼む。
+  書き出しに失敗した場合も、頼んだ後に始まった書き出しが終われば戻る。
+ */
+void
+wait_log_written( const uint64_t seq )
+{
+    if ( message_log_last_seq( message_log ) >= seq )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &log_writer_lock );
+    const uint64_t target = log_writer_passes_started + 1;
+    log_writer_requested = 1;
+    pthread_cond_signal( &log_writer_cond );
+    while ( message_log_last_seq( message_log ) < seq
+            && log_writer_passes_done < target )
+    {
+        pthread_cond_wait( &log_written_cond, &log_writer_lock );
+    }
+    pthread_mutex_unlock( &log_writer_lock );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  メッセージログの書き出しの前に呼ばれ、作成した部屋を対応表に書き出す。
+ */
+void
+flush_room_table( void *arg )
+{
+    if ( ! room_table_flush( (RoomTable *)arg ) )
+    {
+        SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_ERROR, "could not write the room table" );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  クライアントを部屋のメンバーに加える。
+  メンバー集合はクライアントを担当するシャードにあり、そのシャードのスレッドだけが触る。
+  成功した場合は1、参加している部屋が多すぎる場合は0を返す。
+ */
+int
+join_room( Client *client,
+           const uint32_t room )
+{
+    Shard *shard = client->shard;
+    if ( find_joined( client, room ) >= 0 )
+    {
+        return 1; // 参加済み
+    }
+    if ( client->n_joined >= MAX_JOINED_ROOMS )
+    {
+        return 0;
+    }
+
+    if ( room >= shard->n_rooms )
+    {
+        uint32_t new_n = ( shard->n_rooms == 0 ? 16 : shard->n_rooms );
+        while ( room >= new_n ) new_n *= 2;
+
+        RoomMembers *p = realloc( shard->rooms, new_n * sizeof( RoomMembers ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        memset( p + shard->n_rooms, 0, ( new_n - shard->n_rooms ) * sizeof( RoomMembers ) );
+        shard->rooms = p;
+        shard->n_rooms = new_n;
+    }
+
+    RoomMembers *members = &shard->rooms[room];
+    if ( members->count >= members->capacity )
+    {
+        const int new_capacity = ( members->capacity == 0 ? 8 : members->capacity * 2 );
+        Client **p = realloc( members->clients, new_capacity * sizeof( Client * ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        members->clients = p;
+        members->capacity = new_capacity;
+    }
+
+    client->joined[client->n_joined] = room;
+    client->joined_index[client->n_joined] = members->count;
+    ++client->n_joined;
+    members->clients[members->count++] = client;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  クライアントを部屋のメンバーから外す。参加していなければ0を返す。
+ */
+int
+leave_room( Client *client,
+            const uint32_t room )
+{
+    const int j = find_joined( client, room );
+    if ( j < 0 )
+    {
+        return 0;
+    }
+
+    // 末尾のメンバーを空いた位置へ移動して詰め、移動したクライアントの位置を直す
+    RoomMembers *members = &client->shard->rooms[room];
+    const int i = client->joined_index[j];
+    Client *last = members->clients[--members->count];
+    members->clients[i] = last;
+    last->joined_index[find_joined( last, room )] = i;
+
+    --client->n_joined;
+    client->joined[j] = client->joined[client->n_joined];
+    client->joined_index[j] = client->joined_index[client->n_joined];
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+void
+leave_all_rooms( Client *client )
+{
+    while ( client->n_joined > 0 )
+    {
+        leave_room( client, client->joined[client->n_joined - 1] );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  クライアントを watch 番のキーワードの登録者に加える。watch_index への登録は呼び出し側が済ませておく。
+  登録者の一覧はクライアントを担当するシャードにあり、そのシャードのスレッドだけが触る。
+  成功した場合は1、メモリが足りない場合は0を返す。
+ */
+int
+watch_keyword( Client *client,
+               const uint32_t watch,
+               const uint64_t serial )
+{
+    Shard *shard = client->shard;
+    if ( watch >= shard->n_watches )
+    {
+        uint32_t new_n = ( shard->n_watches == 0 ? 16 : shard->n_watches );
+        while ( watch >= new_n ) new_n *= 2;
+
+        WatchMembers *p = realloc( shard->watches, new_n * sizeof( WatchMembers ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        memset( p + shard->n_watches, 0, ( new_n - shard->n_watches ) * sizeof( WatchMembers ) );
+        shard->watches = p;
+        shard->n_watches = new_n;
+    }
+
+    // 空の一覧は、番号を使い回した新しいキーワードのものとして使い始める
+    WatchMembers *members = &shard->watches[watch];
+    if ( members->count == 0 )
+    {
+        members->serial = serial;
+    }
+    if ( members->count >= members->capacity )
+    {
+        const int new_capacity = ( members->capacity == 0 ? 8 : members->capacity * 2 );
+        Client **p = realloc( members->clients, new_capacity * sizeof( Client * ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return 0;
+        }
+        members->clients = p;
+        members->capacity = new_capacity;
+    }
+
+    client->watching[client->n_watching] = watch;
+    client->watching_index[client->n_watching] = members->count;
+    ++client->n_watching;
+    members->clients[members->count++] = client;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  クライアントの j 番目の (watch) を外し、watch_index の参照も減らす。
+ */
+void
+unwatch_keyword( Client *client,
+                 const int j )
+{
+    // 末尾の登録者を空いた位置へ移動して詰め、移動したクライアントの位置を直す
+    const uint32_t watch = client->watching[j];
+    WatchMembers *members = &client->shard->watches[watch];
+    const int i = client->watching_index[j];
+    Client *last = members->clients[--members->count];
+    members->clients[i] = last;
+    last->watching_index[find_watching( last, watch )] = i;
+
+    --client->n_watching;
+    client->watching[j] = client->watching[client->n_watching];
+    client->watching_index[j] = client->watching_index[client->n_watching];
+
+    watch_index_remove( watch_index, watch );
+}
+
+/* ------------------------------------------------------- */
+void
+unwatch_all( Client *client )
+{
+    while ( client->n_watching > 0 )
+    {
+        unwatch_keyword( client, client->n_watching - 1 );
+    }
+}
+
+/* ------------------------------------------------------- */
+int
+find_watching( const Client *client,
+               const uint32_t watch )
+{
+    for ( int j = 0; j < client->n_watching; ++j )
+    {
+        if ( client->watching[j] == watch )
+        {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  参加中の部屋の中での位置を返す。参加していなければ-1を返す。
+ */
+int
+find_joined( const Client *client,
+             const uint32_t room )
+{
+    for ( int j = 0; j < client->n_joined; ++j )
+    {
+        if ( client->joined[j] == room )
+        {
+            return j;
+        }
+    }
+    return -1;
+}
+
+/* ------------------------------------------------------- */
+uint64_t
+monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  処理したコマンドを覚えておく。返信はループの最後にまとめて送るので、
+  所要時間はその送信を終えた finish_command_samples で記録する。
+ */
+void
+record_command( Client *client,
+                const Command command,
+                const uint64_t start_ns )
+{
+    Shard *shard = client->shard;
+    if ( shard->n_samples >= shard->samples_capacity )
+    {
+        const int new_capacity = ( shard->samples_capacity == 0 ? INITIAL_TABLE_SIZE : shard->samples_capacity * 2 );
+        CommandSample *p = realloc( shard->samples, new_capacity * sizeof( CommandSample ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            return; // 計測値が1つ欠けるだけ
+        }
+        shard->samples = p;
+        shard->samples_capacity = new_capacity;
+    }
+
+    CommandSample *sample = &shard->samples[shard->n_samples++];
+    sample->command = command;
+    sample->start_ns = start_ns;
+}
+
+/* ------------------------------------------------------- */
+void
+finish_command_samples( Shard *shard,
+                        const uint64_t end_ns )
+{
+    for ( int i = 0; i < shard->n_samples; ++i )
+    {
+        const CommandSample *sample = &shard->samples[i];
+        histogram_record( &shard->stats.commands[sample->command], end_ns - sample->start_ns );
+    }
+    shard->n_samples = 0;
+}
+
+/* ------------------------------------------------------- */
+void
+run( Shard *shard )
+{
+    if ( use_uring )
+    {
+        run_uring( shard );
+    }
+    else
+    {
+        run_epoll( shard );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  イベントを待つ時間の上限（ミリ秒）を返す。次のタイマーの期限までしか待たない。
+ */
+int
+loop_timeout( const Shard *shard )
+{
+    return timer_wheel_timeout( &shard->timers, monotonic_ns() / 1000000, IDLE_TIMEOUT_MS );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ループの最後の処理。どちらのバックエンドでも、イベントを処理した後に呼ぶ。
+ */
+void
+finish_loop( Shard *shard,
+             const uint64_t wake_ns,
+             const int had_events )
+{
+    // 期限の来たタイマーを処理する。切断や (ping) の送信は下の送信でまとめて行う
+    timer_wheel_advance( &shard->timers, shard->now_ms );
+
+    // 通知フラグを下ろしてから inbox を空にする。
+    // この後に届いた分は改めて eventfd で起こされる
+    __atomic_store_n( &shard->wakeup_pending, 0, __ATOMIC_RELEASE );
+    deliver_broadcasts( shard );
+
+    deliver_jobs( shard );
+
+    // このループで積まれた返信をまとめて送信する
+    flush_pending_clients( shard );
+
+    // このループで追記したメッセージの書き出しを頼む。
+    // 確定を待つ返信があれば、書き出し後に起こしてもらうよう先に印を付けてから確かめる
+    if ( shard->log_appended )
+    {
+        shard->log_appended = 0;
+        kick_log_writer();
+    }
+    if ( shard->n_acks > 0 )
+    {
+        __atomic_store_n( &shard->acks_waiting, 1, __ATOMIC_SEQ_CST );
+        release_acks( shard );
+        flush_pending_clients( shard );
+    }
+
+    // このループで処理したコマンドは、返信を送り終えたここまでを所要時間とする
+    const uint64_t end_ns = monotonic_ns();
+    finish_command_samples( shard, end_ns );
+    if ( had_events )
+    {
+        histogram_record( &shard->stats.loop, end_ns - wake_ns );
+        shard->loop_lag_ns = ( shard->loop_lag_ns * 7 + ( end_ns - wake_ns ) ) / 8;
+    }
+    else
+    {
+        shard->loop_lag_ns = 0; // 何も起きずに待ちが終わったなら遅れていない
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+stats_expired( TimerNode *timer,
+               void *arg )
+{
+    Shard *shard = arg;
+    dump_stats( stats_file );
+    timer_wheel_arm( &shard->timers, timer, shard->now_ms + (uint64_t)stats_interval * 1000 );
+}
+
+/* ------------------------------------------------------- */
+void
+session_expired( TimerNode *timer,
+                 void *arg )
+{
+    Shard *shard = arg;
+    const int n_expired = session_table_expire( sessions, shard->now_ms );
+    if ( n_expired > 0 )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_DEBUG, "expired %d sessions (%d left)",
+                    n_expired, session_table_count( sessions ) );
+    }
+    timer_wheel_arm( &shard->timers, timer, shard->now_ms + SESSION_SWEEP_MS );
+}
+
+/* ------------------------------------------------------- */
+void
+run_epoll( Shard *shard )
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    int timeout_count = 0;
+    while ( server_alive )
+    {
+        const int timeout_ms = loop_timeout( shard );
+        int nfds = epoll_wait( shard->epoll_fd, events, MAX_EVENTS, timeout_ms );
+        const uint64_t wake_ns = monotonic_ns();
+        shard->now_ms = wake_ns / 1000000;
+
+        if ( nfds < 0 )
+        {
+            if ( errno != EINTR )
+            {
+                SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_wait" );
+                stop_server();
+            }
+        }
+        else if ( nfds == 0 )
+        {
+            // timeout
+            ++timeout_count;
+            if ( shard->index == 0
+                 && timeout_ms == IDLE_TIMEOUT_MS )
+            {
+                SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_DEBUG, "Timeout: %d", timeout_count );
+            }
+        }
+        else
+        {
+            timeout_count = 0;
+            for ( int i = 0; i < nfds; ++i )
+            {
+                // 標準入力を扱う場合は、ここで標準入力かどうかを判定して分岐する
+                if ( shard->index == 0
+                     && events[i].data.fd == fileno( stdin ) )
+                {
+                    // キーボードからの入力読み取り。閉じられたら監視をやめる
+                    if ( ! read_stdin()
+                         && epoll_ctl( shard->epoll_fd, EPOLL_CTL_DEL, fileno( stdin ), NULL ) != 0 )
+                    {
+                        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "epoll_ctl" );
+                    }
+                }
+                else if ( events[i].data.fd == shard->wakeup_fd )
+                {
+                    // 他シャードからの通知。配送はループの最後で行う
+                    uint64_t n;
+                    if ( read( shard->wakeup_fd, &n, sizeof( n ) ) < 0
+                         && errno != EAGAIN )
+                    {
+                        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "read" );
+                    }
+                }
+                else
+                {
+                    if ( events[i].data.fd == shard->server_socket )
+                    {
+                        // acceptして新しいクライアントを登録する
+                        create_session( shard );
+                    }
+                    else
+                    {
+                        if ( events[i].events & EPOLLOUT )
+                        {
+                            // 送信キューに残っている分を送る
+                            Client *cli = conn_table_get( &shard->clients, events[i].data.fd );
+                            if ( cli != NULL
+                                 && ! flush_client( cli ) )
+                            {
+                                close_client( cli );
+                                continue;
+                            }
+                        }
+
+                        if ( events[i].events & ( EPOLLIN | EPOLLHUP | EPOLLERR ) )
+                        {
+                            // クライアントからの受信
+                            receive( shard, &events[i] );
+                        }
+                    }
+                }
+            }
+        }
+
+        finish_loop( shard, wake_ns, nfds > 0 );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  io_uring 版のイベントループ。ループの間に積んだ SQE を1回の io_uring_enter で投入し、
+  同じ呼び出しで完了を待つ。受信・accept はマルチショットなので一度投入すれば続けて届く。
+ */
+void
+run_uring( Shard *shard )
+{
+    int timeout_count = 0;
+    while ( server_alive )
+    {
+        const int timeout_ms = loop_timeout( shard );
+        const int ret = uring_submit_and_wait( &shard->uring, timeout_ms );
+        const uint64_t wake_ns = monotonic_ns();
+        shard->now_ms = wake_ns / 1000000;
+
+        // EBUSY は CQ があふれている状態なので、刈り取れば次の呼び出しで投入できる
+        if ( ret < 0
+             && ret != -EINTR
+             && ret != -EBUSY
+             && ret != -EAGAIN )
+        {
+            errno = -ret;
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "io_uring_enter" );
+            stop_server();
+        }
+
+        // CQE は写してからすぐ返し、処理中に投入した操作の完了で CQ が詰まらないようにする
+        int n_cqes = 0;
+        struct io_uring_cqe *cqe;
+        while ( n_cqes < MAX_EVENTS
+                && ( cqe = uring_peek_cqe( &shard->uring ) ) != NULL )
+        {
+            const struct io_uring_cqe done = *cqe;
+            uring_cqe_seen( &shard->uring );
+            handle_cqe( shard, &done );
+            ++n_cqes;
+        }
+        if ( uring_peek_cqe( &shard->uring ) == NULL )
+        {
+            shard->reaped_ms = shard->now_ms;
+        }
+
+        if ( n_cqes == 0 )
+        {
+            ++timeout_count;
+            if ( shard->index == 0
+                 && timeout_ms == IDLE_TIMEOUT_MS )
+            {
+                SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_DEBUG, "Timeout: %d", timeout_count );
+            }
+        }
+        else
+        {
+            timeout_count = 0;
+        }
+
+        finish_loop( shard, wake_ns, n_cqes > 0 );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+handle_cqe( Shard *shard,
+            const struct io_uring_cqe *cqe )
+{
+    const UringOp op = (UringOp)( cqe->user_data & URING_OP_MASK );
+    Client *cli = (Client *)(uintptr_t)( cqe->user_data & ~(uint64_t)URING_OP_MASK );
+    const int more = ( ( cqe->flags & IORING_CQE_F_MORE ) != 0 );
+
+    switch ( op ) {
+    case URING_OP_ACCEPT:
+        if ( cqe->res >= 0 )
+        {
+            register_client( shard, cqe->res, NULL );
+        }
+        else if ( cqe->res != -EAGAIN
+                  && cqe->res != -ECANCELED )
+        {
+            errno = -cqe->res;
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "accept" );
+        }
+        if ( ! more )
+        {
+            arm_accept( shard );
+        }
+        break;
+    case URING_OP_WAKEUP:
+    {
+        // 他シャードからの通知。配送はループの最後で行う
+        uint64_t n;
+        if ( read( shard->wakeup_fd, &n, sizeof( n ) ) < 0
+             && errno != EAGAIN )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "read" );
+        }
+        arm_poll( shard, shard->wakeup_fd, URING_OP_WAKEUP );
+        break;
+    }
+    case URING_OP_STDIN:
+        // 閉じられたら監視をやめる
+        if ( read_stdin() )
+        {
+            arm_poll( shard, fileno( stdin ), URING_OP_STDIN );
+        }
+        break;
+    case URING_OP_RECV:
+        handle_recv_cqe( cli, cqe );
+        break;
+    case URING_OP_SEND:
+        handle_send_cqe( cli, cqe );
+        break;
+    case URING_OP_CANCEL:
+        break; // 取り消された操作はそれぞれの CQE で後始末する
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+handle_recv_cqe( Client *cli,
+                 const struct io_uring_cqe *cqe )
+{
+    Shard *shard = cli->shard;
+    if ( ! ( cqe->flags & IORING_CQE_F_MORE ) )
+    {
+        --cli->uring_ops; // マルチショットの受信が終わった
+    }
+
+    char *data = NULL;
+    uint16_t bid = 0;
+    if ( cqe->flags & IORING_CQE_F_BUFFER )
+    {
+        bid = (uint16_t)( cqe->flags >> IORING_CQE_BUFFER_SHIFT );
+        data = uring_buf_ring_data( &shard->recv_bufs, bid );
+    }
+
+    if ( cli->closing )
+    {
+        if ( data != NULL ) uring_buf_ring_recycle( &shard->recv_bufs, bid );
+        reap_client( cli );
+        return;
+    }
+
+    if ( cqe->res > 0 )
+    {
+        // 受信バッファへ写してからすぐにバッファを返す
+        STATS_ADD( shard->stats.recv_calls, 1 );
+        if ( reserve_input( cli, cqe->res ) )
+        {
+            memcpy( cli->in_buf + cli->in_len, data, cqe->res );
+            cli->in_len += cqe->res;
+            STATS_ADD( shard->stats.bytes_in, cqe->res );
+        }
+        uring_buf_ring_recycle( &shard->recv_bufs, bid );
+        process_input( cli );
+    }
+    else if ( cqe->res == 0 )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_INFO, "[client:%d] disconnected.", cli->id );
+        cli->alive = 0;
+    }
+    else if ( cqe->res != -ENOBUFS )
+    {
+        // ENOBUFS は提供バッファが尽きただけなので、下で受信を投入し直す
+        errno = -cqe->res;
+        SERVER_LOG_ERRNO( LOG_CAT_CONN, "recv" );
+        cli->alive = 0;
+    }
+
+    // 終了したクライアントへの対応
+    if ( cli->alive == 0 )
+    {
+        // 送れる分だけ送ってから閉じる
+        flush_client( cli );
+        close_client( cli );
+        return;
+    }
+
+    if ( ! ( cqe->flags & IORING_CQE_F_MORE )
+         && ! arm_recv( cli ) )
+    {
+        close_client( cli );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+handle_send_cqe( Client *cli,
+                 const struct io_uring_cqe *cqe )
+{
+    --cli->uring_ops;
+    cli->send_inflight = 0;
+    if ( cli->closing )
+    {
+        reap_client( cli );
+        return;
+    }
+
+    if ( cqe->res < 0 )
+    {
+        errno = -cqe->res;
+        SERVER_LOG_ERRNO( LOG_CAT_CONN, "sendmsg" );
+        cli->alive = 0;
+        close_client( cli );
+        return;
+    }
+
+    // 送っている間に積まれた分や、送り切れなかった残りを続けて送る
+    size_t requested = 0;
+    for ( size_t i = 0; i < cli->send_msg.msg_iovlen; ++i )
+    {
+        requested += cli->send_iov[i].iov_len;
+    }
+    advance_out_queue( cli, cqe->res );
+    if ( (size_t)cqe->res < requested
+         && ! enforce_output_limit( cli ) )
+    {
+        close_client( cli );
+        return;
+    }
+    if ( ! submit_send( cli ) )
+    {
+        close_client( cli );
+    }
+}
+
+/* ------------------------------------------------------- */
+int
+arm_accept( Shard *shard )
+{
+    struct io_uring_sqe *sqe = uring_get_sqe( &shard->uring );
+    if ( sqe == NULL )
+    {
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_ERROR, "io_uring: no free SQE for accept" );
+        return 0;
+    }
+    uring_prep_multishot_accept( sqe, shard->server_socket, URING_OP_ACCEPT );
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+int
+arm_poll( Shard *shard,
+          const int fd,
+          const UringOp op )
+{
+    struct io_uring_sqe *sqe = uring_get_sqe( &shard->uring );
+    if ( sqe == NULL )
+    {
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_ERROR, "io_uring: no free SQE for poll" );
+        return 0;
+    }
+    uring_prep_poll( sqe, fd, POLLIN, op );
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+int
+arm_recv( Client *client )
+{
+    Shard *shard = client->shard;
+    struct io_uring_sqe *sqe = uring_get_sqe( &shard->uring );
+    if ( sqe == NULL )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_ERROR, "[client:%d] io_uring: no free SQE for recv", client->id );
+        client->alive = 0;
+        return 0;
+    }
+    uring_prep_multishot_recv( sqe, client->socket_fd, shard->recv_bufs.bgid,
+                               (uint64_t)(uintptr_t)client | URING_OP_RECV );
+    ++client->uring_ops;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信キューの先頭から URING_MAX_IOV 個までを sendmsg で投入する。
+  送信は1つずつなので、完了を待つ間に積まれた分は次の1回でまとめて送れるようにする。
+  投入中のものがあれば、その完了を待ってから handle_send_cqe で続きを送る。
+  接続を閉じるべき場合は0を返す。
+ */
+int
+submit_send( Client *client )
+{
+    if ( client->send_inflight
+         || client->out_count == 0 )
+    {
+        return 1;
+    }
+
+    const int want = ( client->out_count < URING_MAX_IOV ? client->out_count : URING_MAX_IOV );
+    if ( want > client->send_iov_cap )
+    {
+        int new_cap = ( client->send_iov_cap == 0 ? MAX_IOV : client->send_iov_cap );
+        while ( new_cap < want ) new_cap *= 2;
+        struct iovec *p = realloc( client->send_iov, new_cap * sizeof( struct iovec ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            client->alive = 0;
+            return 0;
+        }
+        client->send_iov = p;
+        client->send_iov_cap = new_cap;
+    }
+
+    int n_iov = 0;
+    for ( ; n_iov < want; ++n_iov )
+    {
+        OutEntry *e = &client->out_queue[( client->out_head + n_iov ) % client->out_cap];
+        client->send_iov[n_iov].iov_base = e->buf->data + e->sent;
+        client->send_iov[n_iov].iov_len = e->buf->len - e->sent;
+    }
+    memset( &client->send_msg, 0, sizeof( client->send_msg ) );
+    client->send_msg.msg_iov = client->send_iov;
+    client->send_msg.msg_iovlen = n_iov;
+
+    struct io_uring_sqe *sqe = uring_get_sqe( &client->shard->uring );
+    if ( sqe == NULL )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_ERROR, "[client:%d] io_uring: no free SQE for send", client->id );
+        client->alive = 0;
+        return 0;
+    }
+    uring_prep_sendmsg( sqe, client->socket_fd, &client->send_msg, (uint64_t)(uintptr_t)client | URING_OP_SEND );
+    STATS_ADD( client->shard->stats.writev_calls, 1 );
+    client->send_inflight = 1;
+    client->send_start_ms = client->shard->now_ms;
+    ++client->uring_ops;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  close_client 済みのクライアントを、操作がすべて完了していれば解放する。
+ */
+void
+reap_client( Client *client )
+{
+    if ( client->uring_ops > 0 )
+    {
+        return;
+    }
+
+    Shard *shard = client->shard;
+    if ( client->zombie_prev != NULL ) client->zombie_prev->zombie_next = client->zombie_next;
+    else shard->zombies = client->zombie_next;
+    if ( client->zombie_next != NULL ) client->zombie_next->zombie_prev = client->zombie_prev;
+    destroy_client( client );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  標準入力から1行読んで処理する。標準入力が閉じられたら0を返す。
+ */
+int
+read_stdin()
+{
+    char buf[BUFSIZE];
+    memset( buf, 0, BUFSIZE );
+
+    if ( fgets( buf, sizeof( buf ) - 1, stdin ) == NULL )
+    {
+        return ! feof( stdin );
+    }
+
+    buf[strcspn( buf, "\r\n" )] = '\0';
+
+    if ( strncmp( buf, "quit", 4 ) == 0 )
+    {
+        SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_INFO, "ok. quit all." );
+        stop_server();
+    }
+    else if ( strncmp( buf, "log ", 4 ) == 0 )
+    {
+        // 実行中にレベルを変える。例: log conn=debug
+        if ( server_log_set_levels( buf + 4 ) )
+        {
+            SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_INFO, "log level: %s", buf + 4 );
+        }
+        else
+        {
+            SERVER_LOG( LOG_CAT_SERVER, LOG_LEVEL_WARN, "illegal log level [%s]", buf + 4 );
+        }
+    }
+    else if ( strncmp( buf, "stats", 5 ) == 0 )
+    {
+        ServerStats *total = calloc( 1, sizeof( ServerStats ) );
+        if ( total == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+            return 1;
+        }
+        collect_stats( total );
+        server_stats_report( total, __atomic_load_n( &total_clients, __ATOMIC_RELAXED ),
+                             ( monotonic_ns() - start_time_ns ) / 1e9, print_stats_line, stderr );
+        free( total );
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  待受ソケットに溜まった接続をまとめて受け付ける。
+  他のイベントを待たせないよう1回に ACCEPT_BUDGET 件までとし、残りは次のループで受け付ける
+  （epoll はレベルトリガなので、残っていれば再び通知される）。
+  受け付けた件数を返す。
+ */
+int
+create_session( Shard *shard )
+{
+    int n_accepted = 0;
+    for ( int i = 0; i < ACCEPT_BUDGET; ++i )
+    {
+        // 1つのクライアントがループ全体を止めないようにノンブロッキングにする
+        struct sockaddr_in addr;
+        socklen_t len = sizeof( addr );
+        const int socket_fd = accept4( shard->server_socket, (struct sockaddr *)&addr, &len,
+                                       SOCK_NONBLOCK | SOCK_CLOEXEC );
+        if ( socket_fd < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            if ( errno != EAGAIN
+                 && errno != EWOULDBLOCK )
+            {
+                SERVER_LOG_ERRNO( LOG_CAT_CONN, "accept4" );
+            }
+            break;
+        }
+
+        if ( register_client( shard, socket_fd, &addr ) )
+        {
+            ++n_accepted;
+        }
+    }
+    return n_accepted;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  accept したソケットのクライアントを作って接続テーブルとイベントの監視に登録する。
+  addr が NULL なら getpeername で調べる。
+ */
+int
+register_client( Shard *shard,
+                 const int socket_fd,
+                 const struct sockaddr_in *addr )
+{
+    struct sockaddr_in peer;
+    if ( addr == NULL )
+    {
+        socklen_t len = sizeof( peer );
+        memset( &peer, 0, sizeof( peer ) );
+        if ( getpeername( socket_fd, (struct sockaddr *)&peer, &len ) != 0 )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "getpeername" );
+        }
+        addr = &peer;
+    }
+
+    // 上限に達していても accept はしておかないと待受ソケットが読み込み可能のまま残る
+    if ( __atomic_add_fetch( &total_clients, 1, __ATOMIC_RELAXED ) > max_clients )
+    {
+        __atomic_sub_fetch( &total_clients, 1, __ATOMIC_RELAXED );
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_WARN, "Over the max session (%d)", max_clients );
+        const char *buf = "(error server_full)\n";
+        if ( send( socket_fd, buf, strlen( buf ), MSG_DONTWAIT | MSG_NOSIGNAL ) < 0 )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "send" );
+        }
+        close( socket_fd );
+        return 0;
+    }
+
+    Client *client = create_client( shard, socket_fd );
+    if ( client == NULL )
+    {
+        close( socket_fd );
+        __atomic_sub_fetch( &total_clients, 1, __ATOMIC_RELAXED );
+        return 0;
+    }
+
+    STATS_ADD( shard->stats.accepted, 1 );
+    client->admin = ( ntohl( addr->sin_addr.s_addr ) >> 24 == 127 );
+
+    if ( ! conn_table_insert( &shard->clients, client ) )
+    {
+        destroy_client( client );
+        return 0;
+    }
+
+    if ( use_uring )
+    {
+        // 受信はマルチショットなので1回投入すれば閉じるまで続く
+        if ( ! arm_recv( client ) )
+        {
+            conn_table_remove( &shard->clients, client );
+            destroy_client( client );
+            return 0;
+        }
+    }
+    else
+    {
+        struct epoll_event ev;
+        memset( &ev, 0, sizeof( ev ) );
+        ev.events = EPOLLIN;
+        ev.data.fd = client->socket_fd;
+
+        if ( epoll_ctl( shard->epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &ev ) == -1 )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "epoll_ctl" );
+            conn_table_remove( &shard->clients, client );
+            destroy_client( client );
+            return 0;
+        }
+    }
+
+    client->last_active_ms = shard->now_ms;
+    arm_idle_timer( client );
+    client->tokens = rate_limit * RATE_BURST_MS;
+    client->tokens_ms = shard->now_ms;
+    client->job_pending = 0;
+
+    // inet_ntoa は静的な領域を返しシャード間で競合するので inet_ntop を使う
+    if ( server_log_enabled( LOG_CAT_CONN, LOG_LEVEL_INFO ) )
+    {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop( AF_INET, &addr->sin_addr, ip, sizeof( ip ) );
+        server_log( LOG_CAT_CONN, LOG_LEVEL_INFO, "[client:%d] accepted %s:%d", client->id, ip, ntohs( addr->sin_port ) );
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+Client *
+create_client( Shard *shard,
+               const int socket_fd )
+{
+    if ( shard->free_clients == NULL
+         && ! client_pool_grow( shard ) )
+    {
+        return NULL;
+    }
+
+    // 未使用の Client は destroy_client で初期化済み
+    Client *client = shard->free_clients;
+    shard->free_clients = client->next_free;
+    client->next_free = NULL;
+
+    client->socket_fd = socket_fd;
+    client->shard = shard;
+    client->id = __atomic_add_fetch( &client_count, 1, __ATOMIC_RELAXED );
+    client->alive = 1;
+    client->live_index = -1;
+    timer_init( &client->idle_timer, idle_expired, client );
+    return client;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  次に無通信を確かめる時刻にタイマーを登録する。受信のたびに登録し直すと
+  ホイールの操作が増えるので、受信では last_active_ms を更新するだけにして、
+  期限が来たときに idle_expired が残り時間で登録し直す。
+ */
+void
+arm_idle_timer( Client *client )
+{
+    if ( client_timeout_ms == 0 )
+    {
+        return;
+    }
+    const uint64_t wait_ms = ( client->ping_sent ? client_timeout_ms : client_timeout_ms / 2 );
+    timer_wheel_arm( &client->shard->timers, &client->idle_timer, client->last_active_ms + wait_ms );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  無通信の監視の期限。半分の時間が経っていれば (ping) を送り、
+  それでも応答が無いまま client_timeout_ms が経ったら切断する。
+ */
+void
+idle_expired( TimerNode *timer,
+              void *arg )
+{
+    (void)timer;
+    Client *client = arg;
+    const uint64_t idle_ms = client->shard->now_ms - client->last_active_ms;
+    if ( idle_ms >= client_timeout_ms )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_INFO, "[client:%d] idle for %llu ms, disconnecting",
+                    client->id, (unsigned long long)idle_ms );
+        STATS_ADD( client->shard->stats.idle_closed, 1 );
+        const char *buf = "(error idle_timeout)\n";
+        send_to_client( client, buf, strlen( buf ) );
+        flush_client( client );
+        close_client( client );
+        return;
+    }
+
+    if ( idle_ms >= client_timeout_ms / 2
+         && ! client->ping_sent )
+    {
+        // 要求への返信ではないので seq は0にする
+        const char *buf = "(ping)\n";
+        client->request_seq = 0;
+        send_to_client( client, buf, strlen( buf ) );
+        client->ping_sent = 1;
+    }
+    arm_idle_timer( client );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ソケットを閉じて Client をシャードの free_clients に戻す。
+  受信バッファ・送信キューは最初の大きさのままなら解放せず、次のクライアントで使い回す。
+ */
+void
+destroy_client( Client *client )
+{
+    Shard *shard = client->shard;
+    timer_wheel_cancel( &shard->timers, &client->idle_timer );
+    close( client->socket_fd ); // ソケットを閉じて
+    for ( int i = 0; i < client->out_count; ++i )
+    {
+        shared_buf_unref( client->out_queue[( client->out_head + i ) % client->out_cap].buf );
+    }
+    for ( int i = 0; i < client->n_held; ++i )
+    {
+        shared_buf_unref( client->held[i].buf );
+    }
+    free( client->held );
+    STATS_ADD( shard->stats.closed, 1 );
+    STATS_SUB( shard->stats.queued_bytes, client->out_bytes );
+    __atomic_sub_fetch( &total_clients, 1, __ATOMIC_RELAXED );
+
+    char *in_buf = client->in_buf;
+    size_t in_cap = client->in_cap;
+    if ( in_cap > RECV_CHUNK )
+    {
+        free( in_buf );
+        in_buf = NULL;
+        in_cap = 0;
+    }
+    OutEntry *out_queue = client->out_queue;
+    int out_cap = client->out_cap;
+    if ( out_cap > INITIAL_OUT_QUEUE )
+    {
+        free( out_queue );
+        out_queue = NULL;
+        out_cap = 0;
+    }
+    struct iovec *send_iov = client->send_iov;
+    int send_iov_cap = client->send_iov_cap;
+    if ( send_iov_cap > MAX_IOV )
+    {
+        free( send_iov );
+        send_iov = NULL;
+        send_iov_cap = 0;
+    }
+
+    memset( client, 0, sizeof( Client ) );
+    client->in_buf = in_buf;
+    client->in_cap = in_cap;
+    client->out_queue = out_queue;
+    client->out_cap = out_cap;
+    client->send_iov = send_iov;
+    client->send_iov_cap = send_iov_cap;
+    client->shard = shard;
+    client->next_free = shard->free_clients;
+    shard->free_clients = client;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  CLIENT_POOL_CHUNK 個の Client をまとめて確保して free_clients に加える。
+ */
+int
+client_pool_grow( Shard *shard )
+{
+    ClientChunk *chunk = calloc( 1, sizeof( ClientChunk ) );
+    if ( chunk == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+        return 0;
+    }
+    chunk->next = shard->client_chunks;
+    shard->client_chunks = chunk;
+
+    for ( int i = CLIENT_POOL_CHUNK - 1; i >= 0; --i )
+    {
+        Client *client = &chunk->clients[i];
+        client->shard = shard;
+        client->next_free = shard->free_clients;
+        shard->free_clients = client;
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  すべてのクライアントを destroy_client した後で呼び、使い回していたバッファと一緒に解放する。
+ */
+void
+client_pool_destroy( Shard *shard )
+{
+    for ( Client *client = shard->free_clients; client != NULL; client = client->next_free )
+    {
+        free( client->in_buf );
+        free( client->out_queue );
+        free( client->send_iov );
+    }
+    shard->free_clients = NULL;
+
+    while ( shard->client_chunks != NULL )
+    {
+        ClientChunk *chunk = shard->client_chunks;
+        shard->client_chunks = chunk->next;
+        free( chunk );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+receive( Shard *shard,
+         struct epoll_event *ev )
+{
+    Client *cli = conn_table_get( &shard->clients, ev->data.fd );
+    if ( cli == NULL )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_ERROR, "no client for fd %d", ev->data.fd );
+        return;
+    }
+
+    if ( reserve_input( cli, RECV_CHUNK ) )
+    {
+        // 末尾の1バイトは終端文字用に残しておく
+        ssize_t len = recv( cli->socket_fd, cli->in_buf + cli->in_len, cli->in_cap - cli->in_len - 1, 0 );
+        STATS_ADD( shard->stats.recv_calls, 1 );
+        if ( len == -1 )
+        {
+            if ( errno == EINTR
+                 || errno == EAGAIN )
+            {
+                return;
+            }
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "recv" );
+            cli->alive = 0;
+        }
+        else if ( len == 0 )
+        {
+            SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_INFO, "[client:%d] disconnected.", cli->id );
+            cli->alive = 0;
+        }
+        else
+        {
+            cli->in_len += len;
+            STATS_ADD( shard->stats.bytes_in, len );
+            process_input( cli );
+        }
+    }
+
+    // 終了したクライアントへの対応
+    if ( cli->alive == 0 )
+    {
+        // 送れる分だけ送ってから閉じる
+        flush_client( cli );
+        close_client( cli );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  受信バッファに len バイトの空きを用意する。
+  確保できなければクライアントを終了させて0を返す。
+ */
+int
+reserve_input( Client *cli,
+               const size_t len )
+{
+    if ( cli->in_cap - cli->in_len >= len )
+    {
+        return 1;
+    }
+
+    size_t new_cap = ( cli->in_cap == 0 ? RECV_CHUNK : cli->in_cap * 2 );
+    while ( new_cap - cli->in_len < len ) new_cap *= 2;
+
+    char *p = realloc( cli->in_buf, new_cap );
+    if ( p == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+        cli->alive = 0;
+        return 0;
+    }
+    cli->in_buf = p;
+    cli->in_cap = new_cap;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  受信バッファに溜まった完全な行（バイナリモードではフレーム）をすべて処理する。
+ */
+void
+process_input( Client *cli )
+{
+    // 何か届いていれば生きているとみなす。タイマーは期限が来たときに登録し直す
+    cli->last_active_ms = cli->shard->now_ms;
+    cli->ping_sent = 0;
+
+    consume_input( cli );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  受信バッファのコマンドを順に処理する。ワーカーに任せたコマンドがあればそこで止め、
+  続きはその返信を積んだ deliver_jobs から再開する。
+ */
+void
+consume_input( Client *cli )
+{
+    // (hello binary) の直後からはフレームとして読むので、1つごとにモードを確かめる
+    size_t consumed = 0;
+    while ( cli->alive
+            && ! cli->job_pending )
+    {
+        const size_t n = ( cli->binary
+                           ? receive_frame( cli, cli->in_buf + consumed, cli->in_len - consumed )
+                           : receive_line( cli, cli->in_buf + consumed, cli->in_len - consumed ) );
+        if ( n == 0 )
+        {
+            break;
+        }
+        consumed += n;
+    }
+
+    // 処理しきれなかった残りを先頭へ詰める
+    if ( consumed > 0 )
+    {
+        memmove( cli->in_buf, cli->in_buf + consumed, cli->in_len - consumed );
+        cli->in_len -= consumed;
+    }
+
+    // 返信を待っている間は後続のコマンドが溜まるので、1行の上限ではなく MAX_PENDING_INPUT で制限する
+    if ( ! cli->job_pending
+         && cli->in_len > MAX_LINE_LENGTH )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_WARN, "[client:%d] too long line (%zu bytes)", cli->id, cli->in_len );
+        const char *buf = "(error too_long_line)\n";
+        send_to_client( cli, buf, strlen( buf ) );
+        cli->alive = 0;
+    }
+    else if ( cli->in_len > MAX_PENDING_INPUT )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_WARN, "[client:%d] too much pipelined input (%zu bytes)", cli->id, cli->in_len );
+        const char *buf = "(error too_much_input)\n";
+        send_to_client( cli, buf, strlen( buf ) );
+        cli->alive = 0;
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  data の先頭の1行を処理する。
+  処理したバイト数を返し、改行がまだ届いていなければ0を返す。
+ */
+size_t
+receive_line( Client *cli,
+              char *data,
+              const size_t len )
+{
+    char *nl = memchr( data, '\n', len );
+    if ( nl == NULL )
+    {
+        return 0;
+    }
+
+    const size_t consumed = nl - data + 1;
+    *nl = '\0';
+    if ( nl > data && *(nl - 1) == '\r' )
+    {
+        *--nl = '\0';
+    }
+
+    if ( nl > data ) // 空行は無視
+    {
+        handle_command( cli, data, nl - data );
+    }
+    return consumed;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  data の先頭のフレームを処理する。ヘッダの長さでペイロードを切り出すので走査はしない。
+  処理したバイト数を返し、フレームがまだ揃っていなければ0を返す。
+ */
+size_t
+receive_frame( Client *cli,
+               char *data,
+               const size_t len )
+{
+    FrameHeader hdr;
+    const int ret = frame_decode_header( data, len, &hdr );
+    if ( ret < 0 )
+    {
+        SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_WARN, "[client:%d] too large frame (%u bytes)", cli->id, (unsigned)hdr.len );
+        const char *buf = "(error too_large_frame)\n";
+        send_to_client( cli, buf, strlen( buf ) );
+        cli->alive = 0;
+        return 0;
+    }
+
+    if ( ret == 0
+         || len < FRAME_HEADER_SIZE + hdr.len )
+    {
+        return 0;
+    }
+
+    handle_frame( cli, &hdr, data + FRAME_HEADER_SIZE );
+    return FRAME_HEADER_SIZE + hdr.len;
+}
+
+/* ------------------------------------------------------- */
+void
+close_client( Client *client )
+{
+    Shard *shard = client->shard;
+
+    // epollからソケットの登録を削除
+    if ( ! use_uring
+         && epoll_ctl( shard->epoll_fd, EPOLL_CTL_DEL, client->socket_fd, NULL ) != 0 )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_CONN, "epoll_ctl" );
+    }
+
+    // セッションは ttl の間 (resume) で引き継げるよう、参加中の部屋と一緒に残す
+    if ( client->session_generation != 0 )
+    {
+        session_table_detach( sessions, client->session_token, client->session_generation,
+                              client->joined, client->n_joined, shard->now_ms );
+    }
+
+    // 部屋のメンバー・(watch) の登録と接続テーブル・タイマーから削除
+    timer_wheel_cancel( &shard->timers, &client->idle_timer );
+    leave_all_rooms( client );
+    unwatch_all( client );
+    conn_table_remove( &shard->clients, client );
+
+    // io_uring の操作が残っていれば取り消し、すべての完了を受けてから reap_client で解放する。
+    // それまではソケットを閉じないので、fd が別の接続に再利用されることもない
+    if ( client->uring_ops > 0 )
+    {
+        client->closing = 1;
+        client->zombie_prev = NULL;
+        client->zombie_next = shard->zombies;
+        if ( shard->zombies != NULL ) shard->zombies->zombie_prev = client;
+        shard->zombies = client;
+
+        struct io_uring_sqe *sqe = uring_get_sqe( &shard->uring );
+        if ( sqe != NULL )
+        {
+            uring_prep_cancel_fd( sqe, client->socket_fd, URING_OP_CANCEL );
+        }
+        else
+        {
+            shutdown( client->socket_fd, SHUT_RDWR ); // 取り消せなくても受信は0バイトで終わる
+        }
+        return;
+    }
+    destroy_client( client );
+}
+
+/* ------------------------------------------------------- */
+SharedBuf *
+shared_buf_alloc( const size_t len )
+{
+    SharedBuf *buf = malloc( sizeof( SharedBuf ) + len );
+    if ( buf == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "malloc" );
+        return NULL;
+    }
+    __atomic_store_n( &buf->refcount, 1, __ATOMIC_RELAXED );
+    buf->len = len;
+    return buf;
+}
+
+/* ------------------------------------------------------- */
+SharedBuf *
+shared_buf_new( const char *data,
+                const size_t len )
+{
+    SharedBuf *buf = shared_buf_alloc( len );
+    if ( buf != NULL )
+    {
+        memcpy( buf->data, data, len );
+    }
+    return buf;
+}
+
+/* ------------------------------------------------------- */
+void
+shared_buf_unref( SharedBuf *buf )
+{
+    if ( __atomic_sub_fetch( &buf->refcount, 1, __ATOMIC_ACQ_REL ) == 0 )
+    {
+        free( buf );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+send_to_client( Client *client,
+                const char *buf,
+                const size_t len )
+{
+    if ( client->alive == 0
+         || len == 0 )
+    {
+        return;
+    }
+
+    SharedBuf *shared = text_buf_new( client, buf, len );
+    if ( shared == NULL )
+    {
+        client->alive = 0;
+        return;
+    }
+    send_shared_to_client( client, shared );
+    shared_buf_unref( shared );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  テキストの1行を、クライアントのモードに合わせてそのまま、または FRAME_TEXT に包んで返す。
+ */
+SharedBuf *
+text_buf_new( const Client *client,
+              const char *buf,
+              const size_t len )
+{
+    if ( ! client->binary )
+    {
+        return shared_buf_new( buf, len );
+    }
+
+    // バイナリモードでは改行を除いた1行を FRAME_TEXT に包んで送る
+    const size_t line_len = ( buf[len - 1] == '\n' ? len - 1 : len );
+    SharedBuf *shared = shared_buf_alloc( FRAME_HEADER_SIZE + line_len );
+    if ( shared != NULL
+         && frame_encode( shared->data, shared->len, FRAME_TEXT, 0, client->request_seq, buf, line_len ) == 0 )
+    {
+        shared_buf_unref( shared );
+        shared = NULL;
+    }
+    return shared;
+}
+
+/* ------------------------------------------------------- */
+void
+send_shared_to_client( Client *client,
+                       SharedBuf *buf )
+{
+    if ( client->alive == 0
+         || buf->len == 0 )
+    {
+        return;
+    }
+    queue_output( client, buf, OUT_REPLY );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ブロードキャストを送信キューに積む。送信が遅いクライアントでは
+  enforce_output_limit が古いものから捨てることがある。
+ */
+void
+send_broadcast_to_client( Client *client,
+                          SharedBuf *buf )
+{
+    if ( client->alive == 0
+         || buf->len == 0 )
+    {
+        return;
+    }
+    queue_output( client, buf, OUT_BROADCAST );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  このクライアントの送信キューの上限。シャードの合計が持ち分を超えている間は、
+  溜まっているクライアントから減らすよう PRESSURE_OUTPUT_LIMIT まで下げる。
+ */
+size_t
+output_limit( const Client *client )
+{
+    const Shard *shard = client->shard;
+    if ( shard->stats.queued_bytes > max_total_output / n_shards
+         && max_output > PRESSURE_OUTPUT_LIMIT )
+    {
+        return PRESSURE_OUTPUT_LIMIT;
+    }
+    return max_output;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ソケットが一杯で送り切れないときに呼び、送信キューが上限を超えていれば方針に従って減らす。
+  積むときに調べないのは、1回のループで上限を超えるほど届いても、読んでいるクライアントなら
+  続く送信で捌けるため。ブロードキャストは全受信者で共有しているので、
+  1回のループで積む分のメモリは受信者の数によらない。
+  drop では古いブロードキャストを捨て、それでも上限の2倍を超えていれば切断する。
+  disconnect では上限を超えた時点で切断する。切断すべきなら0を返す。
+ */
+int
+enforce_output_limit( Client *client )
+{
+    const size_t limit = output_limit( client );
+    if ( client->out_bytes <= limit )
+    {
+        return 1;
+    }
+
+    if ( ! slow_disconnect )
+    {
+        drop_broadcasts( client, limit / 2 );
+        if ( client->out_bytes <= limit * 2 )
+        {
+            return client->alive;
+        }
+    }
+
+    SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_WARN, "[client:%d] slow consumer: %zu bytes queued, disconnecting",
+                client->id, client->out_bytes );
+    STATS_ADD( client->shard->stats.slow_closed, 1 );
+    client->alive = 0;
+    return 0;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  まだ送り始めていないブロードキャストを、送信キューが target バイト以下になるまで古い順に捨てる。
+  捨てるたびに詰め直すと遅いクライアントほど重くなるので、上限の半分まで一度に減らす。
+  捨てた位置には "(gap n)" を置く。すぐ前が未送信の "(gap n)" ならその n に足す。
+  捨てた数を返す。
+ */
+int
+drop_broadcasts( Client *client,
+                 const size_t target )
+{
+    // io_uring で送信中の要素と、途中まで送った先頭の要素は動かせない
+    int locked = ( client->send_inflight ? (int)client->send_msg.msg_iovlen : 0 );
+    if ( locked == 0
+         && client->out_count > 0
+         && client->out_queue[client->out_head].sent > 0 )
+    {
+        locked = 1;
+    }
+
+    int n_dropped = 0;
+    int gap_at = -1;
+    int w = locked;
+    for ( int r = locked; r < client->out_count; ++r )
+    {
+        const OutEntry e = client->out_queue[( client->out_head + r ) % client->out_cap];
+        if ( e.kind != OUT_BROADCAST
+             || client->out_bytes <= target )
+        {
+            client->out_queue[( client->out_head + w ) % client->out_cap] = e;
+            ++w;
+            continue;
+        }
+
+        client->out_bytes -= e.buf->len;
+        STATS_SUB( client->shard->stats.queued_bytes, e.buf->len );
+        shared_buf_unref( e.buf );
+        ++n_dropped;
+
+        if ( gap_at < 0 )
+        {
+            const OutEntry *prev = ( w > locked ? &client->out_queue[( client->out_head + w - 1 ) % client->out_cap] : NULL );
+            if ( prev != NULL
+                 && prev->kind == OUT_GAP )
+            {
+                gap_at = w - 1;
+            }
+            else
+            {
+                // 読み出し位置より前にしか書かないので、空いたこの位置に置ける
+                OutEntry *g = &client->out_queue[( client->out_head + w ) % client->out_cap];
+                g->buf = NULL;
+                g->sent = 0;
+                g->kind = OUT_GAP;
+                g->gap = 0;
+                gap_at = w;
+                ++w;
+            }
+        }
+    }
+    client->out_count = w;
+
+    if ( n_dropped > 0 )
+    {
+        const OutEntry *g = &client->out_queue[( client->out_head + gap_at ) % client->out_cap];
+        STATS_ADD( client->shard->stats.slow_dropped, n_dropped );
+        SERVER_LOG( LOG_CAT_BROADCAST, LOG_LEVEL_DEBUG, "[client:%d] slow consumer: dropped %d messages",
+                    client->id, n_dropped );
+        set_gap( client, gap_at, g->gap + n_dropped );
+    }
+    return n_dropped;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信キューの i 番目の OUT_GAP を "(gap n)" で作り直す。まだ送り始めていないこと
+ */
+int
+set_gap( Client *client,
+         const int i,
+         const int gap )
+{
+    char line[64];
+    const int len = snprintf( line, sizeof( line ), "(gap %d)\n", gap );
+
+    // 要求への返信ではないので seq は0にする
+    const uint64_t request_seq = client->request_seq;
+    client->request_seq = 0;
+    SharedBuf *buf = text_buf_new( client, line, len );
+    client->request_seq = request_seq;
+
+    OutEntry *e = &client->out_queue[( client->out_head + i ) % client->out_cap];
+    if ( buf == NULL )
+    {
+        // 中身の無い要素は残せないので詰めて取り除く。切断するので遅くてよい
+        if ( e->buf == NULL )
+        {
+            for ( int j = i + 1; j < client->out_count; ++j )
+            {
+                client->out_queue[( client->out_head + j - 1 ) % client->out_cap] =
+                    client->out_queue[( client->out_head + j ) % client->out_cap];
+            }
+            --client->out_count;
+        }
+        client->alive = 0;
+        return 0;
+    }
+
+    if ( e->buf != NULL )
+    {
+        client->out_bytes -= e->buf->len;
+        STATS_SUB( client->shard->stats.queued_bytes, e->buf->len );
+        shared_buf_unref( e->buf );
+    }
+    e->buf = buf;
+    e->gap = gap;
+    client->out_bytes += buf->len;
+    STATS_ADD( client->shard->stats.queued_bytes, buf->len );
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信キューに buf を積む。
+ */
+int
+queue_output( Client *client,
+              SharedBuf *buf,
+              const OutKind kind )
+{
+    if ( client->out_count >= client->out_cap )
+    {
+        // リングを倍に拡張し、先頭から順に並べ直す
+        const int new_cap = ( client->out_cap == 0 ? INITIAL_OUT_QUEUE : client->out_cap * 2 );
+        OutEntry *q = malloc( new_cap * sizeof( OutEntry ) );
+        if ( q == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "malloc" );
+            client->alive = 0;
+            return 0;
+        }
+        for ( int i = 0; i < client->out_count; ++i )
+        {
+            q[i] = client->out_queue[( client->out_head + i ) % client->out_cap];
+        }
+        free( client->out_queue );
+        client->out_queue = q;
+        client->out_head = 0;
+        client->out_cap = new_cap;
+    }
+
+    // データはコピーせず参照だけをキューに積む
+    OutEntry *e = &client->out_queue[( client->out_head + client->out_count ) % client->out_cap];
+    __atomic_add_fetch( &buf->refcount, 1, __ATOMIC_RELAXED );
+    e->buf = buf;
+    e->sent = 0;
+    e->kind = kind;
+    e->gap = 0;
+    ++client->out_count;
+    client->out_bytes += buf->len;
+    STATS_ADD( client->shard->stats.queued_bytes, buf->len );
+
+    // 実際の送信はループの最後にまとめて行う
+    return mark_pending( client );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ループの最後に flush_pending_clients で送信（または切断）するよう登録する。
+ */
+int
+mark_pending( Client *client )
+{
+    if ( client->out_pending )
+    {
+        return 1;
+    }
+
+    Shard *shard = client->shard;
+    if ( shard->pending_count >= shard->pending_capacity )
+    {
+        const int new_capacity = ( shard->pending_capacity == 0 ? INITIAL_TABLE_SIZE : shard->pending_capacity * 2 );
+        int *p = realloc( shard->pending_fds, new_capacity * sizeof( int ) );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            client->alive = 0;
+            return 0;
+        }
+        shard->pending_fds = p;
+        shard->pending_capacity = new_capacity;
+    }
+    shard->pending_fds[shard->pending_count++] = client->socket_fd;
+    client->out_pending = 1;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信キューを writev でまとめて可能な限り送信する。
+  送り切れなければ EPOLLOUT を監視して続きを待つ。
+  io_uring の場合は sendmsg を投入するだけで、続きは完了を受けてから送る。
+  送信エラーで接続を閉じるべき場合は0を返す。
+ */
+int
+flush_client( Client *client )
+{
+    ServerStats *stats = &client->shard->stats;
+    if ( client->out_count > 0 )
+    {
+        histogram_record( &stats->out_queue_depth, client->out_count );
+    }
+
+    if ( use_uring )
+    {
+        // sendmsg はソケットが空くまで完了しないので、完了が遅れていれば一杯とみなす。
+        // CQ に残っている分は完了していてもまだ見ていないだけなので、空にした時点で判断する
+        if ( client->send_inflight
+             && client->shard->reaped_ms >= client->send_start_ms + URING_SEND_STALL_MS
+             && ! enforce_output_limit( client ) )
+        {
+            return 0;
+        }
+        return submit_send( client );
+    }
+
+    while ( client->out_count > 0 )
+    {
+        struct iovec iov[MAX_IOV];
+        int n_iov = 0;
+        for ( ; n_iov < client->out_count && n_iov < MAX_IOV; ++n_iov )
+        {
+            OutEntry *e = &client->out_queue[( client->out_head + n_iov ) % client->out_cap];
+            iov[n_iov].iov_base = e->buf->data + e->sent;
+            iov[n_iov].iov_len = e->buf->len - e->sent;
+        }
+
+        ssize_t n = writev( client->socket_fd, iov, n_iov );
+        STATS_ADD( stats->writev_calls, 1 );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            if ( errno == EAGAIN
+                 || errno == EWOULDBLOCK )
+            {
+                if ( ! enforce_output_limit( client ) ) return 0;
+                break;
+            }
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "writev" );
+            client->alive = 0;
+            return 0;
+        }
+
+        advance_out_queue( client, n );
+
+        if ( client->out_count > 0
+             && client->out_queue[client->out_head].sent > 0 )
+        {
+            // 短い書き込みになったのでソケットバッファが一杯
+            if ( ! enforce_output_limit( client ) ) return 0;
+            break;
+        }
+    }
+
+    const int want_write = ( client->out_count > 0 );
+    if ( want_write != client->want_write )
+    {
+        struct epoll_event ev;
+        memset( &ev, 0, sizeof( ev ) );
+        ev.events = EPOLLIN | ( want_write ? EPOLLOUT : 0 );
+        ev.data.fd = client->socket_fd;
+        if ( epoll_ctl( client->shard->epoll_fd, EPOLL_CTL_MOD, client->socket_fd, &ev ) != 0 )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_CONN, "epoll_ctl" );
+            client->alive = 0;
+            return 0;
+        }
+        client->want_write = want_write;
+    }
+
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信できたバイト数だけキューを進める。途中までの要素は位置を覚えておく
+ */
+void
+advance_out_queue( Client *client,
+                   size_t n )
+{
+    ServerStats *stats = &client->shard->stats;
+    client->out_bytes -= n;
+    STATS_ADD( stats->bytes_out, n );
+    STATS_SUB( stats->queued_bytes, n );
+    while ( n > 0 )
+    {
+        OutEntry *e = &client->out_queue[client->out_head];
+        const size_t rest = e->buf->len - e->sent;
+        if ( n < rest )
+        {
+            e->sent += n;
+            break;
+        }
+        n -= rest;
+        shared_buf_unref( e->buf );
+        e->buf = NULL;
+        client->out_head = ( client->out_head + 1 ) % client->out_cap;
+        --client->out_count;
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+flush_pending_clients( Shard *shard )
+{
+    for ( int i = 0; i < shard->pending_count; ++i )
+    {
+        Client *cli = conn_table_get( &shard->clients, shard->pending_fds[i] );
+        if ( cli == NULL
+             || ! cli->out_pending )
+        {
+            continue; // 既に閉じられたクライアント
+        }
+        cli->out_pending = 0;
+
+        if ( ! flush_client( cli )
+             || cli->alive == 0 )
+        {
+            close_client( cli );
+        }
+    }
+    shard->pending_count = 0;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  コマンドを受け付けるかどうかを決める。ループが max_lag_ms より遅れていれば重いコマンドを断り、
+  そうでなければクライアントのトークンバケツからコストを払う。
+  断った場合は (error rate_limited 再試行までのミリ秒) を返信して0を返す。
+ */
+int
+admit_command( Client *cli,
+               const Command command )
+{
+    Shard *shard = cli->shard;
+    const int cost = command_costs[command];
+    if ( cost == 0 )
+    {
+        return 1;
+    }
+
+    uint64_t retry_ms = 0;
+    const uint64_t lag_ms = shard->loop_lag_ns / 1000000;
+    if ( max_lag_ms > 0
+         && cost >= EXPENSIVE_COMMAND_COST
+         && lag_ms > max_lag_ms )
+    {
+        STATS_ADD( shard->stats.shed, 1 );
+        retry_ms = lag_ms;
+    }
+    else if ( rate_limit > 0 )
+    {
+        // 経過時間の分だけ足す。rate_limit トークン/秒は rate_limit（1000分の1トークン）/ミリ秒
+        const int64_t capacity = rate_limit * RATE_BURST_MS;
+        cli->tokens += (int64_t)( shard->now_ms - cli->tokens_ms ) * rate_limit;
+        if ( cli->tokens > capacity ) cli->tokens = capacity;
+        cli->tokens_ms = shard->now_ms;
+
+        // 貯められる量より重いコマンドは、満杯になれば借りて実行できるようにする
+        const int64_t price = (int64_t)cost * 1000;
+        const int64_t required = ( price < capacity ? price : capacity );
+        if ( cli->tokens >= required )
+        {
+            cli->tokens -= price;
+            return 1;
+        }
+        STATS_ADD( shard->stats.rate_limited, 1 );
+        retry_ms = (uint64_t)( ( required - cli->tokens + rate_limit - 1 ) / rate_limit );
+    }
+    else
+    {
+        return 1;
+    }
+
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "[client:%d] %s rate limited, retry in %llu ms",
+                cli->id, command_name( command ), (unsigned long long)retry_ms );
+    char buf[BUFSIZE];
+    snprintf( buf, BUFSIZE - 1, "(error rate_limited %llu)\n", (unsigned long long)retry_ms );
+    send_to_client( cli, buf, strlen( buf ) );
+    return 0;
+}
+
+/* ------------------------------------------------------- */
+void
+handle_command( Client *cli,
+                const char *line,
+                const size_t len )
+{
+    const uint64_t start_ns = monotonic_ns();
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "[client:%d] received=\"%.*s\"", cli->id, (int)len, line );
+
+    // 行を一度だけ走査して字句に分ける。各コマンドは引数を StrView のまま受け取る
+    ParsedCommand cmd;
+    if ( ! command_parse( line, len, &cmd ) )
+    {
+        reply_unknown_command( cli, &cmd );
+        record_command( cli, CMD_UNKNOWN, start_ns );
+        return;
+    }
+    if ( ! admit_command( cli, cmd.command ) )
+    {
+        return;
+    }
+
+    switch ( cmd.command ) {
+    case CMD_MESSAGE:
+        send_message_to_all( cli, &cmd );
+        break;
+    case CMD_FIND:
+        find_message( cli, &cmd );
+        break;
+    case CMD_HISTORY:
+        send_history( cli, &cmd );
+        break;
+    case CMD_HISTORY_SINCE:
+        send_history_since( cli, &cmd );
+        break;
+    case CMD_HISTORY_RANGE:
+        send_history_range( cli, &cmd );
+        break;
+    case CMD_TIME:
+        reply_time_message( cli, &cmd );
+        break;
+    case CMD_HELLO:
+        reply_hello( cli, &cmd );
+        break;
+    case CMD_QUIT:
+        disable_client( cli, &cmd );
+        break;
+    case CMD_JOIN:
+        reply_join( cli, &cmd );
+        break;
+    case CMD_LEAVE:
+        reply_leave( cli, &cmd );
+        break;
+    case CMD_STATS:
+        reply_stats( cli, &cmd );
+        break;
+    case CMD_PING:
+        reply_ping( cli, &cmd );
+        break;
+    case CMD_PONG:
+        break; // (ping) への応答。受信した時点で last_active_ms は更新済み
+    case CMD_RESUME:
+        reply_resume( cli, &cmd );
+        break;
+    case CMD_WATCH:
+        reply_watch( cli, &cmd );
+        break;
+    case CMD_UNWATCH:
+        reply_unwatch( cli, &cmd );
+        break;
+    default:
+        reply_unknown_command( cli, &cmd );
+        break;
+    };
+
+    if ( cmd.command != CMD_HELLO
+         && cmd.command != CMD_PING
+         && cmd.command != CMD_PONG )
+    {
+        cli->started = 1;
+    }
+
+    // ワーカーに任せたコマンドは返信を積んだ時点で記録する
+    if ( ! cli->job_pending )
+    {
+        record_command( cli, cmd.command, start_ns );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+handle_frame( Client *cli,
+              const FrameHeader *hdr,
+              const char *payload )
+{
+    // 返信には要求の seq をそのまま付ける
+    const uint64_t start_ns = monotonic_ns();
+    cli->request_seq = hdr->seq;
+
+    if ( hdr->type != FRAME_TEXT )
+    {
+        cli->started = 1;
+    }
+
+    // FRAME_TEXT は handle_command の中で判断する
+    if ( ( hdr->type == FRAME_MSG
+           && ! admit_command( cli, CMD_MESSAGE ) )
+         || ( hdr->type == FRAME_FIND
+              && ! admit_command( cli, CMD_FIND ) ) )
+    {
+        return;
+    }
+
+    switch ( hdr->type ) {
+    case FRAME_TEXT:
+        handle_command( cli, payload, hdr->len );
+        break;
+    case FRAME_MSG:
+        if ( hdr->flags & FRAME_FLAG_ROOM )
+        {
+            // 部屋名の長さと部屋名が本文の前に付いている
+            const char *name;
+            size_t name_len;
+            const char *body;
+            size_t body_len;
+            uint32_t room = GLOBAL_ROOM;
+            if ( frame_split_room( payload, hdr->len, &name, &name_len, &body, &body_len ) )
+            {
+                room = room_table_lookup( room_table, name, name_len );
+            }
+            if ( room == GLOBAL_ROOM )
+            {
+                const char *buf = "(error unknown_room)\n";
+                send_to_client( cli, buf, strlen( buf ) );
+                break;
+            }
+            broadcast_message( cli, room, body, body_len );
+        }
+        else
+        {
+            broadcast_message( cli, GLOBAL_ROOM, payload, hdr->len );
+        }
+        break;
+    case FRAME_FIND:
+    {
+        char keyword[MAX_MESSAGE_LENGTH + 1];
+        if ( hdr->len == 0
+             || MAX_MESSAGE_LENGTH < hdr->len
+             || memchr( payload, '\0', hdr->len ) != NULL )
+        {
+            const char *buf = "(error illegal_keyword)\n";
+            send_to_client( cli, buf, strlen( buf ) );
+            break;
+        }
+        memcpy( keyword, payload, hdr->len );
+        keyword[hdr->len] = '\0';
+        find_keyword( cli, GLOBAL_ROOM, keyword, 1, 0 );
+        break;
+    }
+    default:
+    {
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(error unknown_frame %d)\n", hdr->type );
+        SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_WARN, "[client:%d] unknown frame type %d", cli->id, hdr->type );
+        send_to_client( cli, buf, strlen( buf ) );
+        break;
+    }
+    };
+
+    // FRAME_TEXT は handle_command の中で、ワーカーに任せたものは返信を積んだ時点で記録される
+    if ( hdr->type == FRAME_MSG
+         || ( hdr->type == FRAME_FIND && ! cli->job_pending ) )
+    {
+        record_command( cli, ( hdr->type == FRAME_MSG ? CMD_MESSAGE : CMD_FIND ), start_ns );
+    }
+}
+
+/* ------------------------------------------------------- */
+void
+send_message_to_all( Client *sender, const ParsedCommand *cmd )
+{
+    char msg[MAX_MESSAGE_LENGTH + 1];
+
+    // (msg "MSG") または (msg ROOM "MSG") という形式を想定し、エスケープを解いた MSG を取り出す
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    const long len = ( cmd->n_args == shift + 1
+                       ? command_arg_string( cmd, shift, msg, sizeof( msg ) )
+                       : -1 );
+    if ( len <= 0 )
+    {
+        char buf[BUFSIZE];
+        SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_WARN, "received an illegal message [%.*s]", (int)cmd->line.len, cmd->line.ptr );
+        snprintf( buf, BUFSIZE - 1, "(error illegal_message [%.*s])\n", (int)cmd->line.len, cmd->line.ptr );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
+
+    broadcast_message( sender, room, msg, (size_t)len );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  メッセージを保存して全員（部屋宛てなら部屋のメンバー）へ配信し、送信者へ確認を返す。
+  msg はテキストモードではエスケープを解いた本文、バイナリモードではフレームのペイロードそのもの。
+ */
+void
+broadcast_message( Client *sender,
+                   const uint32_t room,
+                   const char *msg,
+                   const size_t len )
+{
+    char buf[BUFSIZE];
+    const char *room_name = room_table_name( room_table, room );
+
+    // 部屋へ送れるのはメンバーだけ
+    if ( room != GLOBAL_ROOM
+         && find_joined( sender, room ) < 0 )
+    {
+        snprintf( buf, BUFSIZE - 1, "(error not_member %s)\n", room_name );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
+
+    // 改行を含むとテキストモードの受信者が行を区切れなくなるので受け付けない
+    if ( len == 0
+         || MAX_MESSAGE_LENGTH < len
+         || memchr( msg, '\0', len ) != NULL
+         || memchr( msg, '\n', len ) != NULL
+         || memchr( msg, '\r', len ) != NULL )
+    {
+        const char *error = "(error illegal_message)\n";
+        SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_WARN, "[client:%d] illegal message (%zu bytes)", sender->id, len );
+        send_to_client( sender, error, strlen( error ) );
+        return;
+    }
+
+    // 時刻の決定・保存・配送を1つのロックの中で行い、全シャードで順序を揃える
+    pthread_mutex_lock( &broadcast_lock );
+
+    // ログを時刻で二分探索できるよう、時計が戻っても時刻を減らさない
+    time_t current_time = time( NULL );
+    if ( current_time < last_message_time )
+    {
+        current_time = last_message_time;
+    }
+    last_message_time = current_time;
+
+    SERVER_LOG( LOG_CAT_BROADCAST, LOG_LEVEL_DEBUG, "send message to %s [%.*s]",
+                ( room == GLOBAL_ROOM ? "all" : room_name ), (int)len, msg );
+
+    // ログに追記してシーケンス番号を決めてから、行とフレームを1つずつ作る。
+    // どちらも履歴と全シャード・全受信者のキューで共有し、受信者のモードに合う方を送る。
+    // 自分のシャードへも inbox 経由で送り、他シャードからの配送と順序を揃える
+    LogRecord rec;
+    rec.time = current_time;
+    rec.sender_id = sender->id;
+    rec.room = room;
+    rec.len = (uint32_t)len;
+    rec.msg = msg;
+    const uint64_t append_ns = monotonic_ns();
+    rec.seq = save_message( current_time, sender->id, room, msg, len );
+    histogram_record( &sender->shard->stats.log_append, monotonic_ns() - append_ns );
+    sender->shard->log_appended = 1;
+
+    SharedBuf *line = message_line_new( &rec );
+    SharedBuf *frame = message_frame_new( &rec );
+    if ( line != NULL
+         && frame != NULL )
+    {
+        // メモリ上の履歴は全員宛てのメッセージだけを持つ
+        if ( room == GLOBAL_ROOM )
+        {
+            history_ring_push( &history, rec.seq, current_time, sender->id, line, frame );
+        }
+
+        // 本文を1回走査して (watch) のキーワードをすべて見つけ、キーワードごとに通知を1つ作る。
+        // 登録者への配送は各シャードがブロードキャストと一緒に行う
+        WatchMatchList matched;
+        matched.line = line;
+        matched.n_matches = 0;
+        watch_index_match( watch_index, msg, len, collect_watch_match, &matched );
+
+        for ( int i = 0; i < n_shards; ++i )
+        {
+            Broadcast *b = malloc( sizeof( Broadcast ) + matched.n_matches * sizeof( WatchMatch ) );
+            if ( b == NULL )
+            {
+                SERVER_LOG_ERRNO( LOG_CAT_SERVER, "malloc" );
+                continue;
+            }
+            __atomic_add_fetch( &line->refcount, 1, __ATOMIC_RELAXED );
+            __atomic_add_fetch( &frame->refcount, 1, __ATOMIC_RELAXED );
+            b->room = room;
+            b->buf = line;
+            b->frame = frame;
+            b->sender_id = sender->id;
+            b->seq = rec.seq;
+            b->n_matches = matched.n_matches;
+            for ( int m = 0; m < matched.n_matches; ++m )
+            {
+                b->matches[m] = matched.matches[m];
+                __atomic_add_fetch( &b->matches[m].buf->refcount, 1, __ATOMIC_RELAXED );
+                __atomic_add_fetch( &b->matches[m].frame->refcount, 1, __ATOMIC_RELAXED );
+            }
+            mpsc_queue_push( &shards[i].inbox, &b->node );
+
+            if ( &shards[i] != sender->shard )
+            {
+                wake_shard( &shards[i] );
+            }
+        }
+
+        for ( int m = 0; m < matched.n_matches; ++m )
+        {
+            shared_buf_unref( matched.matches[m].buf );
+            shared_buf_unref( matched.matches[m].frame );
+        }
+    }
+
+    pthread_mutex_unlock( &broadcast_lock );
+
+    if ( line != NULL )
+    {
+        shared_buf_unref( line );
+    }
+    if ( frame != NULL )
+    {
+        shared_buf_unref( frame );
+    }
+
+    // 確認メッセージを送信者へ返信。バイナリモードでは本文をそのまま FRAME_OK で返す。
+    // FSYNC_BATCH ではログが fsync されるまで返信を保留する
+    SharedBuf *reply;
+    if ( sender->binary )
+    {
+        reply = shared_buf_alloc( FRAME_HEADER_SIZE + len );
+        if ( reply != NULL
+             && frame_encode( reply->data, reply->len, FRAME_OK, 0, sender->request_seq, msg, len ) == 0 )
+        {
+            shared_buf_unref( reply );
+            reply = NULL;
+        }
+    }
+    else
+    {
+        char escaped[2 * MAX_MESSAGE_LENGTH + 1];
+        command_escape( msg, len, escaped, sizeof( escaped ) );
+        if ( room == GLOBAL_ROOM )
+        {
+            snprintf( buf, BUFSIZE - 1, "(ok msg \"%s\")\n", escaped );
+        }
+        else
+        {
+            snprintf( buf, BUFSIZE - 1, "(ok msg %s \"%s\")\n", room_name, escaped );
+        }
+        reply = shared_buf_new( buf, strlen( buf ) );
+    }
+
+    if ( reply == NULL )
+    {
+        sender->alive = 0;
+        return;
+    }
+
+    if ( rec.seq != 0
+         && message_log_delays_ack( message_log ) )
+    {
+        defer_ack( sender, rec.seq, reply );
+    }
+    else
+    {
+        send_shared_to_client( sender, reply );
+    }
+    shared_buf_unref( reply );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (find "kw") は一致したメッセージをすべて返す。
+  (find "kw" limit [cursor]) は cursor（省略時は先頭）から limit 件までを返し、
+  最後に (find-end 続きの cursor) を送る。続きが無ければ cursor は0になる。
+ */
+void
+find_message( Client *sender, const ParsedCommand *cmd )
+{
+    char keyword[MAX_MESSAGE_LENGTH + 1];
+    long limit = 0;
+    long cursor = 1;
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    const int n_args = cmd->n_args - shift;
+    if ( n_args < 1 || 3 < n_args
+         || command_arg_string( cmd, shift, keyword, sizeof( keyword ) ) <= 0
+         || ( n_args >= 2 && ! command_arg_long( cmd, shift + 1, &limit ) )
+         || ( n_args == 3 && ! command_arg_long( cmd, shift + 2, &cursor ) )
+         || cursor <= 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+    if ( n_args >= 2
+         && ( limit <= 0 || MAX_FIND_PAGE < limit ) )
+    {
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(error illegal_find_limit %ld)\n", limit );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
+
+    find_keyword( sender, room, keyword, (uint64_t)cursor, (int)limit );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  シーケンス番号 from 以降で keyword を含むメッセージを limit 件まで返す。limit が0なら上限なしで、
+  (find-end) も送らない。検索はワーカーで行い、返信は deliver_jobs で積む。
+ */
+void
+find_keyword( Client *sender,
+              const uint32_t room,
+              const char *keyword,
+              const uint64_t from,
+              const int limit )
+{
+    Job *job = job_new( sender, JOB_FIND, CMD_FIND );
+    if ( job == NULL )
+    {
+        return;
+    }
+    job->room = room;
+    snprintf( job->keyword, sizeof( job->keyword ), "%s", keyword );
+    job->cursor = from;
+    job->limit = limit;
+    submit_job( sender, job );
+}
+
+/* ------------------------------------------------------- */
+int
+reply_found_message( const LogRecord *rec,
+                     void *arg )
+{
+    FindContext *ctx = arg;
+    if ( rec->room != ctx->room
+         || ctx->page->failed
+         || ! reply_page_add_record( ctx->page, rec ) )
+    {
+        return 0;
+    }
+    ++ctx->n_sent;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+void
+send_history( Client *sender, const ParsedCommand *cmd )
+{
+    long history_size = 0;
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    if ( cmd->n_args != shift + 1
+         || ! command_arg_long( cmd, shift, &history_size ) )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    if ( history_size <= 0
+         || history.capacity < history_size )
+    {
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(error illegal_history_size %ld)\n", history_size );
+        SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_WARN, "illegal history size [%.*s]", (int)cmd->line.len, cmd->line.ptr );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
+
+    if ( room != GLOBAL_ROOM )
+    {
+        // 部屋の履歴はログから読むのでワーカーに任せる
+        Job *job = job_new( sender, JOB_ROOM_HISTORY, CMD_HISTORY );
+        if ( job == NULL )
+        {
+            return;
+        }
+        job->room = room;
+        job->limit = (int)history_size;
+        submit_job( sender, job );
+        return;
+    }
+
+    // メモリ上の履歴から古い順に返す。ファイルは読まない
+    pthread_mutex_lock( &broadcast_lock );
+
+    const int read_size = ( history_size < history.count
+                            ? (int)history_size
+                            : history.count );
+    int start = history.head - read_size;
+    if ( start < 0 ) start += history.capacity;
+
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "read size = %d start=%d", read_size, start );
+
+    for ( int cnt = 0; cnt < read_size; ++cnt )
+    {
+        int i = start + cnt;
+        if ( i >= history.capacity ) i -= history.capacity;
+
+        send_shared_to_client( sender, ( sender->binary ? history.entries[i].frame : history.entries[i].line ) );
+    }
+
+    pthread_mutex_unlock( &broadcast_lock );
+}
+
+/* ------------------------------------------------------- */
+void
+send_history_since( Client *sender, const ParsedCommand *cmd )
+{
+    long since = 0;
+    long limit = MAX_HISTORY_QUERY;
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    const int n_args = cmd->n_args - shift;
+    if ( n_args < 1 || 2 < n_args
+         || ! command_arg_long( cmd, shift, &since )
+         || ( n_args == 2 && ! command_arg_long( cmd, shift + 1, &limit ) ) )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    send_logged_messages( sender, cmd->command, room, (time_t)since, (time_t)LONG_MAX,
+                          ( limit > INT_MAX ? INT_MAX : (int)limit ) );
+}
+
+/* ------------------------------------------------------- */
+void
+send_history_range( Client *sender, const ParsedCommand *cmd )
+{
+    long from = 0;
+    long to = 0;
+    long limit = MAX_HISTORY_QUERY;
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    const int n_args = cmd->n_args - shift;
+    if ( n_args < 2 || 3 < n_args
+         || ! command_arg_long( cmd, shift, &from )
+         || ! command_arg_long( cmd, shift + 1, &to )
+         || ( n_args == 3 && ! command_arg_long( cmd, shift + 2, &limit ) )
+         || to < from )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    send_logged_messages( sender, cmd->command, room, (time_t)from, (time_t)to,
+                          ( limit > INT_MAX ? INT_MAX : (int)limit ) );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  部屋のメッセージのうち、時刻が from 以上 to 以下のものを古い順に limit 件まで返す。
+  ログを読むのはワーカーの run_logged_history で行う。
+ */
+void
+send_logged_messages( Client *sender,
+                      const Command command,
+                      const uint32_t room,
+                      const time_t from,
+                      const time_t to,
+                      const int limit )
+{
+    if ( limit <= 0
+         || MAX_HISTORY_QUERY < limit )
+    {
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(error illegal_history_size %d)\n", limit );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
+
+    Job *job = job_new( sender, JOB_LOGGED_HISTORY, command );
+    if ( job == NULL )
+    {
+        return;
+    }
+    job->room = room;
+    job->from = from;
+    job->to = to;
+    job->limit = limit;
+    submit_job( sender, job );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ログを読むコマンドをワーカーに任せるための Job を作る。返信のモードと seq はこの時点のものを使う。
+  作れなければクライアントを終了させて NULL を返す。
+ */
+Job *
+job_new( Client *client,
+         const JobKind kind,
+         const Command command )
+{
+    Job *job = calloc( 1, sizeof( Job ) );
+    if ( job == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+        client->alive = 0;
+        return NULL;
+    }
+    job->work.run = run_job;
+    job->kind = kind;
+    job->shard = client->shard;
+    job->fd = client->socket_fd;
+    job->client_id = client->id;
+    job->command = command;
+    job->start_ns = monotonic_ns();
+    job->page.binary = client->binary;
+    job->page.request_seq = client->request_seq;
+    return job;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  Job をワーカーへ渡す。返信が届くまで、このクライアントの続きのコマンドは受信バッファに残しておく。
+ */
+void
+submit_job( Client *client,
+            Job *job )
+{
+    client->job_pending = 1;
+    work_pool_submit( work_pool, &job->work );
+}
+
+/* ------------------------------------------------------- */
+void
+free_job( Job *job )
+{
+    if ( job->page.buf != NULL )
+    {
+        shared_buf_unref( job->page.buf );
+    }
+    free( job );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ワーカースレッドで Job を処理し、依頼したシャードの done へ返して起こす。
+  ここではクライアントに触れず、ログ・インデックス・部屋の一覧だけを読む。
+ */
+void
+run_job( WorkItem *item )
+{
+    Job *job = (Job *)item;
+    Shard *shard = job->shard;
+
+    // ログは書き出し済みの分だけを読み、書き出しは log_writer に任せる。
+    // 送り直しだけは upto まで欠けずに読む必要があるので、書き出されるのを待つ
+    if ( job->kind == JOB_RESUME )
+    {
+        wait_log_written( job->upto );
+    }
+
+    switch ( job->kind ) {
+    case JOB_FIND:
+        run_find( job );
+        break;
+    case JOB_ROOM_HISTORY:
+        run_room_history( job );
+        break;
+    case JOB_LOGGED_HISTORY:
+        run_logged_history( job );
+        break;
+    case JOB_RESUME:
+        run_resume( job );
+        break;
+    };
+
+    mpsc_queue_push( &shard->done, &job->done_node );
+    wake_shard( shard );
+}
+
+/* ------------------------------------------------------- */
+void
+run_find( Job *job )
+{
+    // インデックスで候補を絞ってから本文を確かめ、部屋が違うものは除く
+    FindContext ctx = { job->room, 0, &job->page };
+    uint64_t next = 0;
+    if ( trigram_index_find_page( find_index, job->keyword, job->cursor, job->limit, reply_found_message, &ctx, &next ) < 0 )
+    {
+        SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_ERROR, "find [%s] failed", job->keyword );
+    }
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "find [%s]: %d messages, next %llu",
+                job->keyword, ctx.n_sent, (unsigned long long)next );
+
+    if ( job->limit > 0 )
+    {
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(find-end %llu)\n", (unsigned long long)next );
+        reply_page_add_text( &job->page, buf, strlen( buf ) );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  部屋の履歴は部屋ごとの一覧から直近のシーケンス番号を取り、ログから読む
+ */
+void
+run_room_history( Job *job )
+{
+    uint64_t *seqs = malloc( job->limit * sizeof( uint64_t ) );
+    if ( seqs == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "malloc" );
+        return;
+    }
+
+    LogRecord rec;
+    const int n = room_table_recent( room_table, job->room, seqs, job->limit );
+    for ( int i = 0; i < n && message_log_read( message_log, seqs[i], &rec ); ++i )
+    {
+        if ( ! reply_page_add_record( &job->page, &rec ) )
+        {
+            break;
         }
-        else if ( nfds == 0 )
+    }
+    free( seqs );
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "room history: %d messages", n );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ログの時刻インデックスを二分探索して from 以降の最初のシーケンス番号を求め、
+  部屋ごとの一覧の中をさらにそのシーケンス番号で二分探索するので、先頭から読むことはない。
+ */
+void
+run_logged_history( Job *job )
+{
+    const uint64_t first = message_log_find_time( message_log, job->from );
+
+    uint64_t seqs[MAX_HISTORY_QUERY];
+    const int n = room_table_since( room_table, job->room, first, seqs, job->limit );
+
+    LogRecord rec;
+    int n_sent = 0;
+    while ( n_sent < n
+            && message_log_read( message_log, seqs[n_sent], &rec )
+            && rec.time <= job->to
+            && reply_page_add_record( &job->page, &rec ) )
+    {
+        ++n_sent;
+    }
+
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "history from %ld to %ld: %d messages (first seq %llu)",
+                (long)job->from, (long)job->to, n_sent, (unsigned long long)first );
+}
+
+/* ------------------------------------------------------- */
+int
+compare_seq( const void *a,
+             const void *b )
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return ( x < y ? -1 : x > y );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (resume) で、全員宛てと参加していた部屋のメッセージのうち cursor より後、upto までのものを送り直す。
+  部屋ごとの一覧から少しずつシーケンス番号を集め、新しい方から MAX_RESUME_MESSAGES 件だけを残す。
+  残らなかった分は (gap n) で知らせ、最後に (resumed ID upto) を送る。
+ */
+void
+run_resume( Job *job )
+{
+    uint32_t rooms[MAX_JOINED_ROOMS + 1];
+    int n_rooms = 0;
+    rooms[n_rooms++] = GLOBAL_ROOM;
+    for ( int i = 0; i < job->n_rooms; ++i )
+    {
+        rooms[n_rooms++] = job->rooms[i];
+    }
+
+    // 2倍まで溜まったら並べ替えて新しい方だけを残す
+    uint64_t *seqs = malloc( ( 2 * MAX_RESUME_MESSAGES + RESUME_SCAN_PAGE ) * sizeof( uint64_t ) );
+    if ( seqs == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "malloc" );
+        job->page.failed = 1;
+        return;
+    }
+
+    int n = 0;
+    uint64_t n_skipped = 0;
+    for ( int r = 0; r < n_rooms; ++r )
+    {
+        uint64_t first = job->cursor + 1;
+        for ( ;; )
         {
-            // timeout
-            ++timeout_count;
-            fprintf( stderr, "Timeout: %d\n", timeout_count );
+            const int got = room_table_since( room_table, rooms[r], first, seqs + n, RESUME_SCAN_PAGE );
+            int n_new = 0;
+            while ( n_new < got && seqs[n + n_new] <= job->upto ) ++n_new;
+            if ( n_new > 0 ) first = seqs[n + n_new - 1] + 1;
+            n += n_new;
+
+            if ( n > 2 * MAX_RESUME_MESSAGES )
+            {
+                qsort( seqs, n, sizeof( uint64_t ), compare_seq );
+                n_skipped += n - MAX_RESUME_MESSAGES;
+                memmove( seqs, seqs + n - MAX_RESUME_MESSAGES, MAX_RESUME_MESSAGES * sizeof( uint64_t ) );
+                n = MAX_RESUME_MESSAGES;
+            }
+            if ( n_new < RESUME_SCAN_PAGE )
+            {
+                break;
+            }
         }
-        else
+    }
+    qsort( seqs, n, sizeof( uint64_t ), compare_seq );
+    int start = 0;
+    if ( n > MAX_RESUME_MESSAGES )
+    {
+        n_skipped += n - MAX_RESUME_MESSAGES;
+        start = n - MAX_RESUME_MESSAGES;
+    }
+
+    char buf[BUFSIZE];
+    if ( n_skipped > 0 )
+    {
+        snprintf( buf, BUFSIZE - 1, "(gap %llu)\n", (unsigned long long)n_skipped );
+        reply_page_add_text( &job->page, buf, strlen( buf ) );
+    }
+
+    // 送信者本人にはブロードキャストと同じく送らない
+    LogRecord rec;
+    int n_sent = 0;
+    for ( int i = start; i < n && message_log_read( message_log, seqs[i], &rec ); ++i )
+    {
+        if ( rec.sender_id == job->client_id ) continue;
+        if ( ! reply_page_add_record( &job->page, &rec ) )
         {
-            timeout_count = 0;
-            for ( int i = 0; i < nfds; ++i )
+            break;
+        }
+        ++n_sent;
+    }
+    free( seqs );
+
+    snprintf( buf, BUFSIZE - 1, "(resumed %d %llu)\n", job->client_id, (unsigned long long)job->upto );
+    reply_page_add_text( &job->page, buf, strlen( buf ) );
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "resume from the log: %d messages after seq %llu (%llu skipped)",
+                n_sent, (unsigned long long)job->cursor, (unsigned long long)n_skipped );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ワーカーが処理し終えた Job の返信を積み、そのクライアントの溜まっているコマンドの処理を再開する。
+  返信はまとめて1つの要素になっているので、コマンドの順に並ぶ。
+ */
+void
+deliver_jobs( Shard *shard )
+{
+    MpscNode *node;
+    while ( ( node = mpsc_queue_pop( &shard->done ) ) != NULL )
+    {
+        Job *job = (Job *)( (char *)node - offsetof( Job, done_node ) );
+        Client *cli = conn_table_get( &shard->clients, job->fd );
+        if ( cli != NULL
+             && cli->id == job->client_id )
+        {
+            if ( job->page.failed )
             {
-                // 標準入力を扱う場合は、ここで標準入力かどうかを判定して分岐する
-                if ( events[i].data.fd == fileno( stdin ) )
-                {
-                    // キーボードからの入力読み取り
-                    read_stdin();
-                }
-                else
-                {
-                    Client *cli = events[i].data.ptr;
-                    if ( cli->socket_fd == server_socket )
-                    {
-                        // acceptして新しいクライアントを登録する
-                        create_session( server_socket, epoll_fd );
-                    }
-                    else
-                    {
-                        if ( events[i].events & EPOLLIN )
-                        {
-                            // クライアントからの受信
-                            receive( epoll_fd, &events[i] );
-                        }
-                    }
-                }
+                cli->alive = 0;
+            }
+            else if ( job->page.buf != NULL )
+            {
+                send_shared_to_client( cli, job->page.buf );
+            }
+            if ( job->kind == JOB_RESUME )
+            {
+                release_held( cli, job->upto );
             }
+            cli->job_pending = 0;
+            record_command( cli, job->command, job->start_ns );
+
+            // 切断することになっても、ループの最後の送信で閉じられるよう登録しておく
+            consume_input( cli );
+            mark_pending( cli );
+        }
+        free_job( job );
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  返信の末尾に len バイトを確保して、その位置を返す。足りなければ倍に広げる
+ */
+char *
+reply_page_reserve( ReplyPage *page,
+                    const size_t len )
+{
+    const size_t used = ( page->buf != NULL ? page->buf->len : 0 );
+    if ( used + len > page->cap )
+    {
+        size_t new_cap = ( page->cap == 0 ? INITIAL_FIND_PAGE : page->cap * 2 );
+        while ( new_cap < used + len ) new_cap *= 2;
+        SharedBuf *p = realloc( page->buf, sizeof( SharedBuf ) + new_cap );
+        if ( p == NULL )
+        {
+            SERVER_LOG_ERRNO( LOG_CAT_SERVER, "realloc" );
+            page->failed = 1;
+            return NULL;
+        }
+        if ( page->buf == NULL )
+        {
+            __atomic_store_n( &p->refcount, 1, __ATOMIC_RELAXED );
+            p->len = 0;
+        }
+        page->buf = p;
+        page->cap = new_cap;
+    }
+    return page->buf->data + page->buf->len;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  ログから読んだメッセージを、返信のモードに合わせて行またはフレームにして返信に加える。
+ */
+int
+reply_page_add_record( ReplyPage *page,
+                       const LogRecord *rec )
+{
+    if ( page->binary )
+    {
+        const char *room = room_table_name( room_table, rec->room );
+        const size_t room_len = strlen( room );
+        const size_t len = FRAME_HEADER_SIZE + FRAME_MESSAGE_PREFIX_SIZE + ( room_len > 0 ? 1 + room_len : 0 ) + rec->len;
+        char *out = reply_page_reserve( page, len );
+        if ( out == NULL
+             || frame_encode_message( out, len, rec->seq, rec->time, rec->sender_id,
+                                      room, room_len, rec->msg, rec->len ) == 0 )
+        {
+            page->failed = 1;
+            return 0;
         }
+        page->buf->len += len;
+        return 1;
+    }
+
+    char line[BUFSIZE];
+    format_message_line( line, BUFSIZE - 1, rec );
+    return reply_page_add_text( page, line, strlen( line ) );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  テキストの1行を、返信のモードに合わせてそのまま、または FRAME_TEXT に包んで返信に加える。
+ */
+int
+reply_page_add_text( ReplyPage *page,
+                     const char *line,
+                     const size_t len )
+{
+    // バイナリモードでは改行を除いた1行を FRAME_TEXT に包む
+    const size_t line_len = ( page->binary && line[len - 1] == '\n' ? len - 1 : len );
+    const size_t size = ( page->binary ? FRAME_HEADER_SIZE + line_len : len );
+    char *out = reply_page_reserve( page, size );
+    if ( out == NULL )
+    {
+        return 0;
+    }
+
+    if ( ! page->binary )
+    {
+        memcpy( out, line, len );
+    }
+    else if ( frame_encode( out, size, FRAME_TEXT, 0, page->request_seq, line, line_len ) == 0 )
+    {
+        page->failed = 1;
+        return 0;
+    }
+    page->buf->len += size;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+void
+reply_time_message( Client *sender, const ParsedCommand *cmd )
+{
+    char buf[BUFSIZE];
+    char time_str[128];
+
+    if ( cmd->n_args != 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    get_datetime_string( time_str, sizeof( time_str ) );
+    snprintf( buf, BUFSIZE - 1, "(time \"%s\")\n", time_str );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "reply time [%s]", time_str );
+
+    send_to_client( sender, buf, strlen( buf ) );
+}
+
+/* ------------------------------------------------------- */
+void
+reply_ping( Client *sender, const ParsedCommand *cmd )
+{
+    if ( cmd->n_args != 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    const char *buf = "(pong)\n";
+    send_to_client( sender, buf, strlen( buf ) );
+}
+
+/* ------------------------------------------------------- */
+void
+reply_hello( Client *sender, const ParsedCommand *cmd )
+{
+    char buf[BUFSIZE];
+
+    // (hello binary) / (hello text) でモードを選ぶ。
+    // 返信は今のモードで送り、それより後のやり取りから切り替える
+    int binary = sender->binary;
+    if ( cmd->n_args == 1
+         && cmd->args[0].type == TOKEN_ATOM
+         && cmd->args[0].text.len == strlen( "binary" )
+         && memcmp( cmd->args[0].text.ptr, "binary", strlen( "binary" ) ) == 0 )
+    {
+        binary = 1;
+    }
+    else if ( cmd->n_args == 1
+              && cmd->args[0].type == TOKEN_ATOM
+              && cmd->args[0].text.len == strlen( "text" )
+              && memcmp( cmd->args[0].text.ptr, "text", strlen( "text" ) ) == 0 )
+    {
+        binary = 0;
+    }
+    else if ( cmd->n_args != 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
+
+    // 再接続したときに (resume トークン 最後に受け取ったシーケンス番号) で続きを受け取れるよう、
+    // トークンと現在の最後のシーケンス番号を返す。表が一杯なら返さない
+    // 書き出しを待っているメッセージもすでに配送済みなので、書き出し済みでなく追記済みの番号を使う
+    pthread_mutex_lock( &broadcast_lock );
+    const uint64_t last_seq = message_log_last_appended( message_log );
+    pthread_mutex_unlock( &broadcast_lock );
+    if ( sender->session_generation == 0 )
+    {
+        sender->session_generation = session_table_open( sessions, sender->id, last_seq, sender->shard->now_ms,
+                                                         sender->session_token );
+    }
+
+    char session[SESSION_TOKEN_LEN + 32] = "";
+    if ( sender->session_generation != 0 )
+    {
+        snprintf( session, sizeof( session ), " %s %llu", sender->session_token, (unsigned long long)last_seq );
+    }
+
+    if ( cmd->n_args == 0 )
+    {
+        snprintf( buf, BUFSIZE - 1, "(hello %d%s)\n", sender->id, session );
+    }
+    else
+    {
+        snprintf( buf, BUFSIZE - 1, "(hello %d %s%s)\n", sender->id, ( binary ? "binary" : "text" ), session );
     }
-}
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "reply hello (%s mode)", ( binary ? "binary" : "text" ) );
 
+    send_to_client( sender, buf, strlen( buf ) );
+    sender->binary = binary;
+}
 
 /* ------------------------------------------------------- */
+/*!
+  (resume トークン 最後に受け取ったシーケンス番号) で切断したセッションを引き継ぐ。
+  クライアントIDと参加していた部屋を戻し、その後のメッセージを古い順に送り直してから
+  (resumed ID 送り直した最後のシーケンス番号) を返す。以降のブロードキャストはそれより後のものだけが届く。
+  メモリ上の履歴で足りればその場で、足りなければワーカーがログから読んで送り直す。
+ */
 void
-read_stdin()
+reply_resume( Client *sender, const ParsedCommand *cmd )
 {
-    char buf[BUFSIZE];
-    memset( buf, 0, BUFSIZE );
+    long last_seq = 0;
+    if ( cmd->n_args != 2
+         || cmd->args[0].type != TOKEN_ATOM
+         || ! command_arg_long( cmd, 1, &last_seq )
+         || last_seq < 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
 
-    if ( fgets( buf, sizeof( buf ) - 1, stdin ) == NULL )
+    // 他のコマンドの返信やブロードキャストを積んだ後では、送り直しとの順序が保てない
+    if ( sender->started )
     {
+        const char *error = "(error resume_not_first)\n";
+        send_to_client( sender, error, strlen( error ) );
         return;
     }
 
-    buf[strcspn( buf, "\r\n" )] = '\0';
+    SessionState state;
+    const uint64_t generation = session_table_resume( sessions, cmd->args[0].text.ptr, cmd->args[0].text.len,
+                                                      sender->shard->now_ms, &state );
+    if ( generation == 0 )
+    {
+        const char *error = "(error unknown_session)\n";
+        send_to_client( sender, error, strlen( error ) );
+        return;
+    }
 
-    if ( strncmp( buf, "quit", 4 ) == 0 )
+    // (hello) で発行したセッションは使わないので捨てる
+    if ( sender->session_generation != 0 )
+    {
+        session_table_close( sessions, sender->session_token, sender->session_generation );
+    }
+    SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_INFO, "[client:%d] resumed the session of client:%d from seq %ld",
+                sender->id, state.client_id, last_seq );
+    memcpy( sender->session_token, cmd->args[0].text.ptr, SESSION_TOKEN_LEN );
+    sender->session_token[SESSION_TOKEN_LEN] = '\0';
+    sender->session_generation = generation;
+    sender->id = state.client_id;
+    for ( int i = 0; i < state.n_rooms; ++i )
     {
-        fprintf( stderr, "ok. quit all.\n" );
-        server_alive = 0;
+        join_room( sender, state.rooms[i] );
     }
+    STATS_ADD( sender->shard->stats.resumed, 1 );
+
+    // セッションを発行する前のメッセージは送り直さない
+    uint64_t cursor = (uint64_t)last_seq;
+    if ( cursor < state.first_seq )
+    {
+        cursor = state.first_seq;
+    }
+
+    if ( resume_from_history( sender, cursor ) )
+    {
+        return;
+    }
+
+    // ログから読む。ここまでのシーケンス番号をワーカーが送り直し、それより後のブロードキャストは
+    // 送り直しを積むまで溜めておく。ロックの中で決めるので、どのメッセージもどちらか一方で届く
+    Job *job = job_new( sender, JOB_RESUME, CMD_RESUME );
+    if ( job == NULL )
+    {
+        return;
+    }
+    // 書き出し前のメッセージも含める。ワーカーは読む前にログを書き出す
+    pthread_mutex_lock( &broadcast_lock );
+    job->upto = message_log_last_appended( message_log );
+    pthread_mutex_unlock( &broadcast_lock );
+    job->cursor = ( cursor < job->upto ? cursor : job->upto );
+    job->n_rooms = sender->n_joined;
+    memcpy( job->rooms, sender->joined, sender->n_joined * sizeof( uint32_t ) );
+    sender->holding = 1;
+    submit_job( sender, job );
 }
 
 /* ------------------------------------------------------- */
+/*!
+  部屋に参加していなければ、送り直すのは全員宛てのメッセージだけなので、
+  メモリ上の履歴が cursor より後をすべて持っていればそこから送り直す。
+  ¥return 送り直した場合は1。ログから読む必要があれば0
+ */
 int
-create_session( const int server_socket,
-                const int epoll_fd )
+resume_from_history( Client *sender,
+                     const uint64_t cursor )
 {
-    if ( client_count + 1 >= MAX_EVENTS )
+    char buf[BUFSIZE];
+    if ( sender->n_joined > 0 )
     {
-        fprintf( stderr, "Over the max session\n" );
         return 0;
     }
 
-    Client *client = malloc( sizeof( Client ) ); // メモリ確保
-    if ( client == NULL )
+    pthread_mutex_lock( &broadcast_lock );
+    if ( history.floor_seq > cursor )
     {
-        perror( "malloc" );
+        pthread_mutex_unlock( &broadcast_lock );
         return 0;
     }
 
-    struct sockaddr_in addr;
-    socklen_t len = sizeof( addr );
-    client->socket_fd = accept( server_socket, (struct sockaddr *)&addr, &len );
-    if ( client->socket_fd < 0 )
+    // 送るものを数え、多すぎれば古い方を (gap n) にする
+    int start = history.head - history.count;
+    if ( start < 0 ) start += history.capacity;
+    int n_matched = 0;
+    for ( int cnt = 0; cnt < history.count; ++cnt )
     {
-        perror( "accept" );
-        free( client );
-        return 0;
+        const HistoryEntry *e = &history.entries[( start + cnt ) % history.capacity];
+        if ( e->seq > cursor && e->sender_id != sender->id ) ++n_matched;
     }
-    client->id = ++client_count;
-    client->alive = 1;
-
-    struct epoll_event ev;
-    memset( &ev, 0, sizeof( ev ) );
-    ev.events = EPOLLIN;
-    ev.data.fd = client->socket_fd;
-    ev.data.ptr = client;
-
-    if ( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, client->socket_fd, &ev ) == -1 )
+    int n_skipped = ( n_matched > MAX_RESUME_MESSAGES ? n_matched - MAX_RESUME_MESSAGES : 0 );
+    if ( n_skipped > 0 )
     {
-        perror( "epoll_ctl" );
-        close( client->socket_fd );
-        free( client );
-        return 0;
+        snprintf( buf, BUFSIZE - 1, "(gap %d)\n", n_skipped );
+        send_to_client( sender, buf, strlen( buf ) );
     }
 
-    for ( int i = 0; i < MAX_EVENTS - 1; ++i )
+    for ( int cnt = 0; cnt < history.count; ++cnt )
     {
-        if ( clients[i] == NULL )
+        const HistoryEntry *e = &history.entries[( start + cnt ) % history.capacity];
+        if ( e->seq <= cursor || e->sender_id == sender->id ) continue;
+        if ( n_skipped > 0 )
         {
-            clients[i] = client;
-            break;
+            --n_skipped;
+            continue;
         }
+        send_shared_to_client( sender, ( sender->binary ? e->frame : e->line ) );
     }
 
-    fprintf( stderr, "Accepted %s:%d\n", inet_ntoa( addr.sin_addr ), ntohs( addr.sin_port ) );
+    // これ以下のブロードキャストは inbox に残っていても届けない。
+    // 履歴には書き出し前のメッセージも入っているので、追記済みの番号で区切る
+    const uint64_t upto = message_log_last_appended( message_log );
+    pthread_mutex_unlock( &broadcast_lock );
+
+    sender->resumed_seq = upto;
+    snprintf( buf, BUFSIZE - 1, "(resumed %d %llu)\n", sender->id, (unsigned long long)upto );
+    send_to_client( sender, buf, strlen( buf ) );
+    SERVER_LOG( LOG_CAT_QUERY, LOG_LEVEL_DEBUG, "resume from memory: %d messages after seq %llu",
+                n_matched, (unsigned long long)cursor );
     return 1;
 }
 
 /* ------------------------------------------------------- */
 void
-receive( const int epoll_fd,
-         struct epoll_event *ev )
+reply_join( Client *sender, const ParsedCommand *cmd )
 {
-    Client *cli = ev->data.ptr;
+    char buf[BUFSIZE];
 
-    char recv_buf[512];
-    int len = recv( cli->socket_fd, recv_buf, sizeof( recv_buf ), 0 );
-    if ( len == -1 )
-    {
-        perror( "recv" );
-        return;
-    }
-    else if ( len == 0 )
+    // 部屋が無ければ作る
+    uint32_t room = GLOBAL_ROOM;
+    if ( cmd->n_args == 1
+         && cmd->args[0].type == TOKEN_ATOM )
     {
-        fprintf( stdout, "[client:%d] disconnected.\n", cli->id );
-        cli->alive = 0;
+        room = room_table_create( room_table, cmd->args[0].text.ptr, cmd->args[0].text.len );
     }
-    else
+    if ( room == GLOBAL_ROOM )
     {
-        recv_buf[len] = '\0';
-        recv_buf[strcspn( recv_buf, "\r\n" )] = '\0';
-        fprintf( stdout, "[client:%d] received=\"%s\"\n", cli->id, recv_buf );
-
-        char com[128];
-        if ( sscanf( recv_buf, "(%127[^)]", com ) != 1 )
-        {
-            reply_unknown_command( cli, recv_buf );
-        }
-        else
-        {
-            switch ( parse_command( com ) ) {
-            case CMD_MESSAGE:
-                send_message_to_all( cli, recv_buf );
-                break;
-            case CMD_FIND:
-                find_message( cli, recv_buf );
-                break;
-            case CMD_HISTORY:
-                send_history( cli, recv_buf );
-                break;
-            case CMD_TIME:
-                reply_time_message( cli, recv_buf );
-                break;
-            case CMD_HELLO:
-                reply_hello( cli, recv_buf );
-                break;
-            case CMD_QUIT:
-                disable_client( cli, recv_buf );
-                break;
-            default:
-                reply_unknown_command( cli, recv_buf );
-                break;
-            };
-        }
+        snprintf( buf, BUFSIZE - 1, "(error illegal_room [%.*s])\n", (int)cmd->line.len, cmd->line.ptr );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
     }
 
-    // 終了したクライアントへの対応
-    if ( cli->alive == 0 )
+    const char *name = room_table_name( room_table, room );
+    if ( ! join_room( sender, room ) )
     {
-        // epollからソケットの登録を削除
-        if ( epoll_ctl( epoll_fd, EPOLL_CTL_DEL, cli->socket_fd, ev ) != 0 )
-        {
-            perror( "epoll_ctl" );
-        }
-
-        // 参照用のポインタ配列から削除
-        for ( int i = 0; i < MAX_EVENTS - 1; ++i )
-        {
-            if ( clients[i] == NULL ) continue;
-            if ( clients[i]->id == cli->id )
-            {
-                clients[i] = NULL;
-            }
-        }
-        close( cli->socket_fd ); // ソケットを閉じて
-        free( ev->data.ptr ); // メモリを解放
+        snprintf( buf, BUFSIZE - 1, "(error too_many_rooms %s)\n", name );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
     }
+
+    snprintf( buf, BUFSIZE - 1, "(ok join %s)\n", name );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "client:%d joined %s", sender->id, name );
+    send_to_client( sender, buf, strlen( buf ) );
 }
 
 /* ------------------------------------------------------- */
-Command
-parse_command( const char *msg )
+void
+reply_leave( Client *sender, const ParsedCommand *cmd )
 {
-    if ( strncmp( msg, COMMAND_MESSAGE, strlen( COMMAND_MESSAGE ) ) == 0 )
+    char buf[BUFSIZE];
+
+    uint32_t room;
+    const int shift = room_arg( sender, cmd, &room );
+    if ( shift < 0 )
+    {
+        return;
+    }
+    if ( shift == 0
+         || cmd->n_args != 1 )
     {
-        return CMD_MESSAGE;
+        reply_illegal_command( sender, cmd );
+        return;
     }
-    else if ( strncmp( msg, COMMAND_FIND, strlen( COMMAND_FIND ) ) == 0 )
+
+    const char *name = room_table_name( room_table, room );
+    if ( ! leave_room( sender, room ) )
     {
-        return CMD_FIND;
+        snprintf( buf, BUFSIZE - 1, "(error not_member %s)\n", name );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
     }
-    else if ( strncmp( msg, COMMAND_HISTORY, strlen( COMMAND_HISTORY ) ) == 0 )
+
+    snprintf( buf, BUFSIZE - 1, "(ok leave %s)\n", name );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "client:%d left %s", sender->id, name );
+    send_to_client( sender, buf, strlen( buf ) );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (watch "kw") は、以降に kw を含むメッセージが送られるたびに (match "kw" ...) を届けるよう登録する。
+  kw より後ろは (msg ...) と同じで、部屋宛てのメッセージは部屋のメンバーにだけ届く。
+ */
+void
+reply_watch( Client *sender, const ParsedCommand *cmd )
+{
+    char buf[BUFSIZE];
+    char keyword[MAX_MESSAGE_LENGTH + 1];
+    long len;
+    if ( cmd->n_args != 1
+         || ( len = command_arg_string( cmd, 0, keyword, sizeof( keyword ) ) ) <= 0
+         || memchr( keyword, '\0', len ) != NULL )
     {
-        return CMD_HISTORY;
+        reply_illegal_command( sender, cmd );
+        return;
     }
-    else if ( strncmp( msg, COMMAND_TIME, strlen( COMMAND_TIME ) ) == 0 )
+
+    char escaped[2 * MAX_MESSAGE_LENGTH + 1];
+    command_escape( keyword, len, escaped, sizeof( escaped ) );
+
+    uint32_t watch;
+    uint64_t serial;
+    if ( watch_index_lookup( watch_index, keyword, len, &watch )
+         && find_watching( sender, watch ) >= 0 )
     {
-        return CMD_TIME;
+        // 登録済み
     }
-    else if ( strncmp( msg, COMMAND_HELLO, strlen( COMMAND_HELLO ) ) == 0 )
+    else if ( sender->n_watching >= MAX_WATCHES
+              || ! watch_index_add( watch_index, keyword, len, &watch, &serial ) )
     {
-        return CMD_HELLO;
+        snprintf( buf, BUFSIZE - 1, "(error too_many_watches \"%s\")\n", escaped );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
     }
-    else if ( strncmp( msg, COMMAND_QUIT, strlen( COMMAND_QUIT ) ) == 0 )
+    else if ( ! watch_keyword( sender, watch, serial ) )
     {
-        return CMD_QUIT;
+        watch_index_remove( watch_index, watch );
+        snprintf( buf, BUFSIZE - 1, "(error too_many_watches \"%s\")\n", escaped );
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
     }
 
-    return CMD_UNKNOWN;
+    snprintf( buf, BUFSIZE - 1, "(ok watch \"%s\")\n", escaped );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "client:%d watches \"%s\"", sender->id, escaped );
+    send_to_client( sender, buf, strlen( buf ) );
 }
 
 /* ------------------------------------------------------- */
 void
-send_message_to_all( Client *sender, const char *recv_msg )
+reply_unwatch( Client *sender, const ParsedCommand *cmd )
 {
     char buf[BUFSIZE];
-    char msg[512];
+    char keyword[MAX_MESSAGE_LENGTH + 1];
+    long len;
+    if ( cmd->n_args != 1
+         || ( len = command_arg_string( cmd, 0, keyword, sizeof( keyword ) ) ) <= 0 )
+    {
+        reply_illegal_command( sender, cmd );
+        return;
+    }
 
-    // (msg "MSG") という形式の文字列を想定し、MSGのみを取り出す
-    // COMMAND_MESSAGEは "(msg " に置き換えられれる
-    // %511[^\"] は '"'を含まない文字列を511文字まで読み取ることを意味する
-    if ( sscanf( recv_msg, "("COMMAND_MESSAGE" \"%511[^\"]\")", msg ) != 1
-         || strlen( msg ) == 0 )
+    char escaped[2 * MAX_MESSAGE_LENGTH + 1];
+    command_escape( keyword, len, escaped, sizeof( escaped ) );
+
+    uint32_t watch;
+    const int j = ( watch_index_lookup( watch_index, keyword, len, &watch )
+                    ? find_watching( sender, watch )
+                    : -1 );
+    if ( j < 0 )
     {
-        fprintf( stderr, "ERROR: received an illegal message [%s]\n", recv_msg );
-        snprintf( buf, BUFSIZE - 1, "(error illegal_message [%s])\n", recv_msg );
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+        snprintf( buf, BUFSIZE - 1, "(error not_watching \"%s\")\n", escaped );
+        send_to_client( sender, buf, strlen( buf ) );
         return;
     }
+    unwatch_keyword( sender, j );
 
-    time_t current_time = time( NULL );
+    snprintf( buf, BUFSIZE - 1, "(ok unwatch \"%s\")\n", escaped );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_DEBUG, "client:%d unwatched \"%s\"", sender->id, escaped );
+    send_to_client( sender, buf, strlen( buf ) );
+}
 
-    save_message( current_time, sender->id, msg );
+/* ------------------------------------------------------- */
+/*!
+  watch_index_match のコールバック。メッセージの行から (match "kw" ...) の行とフレームを作って list に加える。
+  1つのメッセージが MAX_WATCH_MATCHES を超えるキーワードを含む場合、残りは知らせない。
+ */
+int
+collect_watch_match( const uint32_t id,
+                     const uint64_t serial,
+                     const char *keyword,
+                     const size_t len,
+                     void *arg )
+{
+    WatchMatchList *list = (WatchMatchList *)arg;
+    char escaped[2 * MAX_MESSAGE_LENGTH + 1];
+    char line[2 * BUFSIZE];
 
-    snprintf( buf, BUFSIZE - 1, "(msg %ld %d \"%s\")\n", current_time, sender->id, msg );
-    fprintf( stderr, "send message to all [%s]\n", msg );
+    // "(msg " の後ろをそのまま続ける
+    const size_t prefix_len = sizeof( "(msg " ) - 1;
+    command_escape( keyword, len, escaped, sizeof( escaped ) );
+    const int n = snprintf( line, sizeof( line ), "(match \"%s\" %.*s", escaped,
+                            (int)( list->line->len - prefix_len ), list->line->data + prefix_len );
+    if ( n <= 0 || (size_t)n >= sizeof( line ) )
+    {
+        return 1;
+    }
 
-    // 生きている他のクライアントへメッセージ送信
-    for ( int i = 0; i < MAX_EVENTS - 1; ++i )
+    SharedBuf *buf = shared_buf_new( line, n );
+    SharedBuf *frame = shared_buf_alloc( FRAME_HEADER_SIZE + n - 1 );
+    if ( buf == NULL
+         || frame == NULL
+         || frame_encode( frame->data, frame->len, FRAME_TEXT, 0, 0, line, n - 1 ) == 0 )
     {
-        if ( clients[i] == NULL ) continue;
-        if ( clients[i]->alive == 0 ) continue;
-        if ( clients[i]->socket_fd == sender->socket_fd ) continue;
+        if ( buf != NULL ) shared_buf_unref( buf );
+        if ( frame != NULL ) shared_buf_unref( frame );
+        return 1;
+    }
 
-        fprintf( stderr, "send message to client:%d\n", clients[i]->id );
+    WatchMatch *match = &list->matches[list->n_matches++];
+    match->watch = id;
+    match->serial = serial;
+    match->buf = buf;
+    match->frame = frame;
+    return ( list->n_matches < MAX_WATCH_MATCHES );
+}
 
-        int len = send( clients[i]->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+/* ------------------------------------------------------- */
+/*!
+  先頭の引数が部屋名なら、部屋の番号を room に入れて1を返す。
+  部屋名は英字で始まるので数値の引数とは区別できる。部屋名でなければ GLOBAL_ROOM にして0を返す。
+  知らない部屋なら (error unknown_room ...) を返信して-1を返す。
+ */
+int
+room_arg( Client *sender,
+          const ParsedCommand *cmd,
+          uint32_t *room )
+{
+    *room = GLOBAL_ROOM;
+    if ( cmd->n_args == 0
+         || cmd->args[0].type != TOKEN_ATOM
+         || ! room_table_valid_name( cmd->args[0].text.ptr, cmd->args[0].text.len ) )
+    {
+        return 0;
     }
 
-    // 確認メッセージを送信者へ返信
+    const StrView name = cmd->args[0].text;
+    *room = room_table_lookup( room_table, name.ptr, name.len );
+    if ( *room == GLOBAL_ROOM )
     {
-        snprintf( buf, BUFSIZE - 1, "(ok msg \"%s\")\n", msg);
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+        char buf[BUFSIZE];
+        snprintf( buf, BUFSIZE - 1, "(error unknown_room %.*s)\n", (int)name.len, name.ptr );
+        send_to_client( sender, buf, strlen( buf ) );
+        return -1;
     }
+    return 1;
 }
 
 /* ------------------------------------------------------- */
-void find_message( Client *sender, const char *recv_msg )
+/*!
+  全シャードの計測値を total に足し込む。各シャードは更新を続けていてよい。
+ */
+void
+collect_stats( ServerStats *total )
 {
-    char keyword[512];
-    if ( sscanf( recv_msg, "("COMMAND_FIND" \"%511[^\"]\")", keyword ) != 1
-         || strlen( keyword ) == 0 )
+    for ( int i = 0; i < n_shards; ++i )
     {
-        char buf[BUFSIZE];
-        fprintf( stderr, "ERROR: received an illegal command [%s]\n", recv_msg );
-        snprintf( buf, BUFSIZE - 1, "(error illegal_command [%s])\n", recv_msg );
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
-        return;
+        server_stats_merge( total, &shards[i].stats );
     }
+}
 
-    FILE *fp = fopen( MESSAGE_LOG, "r" );
-    if ( fp == NULL )
+/* ------------------------------------------------------- */
+void
+reply_stats( Client *sender, const ParsedCommand *cmd )
+{
+    if ( cmd->n_args != 0 )
     {
-        fprintf( stderr, "ERROR: could not open the file [%s]\n", MESSAGE_LOG );
+        reply_illegal_command( sender, cmd );
         return;
     }
 
-    char line_buf[BUFSIZE];
-    int n_line = 0;
-    while ( fgets( line_buf, BUFSIZE - 1, fp ) != NULL )
+    // 管理用のコマンドなので、サーバと同じホストからの接続に限る
+    if ( ! sender->admin )
     {
-        ++n_line;
-
-        long unix_time;
-        int id;
-        int n_read = 0;
-        char msg[512];
-        if ( sscanf( line_buf, "%ld %d %n", &unix_time, &id, &n_read ) != 2 )
-        {
-            fprintf( stderr, "ERROR: illegal data at line %d in %s\n", n_line, MESSAGE_LOG );
-            continue;
-        }
-        strcpy( msg, line_buf + n_read );
-        msg[strcspn( msg, "\r\n" )] = '\0';
+        const char *buf = "(error permission_denied)\n";
+        send_to_client( sender, buf, strlen( buf ) );
+        return;
+    }
 
-        // keywardを含む文字列かどうかを判定
-        if ( strstr( msg, keyword ) != NULL )
-        {
-            char buf[BUFSIZE];
-            snprintf( buf, BUFSIZE - 1, "(msg %ld %d \"%s\")\n", unix_time, id, msg );
-            int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-            if ( len < 0 )
-            {
-                perror( "send" );
-            }
-        }
+    ServerStats *total = calloc( 1, sizeof( ServerStats ) );
+    if ( total == NULL )
+    {
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
+        return;
     }
+    collect_stats( total );
+    server_stats_report( total, __atomic_load_n( &total_clients, __ATOMIC_RELAXED ),
+                         ( monotonic_ns() - start_time_ns ) / 1e9, send_stats_line, sender );
+    free( total );
+}
 
-    fclose( fp );
+/* ------------------------------------------------------- */
+void
+send_stats_line( const char *line,
+                 void *arg )
+{
+    char buf[BUFSIZE];
+    snprintf( buf, BUFSIZE - 1, "%s\n", line );
+    send_to_client( (Client *)arg, buf, strlen( buf ) );
+}
+
+/* ------------------------------------------------------- */
+void
+print_stats_line( const char *line,
+                  void *arg )
+{
+    fprintf( (FILE *)arg, "%s\n", line );
 }
 
 /* ------------------------------------------------------- */
+/*!
+  計測値をファイルに書き出す。読み手が書きかけの内容を見ないよう、一時ファイルに書いてから置き換える。
+ */
 void
-send_history( Client *sender, const char *recv_msg )
+dump_stats( const char *file )
 {
-    int history_size = 0;
-    if ( sscanf( recv_msg, "("COMMAND_HISTORY" %d)", &history_size ) != 1 )
+    ServerStats *total = calloc( 1, sizeof( ServerStats ) );
+    if ( total == NULL )
     {
-        char buf[BUFSIZE];
-        snprintf( buf, BUFSIZE - 1, "(error illegal_command [%s])\n", recv_msg );
-        fprintf( stderr, "illegal command %s\n", recv_msg );
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "calloc" );
         return;
     }
+    collect_stats( total );
 
-    if ( history_size <= 0
-         || 10 < history_size )
+    char tmp_file[PATH_MAX];
+    snprintf( tmp_file, sizeof( tmp_file ), "%s.tmp", file );
+    FILE *fp = fopen( tmp_file, "w" );
+    if ( fp == NULL )
     {
-        char buf[BUFSIZE];
-        snprintf( buf, BUFSIZE - 1, "(error illegal_history_size %d)\n", history_size );
-        fprintf( stderr, "illegal history size [%s]\n", recv_msg );
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "fopen" );
+        free( total );
         return;
     }
 
-    FILE *fp = fopen( MESSAGE_LOG, "r" );
-    if ( fp == NULL )
+    server_stats_report( total, __atomic_load_n( &total_clients, __ATOMIC_RELAXED ),
+                         ( monotonic_ns() - start_time_ns ) / 1e9, print_stats_line, fp );
+    free( total );
+
+    if ( fclose( fp ) != 0 )
     {
-        fprintf( stderr, "ERROR: could not open the file [%s]\n", MESSAGE_LOG );
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "fclose" );
         return;
     }
-
-    long time_history[10];
-    int id_history[10];
-    char msg_history[10][512];
-    int index = 0;
-    char line_buf[BUFSIZE];
-    int n_line = 0;
-    int read_count = 0;
-    while ( fgets( line_buf, BUFSIZE - 1, fp ) != NULL )
+    if ( rename( tmp_file, file ) != 0 )
     {
-        ++n_line;
-
-        long unix_time;
-        int id;
-        int n_read = 0;
-        char msg[512];
-        if ( sscanf( line_buf, "%ld %d %n", &unix_time, &id, &n_read ) != 2 )
-        {
-            fprintf( stderr, "ERROR: illegal data at line %d in %s\n", n_line, MESSAGE_LOG );
-            continue;
-        }
-        strcpy( msg, line_buf + n_read );
-        msg[strcspn( msg, "\r\n" )] = '\0';
-
-        time_history[index] = unix_time;
-        id_history[index] = id;
-        strcpy( msg_history[index], msg );
-        if ( ++index >= 10 ) index = 0;
-        ++read_count;
+        SERVER_LOG_ERRNO( LOG_CAT_SERVER, "rename" );
     }
+}
+
+/* ------------------------------------------------------- */
+void reply_illegal_command( Client *sender, const ParsedCommand *cmd )
+{
+    char buf[BUFSIZE];
+    snprintf( buf, BUFSIZE - 1, "(error illegal_command [%.*s])\n", (int)cmd->line.len, cmd->line.ptr );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_WARN, "illegal command %.*s", (int)cmd->line.len, cmd->line.ptr );
 
-    fclose( fp );
+    send_to_client( sender, buf, strlen( buf ) );
+}
 
-    int read_size = ( history_size < read_count
-                      ? history_size
-                      : read_count );
-    int start = index - read_size;
-    if ( start < 0 ) start += 10;
+/* ------------------------------------------------------- */
+void reply_unknown_command( Client *sender, const ParsedCommand *cmd )
+{
+    char buf[BUFSIZE];
+    snprintf( buf, BUFSIZE - 1, "(error unknown_command [%.*s])\n", (int)cmd->line.len, cmd->line.ptr );
+    SERVER_LOG( LOG_CAT_COMMAND, LOG_LEVEL_WARN, "unknown command %.*s", (int)cmd->line.len, cmd->line.ptr );
 
-    fprintf( stderr, "read size = %d start=%d\n", read_size, start );
+    send_to_client( sender, buf, strlen( buf ) );
+}
 
-    for ( int cnt = 0; cnt < read_size; ++cnt )
+/* ------------------------------------------------------- */
+void disable_client( Client *sender, const ParsedCommand *cmd )
+{
+    if ( cmd->n_args != 0 )
     {
-        int i = start + cnt;
-        if ( i >= 10 ) i -= 10;
+        reply_illegal_command( sender, cmd );
+        return;
+    }
 
-        char buf[BUFSIZE];
-        snprintf( buf, BUFSIZE - 1, "(msg %ld %d \"%s\")\n", time_history[i], id_history[i], msg_history[i] );
+    // 自分から終えたセッションは引き継がない
+    if ( sender->session_generation != 0 )
+    {
+        session_table_close( sessions, sender->session_token, sender->session_generation );
+        sender->session_generation = 0;
+    }
 
-        fprintf( stderr, "history index = %d [%s]", i, buf );
+    SERVER_LOG( LOG_CAT_CONN, LOG_LEVEL_DEBUG, "[client:%d] quit", sender->id );
+    sender->alive = 0;
+}
 
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
+/* ------------------------------------------------------- */
+uint64_t
+save_message( const time_t msg_time, const int sender_id, const uint32_t room,
+              const char *msg, const size_t len )
+{
+    // ログへはメモリに積むだけで、書き出しは log_writer がまとめて行う。
+    // インデックスと部屋の一覧には割り当てられたシーケンス番号を登録する
+    const uint64_t seq = message_log_append( message_log, msg_time, sender_id, room, msg, len );
+    if ( seq == 0 )
+    {
+        SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_ERROR, "could not append to the message log" );
+        return 0;
     }
+
+    trigram_index_add( find_index, seq, msg, len );
+    room_table_add( room_table, room, seq );
+    return seq;
 }
 
 /* ------------------------------------------------------- */
 void
-reply_time_message( Client *sender, const char *recv_msg )
+format_message_line( char *buf,
+                     const size_t size,
+                     const LogRecord *rec )
 {
-    char buf[BUFSIZE];
-    char time_str[128];
-    int len = 0;
-
-    if ( strncmp( recv_msg, "("COMMAND_TIME")", strlen( COMMAND_TIME ) + 2 ) != 0 )
+    // 末尾のシーケンス番号は、再接続したクライアントが (resume) で続きを求めるのに使う
+    char escaped[BUFSIZE];
+    command_escape( rec->msg, rec->len, escaped, sizeof( escaped ) );
+    if ( rec->room == GLOBAL_ROOM )
     {
-        snprintf( buf, BUFSIZE - 1, "(error illegal_command [%s])\n", recv_msg );
-        fprintf( stderr, "illegal command %s\n", recv_msg );
-        len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
-        return;
+        snprintf( buf, size, "(msg %ld %d \"%s\" %llu)\n", (long)rec->time, rec->sender_id, escaped,
+                  (unsigned long long)rec->seq );
     }
-
-    get_datetime_string( time_str, sizeof( time_str ) );
-    snprintf( buf, BUFSIZE - 1, "(time \"%s\")\n", time_str );
-    fprintf( stderr, "reply time [%s]\n", time_str );
-
-    len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-    if ( len < 0 )
+    else
     {
-        perror( "send" );
+        snprintf( buf, size, "(msg %s %ld %d \"%s\" %llu)\n", room_table_name( room_table, rec->room ),
+                  (long)rec->time, rec->sender_id, escaped, (unsigned long long)rec->seq );
     }
 }
 
 /* ------------------------------------------------------- */
-void
-reply_hello( Client *sender, const char *recv_msg )
+SharedBuf *
+message_line_new( const LogRecord *rec )
 {
     char buf[BUFSIZE];
-    int len = 0;
+    format_message_line( buf, BUFSIZE - 1, rec );
+    return shared_buf_new( buf, strlen( buf ) );
+}
 
-    if ( strncmp( recv_msg, "("COMMAND_HELLO")", strlen( COMMAND_TIME ) + 2 ) != 0 )
+/* ------------------------------------------------------- */
+SharedBuf *
+message_frame_new( const LogRecord *rec )
+{
+    const char *room = room_table_name( room_table, rec->room );
+    const size_t room_len = strlen( room );
+    SharedBuf *buf = shared_buf_alloc( FRAME_HEADER_SIZE + FRAME_MESSAGE_PREFIX_SIZE
+                                       + ( room_len > 0 ? 1 + room_len : 0 ) + rec->len );
+    if ( buf != NULL
+         && frame_encode_message( buf->data, buf->len, rec->seq, rec->time, rec->sender_id,
+                                  room, room_len, rec->msg, rec->len ) == 0 )
     {
-        snprintf( buf, BUFSIZE - 1, "(error illegal_command [%s])\n", recv_msg );
-        fprintf( stderr, "illegal command %s\n", recv_msg );
-        len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
-        return;
+        shared_buf_unref( buf );
+        return NULL;
     }
+    return buf;
+}
 
-    snprintf( buf, BUFSIZE - 1, "(hello %d)\n", sender->id );
-    fprintf( stderr, "reply hello\n" );
-
-    len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-    if ( len < 0 )
+/* ------------------------------------------------------- */
+int
+history_ring_init( HistoryRing *ring,
+                   const int capacity )
+{
+    memset( ring, 0, sizeof( *ring ) );
+    ring->entries = calloc( capacity, sizeof( HistoryEntry ) );
+    if ( ring->entries == NULL )
     {
-        perror( "send" );
+        SERVER_LOG_ERRNO( LOG_CAT_STORAGE, "calloc" );
+        return 0;
     }
+    ring->capacity = capacity;
+    return 1;
 }
 
 /* ------------------------------------------------------- */
-void reply_unknown_command( Client *sender, const char *recv_msg )
+void
+history_ring_destroy( HistoryRing *ring )
 {
-    char buf[BUFSIZE];
-    snprintf( buf, BUFSIZE - 1, "(error unknown_command [%s])\n", recv_msg );
-    fprintf( stderr, "unknown command %s\n", recv_msg );
-
-    int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-    if ( len < 0 )
+    for ( int i = 0; i < ring->capacity; ++i )
     {
-        perror( "send" );
+        if ( ring->entries[i].line != NULL )
+        {
+            shared_buf_unref( ring->entries[i].line );
+            shared_buf_unref( ring->entries[i].frame );
+        }
     }
+    free( ring->entries );
+    memset( ring, 0, sizeof( *ring ) );
 }
 
 /* ------------------------------------------------------- */
-void disable_client( Client *sender, const char *recv_msg )
+void
+history_ring_push( HistoryRing *ring,
+                   const uint64_t seq,
+                   const time_t msg_time,
+                   const int sender_id,
+                   SharedBuf *line,
+                   SharedBuf *frame )
 {
-    if ( strncmp( recv_msg, "("COMMAND_QUIT")", strlen( COMMAND_TIME ) + 2 ) != 0 )
+    HistoryEntry *e = &ring->entries[ring->head];
+
+    // 一杯なら最も古いものを上書きする
+    if ( e->line != NULL )
     {
-        char buf[BUFSIZE];
-        snprintf( buf, BUFSIZE - 1, "(error illegal_command [%s])\n", recv_msg );
-        fprintf( stderr, "illegal command %s\n", recv_msg );
-        int len = send( sender->socket_fd, buf, strlen( buf ), 0 );
-        if ( len < 0 )
-        {
-            perror( "send" );
-        }
-        return;
+        ring->floor_seq = e->seq;
+        shared_buf_unref( e->line );
+        shared_buf_unref( e->frame );
     }
 
-    fprintf( stderr, "disable client\n" );
-    sender->alive = 0;
+    __atomic_add_fetch( &line->refcount, 1, __ATOMIC_RELAXED );
+    __atomic_add_fetch( &frame->refcount, 1, __ATOMIC_RELAXED );
+    e->seq = seq;
+    e->time = msg_time;
+    e->sender_id = sender_id;
+    e->line = line;
+    e->frame = frame;
+
+    if ( ++ring->head >= ring->capacity ) ring->head = 0;
+    if ( ring->count < ring->capacity ) ++ring->count;
 }
 
 /* ------------------------------------------------------- */
-void
-save_message( const time_t msg_time, const int sender_id, const char *msg )
+/*!
+  ログの末尾から capacity 件をたどれる位置に移り、直近のメッセージを履歴に載せる。
+  読み込んだ件数を返す。
+ */
+int
+history_ring_load( HistoryRing *ring,
+                   MessageLog *log )
 {
-    FILE *fp = fopen( MESSAGE_LOG, "a" );
-    if ( fp == NULL )
+    const uint64_t last = message_log_last_seq( log );
+
+    // 全員宛ての部屋のメッセージだけを積むので、部屋ごとの一覧から直近のものを取る
+    uint64_t *seqs = malloc( ring->capacity * sizeof( uint64_t ) );
+    if ( seqs == NULL )
     {
-        fprintf( stderr, "ERROR: could not open the file [%s]\n", MESSAGE_LOG );
-        return;
+        SERVER_LOG_ERRNO( LOG_CAT_STORAGE, "malloc" );
+        return 0;
+    }
+    const int n = room_table_recent( room_table, GLOBAL_ROOM, seqs, ring->capacity );
+
+    // 一杯まで読めた場合は、それより古いメッセージがログにだけ残っているかもしれない
+    if ( n == ring->capacity )
+    {
+        ring->floor_seq = seqs[0] - 1;
+    }
+
+    LogRecord rec;
+    int read_count = 0;
+    while ( read_count < n
+            && message_log_read( log, seqs[read_count], &rec ) )
+    {
+        SharedBuf *line = message_line_new( &rec );
+        SharedBuf *frame = message_frame_new( &rec );
+        if ( line == NULL
+             || frame == NULL )
+        {
+            if ( line != NULL ) shared_buf_unref( line );
+            if ( frame != NULL ) shared_buf_unref( frame );
+            break;
+        }
+        history_ring_push( ring, rec.seq, rec.time, rec.sender_id, line, frame );
+        shared_buf_unref( line );
+        shared_buf_unref( frame );
+        ++read_count;
+    }
+    if ( read_count < n )
+    {
+        ring->floor_seq = last; // 途中までしか読めなかった
     }
+    free( seqs );
 
-    fprintf( fp, "%ld %d %s\n", msg_time, sender_id, msg );
-    fclose( fp );
+    SERVER_LOG( LOG_CAT_STORAGE, LOG_LEVEL_INFO, "loaded %d messages from the log (last seq %llu)",
+                read_count, (unsigned long long)last );
+    return read_count;
 }
\ No newline at end of file
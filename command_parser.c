@@ -0,0 +1,311 @@
+
+#include "command_parser.h"
+
+#include <limits.h>
+#include <string.h>
+
+// 文字の分類表。1文字ごとに関数を呼ばず表を1回引くだけで済ませる
+#define CHAR_SPACE 1
+#define CHAR_DELIMITER 2
+
+static const unsigned char char_class[256] = {
+    [' '] = CHAR_SPACE | CHAR_DELIMITER,
+    ['\t'] = CHAR_SPACE | CHAR_DELIMITER,
+    ['\r'] = CHAR_SPACE | CHAR_DELIMITER,
+    ['('] = CHAR_DELIMITER,
+    [')'] = CHAR_DELIMITER,
+    ['"'] = CHAR_DELIMITER,
+};
+
+#define IS_SPACE( c ) ( char_class[(unsigned char)( c )] & CHAR_SPACE )
+#define IS_DELIMITER( c ) ( char_class[(unsigned char)( c )] & CHAR_DELIMITER )
+
+/* --------------------------------------------------------------------------- */
+static int
+view_equals( const StrView v,
+             const char * s,
+             const size_t len )
+{
+    return v.len == len && memcmp( v.ptr, s, len ) == 0;
+}
+
+#define VIEW_IS( v, name ) view_equals( v, name, sizeof( name ) - 1 )
+
+/* --------------------------------------------------------------------------- */
+Command
+command_lookup( const StrView name )
+{
+    switch ( name.len ) {
+    case sizeof( COMMAND_MESSAGE ) - 1:
+        if ( VIEW_IS( name, COMMAND_MESSAGE ) ) return CMD_MESSAGE;
+        break;
+    case sizeof( COMMAND_FIND ) - 1: // time, quit, join, ping, pong も同じ長さ
+        if ( VIEW_IS( name, COMMAND_FIND ) ) return CMD_FIND;
+        if ( VIEW_IS( name, COMMAND_TIME ) ) return CMD_TIME;
+        if ( VIEW_IS( name, COMMAND_QUIT ) ) return CMD_QUIT;
+        if ( VIEW_IS( name, COMMAND_JOIN ) ) return CMD_JOIN;
+        if ( VIEW_IS( name, COMMAND_PING ) ) return CMD_PING;
+        if ( VIEW_IS( name, COMMAND_PONG ) ) return CMD_PONG;
+        break;
+    case sizeof( COMMAND_HELLO ) - 1: // leave, stats, watch も同じ長さ
+        if ( VIEW_IS( name, COMMAND_HELLO ) ) return CMD_HELLO;
+        if ( VIEW_IS( name, COMMAND_LEAVE ) ) return CMD_LEAVE;
+        if ( VIEW_IS( name, COMMAND_STATS ) ) return CMD_STATS;
+        if ( VIEW_IS( name, COMMAND_WATCH ) ) return CMD_WATCH;
+        break;
+    case sizeof( COMMAND_RESUME ) - 1:
+        if ( VIEW_IS( name, COMMAND_RESUME ) ) return CMD_RESUME;
+        break;
+    case sizeof( COMMAND_HISTORY ) - 1: // unwatch も同じ長さ
+        if ( VIEW_IS( name, COMMAND_HISTORY ) ) return CMD_HISTORY;
+        if ( VIEW_IS( name, COMMAND_UNWATCH ) ) return CMD_UNWATCH;
+        break;
+    case sizeof( COMMAND_HISTORY_SINCE ) - 1: // history-range も同じ長さ
+        if ( VIEW_IS( name, COMMAND_HISTORY_SINCE ) ) return CMD_HISTORY_SINCE;
+        if ( VIEW_IS( name, COMMAND_HISTORY_RANGE ) ) return CMD_HISTORY_RANGE;
+        break;
+    default:
+        break;
+    }
+    return CMD_UNKNOWN;
+}
+
+/* --------------------------------------------------------------------------- */
+const char *
+command_name( const Command command )
+{
+    static const char * const names[N_COMMAND_TYPES] = {
+        [CMD_UNKNOWN] = "unknown",
+        [CMD_MESSAGE] = COMMAND_MESSAGE,
+        [CMD_FIND] = COMMAND_FIND,
+        [CMD_HISTORY] = COMMAND_HISTORY,
+        [CMD_HISTORY_SINCE] = COMMAND_HISTORY_SINCE,
+        [CMD_HISTORY_RANGE] = COMMAND_HISTORY_RANGE,
+        [CMD_TIME] = COMMAND_TIME,
+        [CMD_HELLO] = COMMAND_HELLO,
+        [CMD_QUIT] = COMMAND_QUIT,
+        [CMD_JOIN] = COMMAND_JOIN,
+        [CMD_LEAVE] = COMMAND_LEAVE,
+        [CMD_STATS] = COMMAND_STATS,
+        [CMD_PING] = COMMAND_PING,
+        [CMD_PONG] = COMMAND_PONG,
+        [CMD_RESUME] = COMMAND_RESUME,
+        [CMD_WATCH] = COMMAND_WATCH,
+        [CMD_UNWATCH] = COMMAND_UNWATCH,
+    };
+    return ( 0 <= (int)command && command < N_COMMAND_TYPES ? names[command] : names[CMD_UNKNOWN] );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+command_parse( const char * line,
+               const size_t len,
+               ParsedCommand * cmd )
+{
+    const char *p = line;
+    const char *end = line + len;
+
+    cmd->line.ptr = line;
+    cmd->line.len = len;
+    cmd->name.ptr = NULL;
+    cmd->name.len = 0;
+    cmd->command = CMD_UNKNOWN;
+    cmd->n_args = 0;
+
+    while ( p < end && IS_SPACE( *p ) ) ++p;
+    if ( p == end || *p != '(' )
+    {
+        return 0;
+    }
+    ++p;
+
+    // コマンド名
+    const char *start = p;
+    while ( p < end && ! IS_DELIMITER( *p ) ) ++p;
+    if ( p == start )
+    {
+        return 0;
+    }
+    cmd->name.ptr = start;
+    cmd->name.len = p - start;
+    cmd->command = command_lookup( cmd->name );
+
+    // 引数
+    for ( ;; )
+    {
+        while ( p < end && IS_SPACE( *p ) ) ++p;
+        if ( p == end )
+        {
+            return 0; // 閉じ括弧が無い
+        }
+        if ( *p == ')' )
+        {
+            ++p;
+            break;
+        }
+        if ( cmd->n_args >= MAX_COMMAND_ARGS
+             || *p == '(' )
+        {
+            return 0;
+        }
+
+        Token *tok = &cmd->args[cmd->n_args++];
+        tok->escaped = 0;
+        if ( *p == '"' )
+        {
+            start = ++p;
+            while ( p < end && *p != '"' )
+            {
+                if ( *p == '\\' && p + 1 < end )
+                {
+                    tok->escaped = 1;
+                    ++p;
+                }
+                ++p;
+            }
+            if ( p == end )
+            {
+                return 0; // 閉じていない文字列
+            }
+            tok->type = TOKEN_STRING;
+            tok->text.ptr = start;
+            tok->text.len = p - start;
+            ++p;
+        }
+        else
+        {
+            start = p;
+            while ( p < end && ! IS_DELIMITER( *p ) ) ++p;
+            tok->type = TOKEN_ATOM;
+            tok->text.ptr = start;
+            tok->text.len = p - start;
+        }
+    }
+
+    // 閉じ括弧の後ろには空白しか置けない
+    while ( p < end && IS_SPACE( *p ) ) ++p;
+    return p == end;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+command_arg_long( const ParsedCommand * cmd,
+                  const int i,
+                  long * value )
+{
+    if ( i >= cmd->n_args
+         || cmd->args[i].type != TOKEN_ATOM )
+    {
+        return 0;
+    }
+
+    const char *p = cmd->args[i].text.ptr;
+    const char *end = p + cmd->args[i].text.len;
+    int negative = 0;
+    if ( p < end && ( *p == '-' || *p == '+' ) )
+    {
+        negative = ( *p == '-' );
+        ++p;
+    }
+    if ( p == end )
+    {
+        return 0;
+    }
+
+    unsigned long v = 0;
+    for ( ; p < end; ++p )
+    {
+        if ( *p < '0' || '9' < *p )
+        {
+            return 0;
+        }
+        const unsigned long d = *p - '0';
+        if ( v > ( (unsigned long)LONG_MAX - d ) / 10 )
+        {
+            return 0; // 桁あふれ
+        }
+        v = v * 10 + d;
+    }
+
+    *value = ( negative ? -(long)v : (long)v );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+long
+command_arg_string( const ParsedCommand * cmd,
+                    const int i,
+                    char * out,
+                    const size_t size )
+{
+    if ( i >= cmd->n_args
+         || cmd->args[i].type != TOKEN_STRING
+         || size == 0 )
+    {
+        return -1;
+    }
+
+    const Token *tok = &cmd->args[i];
+    if ( ! tok->escaped )
+    {
+        if ( tok->text.len >= size )
+        {
+            return -1;
+        }
+        memcpy( out, tok->text.ptr, tok->text.len );
+        out[tok->text.len] = '\0';
+        return (long)tok->text.len;
+    }
+
+    // ¥" と ¥¥ だけを解く。それ以外の ¥ は文字としてそのまま残す
+    const char *p = tok->text.ptr;
+    const char *end = p + tok->text.len;
+    size_t n = 0;
+    for ( ; p < end; ++p )
+    {
+        char c = *p;
+        if ( c == '\\'
+             && p + 1 < end
+             && ( p[1] == '"' || p[1] == '\\' ) )
+        {
+            c = *++p;
+        }
+        if ( n + 1 >= size )
+        {
+            return -1;
+        }
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    return (long)n;
+}
+
+/* --------------------------------------------------------------------------- */
+size_t
+command_escape( const char * in,
+                const size_t len,
+                char * out,
+                const size_t size )
+{
+    if ( size == 0 )
+    {
+        return 0;
+    }
+
+    size_t n = 0;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        const int needs_escape = ( in[i] == '"' || in[i] == '\\' );
+        if ( n + 1 + needs_escape >= size )
+        {
+            break;
+        }
+        if ( needs_escape )
+        {
+            out[n++] = '\\';
+        }
+        out[n++] = in[i];
+    }
+    out[n] = '\0';
+    return n;
+}
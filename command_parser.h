@@ -0,0 +1,118 @@
+#ifndef COMMAND_PARSER_H
+#define COMMAND_PARSER_H
+
+#include <stddef.h>
+
+/*!
+  ¥brief クライアントから届く "(名前 引数...)" 形式のコマンドの字句解析。
+  1行を1回だけ走査し、名前と引数は入力バッファを指す StrView として返すのでコピーは発生しない。
+  文字列引数の中では ¥" と ¥¥ によるエスケープを使える。
+ */
+
+// コマンドの名前をマクロで定義しておく
+#define COMMAND_MESSAGE "msg"
+#define COMMAND_FIND "find"
+#define COMMAND_HISTORY "history"
+#define COMMAND_HISTORY_SINCE "history-since"
+#define COMMAND_HISTORY_RANGE "history-range"
+#define COMMAND_TIME "time"
+#define COMMAND_HELLO "hello"
+#define COMMAND_QUIT "quit"
+#define COMMAND_JOIN "join"
+#define COMMAND_LEAVE "leave"
+#define COMMAND_STATS "stats"
+#define COMMAND_PING "ping"
+#define COMMAND_PONG "pong"
+#define COMMAND_RESUME "resume"
+#define COMMAND_WATCH "watch"
+#define COMMAND_UNWATCH "unwatch"
+
+// コマンドのタイプを列挙型で管理する
+typedef enum {
+    CMD_UNKNOWN,
+    CMD_MESSAGE,
+    CMD_FIND,
+    CMD_HISTORY,
+    CMD_HISTORY_SINCE,
+    CMD_HISTORY_RANGE,
+    CMD_TIME,
+    CMD_HELLO,
+    CMD_QUIT,
+    CMD_JOIN,
+    CMD_LEAVE,
+    CMD_STATS,
+    CMD_PING,
+    CMD_PONG,
+    CMD_RESUME,
+    CMD_WATCH,
+    CMD_UNWATCH,
+    N_COMMAND_TYPES, // コマンドの種類の数。コマンドごとの表の大きさに使う
+} Command;
+
+#define MAX_COMMAND_ARGS 8
+
+/*!
+  ¥brief 入力バッファの一部を指す文字列。終端文字は付かない
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} StrView;
+
+typedef enum {
+    TOKEN_ATOM, //!< 数値など引用符で囲まれていない語
+    TOKEN_STRING, //!< "..." の中身。エスケープは元のまま残る
+} TokenType;
+
+typedef struct {
+    TokenType type;
+    StrView text;
+    int escaped; //!< TOKEN_STRING がエスケープを含む場合は1
+} Token;
+
+typedef struct {
+    StrView line; //!< 解析した行全体
+    StrView name;
+    Command command; //!< 名前が完全に一致したコマンド。無ければ CMD_UNKNOWN
+    int n_args;
+    Token args[MAX_COMMAND_ARGS];
+} ParsedCommand;
+
+/*!
+  ¥brief 1行を字句に分け、コマンド名を引く
+  ¥param line 行の先頭。改行は含まない
+  ¥param len 行の長さ
+  ¥param cmd 結果。line を指すだけでコピーはしない
+  ¥return 構文が正しければ1
+ */
+int command_parse( const char * line, const size_t len, ParsedCommand * cmd );
+
+/*!
+  ¥brief コマンド名を完全一致で引く。長さで分岐してから比較するので、文字列比較は高々数回
+ */
+Command command_lookup( const StrView name );
+
+/*!
+  ¥brief コマンドの名前を返す。CMD_UNKNOWN では "unknown"
+ */
+const char * command_name( const Command command );
+
+/*!
+  ¥brief i 番目の引数を整数として読む
+  ¥return 整数として正しければ1
+ */
+int command_arg_long( const ParsedCommand * cmd, const int i, long * value );
+
+/*!
+  ¥brief i 番目の文字列引数のエスケープを解いて out に終端文字付きで書き出す
+  ¥return 書き出した長さ。文字列でない・out に入り切らない場合は-1
+ */
+long command_arg_string( const ParsedCommand * cmd, const int i, char * out, const size_t size );
+
+/*!
+  ¥brief 文字列を "..." の中に置けるよう " と ¥ をエスケープして out に書き出す
+  ¥return 書き出した長さ。入り切らない分は切り捨てる
+ */
+size_t command_escape( const char * in, const size_t len, char * out, const size_t size );
+
+#endif
@@ -0,0 +1,100 @@
+
+#include "histogram.h"
+
+/* --------------------------------------------------------------------------- */
+static int
+bucket_index( const uint64_t value )
+{
+    if ( value < HISTOGRAM_SUB_BUCKETS )
+    {
+        return (int)value;
+    }
+    if ( value >> HISTOGRAM_MAX_BITS )
+    {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    // 最上位ビットより下の HISTOGRAM_SUB_BITS ビットで区間内の位置を決める
+    const int shift = 63 - __builtin_clzll( value ) - HISTOGRAM_SUB_BITS;
+    return shift * HISTOGRAM_SUB_BUCKETS + (int)( value >> shift );
+}
+
+/* --------------------------------------------------------------------------- */
+static uint64_t
+bucket_upper( const int index )
+{
+    if ( index < 2 * HISTOGRAM_SUB_BUCKETS )
+    {
+        return (uint64_t)index; // 幅1のバケツ
+    }
+
+    const int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    const uint64_t lower = (uint64_t)( index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS ) << shift;
+    return lower + ( (uint64_t)1 << shift ) - 1;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+histogram_record( Histogram * h,
+                  const uint64_t value )
+{
+    // 書き込むのはこのスレッドだけなので、読み出し側に途中の値が見えないことだけを保証すればよい
+    const int i = bucket_index( value );
+    __atomic_store_n( &h->buckets[i], h->buckets[i] + 1, __ATOMIC_RELAXED );
+    __atomic_store_n( &h->sum, h->sum + value, __ATOMIC_RELAXED );
+    if ( value > h->max )
+    {
+        __atomic_store_n( &h->max, value, __ATOMIC_RELAXED );
+    }
+    __atomic_store_n( &h->count, h->count + 1, __ATOMIC_RELAXED );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+histogram_merge( Histogram * dst,
+                 const Histogram * src )
+{
+    // count はバケツの合計から数え直し、読み出し中の記録で分位点がずれないようにする
+    uint64_t count = 0;
+    for ( int i = 0; i < HISTOGRAM_BUCKETS; ++i )
+    {
+        const uint64_t n = __atomic_load_n( &src->buckets[i], __ATOMIC_RELAXED );
+        dst->buckets[i] += n;
+        count += n;
+    }
+    dst->count += count;
+    dst->sum += __atomic_load_n( &src->sum, __ATOMIC_RELAXED );
+
+    const uint64_t max = __atomic_load_n( &src->max, __ATOMIC_RELAXED );
+    if ( max > dst->max )
+    {
+        dst->max = max;
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+histogram_percentile( const Histogram * h,
+                      const double percentile )
+{
+    if ( h->count == 0 )
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)( h->count * percentile / 100.0 + 0.5 );
+    if ( target < 1 ) target = 1;
+    if ( target > h->count ) target = h->count;
+
+    uint64_t seen = 0;
+    for ( int i = 0; i < HISTOGRAM_BUCKETS; ++i )
+    {
+        seen += h->buckets[i];
+        if ( seen >= target )
+        {
+            const uint64_t upper = bucket_upper( i );
+            return ( upper < h->max ? upper : h->max );
+        }
+    }
+    return h->max;
+}
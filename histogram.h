@@ -0,0 +1,43 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*!
+  ¥brief 値の大きさに対して相対誤差がほぼ一定になる HDR 形式のヒストグラム。
+  2のべき乗ごとの区間をさらに HISTOGRAM_SUB_BUCKETS 個に等分して数えるので、
+  分位点の誤差は 1/HISTOGRAM_SUB_BUCKETS (約6%) 以内に収まる。
+  バケツは固定長の配列で、記録は割り算もメモリ確保もしない。
+  記録は1つのスレッドだけが行い、他のスレッドは histogram_merge で読み出してよい。
+ */
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS ( 1 << HISTOGRAM_SUB_BITS )
+#define HISTOGRAM_MAX_BITS 40 // 2^40 以上の値は最後のバケツに数える。ナノ秒なら約18分
+#define HISTOGRAM_BUCKETS ( ( HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1 ) * HISTOGRAM_SUB_BUCKETS )
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} Histogram;
+
+/*!
+  ¥brief 値を1つ記録する。記録するスレッドは1つに限る
+ */
+void histogram_record( Histogram * h, const uint64_t value );
+
+/*!
+  ¥brief src の内容を dst に足し込む。src は記録中でもよい
+ */
+void histogram_merge( Histogram * dst, const Histogram * src );
+
+/*!
+  ¥brief 分位点を求める
+  ¥param percentile 0 から 100 まで。99.9 なら p999
+  ¥return 分位点を含むバケツの上限。記録が無ければ0
+ */
+uint64_t histogram_percentile( const Histogram * h, const double percentile );
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <limits.h>
+
+#include "message_log.h"
+
+/*
+  メッセージログの書き込み方式ごとのスループットを測る。
+  legacy は従来の save_message と同じく1件ごとに fopen/fprintf/fclose する方式。
+  それ以外は MessageLog に batch 件ずつ追記して message_log_flush する。
+ */
+
+/* ------------------------------------------------------- */
+static void
+remove_log_dir( const char *dir )
+{
+    DIR *d = opendir( dir );
+    if ( d == NULL )
+    {
+        return;
+    }
+
+    struct dirent *ent;
+    while ( ( ent = readdir( d ) ) != NULL )
+    {
+        if ( strcmp( ent->d_name, "." ) == 0 || strcmp( ent->d_name, ".." ) == 0 )
+        {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf( path, sizeof( path ), "%s/%s", dir, ent->d_name );
+        unlink( path );
+    }
+    closedir( d );
+    rmdir( dir );
+}
+
+/* ------------------------------------------------------- */
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ------------------------------------------------------- */
+static void
+report( const char *policy, const int n_messages, const int batch,
+        const double sec, const unsigned long long n_syncs )
+{
+    // 比較しやすいように1行1ケースの key=value 形式で出力する
+    printf( "policy=%s messages=%d batch=%d seconds=%.6f msgs_per_sec=%.0f fsyncs=%llu\n",
+            policy, n_messages, batch, sec, n_messages / sec, n_syncs );
+}
+
+/* ------------------------------------------------------- */
+static void
+bench_legacy( const char *filename, const int n_messages, const char *msg )
+{
+    unlink( filename );
+
+    const double start = now_sec();
+    for ( int i = 0; i < n_messages; ++i )
+    {
+        FILE *fp = fopen( filename, "a" );
+        if ( fp == NULL )
+        {
+            perror( "fopen" );
+            return;
+        }
+        fprintf( fp, "%ld %d %s\n", (long)time( NULL ), i, msg );
+        fclose( fp );
+    }
+    report( "legacy", n_messages, 1, now_sec() - start, 0 );
+
+    unlink( filename );
+}
+
+/* ------------------------------------------------------- */
+static void
+bench_policy( const char *dir, const char *policy_str,
+              const int n_messages, const int batch, const char *msg )
+{
+    FsyncPolicy policy;
+    int interval_ms;
+    if ( ! message_log_parse_policy( policy_str, &policy, &interval_ms ) )
+    {
+        fprintf( stderr, "illegal policy [%s]\n", policy_str );
+        return;
+    }
+
+    remove_log_dir( dir );
+    MessageLog *log = message_log_open( dir, policy, interval_ms, DEFAULT_SEGMENT_SIZE );
+    if ( log == NULL )
+    {
+        return;
+    }
+
+    const size_t msg_len = strlen( msg );
+    const double start = now_sec();
+    for ( int i = 0; i < n_messages; ++i )
+    {
+        if ( message_log_append( log, time( NULL ), i, 0, msg, msg_len ) == 0 )
+        {
+            break;
+        }
+        // サーバのイベントループ1回分に相当する
+        if ( ( i + 1 ) % batch == 0 )
+        {
+            message_log_flush( log );
+        }
+    }
+    message_log_flush( log );
+    const double sec = now_sec() - start;
+    const unsigned long long n_syncs = message_log_sync_count( log );
+    message_log_close( log );
+
+    report( policy_str, n_messages, batch, sec, n_syncs );
+
+    remove_log_dir( dir );
+}
+
+/* ------------------------------------------------------- */
+int
+main( int argc, char **argv )
+{
+    int n_messages = 100000;
+    int batch = 64;
+    int msg_size = 64;
+    const char *filename = "log-bench.log";
+    const char *dir = "log-bench.d";
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "n:b:s:f:d:h" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 'n': n_messages = atoi( optarg ); break;
+        case 'b': batch = atoi( optarg ); break;
+        case 's': msg_size = atoi( optarg ); break;
+        case 'f': filename = optarg; break;
+        case 'd': dir = optarg; break;
+        default:
+            fprintf( stderr, "Usage: %s [-n messages] [-b batch] [-s msg_size] [-f file] [-d dir] [policy...]\n"
+                     "  policy: legacy, none, batch or interval in ms (default: all of legacy none 10 batch)\n",
+                     argv[0] );
+            return 1;
+        }
+    }
+
+    if ( n_messages <= 0 || batch <= 0 || msg_size <= 0 || msg_size > 511 )
+    {
+        fprintf( stderr, "illegal arguments\n" );
+        return 1;
+    }
+
+    char msg[512];
+    memset( msg, 'x', msg_size );
+    msg[msg_size] = '\0';
+
+    static const char *default_policies[] = { "legacy", "none", "10", "batch" };
+    const int n_policies = ( optind < argc ? argc - optind : 4 );
+    for ( int i = 0; i < n_policies; ++i )
+    {
+        const char *policy = ( optind < argc ? argv[optind + i] : default_policies[i] );
+        if ( strcmp( policy, "legacy" ) == 0 )
+        {
+            bench_legacy( filename, n_messages, msg );
+        }
+        else
+        {
+            bench_policy( dir, policy, n_messages, batch, msg );
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "message_log.h"
+
+/*
+  "時刻 ID 本文" 形式の旧テキストログをセグメント形式のメッセージログに変換する。
+  ログのディレクトリに既にメッセージがある場合はその後ろに追記する。
+ */
+
+/* ------------------------------------------------------- */
+int
+main( int argc, char **argv )
+{
+    uint64_t segment_size = DEFAULT_SEGMENT_SIZE;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "s:h" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 's':
+            if ( atoi( optarg ) <= 0 )
+            {
+                fprintf( stderr, "illegal segment size [%s]\n", optarg );
+                return 1;
+            }
+            segment_size = (uint64_t)atoi( optarg ) * 1024 * 1024;
+            break;
+        default:
+            fprintf( stderr, "Usage: %s [-s segment_size_mb] text_log log_dir\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( argc - optind != 2 )
+    {
+        fprintf( stderr, "Usage: %s [-s segment_size_mb] text_log log_dir\n", argv[0] );
+        return 1;
+    }
+    const char *text_log = argv[optind];
+    const char *log_dir = argv[optind + 1];
+
+    MessageLog *log = message_log_open( log_dir, FSYNC_BATCH, 0, segment_size );
+    if ( log == NULL )
+    {
+        return 1;
+    }
+
+    const uint64_t before = message_log_last_seq( log );
+    const long n = message_log_import_text( log, text_log );
+    if ( n < 0 )
+    {
+        perror( text_log );
+        message_log_close( log );
+        return 1;
+    }
+
+    fprintf( stderr, "converted %ld messages from %s (seq %llu - %llu)\n",
+             n, text_log, (unsigned long long)before + 1,
+             (unsigned long long)message_log_last_seq( log ) );
+    message_log_close( log );
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "message_log.h"
+
+/*
+  セグメント形式のメッセージログを "時刻 ID 本文" 形式のテキストとして標準出力に書き出す。
+  -q を付けると先頭にシーケンス番号を付ける。出力はそのまま log-convert で読み戻せる。
+ */
+
+/* ------------------------------------------------------- */
+int
+main( int argc, char **argv )
+{
+    uint64_t from = 1;
+    uint64_t count = 0; // 0 なら末尾まで
+    int with_seq = 0;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "f:n:qh" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 'f': from = strtoull( optarg, NULL, 10 ); break;
+        case 'n': count = strtoull( optarg, NULL, 10 ); break;
+        case 'q': with_seq = 1; break;
+        default:
+            fprintf( stderr, "Usage: %s [-f from_seq] [-n count] [-q] log_dir\n", argv[0] );
+            return 1;
+        }
+    }
+
+    if ( argc - optind != 1
+         || from == 0 )
+    {
+        fprintf( stderr, "Usage: %s [-f from_seq] [-n count] [-q] log_dir\n", argv[0] );
+        return 1;
+    }
+
+    MessageLog *log = message_log_open( argv[optind], FSYNC_NONE, 0, DEFAULT_SEGMENT_SIZE );
+    if ( log == NULL )
+    {
+        return 1;
+    }
+
+    LogCursor cur;
+    LogRecord rec;
+    uint64_t n = 0;
+    if ( message_log_seek( log, from, &cur ) )
+    {
+        while ( ( count == 0 || n < count )
+                && message_log_next( &cur, &rec ) )
+        {
+            if ( with_seq )
+            {
+                printf( "%llu ", (unsigned long long)rec.seq );
+            }
+            printf( "%ld %d %.*s\n", (long)rec.time, rec.sender_id, (int)rec.len, rec.msg );
+            ++n;
+        }
+    }
+
+    message_log_close( log );
+    return 0;
+}
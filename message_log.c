@@ -0,0 +1,1611 @@
+
+#include "message_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define LOG_BLOCK_SIZE ( 64 * 1024 )
+#define MAX_LOG_IOV 64
+#define MAX_RECORD_LEN ( 1024 * 1024 )
+#define MIN_SEGMENT_SIZE ( 64 * 1024 )
+#define INDEX_INTERVAL 4096 // セグメント内でこのバイト数ごとに疎インデックスへ登録する
+#define INITIAL_SEGMENTS 16
+#define MAX_IMPORT_LINE 4096
+
+#define SEGMENT_MAGIC "CHATLOG1"
+#define SEGMENT_VERSION 1
+#define SEGMENT_SUFFIX ".seg"
+#define INDEX_SUFFIX ".idx"
+#define SEGMENT_NAME_DIGITS 20
+#define SPARE_PREFIX "spare-" // 先に作っておく、まだ先頭のシーケンス番号が決まっていないセグメント
+
+// セグメントファイルの先頭
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t first_seq;
+    uint64_t reserved;
+} SegmentHeader;
+
+// レコードの固定長ヘッダ。直後に len バイトの本文が続く
+typedef struct {
+    uint32_t len;
+    uint32_t crc; // seq 以降のヘッダと本文の CRC32
+    uint64_t seq;
+    int64_t time;
+    int32_t sender_id;
+    uint32_t room; // 部屋の番号。部屋が無かった頃のレコードでは0
+} RecordHeader;
+
+// 疎インデックスの1件。idx ファイルにはこれがそのまま並ぶ
+typedef struct {
+    uint64_t seq;
+    int64_t time;
+    uint64_t offset;
+} IndexEntry;
+
+typedef struct {
+    uint64_t first_seq;
+    char *map;
+    size_t map_len;
+
+    uint64_t end; // 書き出し済みの末尾。flush だけが更新し、読み出し側は __atomic で読む
+    uint64_t append_end; // 書き出し待ちを含めた末尾 (mutex)
+    uint64_t last_seq; // 書き出し待ちを含めた最後のシーケンス番号 (mutex)
+    int sealed; // 次のセグメントに切り替え済み (mutex)
+    uint64_t spare_id; // 0 でなければ SPARE_PREFIX の仮の名前のまま。ヘッダもまだ書いていない
+
+    int fd; // 追記用。封じて書き出し終えたら -1 (flush_lock)
+    int idx_fd;
+
+    // 疎インデックス。配列の形は rwlock で守る
+    IndexEntry *index;
+    uint32_t n_index;
+    uint32_t index_capacity;
+    uint32_t n_index_written; // idx ファイルに書いた件数 (flush_lock)
+} Segment;
+
+// 書き出し待ちの追記を詰めておくブロック。1つのブロックは1つのセグメントに属する
+typedef struct LogBlock {
+    struct LogBlock *next;
+    Segment *segment;
+    size_t len;
+    size_t capacity;
+    char data[];
+} LogBlock;
+
+struct MessageLog {
+    // 追記側 (pending のリスト・セグメントの末尾・チケット) を守る
+    pthread_mutex_t mutex;
+    // 書き出しと fsync を1スレッドずつに制限する
+    pthread_mutex_t flush_lock;
+    // セグメントの配列と疎インデックスの配列を守る。読み出し側は読み取りロックを取る
+    pthread_rwlock_t rwlock;
+
+    char *dir;
+    FsyncPolicy policy;
+    int interval_ms;
+    uint64_t segment_size;
+
+    Segment **segments;
+    int n_segments;
+    int segments_capacity;
+    Segment *write_segment; // fsync の対象になる書き込み中のセグメント (flush_lock)
+    Segment *spare_segment; // flush が先に作っておく次のセグメント (mutex)
+    uint64_t last_spare_id; // (flush_lock)
+
+    LogBlock *head;
+    LogBlock *tail;
+    LogBlock *spare; // 使い回し用
+
+    MessageLogFlushHook flush_hook; // (flush_lock)
+    void *flush_hook_arg;
+
+    uint64_t last_ticket; // 最後に払い出したシーケンス番号
+    uint64_t written_ticket; // ここまで write 済み (__atomic で読む)
+    uint64_t synced_ticket; // ここまで fsync 済み
+    uint64_t durable_ticket; // 方針に従い確定したシーケンス番号 (__atomic で読む)
+
+    struct timespec last_sync;
+    uint64_t sync_count;
+};
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+/* --------------------------------------------------------------------------- */
+static void
+init_crc_table( void )
+{
+    for ( uint32_t i = 0; i < 256; ++i )
+    {
+        uint32_t c = i;
+        for ( int k = 0; k < 8; ++k )
+        {
+            c = ( c & 1 ) ? ( 0xEDB88320u ^ ( c >> 1 ) ) : ( c >> 1 );
+        }
+        crc_table[i] = c;
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+crc32_update( uint32_t crc,
+              const void * data,
+              const size_t len )
+{
+    const unsigned char *p = data;
+    crc = ~crc;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        crc = crc_table[( crc ^ p[i] ) & 0xFF] ^ ( crc >> 8 );
+    }
+    return ~crc;
+}
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+record_crc( const RecordHeader * h,
+            const char * msg )
+{
+    const size_t skip = offsetof( RecordHeader, seq );
+    const uint32_t crc = crc32_update( 0, (const char *)h + skip, sizeof( RecordHeader ) - skip );
+    return crc32_update( crc, msg, h->len );
+}
+
+/* --------------------------------------------------------------------------- */
+static long
+elapsed_ms( const struct timespec * since )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ( now.tv_sec - since->tv_sec ) * 1000 + ( now.tv_nsec - since->tv_nsec ) / 1000000;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+segment_path( const MessageLog * log,
+              const uint64_t first_seq,
+              const char * suffix,
+              char * path,
+              const size_t size )
+{
+    snprintf( path, size, "%s/%020" PRIu64 "%s", log->dir, first_seq, suffix );
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+spare_path( const MessageLog * log,
+            const uint64_t spare_id,
+            const char * suffix,
+            char * path,
+            const size_t size )
+{
+    snprintf( path, size, "%s/" SPARE_PREFIX "%" PRIu64 "%s", log->dir, spare_id, suffix );
+}
+
+/* --------------------------------------------------------------------------- */
+static size_t
+segment_map_length( const MessageLog * log,
+                    const uint64_t file_size )
+{
+    // 伸びていくセグメントを張り直さずに読めるよう、書き得る最大の大きさで mmap しておく
+    const uint64_t max = log->segment_size + sizeof( RecordHeader ) + MAX_RECORD_LEN;
+    return (size_t)( file_size > max ? file_size : max );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_parse_policy( const char * str,
+                          FsyncPolicy * policy,
+                          int * interval_ms )
+{
+    if ( strcmp( str, "none" ) == 0 )
+    {
+        *policy = FSYNC_NONE;
+        *interval_ms = 0;
+        return 1;
+    }
+
+    if ( strcmp( str, "batch" ) == 0 )
+    {
+        *policy = FSYNC_BATCH;
+        *interval_ms = 0;
+        return 1;
+    }
+
+    char *end = NULL;
+    long ms = strtol( str, &end, 10 );
+    if ( end != str
+         && ( *end == '\0' || strcmp( end, "ms" ) == 0 )
+         && 0 < ms && ms <= 60 * 1000 )
+    {
+        *policy = FSYNC_INTERVAL;
+        *interval_ms = (int)ms;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  疎インデックスに1件加える。配列を読み出し側と共有しているので書き込みロックを取る
+ */
+static int
+add_index_entry( MessageLog * log,
+                 Segment * seg,
+                 const uint64_t seq,
+                 const int64_t msg_time,
+                 const uint64_t offset )
+{
+    pthread_rwlock_wrlock( &log->rwlock );
+
+    if ( seg->n_index == seg->index_capacity )
+    {
+        const uint32_t capacity = ( seg->index_capacity == 0 ? 64 : seg->index_capacity * 2 );
+        IndexEntry *index = realloc( seg->index, sizeof( IndexEntry ) * capacity );
+        if ( index == NULL )
+        {
+            perror( "realloc" );
+            pthread_rwlock_unlock( &log->rwlock );
+            return 0;
+        }
+        seg->index = index;
+        seg->index_capacity = capacity;
+    }
+
+    IndexEntry *e = &seg->index[seg->n_index++];
+    e->seq = seq;
+    e->time = msg_time;
+    e->offset = offset;
+
+    pthread_rwlock_unlock( &log->rwlock );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+needs_index_entry( const Segment * seg,
+                   const uint64_t offset )
+{
+    return ( seg->n_index == 0
+             || offset - seg->index[seg->n_index - 1].offset >= INDEX_INTERVAL );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+push_segment( MessageLog * log,
+              Segment * seg )
+{
+    pthread_rwlock_wrlock( &log->rwlock );
+
+    if ( log->n_segments == log->segments_capacity )
+    {
+        const int capacity = ( log->segments_capacity == 0 ? INITIAL_SEGMENTS : log->segments_capacity * 2 );
+        Segment **segments = realloc( log->segments, sizeof( Segment * ) * capacity );
+        if ( segments == NULL )
+        {
+            perror( "realloc" );
+            pthread_rwlock_unlock( &log->rwlock );
+            return 0;
+        }
+        log->segments = segments;
+        log->segments_capacity = capacity;
+    }
+    log->segments[log->n_segments++] = seg;
+
+    pthread_rwlock_unlock( &log->rwlock );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+free_segment( Segment * seg )
+{
+    if ( seg->fd >= 0 ) close( seg->fd );
+    if ( seg->idx_fd >= 0 ) close( seg->idx_fd );
+    if ( seg->map != NULL ) munmap( seg->map, seg->map_len );
+    free( seg->index );
+    free( seg );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  セグメントのヘッダを書く。ファイルが空の状態で呼ぶ
+ */
+static int
+write_segment_header( const Segment * seg )
+{
+    SegmentHeader h;
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.magic, SEGMENT_MAGIC, sizeof( h.magic ) );
+    h.version = SEGMENT_VERSION;
+    h.header_size = sizeof( SegmentHeader );
+    h.first_seq = seg->first_seq;
+    if ( write( seg->fd, &h, sizeof( h ) ) != (ssize_t)sizeof( h ) )
+    {
+        perror( "write" );
+        return 0;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  first_seq から始まる空のセグメントを作る。
+  spare_id が0でなければ先頭のシーケンス番号を決めずに仮の名前で作り、ヘッダも書かない。
+  追記側が切り替えた後の flush で name_segment_locked が名前とヘッダを決める
+ */
+static Segment *
+create_segment( MessageLog * log,
+                const uint64_t first_seq,
+                const uint64_t spare_id )
+{
+    char path[PATH_MAX];
+    Segment *seg = calloc( 1, sizeof( Segment ) );
+    if ( seg == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    seg->fd = seg->idx_fd = -1;
+    seg->first_seq = first_seq;
+    seg->last_seq = first_seq - 1;
+    seg->spare_id = spare_id;
+
+    if ( spare_id != 0 ) spare_path( log, spare_id, SEGMENT_SUFFIX, path, sizeof( path ) );
+    else segment_path( log, first_seq, SEGMENT_SUFFIX, path, sizeof( path ) );
+    seg->fd = open( path, O_RDWR | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( seg->fd < 0 )
+    {
+        perror( path );
+        free_segment( seg );
+        return NULL;
+    }
+
+    if ( spare_id == 0
+         && ! write_segment_header( seg ) )
+    {
+        free_segment( seg );
+        return NULL;
+    }
+    seg->end = seg->append_end = sizeof( SegmentHeader );
+
+    seg->map_len = segment_map_length( log, 0 );
+    seg->map = mmap( NULL, seg->map_len, PROT_READ, MAP_SHARED, seg->fd, 0 );
+    if ( seg->map == MAP_FAILED )
+    {
+        perror( "mmap" );
+        seg->map = NULL;
+        free_segment( seg );
+        return NULL;
+    }
+
+    if ( spare_id != 0 ) spare_path( log, spare_id, INDEX_SUFFIX, path, sizeof( path ) );
+    else segment_path( log, first_seq, INDEX_SUFFIX, path, sizeof( path ) );
+    seg->idx_fd = open( path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( seg->idx_fd < 0 )
+    {
+        perror( path );
+        free_segment( seg );
+        return NULL;
+    }
+
+    return seg;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  offset にあるレコードのヘッダを読み、正しいレコードかどうかを確かめる
+  ¥return レコード全体の大きさ。壊れている・書きかけの場合は0
+ */
+static size_t
+check_record( const Segment * seg,
+              const uint64_t offset,
+              const uint64_t file_size,
+              const uint64_t expected_seq,
+              RecordHeader * h )
+{
+    if ( offset + sizeof( RecordHeader ) > file_size )
+    {
+        return 0;
+    }
+    memcpy( h, seg->map + offset, sizeof( RecordHeader ) );
+    if ( h->len > MAX_RECORD_LEN
+         || offset + sizeof( RecordHeader ) + h->len > file_size
+         || h->seq != expected_seq
+         || h->crc != record_crc( h, seg->map + offset + sizeof( RecordHeader ) ) )
+    {
+        return 0;
+    }
+    return sizeof( RecordHeader ) + h->len;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  idx ファイルを読み込む。セグメントの中身と食い違う項目以降は捨てる
+ */
+static void
+load_index( MessageLog * log,
+            Segment * seg,
+            const uint64_t file_size )
+{
+    char path[PATH_MAX];
+    segment_path( log, seg->first_seq, INDEX_SUFFIX, path, sizeof( path ) );
+    FILE *fp = fopen( path, "rb" );
+    if ( fp == NULL )
+    {
+        return;
+    }
+
+    IndexEntry e;
+    uint64_t prev_seq = 0;
+    uint64_t prev_offset = 0;
+    while ( fread( &e, sizeof( e ), 1, fp ) == 1 )
+    {
+        RecordHeader h;
+        if ( e.seq < seg->first_seq
+             || ( seg->n_index > 0 && ( e.seq <= prev_seq || e.offset <= prev_offset ) )
+             || e.offset < sizeof( SegmentHeader )
+             || e.offset + sizeof( RecordHeader ) > file_size )
+        {
+            break;
+        }
+        memcpy( &h, seg->map + e.offset, sizeof( h ) );
+        if ( h.seq != e.seq )
+        {
+            break;
+        }
+        if ( ! add_index_entry( log, seg, e.seq, e.time, e.offset ) )
+        {
+            break;
+        }
+        prev_seq = e.seq;
+        prev_offset = e.offset;
+    }
+    fclose( fp );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+rewrite_index( MessageLog * log,
+               Segment * seg )
+{
+    char path[PATH_MAX];
+    segment_path( log, seg->first_seq, INDEX_SUFFIX, path, sizeof( path ) );
+    const int fd = open( path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( fd < 0 )
+    {
+        perror( path );
+        return -1;
+    }
+    const ssize_t size = sizeof( IndexEntry ) * seg->n_index;
+    if ( write( fd, seg->index, size ) != size )
+    {
+        perror( "write" );
+    }
+    seg->n_index_written = seg->n_index;
+    return fd;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  既存のセグメントを開く。最後に記録されたインデックスの位置からレコードを検査して末尾を求め、
+  最後のセグメントでは書きかけのレコードを切り捨てる
+ */
+static Segment *
+load_segment( MessageLog * log,
+              const uint64_t first_seq,
+              const int is_last )
+{
+    char path[PATH_MAX];
+    Segment *seg = calloc( 1, sizeof( Segment ) );
+    if ( seg == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    seg->fd = seg->idx_fd = -1;
+    seg->first_seq = first_seq;
+
+    segment_path( log, first_seq, SEGMENT_SUFFIX, path, sizeof( path ) );
+    seg->fd = open( path, O_RDWR | O_APPEND | O_CLOEXEC );
+    if ( seg->fd < 0 )
+    {
+        perror( path );
+        free_segment( seg );
+        return NULL;
+    }
+
+    struct stat st;
+    SegmentHeader h;
+    if ( fstat( seg->fd, &st ) != 0
+         || pread( seg->fd, &h, sizeof( h ), 0 ) != (ssize_t)sizeof( h )
+         || memcmp( h.magic, SEGMENT_MAGIC, sizeof( h.magic ) ) != 0
+         || h.version != SEGMENT_VERSION
+         || h.header_size != sizeof( SegmentHeader )
+         || h.first_seq != first_seq )
+    {
+        fprintf( stderr, "ERROR: %s is not a message log segment\n", path );
+        free_segment( seg );
+        return NULL;
+    }
+    const uint64_t file_size = (uint64_t)st.st_size;
+
+    seg->map_len = segment_map_length( log, file_size );
+    seg->map = mmap( NULL, seg->map_len, PROT_READ, MAP_SHARED, seg->fd, 0 );
+    if ( seg->map == MAP_FAILED )
+    {
+        perror( "mmap" );
+        seg->map = NULL;
+        free_segment( seg );
+        return NULL;
+    }
+
+    load_index( log, seg, file_size );
+    const uint32_t n_loaded = seg->n_index;
+
+    // 最後のインデックスの位置から末尾まで検査する
+    uint64_t offset = sizeof( SegmentHeader );
+    uint64_t seq = first_seq;
+    if ( seg->n_index > 0 )
+    {
+        offset = seg->index[seg->n_index - 1].offset;
+        seq = seg->index[seg->n_index - 1].seq;
+    }
+
+    RecordHeader rh;
+    size_t size;
+    while ( ( size = check_record( seg, offset, file_size, seq, &rh ) ) != 0 )
+    {
+        if ( needs_index_entry( seg, offset )
+             && ! add_index_entry( log, seg, seq, rh.time, offset ) )
+        {
+            free_segment( seg );
+            return NULL;
+        }
+        offset += size;
+        ++seq;
+    }
+
+    if ( offset < file_size )
+    {
+        if ( ! is_last )
+        {
+            fprintf( stderr, "ERROR: %s is corrupted at offset %" PRIu64 "\n", path, offset );
+            free_segment( seg );
+            return NULL;
+        }
+        fprintf( stderr, "WARNING: truncating %s from %" PRIu64 " to %" PRIu64 " bytes\n",
+                 path, file_size, offset );
+        if ( ftruncate( seg->fd, offset ) != 0 )
+        {
+            perror( "ftruncate" );
+            free_segment( seg );
+            return NULL;
+        }
+    }
+
+    seg->end = seg->append_end = offset;
+    seg->last_seq = seq - 1;
+
+    if ( seg->n_index != n_loaded
+         || is_last )
+    {
+        seg->idx_fd = rewrite_index( log, seg );
+    }
+    seg->n_index_written = seg->n_index;
+
+    if ( ! is_last )
+    {
+        seg->sealed = 1;
+        close( seg->fd );
+        seg->fd = -1;
+        if ( seg->idx_fd >= 0 ) close( seg->idx_fd );
+        seg->idx_fd = -1;
+    }
+    else if ( seg->idx_fd < 0 )
+    {
+        free_segment( seg );
+        return NULL;
+    }
+
+    return seg;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+compare_seq( const void * a,
+             const void * b )
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return ( x < y ? -1 : x > y ? 1 : 0 );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  ディレクトリにあるセグメントの先頭シーケンス番号を昇順に列挙する
+  ¥return 見つかった数。エラーの場合は-1
+ */
+static int
+list_segments( const char * dir,
+               uint64_t ** first_seqs )
+{
+    DIR *d = opendir( dir );
+    if ( d == NULL )
+    {
+        perror( dir );
+        return -1;
+    }
+
+    int n = 0;
+    int capacity = 0;
+    uint64_t *seqs = NULL;
+    struct dirent *ent;
+    while ( ( ent = readdir( d ) ) != NULL )
+    {
+        const char *name = ent->d_name;
+
+        // 前回の実行で使わずに終わった仮のセグメントは捨てる
+        if ( strncmp( name, SPARE_PREFIX, strlen( SPARE_PREFIX ) ) == 0 )
+        {
+            char path[PATH_MAX];
+            snprintf( path, sizeof( path ), "%s/%s", dir, name );
+            unlink( path );
+            continue;
+        }
+
+        if ( strlen( name ) != SEGMENT_NAME_DIGITS + strlen( SEGMENT_SUFFIX )
+             || strcmp( name + SEGMENT_NAME_DIGITS, SEGMENT_SUFFIX ) != 0 )
+        {
+            continue;
+        }
+        char *end = NULL;
+        const uint64_t seq = strtoull( name, &end, 10 );
+        if ( end != name + SEGMENT_NAME_DIGITS
+             || seq == 0 )
+        {
+            continue;
+        }
+
+        if ( n == capacity )
+        {
+            capacity = ( capacity == 0 ? INITIAL_SEGMENTS : capacity * 2 );
+            uint64_t *p = realloc( seqs, sizeof( uint64_t ) * capacity );
+            if ( p == NULL )
+            {
+                perror( "realloc" );
+                free( seqs );
+                closedir( d );
+                return -1;
+            }
+            seqs = p;
+        }
+        seqs[n++] = seq;
+    }
+    closedir( d );
+
+    qsort( seqs, n, sizeof( uint64_t ), compare_seq );
+    *first_seqs = seqs;
+    return n;
+}
+
+/* --------------------------------------------------------------------------- */
+MessageLog *
+message_log_open( const char * dir,
+                  const FsyncPolicy policy,
+                  const int interval_ms,
+                  const uint64_t segment_size )
+{
+    pthread_once( &crc_once, init_crc_table );
+
+    if ( mkdir( dir, 0755 ) != 0
+         && errno != EEXIST )
+    {
+        perror( dir );
+        return NULL;
+    }
+
+    MessageLog *log = calloc( 1, sizeof( MessageLog ) );
+    if ( log == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    log->dir = strdup( dir );
+    log->policy = policy;
+    log->interval_ms = interval_ms;
+    log->segment_size = ( segment_size < MIN_SEGMENT_SIZE ? MIN_SEGMENT_SIZE : segment_size );
+    pthread_mutex_init( &log->mutex, NULL );
+    pthread_mutex_init( &log->flush_lock, NULL );
+    pthread_rwlock_init( &log->rwlock, NULL );
+    clock_gettime( CLOCK_MONOTONIC, &log->last_sync );
+
+    uint64_t *first_seqs = NULL;
+    const int n = list_segments( dir, &first_seqs );
+    if ( n < 0 )
+    {
+        message_log_close( log );
+        return NULL;
+    }
+
+    for ( int i = 0; i < n; ++i )
+    {
+        Segment *seg = load_segment( log, first_seqs[i], i == n - 1 );
+        if ( seg == NULL )
+        {
+            free( first_seqs );
+            message_log_close( log );
+            return NULL;
+        }
+        if ( log->n_segments > 0
+             && log->segments[log->n_segments - 1]->last_seq + 1 != seg->first_seq )
+        {
+            fprintf( stderr, "ERROR: message log segments are not contiguous at seq %" PRIu64 "\n",
+                     seg->first_seq );
+            free_segment( seg );
+            free( first_seqs );
+            message_log_close( log );
+            return NULL;
+        }
+        if ( ! push_segment( log, seg ) )
+        {
+            free_segment( seg );
+            free( first_seqs );
+            message_log_close( log );
+            return NULL;
+        }
+    }
+    free( first_seqs );
+
+    if ( log->n_segments == 0 )
+    {
+        Segment *seg = create_segment( log, 1, 0 );
+        if ( seg == NULL
+             || ! push_segment( log, seg ) )
+        {
+            if ( seg != NULL ) free_segment( seg );
+            message_log_close( log );
+            return NULL;
+        }
+    }
+
+    Segment *last = log->segments[log->n_segments - 1];
+    log->write_segment = last;
+    log->last_ticket = log->written_ticket = log->synced_ticket = log->durable_ticket = last->last_seq;
+    return log;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+message_log_close( MessageLog * log )
+{
+    if ( log == NULL )
+    {
+        return;
+    }
+
+    if ( log->n_segments > 0 )
+    {
+        message_log_flush( log );
+        if ( log->written_ticket > log->synced_ticket
+             && fdatasync( log->write_segment->fd ) != 0 )
+        {
+            perror( "fdatasync" );
+        }
+    }
+
+    for ( int i = 0; i < log->n_segments; ++i )
+    {
+        free_segment( log->segments[i] );
+    }
+    free( log->segments );
+    if ( log->spare_segment != NULL )
+    {
+        char path[PATH_MAX];
+        spare_path( log, log->spare_segment->spare_id, SEGMENT_SUFFIX, path, sizeof( path ) );
+        unlink( path );
+        spare_path( log, log->spare_segment->spare_id, INDEX_SUFFIX, path, sizeof( path ) );
+        unlink( path );
+        free_segment( log->spare_segment );
+    }
+
+    while ( log->head != NULL )
+    {
+        LogBlock *next = log->head->next;
+        free( log->head );
+        log->head = next;
+    }
+    free( log->spare );
+    free( log->dir );
+    pthread_mutex_destroy( &log->mutex );
+    pthread_mutex_destroy( &log->flush_lock );
+    pthread_rwlock_destroy( &log->rwlock );
+    free( log );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  seg に size バイトを書き込める書き出し待ちブロックを返す。mutex を持った状態で呼ぶ
+ */
+static LogBlock *
+reserve_block_locked( MessageLog * log,
+                      Segment * seg,
+                      const size_t size )
+{
+    if ( log->tail != NULL
+         && log->tail->segment == seg
+         && log->tail->capacity - log->tail->len >= size )
+    {
+        return log->tail;
+    }
+
+    LogBlock *block = NULL;
+    if ( size <= LOG_BLOCK_SIZE )
+    {
+        block = log->spare;
+        log->spare = NULL;
+    }
+    if ( block == NULL )
+    {
+        const size_t capacity = ( size > LOG_BLOCK_SIZE ? size : LOG_BLOCK_SIZE );
+        block = malloc( sizeof( LogBlock ) + capacity );
+        if ( block == NULL )
+        {
+            perror( "malloc" );
+            return NULL;
+        }
+        block->capacity = capacity;
+    }
+    block->next = NULL;
+    block->segment = seg;
+    block->len = 0;
+
+    if ( log->tail == NULL ) log->head = block;
+    else log->tail->next = block;
+    log->tail = block;
+    return block;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_append( MessageLog * log,
+                    const time_t msg_time,
+                    const int sender_id,
+                    const uint32_t room,
+                    const char * msg,
+                    const size_t len )
+{
+    if ( len > MAX_RECORD_LEN )
+    {
+        fprintf( stderr, "ERROR: too long message for the log\n" );
+        return 0;
+    }
+    const size_t size = sizeof( RecordHeader ) + len;
+
+    pthread_mutex_lock( &log->mutex );
+
+    Segment *seg = log->segments[log->n_segments - 1];
+    if ( seg->append_end + size > log->segment_size
+         && seg->append_end > sizeof( SegmentHeader )
+         && ( log->spare_segment != NULL
+              || seg->append_end + size > seg->map_len ) )
+    {
+        // 入り切らないので次のセグメントに切り替える。古い方は次の flush で閉じられる。
+        // 次のセグメントは flush が先に作っておくので、ここではファイルに触れずに差し替えるだけにする。
+        // まだ用意されていなければ mmap の余白に収まる間は今のセグメントに書き続け、
+        // 余白も使い切った場合に限りここで作る
+        Segment *next = log->spare_segment;
+        if ( next != NULL )
+        {
+            log->spare_segment = NULL;
+            next->first_seq = log->last_ticket + 1;
+            next->last_seq = log->last_ticket;
+        }
+        else
+        {
+            next = create_segment( log, log->last_ticket + 1, 0 );
+        }
+        if ( next == NULL
+             || ! push_segment( log, next ) )
+        {
+            if ( next != NULL && next->spare_id != 0 ) log->spare_segment = next;
+            else if ( next != NULL ) free_segment( next );
+            pthread_mutex_unlock( &log->mutex );
+            return 0;
+        }
+        seg->sealed = 1;
+        seg = next;
+    }
+
+    LogBlock *block = reserve_block_locked( log, seg, size );
+    if ( block == NULL )
+    {
+        pthread_mutex_unlock( &log->mutex );
+        return 0;
+    }
+
+    const uint64_t seq = log->last_ticket + 1;
+    const uint64_t offset = seg->append_end;
+    if ( needs_index_entry( seg, offset )
+         && ! add_index_entry( log, seg, seq, msg_time, offset ) )
+    {
+        pthread_mutex_unlock( &log->mutex );
+        return 0;
+    }
+
+    RecordHeader h;
+    memset( &h, 0, sizeof( h ) );
+    h.len = (uint32_t)len;
+    h.seq = seq;
+    h.time = msg_time;
+    h.sender_id = sender_id;
+    h.room = room;
+    h.crc = record_crc( &h, msg );
+
+    memcpy( block->data + block->len, &h, sizeof( h ) );
+    memcpy( block->data + block->len + sizeof( h ), msg, len );
+    block->len += size;
+
+    seg->append_end += size;
+    seg->last_seq = seq;
+    log->last_ticket = seq;
+
+    pthread_mutex_unlock( &log->mutex );
+    return seq;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  blocks から stop の手前までを writev で書き切る。途中までしか書けなかった場合は続きから書き直す
+ */
+static int
+write_blocks( const int fd,
+              LogBlock * blocks,
+              const LogBlock * stop )
+{
+    LogBlock *block = blocks;
+    size_t skip = 0; // block の先頭で書き込み済みのバイト数
+
+    while ( block != stop )
+    {
+        struct iovec iov[MAX_LOG_IOV];
+        int n_iov = 0;
+        for ( LogBlock *b = block; b != stop && n_iov < MAX_LOG_IOV; b = b->next )
+        {
+            const size_t s = ( b == block ? skip : 0 );
+            iov[n_iov].iov_base = b->data + s;
+            iov[n_iov].iov_len = b->len - s;
+            ++n_iov;
+        }
+
+        ssize_t n = writev( fd, iov, n_iov );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            perror( "writev" );
+            return 0;
+        }
+
+        while ( block != stop
+                && (size_t)n >= block->len - skip )
+        {
+            n -= block->len - skip;
+            skip = 0;
+            block = block->next;
+        }
+        skip += n;
+    }
+
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  書き出し済みの範囲を指すインデックスを idx ファイルに追記する。flush_lock を持った状態で呼ぶ
+ */
+static void
+write_index_locked( MessageLog * log,
+                    Segment * seg )
+{
+    pthread_rwlock_rdlock( &log->rwlock );
+    uint32_t n = seg->n_index_written;
+    while ( n < seg->n_index
+            && seg->index[n].offset < seg->end )
+    {
+        ++n;
+    }
+    if ( n > seg->n_index_written )
+    {
+        const ssize_t size = sizeof( IndexEntry ) * ( n - seg->n_index_written );
+        if ( write( seg->idx_fd, seg->index + seg->n_index_written, size ) != size )
+        {
+            perror( "write" );
+        }
+        seg->n_index_written = n;
+    }
+    pthread_rwlock_unlock( &log->rwlock );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  書き終えた古いセグメントを閉じる。ここで fsync しておけば後は書き込み中のセグメントだけを見ればよい
+ */
+static void
+seal_segment_locked( MessageLog * log,
+                     Segment * seg )
+{
+    if ( log->policy != FSYNC_NONE )
+    {
+        if ( fdatasync( seg->fd ) != 0 )
+        {
+            perror( "fdatasync" );
+        }
+        else if ( log->synced_ticket < seg->last_seq )
+        {
+            log->synced_ticket = seg->last_seq;
+        }
+    }
+    close( seg->fd );
+    close( seg->idx_fd );
+    seg->fd = seg->idx_fd = -1;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+sync_locked( MessageLog * log )
+{
+    // flush_lock を持った状態で呼ぶ
+    if ( fdatasync( log->write_segment->fd ) != 0 )
+    {
+        perror( "fdatasync" );
+        return;
+    }
+    log->synced_ticket = log->written_ticket;
+    ++log->sync_count;
+    clock_gettime( CLOCK_MONOTONIC, &log->last_sync );
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+update_durable_locked( MessageLog * log )
+{
+    const uint64_t durable = ( log->policy == FSYNC_NONE
+                               ? log->written_ticket
+                               : log->synced_ticket );
+    __atomic_store_n( &log->durable_ticket, durable, __ATOMIC_RELEASE );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  切り替えた後の仮のセグメントにヘッダを書き、先頭のシーケンス番号の名前に変える。
+  レコードより先に呼ぶ。flush_lock を持った状態で呼ぶ
+ */
+static int
+name_segment_locked( MessageLog * log,
+                     Segment * seg )
+{
+    if ( ! write_segment_header( seg ) )
+    {
+        return 0;
+    }
+
+    char from[PATH_MAX];
+    char to[PATH_MAX];
+    spare_path( log, seg->spare_id, SEGMENT_SUFFIX, from, sizeof( from ) );
+    segment_path( log, seg->first_seq, SEGMENT_SUFFIX, to, sizeof( to ) );
+    if ( rename( from, to ) != 0 )
+    {
+        perror( from );
+        return 0;
+    }
+    spare_path( log, seg->spare_id, INDEX_SUFFIX, from, sizeof( from ) );
+    segment_path( log, seg->first_seq, INDEX_SUFFIX, to, sizeof( to ) );
+    if ( rename( from, to ) != 0 )
+    {
+        perror( from );
+        return 0;
+    }
+    seg->spare_id = 0;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  次のセグメントを仮の名前で作っておく。flush_lock を持った状態で呼ぶ
+ */
+static void
+prepare_spare_locked( MessageLog * log )
+{
+    pthread_mutex_lock( &log->mutex );
+    const int needed = ( log->spare_segment == NULL );
+    pthread_mutex_unlock( &log->mutex );
+    if ( ! needed )
+    {
+        return;
+    }
+
+    // 名前を毎回変えるので、まだ名前の決まっていない切り替え済みのセグメントと重ならない
+    Segment *seg = create_segment( log, 0, ++log->last_spare_id );
+    if ( seg == NULL )
+    {
+        return;
+    }
+    pthread_mutex_lock( &log->mutex );
+    log->spare_segment = seg;
+    pthread_mutex_unlock( &log->mutex );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+message_log_set_flush_hook( MessageLog * log,
+                            MessageLogFlushHook hook,
+                            void * arg )
+{
+    pthread_mutex_lock( &log->flush_lock );
+    log->flush_hook = hook;
+    log->flush_hook_arg = arg;
+    pthread_mutex_unlock( &log->flush_lock );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_flush( MessageLog * log )
+{
+    int ok = 1;
+
+    pthread_mutex_lock( &log->flush_lock );
+
+    // 溜まっている分を取り出してから、追記側を止めずに書き出す
+    pthread_mutex_lock( &log->mutex );
+    LogBlock *blocks = log->head;
+    const uint64_t ticket = log->last_ticket;
+    log->head = log->tail = NULL;
+    pthread_mutex_unlock( &log->mutex );
+
+    // 取り出したレコードが前提にするもの（部屋の対応表など）を先に書き出してもらう
+    if ( blocks != NULL
+         && log->flush_hook != NULL )
+    {
+        log->flush_hook( log->flush_hook_arg );
+    }
+
+    // 同じセグメントに属するブロックの並びごとに書き出す
+    LogBlock *block = blocks;
+    while ( ok && block != NULL )
+    {
+        Segment *seg = block->segment;
+        LogBlock *stop = block;
+        uint64_t bytes = 0;
+        while ( stop != NULL
+                && stop->segment == seg )
+        {
+            bytes += stop->len;
+            stop = stop->next;
+        }
+
+        if ( seg != log->write_segment )
+        {
+            // 次のセグメントに移ったので、それまでのセグメントは書き終わっている
+            seal_segment_locked( log, log->write_segment );
+            log->write_segment = seg;
+        }
+        if ( seg->spare_id != 0 )
+        {
+            ok = name_segment_locked( log, seg );
+            if ( ! ok ) break;
+        }
+
+        ok = write_blocks( seg->fd, block, stop );
+        if ( ok )
+        {
+            __atomic_store_n( &seg->end, seg->end + bytes, __ATOMIC_RELEASE );
+            write_index_locked( log, seg );
+        }
+        block = stop;
+    }
+    if ( ok && blocks != NULL )
+    {
+        __atomic_store_n( &log->written_ticket, ticket, __ATOMIC_RELEASE );
+    }
+
+    LogBlock *spare = NULL;
+    while ( blocks != NULL )
+    {
+        LogBlock *next = blocks->next;
+        if ( spare == NULL && blocks->capacity == LOG_BLOCK_SIZE ) spare = blocks;
+        else free( blocks );
+        blocks = next;
+    }
+    if ( spare != NULL )
+    {
+        pthread_mutex_lock( &log->mutex );
+        if ( log->spare == NULL ) log->spare = spare;
+        else free( spare );
+        pthread_mutex_unlock( &log->mutex );
+    }
+
+    if ( log->written_ticket > log->synced_ticket )
+    {
+        if ( log->policy == FSYNC_BATCH
+             || ( log->policy == FSYNC_INTERVAL
+                  && elapsed_ms( &log->last_sync ) >= log->interval_ms ) )
+        {
+            sync_locked( log );
+        }
+    }
+    update_durable_locked( log );
+
+    // 次に切り替えるセグメントをここで作っておく
+    prepare_spare_locked( log );
+
+    pthread_mutex_unlock( &log->flush_lock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_durable( MessageLog * log )
+{
+    return __atomic_load_n( &log->durable_ticket, __ATOMIC_ACQUIRE );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_delays_ack( const MessageLog * log )
+{
+    return log->policy == FSYNC_BATCH;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_policy( const MessageLog * log,
+                      FsyncPolicy * policy,
+                      int * interval_ms )
+{
+    if ( log == NULL )
+    {
+        return 0;
+    }
+    *policy = log->policy;
+    *interval_ms = log->interval_ms;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_sync_count( MessageLog * log )
+{
+    pthread_mutex_lock( &log->flush_lock );
+    const uint64_t n = log->sync_count;
+    pthread_mutex_unlock( &log->flush_lock );
+    return n;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_last_seq( MessageLog * log )
+{
+    return __atomic_load_n( &log->written_ticket, __ATOMIC_ACQUIRE );
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_last_appended( MessageLog * log )
+{
+    pthread_mutex_lock( &log->mutex );
+    const uint64_t seq = log->last_ticket;
+    pthread_mutex_unlock( &log->mutex );
+    return seq;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  seq を含むセグメントの番号を二分探索する。rwlock を持った状態で呼ぶ
+ */
+static int
+find_segment_locked( const MessageLog * log,
+                     const uint64_t seq )
+{
+    int lo = 0;
+    int hi = log->n_segments - 1;
+    if ( hi < 0
+         || seq < log->segments[0]->first_seq )
+    {
+        return -1;
+    }
+    while ( lo < hi )
+    {
+        const int mid = ( lo + hi + 1 ) / 2;
+        if ( log->segments[mid]->first_seq <= seq ) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  seq 以前で最も近いインデックスの位置を二分探索する。rwlock を持った状態で呼ぶ
+ */
+static uint64_t
+find_offset_locked( const Segment * seg,
+                    const uint64_t seq )
+{
+    if ( seg->n_index == 0
+         || seq < seg->index[0].seq )
+    {
+        return sizeof( SegmentHeader );
+    }
+    uint32_t lo = 0;
+    uint32_t hi = seg->n_index - 1;
+    while ( lo < hi )
+    {
+        const uint32_t mid = ( lo + hi + 1 ) / 2;
+        if ( seg->index[mid].seq <= seq ) lo = mid;
+        else hi = mid - 1;
+    }
+    return seg->index[lo].offset;
+}
+
+/* --------------------------------------------------------------------------- */
+static size_t
+read_record( const Segment * seg,
+             const uint64_t offset,
+             LogRecord * rec )
+{
+    RecordHeader h;
+    memcpy( &h, seg->map + offset, sizeof( h ) );
+    rec->seq = h.seq;
+    rec->time = (time_t)h.time;
+    rec->sender_id = h.sender_id;
+    rec->room = h.room;
+    rec->len = h.len;
+    rec->msg = seg->map + offset + sizeof( h );
+    return sizeof( h ) + h.len;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  カーソルを seq 番のレコードの位置に合わせる。rwlock を持った状態で呼ぶ
+ */
+static int
+seek_locked( MessageLog * log,
+             const uint64_t seq,
+             const uint64_t written,
+             LogCursor * cur )
+{
+    const int i = find_segment_locked( log, seq );
+    if ( i < 0 )
+    {
+        return 0;
+    }
+    const Segment *seg = log->segments[i];
+    const uint64_t end = __atomic_load_n( &seg->end, __ATOMIC_ACQUIRE );
+
+    cur->log = log;
+    cur->segment = i;
+    cur->seq = seq;
+    if ( seq > written )
+    {
+        // 末尾の次。以後の追記が書き出されれば読めるようになる
+        cur->offset = end;
+        return 1;
+    }
+
+    uint64_t offset = find_offset_locked( seg, seq );
+    while ( offset < end )
+    {
+        LogRecord rec;
+        const size_t size = read_record( seg, offset, &rec );
+        if ( rec.seq == seq )
+        {
+            cur->offset = offset;
+            return 1;
+        }
+        offset += size;
+    }
+    return 0;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_seek( MessageLog * log,
+                  const uint64_t seq,
+                  LogCursor * cur )
+{
+    const uint64_t written = message_log_last_seq( log );
+    if ( seq == 0
+         || seq > written + 1 )
+    {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock( &log->rwlock );
+    const int ok = seek_locked( log, seq, written, cur );
+    pthread_rwlock_unlock( &log->rwlock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_next( LogCursor * cur,
+                  LogRecord * rec )
+{
+    MessageLog *log = cur->log;
+    if ( cur->seq > message_log_last_seq( log ) )
+    {
+        return 0;
+    }
+
+    pthread_rwlock_rdlock( &log->rwlock );
+    for ( ;; )
+    {
+        const Segment *seg = log->segments[cur->segment];
+        if ( cur->offset < __atomic_load_n( &seg->end, __ATOMIC_ACQUIRE ) )
+        {
+            cur->offset += read_record( seg, cur->offset, rec );
+            cur->seq = rec->seq + 1;
+            break;
+        }
+        if ( cur->segment + 1 >= log->n_segments )
+        {
+            pthread_rwlock_unlock( &log->rwlock );
+            return 0;
+        }
+        ++cur->segment;
+        cur->offset = sizeof( SegmentHeader );
+    }
+    pthread_rwlock_unlock( &log->rwlock );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+message_log_read( MessageLog * log,
+                  const uint64_t seq,
+                  LogRecord * rec )
+{
+    LogCursor cur;
+    return ( seq <= message_log_last_seq( log )
+             && message_log_seek( log, seq, &cur )
+             && message_log_next( &cur, rec ) );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  書き出し済みの範囲にあるインデックスのうち、時刻が msg_time より前の最後の項目を二分探索する。
+  rwlock を持った状態で呼ぶ
+  ¥return 項目の位置。すべて msg_time 以降の場合は-1
+ */
+static int64_t
+find_index_before_locked( const Segment * seg,
+                          const time_t msg_time,
+                          const uint64_t written )
+{
+    int64_t lo = -1;
+    int64_t hi = (int64_t)seg->n_index - 1;
+    while ( hi >= 0 && seg->index[hi].seq > written )
+    {
+        --hi;
+    }
+    while ( lo < hi )
+    {
+        const int64_t mid = ( lo + hi + 1 ) / 2;
+        if ( seg->index[mid].time < msg_time ) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+message_log_find_time( MessageLog * log,
+                       const time_t msg_time )
+{
+    const uint64_t written = message_log_last_seq( log );
+
+    pthread_rwlock_rdlock( &log->rwlock );
+
+    // 先頭のメッセージが msg_time より前である最後のセグメントを探す
+    int lo = 0;
+    int hi = log->n_segments - 1;
+    while ( lo < hi )
+    {
+        const int mid = ( lo + hi + 1 ) / 2;
+        const Segment *seg = log->segments[mid];
+        if ( seg->n_index > 0
+             && seg->index[0].seq <= written
+             && seg->index[0].time < msg_time )
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    // セグメント内ではインデックスで近くまで飛び、そこから順に読む
+    LogCursor cur;
+    cur.log = log;
+    cur.segment = lo;
+    cur.seq = 0;
+    const Segment *seg = log->segments[lo];
+    const int64_t i = find_index_before_locked( seg, msg_time, written );
+    cur.offset = ( i < 0 ? sizeof( SegmentHeader ) : seg->index[i].offset );
+
+    pthread_rwlock_unlock( &log->rwlock );
+
+    LogRecord rec;
+    while ( message_log_next( &cur, &rec ) )
+    {
+        if ( rec.time >= msg_time )
+        {
+            return rec.seq;
+        }
+    }
+    return written + 1;
+}
+
+/* --------------------------------------------------------------------------- */
+long
+message_log_import_text( MessageLog * log,
+                         const char * text_file )
+{
+    FILE *fp = fopen( text_file, "r" );
+    if ( fp == NULL )
+    {
+        return -1;
+    }
+
+    char line[MAX_IMPORT_LINE];
+    long count = 0;
+    while ( fgets( line, sizeof( line ), fp ) != NULL )
+    {
+        long msg_time;
+        int sender_id;
+        int pos = 0;
+        if ( sscanf( line, "%ld %d %n", &msg_time, &sender_id, &pos ) < 2
+             || pos == 0 )
+        {
+            continue;
+        }
+
+        size_t len = strlen( line + pos );
+        if ( len > 0 && line[pos + len - 1] == '\n' )
+        {
+            --len;
+        }
+        if ( message_log_append( log, (time_t)msg_time, sender_id, 0, line + pos, len ) == 0 )
+        {
+            break;
+        }
+        // 溜めすぎないよう適当な間隔で書き出す
+        if ( ++count % 4096 == 0 )
+        {
+            message_log_flush( log );
+        }
+    }
+    fclose( fp );
+
+    message_log_flush( log );
+    return count;
+}
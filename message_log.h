@@ -0,0 +1,170 @@
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/*!
+  ¥brief セグメント分割されたバイナリ形式のメッセージログ。
+  ディレクトリの中に、先頭のシーケンス番号を名前にしたセグメントファイル (*.seg) と
+  その疎なオフセットインデックス (*.idx) を置く。各レコードは長さ・CRC32・シーケンス番号・
+  時刻・送信者を持つ固定長ヘッダと本文からなり、本文に改行を含んでもよい。
+  セグメントが一定の大きさを超えると次のセグメントへ切り替える。
+
+  書き込み側は追記をメモリに溜めて message_log_flush でまとめて writev する (グループコミット)。
+  読み出し側は各セグメントを mmap して読むので、返されるレコードの本文はログを閉じるまで有効。
+ */
+typedef struct MessageLog MessageLog;
+
+typedef enum {
+    FSYNC_NONE, //!< fsync しない。書き込みが終われば確定とみなす
+    FSYNC_INTERVAL, //!< 前回の fsync から一定時間経っていれば flush 時に fsync する
+    FSYNC_BATCH, //!< flush のたびに fsync する
+} FsyncPolicy;
+
+/*!
+  ¥brief ログから読み出したメッセージ1件
+ */
+typedef struct {
+    uint64_t seq; //!< 1から始まる通し番号
+    time_t time;
+    int sender_id;
+    uint32_t room; //!< 部屋の番号。0 は全員宛て
+    uint32_t len; //!< 本文の長さ
+    const char *msg; //!< 本文。終端文字は付かない
+} LogRecord;
+
+/*!
+  ¥brief ログを先頭から順に読むための位置
+ */
+typedef struct {
+    MessageLog *log;
+    int segment;
+    uint64_t offset;
+    uint64_t seq; //!< 次に読むレコードのシーケンス番号
+} LogCursor;
+
+#define DEFAULT_SEGMENT_SIZE ( 64 * 1024 * 1024 )
+
+/*!
+  ¥brief "none", "batch", またはミリ秒の数値で与えられた fsync 方針を解釈する
+  ¥param str 方針を表す文字列
+  ¥param policy 結果の方針
+  ¥param interval_ms FSYNC_INTERVAL の場合の間隔
+  ¥return 解釈できた場合は1
+ */
+int message_log_parse_policy( const char * str, FsyncPolicy * policy, int * interval_ms );
+
+/*!
+  ¥brief ログのディレクトリを開く。無ければ作成する。
+  最後のセグメントの末尾にある書きかけのレコードは切り捨てられる
+  ¥param dir ログのディレクトリ
+  ¥param policy fsync の方針
+  ¥param interval_ms FSYNC_INTERVAL の場合の間隔（ミリ秒）
+  ¥param segment_size セグメントを切り替える大きさ（バイト）
+  ¥return 作成されたログ。エラーの場合は NULL
+ */
+MessageLog * message_log_open( const char * dir, const FsyncPolicy policy, const int interval_ms,
+                               const uint64_t segment_size );
+
+/*!
+  ¥brief 溜まっている分を書き出して fsync し、ログを閉じる
+ */
+void message_log_close( MessageLog * log );
+
+/*!
+  ¥brief メッセージを1件追記する。実際の書き込みは次の message_log_flush で行われる
+  ¥param room 部屋の番号
+  ¥param msg 本文
+  ¥param len 本文の長さ
+  ¥return 割り当てたシーケンス番号。エラーの場合は0
+ */
+uint64_t message_log_append( MessageLog * log, const time_t msg_time, const int sender_id,
+                             const uint32_t room, const char * msg, const size_t len );
+
+/*!
+  ¥brief message_log_flush が書き出すレコードを取り出した後、ファイルへ書く前に呼ぶ関数
+  ¥param arg message_log_set_flush_hook に渡した引数
+ */
+typedef void (*MessageLogFlushHook)( void * arg );
+
+/*!
+  ¥brief 書き出しの前に呼ぶ関数を登録する。取り出したレコードが前提にするもの（部屋の対応表など）を
+  ログより先にファイルへ書くために使う。flush を呼んだスレッドで呼ばれる
+  ¥param hook 登録する関数。NULL なら登録を消す
+ */
+void message_log_set_flush_hook( MessageLog * log, MessageLogFlushHook hook, void * arg );
+
+/*!
+  ¥brief 溜まっている追記を writev で書き出し、方針に従って fsync する。
+  FSYNC_INTERVAL では追記が無くても期限が来ていれば fsync するので、定期的に呼ぶこと。
+  複数スレッドから呼んでよく、戻った時点でそれまでに追記された分は書き出し済みになる。
+  次に切り替えるセグメントもここで作っておき、追記側はファイルを開かずに切り替える
+  ¥return 成功した場合は1
+ */
+int message_log_flush( MessageLog * log );
+
+/*!
+  ¥brief 確定済み（方針に従い fsync まで終わった）の最後のシーケンス番号を返す
+ */
+uint64_t message_log_durable( MessageLog * log );
+
+/*!
+  ¥brief 確定を待ってから返信すべき方針かどうか
+ */
+int message_log_delays_ack( const MessageLog * log );
+
+/*!
+  ¥brief fsync の方針を返す
+  ¥return log が NULL の場合は0
+ */
+int message_log_policy( const MessageLog * log, FsyncPolicy * policy, int * interval_ms );
+
+/*!
+  ¥brief これまでに fsync した回数を返す
+ */
+uint64_t message_log_sync_count( MessageLog * log );
+
+/*!
+  ¥brief 読み出せる（書き出し済みの）最後のシーケンス番号を返す。空の場合は0
+ */
+uint64_t message_log_last_seq( MessageLog * log );
+
+/*!
+  ¥brief 追記した最後のシーケンス番号を返す。まだ書き出していないものも含む。空の場合は0
+ */
+uint64_t message_log_last_appended( MessageLog * log );
+
+/*!
+  ¥brief シーケンス番号を指定して1件読む
+  ¥return 読めた場合は1
+ */
+int message_log_read( MessageLog * log, const uint64_t seq, LogRecord * rec );
+
+/*!
+  ¥brief seq 番のレコードから読み始めるカーソルを作る
+  ¥return seq が読み出せる範囲にあれば1
+ */
+int message_log_seek( MessageLog * log, const uint64_t seq, LogCursor * cur );
+
+/*!
+  ¥brief カーソルの位置のレコードを読み、カーソルを次へ進める
+  ¥return 読めた場合は1、書き出し済みの末尾に達した場合は0
+ */
+int message_log_next( LogCursor * cur, LogRecord * rec );
+
+/*!
+  ¥brief 時刻が msg_time 以上である最初のメッセージを、セグメントと疎インデックスの二分探索で求める。
+  時刻はシーケンス番号に対して単調非減少であることを前提とする
+  ¥return そのシーケンス番号。該当するメッセージが無い場合は読み出せる最後のシーケンス番号 + 1
+ */
+uint64_t message_log_find_time( MessageLog * log, const time_t msg_time );
+
+/*!
+  ¥brief "時刻 ID 本文" 形式の旧テキストログを読み込んで追記する
+  ¥return 追記した件数。ファイルが開けない場合は-1
+ */
+long message_log_import_text( MessageLog * log, const char * text_file );
+
+#endif
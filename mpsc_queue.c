@@ -0,0 +1,69 @@
+
+#include "mpsc_queue.h"
+
+#include <stddef.h>
+
+/* --------------------------------------------------------------------------- */
+void
+mpsc_queue_init( MpscQueue * q )
+{
+    q->stub.next = NULL;
+    q->head = &q->stub;
+    q->tail = &q->stub;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+mpsc_queue_push( MpscQueue * q,
+                 MpscNode * node )
+{
+    __atomic_store_n( &node->next, NULL, __ATOMIC_RELAXED );
+
+    // 末尾を入れ替えてから、直前の要素に次の要素をつなぐ
+    MpscNode *prev = __atomic_exchange_n( &q->head, node, __ATOMIC_ACQ_REL );
+    __atomic_store_n( &prev->next, node, __ATOMIC_RELEASE );
+}
+
+/* --------------------------------------------------------------------------- */
+MpscNode *
+mpsc_queue_pop( MpscQueue * q )
+{
+    MpscNode *tail = q->tail;
+    MpscNode *next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
+
+    // 番兵は読み飛ばす
+    if ( tail == &q->stub )
+    {
+        if ( next == NULL )
+        {
+            return NULL;
+        }
+        q->tail = next;
+        tail = next;
+        next = __atomic_load_n( &next->next, __ATOMIC_ACQUIRE );
+    }
+
+    if ( next != NULL )
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    // 他スレッドの push がつなぎ終わっていない
+    MpscNode *head = __atomic_load_n( &q->head, __ATOMIC_ACQUIRE );
+    if ( tail != head )
+    {
+        return NULL;
+    }
+
+    // 最後の1要素を取り出すため番兵を入れ直す
+    mpsc_queue_push( q, &q->stub );
+    next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
+    if ( next != NULL )
+    {
+        q->tail = next;
+        return tail;
+    }
+
+    return NULL;
+}
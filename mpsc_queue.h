@@ -0,0 +1,38 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+/*!
+  ¥brief 複数スレッドから push し、1つのスレッドだけが pop するロックフリーキュー
+  (Vyukov 方式の侵入型キュー)。要素の構造体の先頭に MpscNode を埋め込んで使う。
+ */
+typedef struct MpscNode {
+    struct MpscNode *next;
+} MpscNode;
+
+typedef struct {
+    MpscNode *head; // producer 側が追加する末尾
+    MpscNode *tail; // consumer 側が取り出す先頭
+    MpscNode stub;
+} MpscQueue;
+
+/*!
+  ¥brief キューを空の状態に初期化する
+  ¥param q 初期化するキュー
+ */
+void mpsc_queue_init( MpscQueue * q );
+
+/*!
+  ¥brief 要素を末尾に追加する。どのスレッドから呼んでもよい
+  ¥param q 追加先のキュー
+  ¥param node 追加する要素
+ */
+void mpsc_queue_push( MpscQueue * q, MpscNode * node );
+
+/*!
+  ¥brief 先頭の要素を取り出す。consumer スレッドからのみ呼ぶこと
+  ¥param q 取り出し元のキュー
+  ¥return 取り出した要素。空の場合(または push が途中の場合)は NULL
+ */
+MpscNode * mpsc_queue_pop( MpscQueue * q );
+
+#endif
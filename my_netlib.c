@@ -6,11 +6,46 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+static int create_listen_socket( const char * port_number, const int reuse_port );
+
 /* --------------------------------------------------------------------------- */
 int
 create_server_socket( const char * port_number )
+{
+    return create_listen_socket( port_number, 0 );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+create_server_sockets( const char * port_number,
+                       int * sockets,
+                       const int n )
+{
+    for ( int i = 0; i < n; ++i )
+    {
+        // 1つだけなら SO_REUSEPORT は不要
+        sockets[i] = create_listen_socket( port_number, n > 1 );
+        if ( sockets[i] < 0 )
+        {
+            for ( int j = 0; j < i; ++j )
+            {
+                close( sockets[j] );
+                sockets[j] = -1;
+            }
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+create_listen_socket( const char * port_number,
+                      const int reuse_port )
 {
     const int MAX_QUEUE = SOMAXCONN;
     int server_socket = -1;
@@ -52,6 +87,16 @@ create_server_socket( const char * port_number )
             close( server_socket );
             return -1;
         }
+
+        // 複数のソケットで同じポートを待ち受けられるように設定
+        if ( reuse_port
+             && setsockopt( server_socket, SOL_SOCKET, SO_REUSEPORT, (const char *)&yes, sizeof( yes ) ) != 0 )
+        {
+            perror( "setsockopt" );
+            freeaddrinfo( my_address );
+            close( server_socket );
+            return -1;
+        }
     }
 
     // ソケットに命名
@@ -87,10 +132,12 @@ get_datetime_string( char *result,
                      const int size )
 {
    time_t t;
+   struct tm tm_buf;
    struct tm *tmp;
 
+   // 複数スレッドから呼ばれるので localtime_r を使う
    t = time( NULL );
-   tmp = localtime( &t );
+   tmp = localtime_r( &t, &tm_buf );
 
    if ( tmp == NULL )
    {
@@ -127,7 +174,7 @@ connect_to_server( const char * hostname,
     if ( err != 0 )
     {
         fprintf( stderr, "getaddrinfo %d : %s\n", err, gai_strerror( err ) );
-        return 1;
+        return -1;
     }
 
     // 接続先アドレス情報を用いてソケットを作成しconnect
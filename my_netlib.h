@@ -8,6 +8,16 @@
  */
 int create_server_socket( const char * port_number );
 
+/*!
+  ¥brief 同じポートで待ち受けるソケットを SO_REUSEPORT を付けて複数作成する。
+  カーネルが新しい接続を各ソケットへ振り分ける
+  ¥param port_number 待ち受けするポート番号（またはサービス名）を文字列で与える
+  ¥param sockets 作成されたソケットのファイルディスクリプタを格納する配列
+  ¥param n 作成するソケットの数
+  ¥return 成功した場合は1、失敗した場合は0（作成済みのソケットは閉じられる）
+ */
+int create_server_sockets( const char * port_number, int * sockets, const int n );
+
 /*!
   ¥brief 現在日時の文字列を取得する
   ¥param result 結果を格納する文字列へのポインタ
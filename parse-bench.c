@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "command_parser.h"
+
+/*
+  コマンド解析1回あたりの時間を測る。
+  legacy は従来の sscanf( "(%127[^)]" ) と strncmp の連鎖で種類を決め、各コマンドで再度 sscanf する方式。
+  tokenizer は command_parse で1回だけ走査し、引数を StrView から取り出す方式。
+ */
+
+static const char *commands[] = {
+    "(msg \"hello everyone, this is a typical chat message\")",
+    "(find \"typical\")",
+    "(history 10)",
+    "(history-since 1700000000 50)",
+    "(time)",
+    "(hello)",
+};
+#define N_COMMANDS ( sizeof( commands ) / sizeof( commands[0] ) )
+
+static volatile long sink; // 最適化で消されないように結果を書き込む
+
+/* ------------------------------------------------------- */
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* ------------------------------------------------------- */
+static Command
+legacy_parse_command( const char *msg )
+{
+    if ( strncmp( msg, COMMAND_MESSAGE, strlen( COMMAND_MESSAGE ) ) == 0 ) return CMD_MESSAGE;
+    else if ( strncmp( msg, COMMAND_FIND, strlen( COMMAND_FIND ) ) == 0 ) return CMD_FIND;
+    else if ( strncmp( msg, COMMAND_HISTORY_SINCE, strlen( COMMAND_HISTORY_SINCE ) ) == 0 ) return CMD_HISTORY_SINCE;
+    else if ( strncmp( msg, COMMAND_HISTORY_RANGE, strlen( COMMAND_HISTORY_RANGE ) ) == 0 ) return CMD_HISTORY_RANGE;
+    else if ( strncmp( msg, COMMAND_HISTORY, strlen( COMMAND_HISTORY ) ) == 0 ) return CMD_HISTORY;
+    else if ( strncmp( msg, COMMAND_TIME, strlen( COMMAND_TIME ) ) == 0 ) return CMD_TIME;
+    else if ( strncmp( msg, COMMAND_HELLO, strlen( COMMAND_HELLO ) ) == 0 ) return CMD_HELLO;
+    else if ( strncmp( msg, COMMAND_QUIT, strlen( COMMAND_QUIT ) ) == 0 ) return CMD_QUIT;
+    return CMD_UNKNOWN;
+}
+
+/* ------------------------------------------------------- */
+static long
+legacy_parse( const char *line )
+{
+    char com[128];
+    char text[512];
+    long a = 0;
+    int b = 0;
+
+    if ( sscanf( line, "(%127[^)]", com ) != 1 )
+    {
+        return -1;
+    }
+
+    switch ( legacy_parse_command( com ) ) {
+    case CMD_MESSAGE:
+        if ( sscanf( line, "("COMMAND_MESSAGE" \"%511[^\"]\")", text ) != 1 ) return -1;
+        return (long)strlen( text );
+    case CMD_FIND:
+        if ( sscanf( line, "("COMMAND_FIND" \"%511[^\"]\")", text ) != 1 ) return -1;
+        return (long)strlen( text );
+    case CMD_HISTORY:
+        if ( sscanf( line, "("COMMAND_HISTORY" %d)", &b ) != 1 ) return -1;
+        return b;
+    case CMD_HISTORY_SINCE:
+        if ( sscanf( line, "("COMMAND_HISTORY_SINCE" %ld %d)", &a, &b ) < 1 ) return -1;
+        return a + b;
+    case CMD_TIME:
+        return strncmp( line, "("COMMAND_TIME")", strlen( COMMAND_TIME ) + 2 );
+    case CMD_HELLO:
+        return strncmp( line, "("COMMAND_HELLO")", strlen( COMMAND_HELLO ) + 2 );
+    default:
+        return -1;
+    }
+}
+
+/* ------------------------------------------------------- */
+static long
+tokenizer_parse( const char *line, const size_t len )
+{
+    ParsedCommand cmd;
+    char text[512];
+    long a = 0;
+    long b = 0;
+
+    if ( ! command_parse( line, len, &cmd ) )
+    {
+        return -1;
+    }
+
+    switch ( cmd.command ) {
+    case CMD_MESSAGE:
+    case CMD_FIND:
+        return command_arg_string( &cmd, 0, text, sizeof( text ) );
+    case CMD_HISTORY:
+        return command_arg_long( &cmd, 0, &b ) ? b : -1;
+    case CMD_HISTORY_SINCE:
+        if ( ! command_arg_long( &cmd, 0, &a ) ) return -1;
+        if ( cmd.n_args == 2 && ! command_arg_long( &cmd, 1, &b ) ) return -1;
+        return a + b;
+    case CMD_TIME:
+    case CMD_HELLO:
+        return cmd.n_args;
+    default:
+        return -1;
+    }
+}
+
+/* ------------------------------------------------------- */
+int
+main( int argc, char **argv )
+{
+    int iterations = 1000000;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "n:h" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 'n': iterations = atoi( optarg ); break;
+        default:
+            fprintf( stderr, "Usage: %s [-n iterations]\n", argv[0] );
+            return 1;
+        }
+    }
+    if ( iterations <= 0 )
+    {
+        fprintf( stderr, "illegal arguments\n" );
+        return 1;
+    }
+
+    for ( size_t c = 0; c < N_COMMANDS; ++c )
+    {
+        const char *line = commands[c];
+        const size_t len = strlen( line );
+        char name[32];
+        sscanf( line, "(%31[^ )]", name );
+
+        double start = now_sec();
+        for ( int i = 0; i < iterations; ++i )
+        {
+            sink += legacy_parse( line );
+        }
+        const double legacy_ns = ( now_sec() - start ) * 1e9 / iterations;
+
+        start = now_sec();
+        for ( int i = 0; i < iterations; ++i )
+        {
+            sink += tokenizer_parse( line, len );
+        }
+        const double tokenizer_ns = ( now_sec() - start ) * 1e9 / iterations;
+
+        // 比較しやすいように1行1ケースの key=value 形式で出力する
+        printf( "command=%s legacy_ns=%.1f tokenizer_ns=%.1f speedup=%.2f\n",
+                name, legacy_ns, tokenizer_ns, legacy_ns / tokenizer_ns );
+    }
+
+    return 0;
+}
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "my_netlib.h"
+#include "command_parser.h"
+
+/*
+  (resume) でメッセージを取りこぼしたり二重に受け取ったりしないかを確かめる。
+  送信用の接続から全員宛てのメッセージを送り続けながら、受信用の接続を切っては (resume) で引き継ぐことを繰り返す。
+  送信側はメッセージを BURST 件ずつまとめて送るので、サーバでは追記したがまだ書き出していないメッセージがある間に
+  (resume) を処理することが多くなる。
+  受信側は (resumed ...) までに届いたものを chat-client と同じくシーケンス番号で並べて重複を除き、
+  それ以降はシーケンス番号が1ずつ増えて届くことを確かめる。
+  ログには送信側のメッセージしか無い前提なので、ほかのクライアントがいないサーバに対して使う。
+  -R を付けると受信側が部屋に参加し、メモリ上の履歴でなくワーカーがログから送り直す経路を通る。
+ */
+
+#define IN_BUFSIZE 65536
+#define BURST 16 // 送信側が1回の send で送るメッセージ数
+#define BURST_INTERVAL_US 100000 // 1接続あたり毎秒 160 件。既定の --rate-limit に収まる
+#define LINE_TIMEOUT_MS 5000 // (resumed ...) などを待つ上限
+#define MAX_HELD 100000 // (resumed ...) までに溜めるメッセージの上限
+#define ROOM_NAME "resumecheck"
+
+typedef struct {
+    int fd;
+    char buf[IN_BUFSIZE];
+    size_t len;
+} LineReader;
+
+static const char *host = "127.0.0.1";
+static const char *port = "21044";
+static volatile int stopping = 0;
+
+/* ------------------------------------------------------- */
+static uint64_t
+monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ------------------------------------------------------- */
+static int
+send_all( const int fd,
+          const char *buf,
+          const size_t len )
+{
+    size_t sent = 0;
+    while ( sent < len )
+    {
+        const ssize_t n = send( fd, buf + sent, len - sent, MSG_NOSIGNAL );
+        if ( n < 0 )
+        {
+            if ( errno == EINTR ) continue;
+            return 0;
+        }
+        sent += n;
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  1行を読む。timeout_ms の間に届かなければ0、切断やエラーなら-1を返す。
+ */
+static int
+read_line( LineReader *r,
+           char *line,
+           const size_t size,
+           const int timeout_ms )
+{
+    const uint64_t deadline = monotonic_ms() + timeout_ms;
+    for ( ;; )
+    {
+        char *nl = memchr( r->buf, '\n', r->len );
+        if ( nl != NULL )
+        {
+            const size_t n = nl - r->buf;
+            const size_t copy = ( n < size - 1 ? n : size - 1 );
+            memcpy( line, r->buf, copy );
+            line[copy] = '\0';
+            memmove( r->buf, nl + 1, r->len - n - 1 );
+            r->len -= n + 1;
+            return 1;
+        }
+        if ( r->len == sizeof( r->buf ) )
+        {
+            return -1;
+        }
+
+        const uint64_t now = monotonic_ms();
+        if ( now >= deadline )
+        {
+            return 0;
+        }
+        struct pollfd pfd = { .fd = r->fd, .events = POLLIN };
+        const int ready = poll( &pfd, 1, (int)( deadline - now ) );
+        if ( ready < 0 && errno != EINTR )
+        {
+            return -1;
+        }
+        if ( ready <= 0 )
+        {
+            continue;
+        }
+        const ssize_t n = recv( r->fd, r->buf + r->len, sizeof( r->buf ) - r->len, 0 );
+        if ( n <= 0 )
+        {
+            return -1;
+        }
+        r->len += n;
+    }
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (msg TIME SENDER "本文" SEQ) ならシーケンス番号を返す。それ以外は0
+ */
+static uint64_t
+message_seq( const char *line )
+{
+    ParsedCommand cmd;
+    long seq;
+    if ( ! command_parse( line, strlen( line ), &cmd )
+         || cmd.command != CMD_MESSAGE
+         || cmd.n_args != 4
+         || ! command_arg_long( &cmd, 3, &seq )
+         || seq <= 0 )
+    {
+        return 0;
+    }
+    return (uint64_t)seq;
+}
+
+/* ------------------------------------------------------- */
+static int
+compare_u64( const void *a,
+             const void *b )
+{
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return ( x < y ? -1 : x > y );
+}
+
+/* ------------------------------------------------------- */
+/*!
+  送信側のスレッド。全員宛てのメッセージをまとめて送り、届くブロードキャストは読み捨てる
+ */
+static void *
+sender_main( void *arg )
+{
+    const int id = (int)(intptr_t)arg;
+    const int fd = connect_to_server( host, port );
+    if ( fd < 0 )
+    {
+        fprintf( stderr, "sender %d: could not connect\n", id );
+        stopping = 1;
+        return NULL;
+    }
+
+    char drain[IN_BUFSIZE];
+    char burst[BURST * 64];
+    uint64_t n = 0;
+    while ( ! stopping )
+    {
+        size_t len = 0;
+        for ( int i = 0; i < BURST; ++i )
+        {
+            len += snprintf( burst + len, sizeof( burst ) - len, "(msg \"check %d %llu\")\n",
+                             id, (unsigned long long)n++ );
+        }
+        if ( ! send_all( fd, burst, len ) )
+        {
+            fprintf( stderr, "sender %d: disconnected\n", id );
+            stopping = 1;
+            break;
+        }
+        while ( recv( fd, drain, sizeof( drain ), MSG_DONTWAIT ) > 0 )
+        {
+        }
+        usleep( BURST_INTERVAL_US );
+    }
+    close( fd );
+    return NULL;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  (hello) を送って (hello ID [mode] TOKEN SEQ) を待ち、トークンと最後のシーケンス番号を取り出す
+ */
+static int
+say_hello( LineReader *r,
+           char *token,
+           const size_t size,
+           uint64_t *last_seq )
+{
+    char line[IN_BUFSIZE];
+    if ( ! send_all( r->fd, "(hello)\n", strlen( "(hello)\n" ) ) )
+    {
+        return 0;
+    }
+    while ( read_line( r, line, sizeof( line ), LINE_TIMEOUT_MS ) == 1 )
+    {
+        ParsedCommand cmd;
+        long seq;
+        if ( command_parse( line, strlen( line ), &cmd )
+             && cmd.command == CMD_HELLO )
+        {
+            if ( cmd.n_args != 3
+                 || cmd.args[1].text.len >= size
+                 || ! command_arg_long( &cmd, 2, &seq ) )
+            {
+                fprintf( stderr, "unexpected hello: [%s]\n", line );
+                return 0;
+            }
+            memcpy( token, cmd.args[1].text.ptr, cmd.args[1].text.len );
+            token[cmd.args[1].text.len] = '\0';
+            *last_seq = (uint64_t)seq;
+            return 1;
+        }
+    }
+    fprintf( stderr, "no reply to hello\n" );
+    return 0;
+}
+
+/* ------------------------------------------------------- */
+/*!
+  受信したメッセージを確かめる。expected より前なら重複、後なら取りこぼし
+ */
+static int
+check_seq( const uint64_t seq,
+           uint64_t *expected,
+           const int round )
+{
+    if ( seq != *expected )
+    {
+        fprintf( stderr, "round %d: expected seq %llu but received %llu (%s)\n", round,
+                 (unsigned long long)*expected, (unsigned long long)seq,
+                 ( seq < *expected ? "duplicate" : "missing" ) );
+        return 0;
+    }
+    ++*expected;
+    return 1;
+}
+
+/* ------------------------------------------------------- */
+int
+main( int argc,
+      char *argv[] )
+{
+    int n_rounds = 300;
+    int n_senders = 32;
+    int use_room = 0;
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "s:p:n:c:Rh" ) ) != -1 )
+    {
+        switch ( opt ) {
+        case 's': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 'n': n_rounds = atoi( optarg ); break;
+        case 'c': n_senders = atoi( optarg ); break;
+        case 'R': use_room = 1; break;
+        default:
+            fprintf( stderr, "Usage: %s [-s host] [-p port] [-n rounds] [-c senders] [-R]\n", argv[0] );
+            return 1;
+        }
+    }
+    if ( n_rounds <= 0 || n_senders <= 0 )
+    {
+        fprintf( stderr, "illegal arguments\n" );
+        return 1;
+    }
+    signal( SIGPIPE, SIG_IGN );
+
+    static LineReader reader;
+    static uint64_t held[MAX_HELD];
+    char line[IN_BUFSIZE];
+    char token[128];
+    char request[256];
+    uint64_t expected;
+
+    reader.fd = connect_to_server( host, port );
+    if ( reader.fd < 0
+         || ! say_hello( &reader, token, sizeof( token ), &expected ) )
+    {
+        return 1;
+    }
+    ++expected;
+    if ( use_room )
+    {
+        send_all( reader.fd, "(join " ROOM_NAME ")\n", strlen( "(join " ROOM_NAME ")\n" ) );
+    }
+
+    pthread_t *senders = calloc( n_senders, sizeof( pthread_t ) );
+    for ( int i = 0; i < n_senders; ++i )
+    {
+        pthread_create( &senders[i], NULL, sender_main, (void *)(intptr_t)i );
+    }
+
+    int ok = 1;
+    uint64_t n_received = 0;
+    for ( int round = 1; ok && round <= n_rounds && ! stopping; ++round )
+    {
+        // しばらくは通常どおり受け取る
+        const uint64_t until = monotonic_ms() + 20 + rand() % 30;
+        uint64_t now;
+        while ( ok && ( now = monotonic_ms() ) < until )
+        {
+            const int got = read_line( &reader, line, sizeof( line ), (int)( until - now ) );
+            if ( got < 0 )
+            {
+                fprintf( stderr, "round %d: disconnected\n", round );
+                ok = 0;
+            }
+            else if ( got > 0 && message_seq( line ) != 0 )
+            {
+                ok = check_seq( message_seq( line ), &expected, round );
+                ++n_received;
+            }
+        }
+        if ( ! ok ) break;
+
+        // 切断して、すぐに別の接続から引き継ぐ
+        close( reader.fd );
+        reader.len = 0;
+        reader.fd = connect_to_server( host, port );
+        if ( reader.fd < 0 )
+        {
+            fprintf( stderr, "round %d: could not reconnect\n", round );
+            ok = 0;
+            break;
+        }
+        snprintf( request, sizeof( request ), "(hello)\n(resume %s %llu)\n", token,
+                  (unsigned long long)( expected - 1 ) );
+        send_all( reader.fd, request, strlen( request ) );
+
+        // (resumed ...) までは送り直しと新しいブロードキャストが重なりうるので、並べて重複を除く
+        int n_held = 0;
+        int resumed = 0;
+        while ( ok && ! resumed )
+        {
+            if ( read_line( &reader, line, sizeof( line ), LINE_TIMEOUT_MS ) != 1 )
+            {
+                fprintf( stderr, "round %d: no (resumed ...)\n", round );
+                ok = 0;
+            }
+            else if ( strncmp( line, "(resumed ", 9 ) == 0 )
+            {
+                resumed = 1;
+            }
+            else if ( strncmp( line, "(error", 6 ) == 0
+                      || strncmp( line, "(gap", 4 ) == 0 )
+            {
+                fprintf( stderr, "round %d: %s\n", round, line );
+                ok = 0;
+            }
+            else if ( message_seq( line ) != 0 )
+            {
+                if ( n_held == MAX_HELD )
+                {
+                    fprintf( stderr, "round %d: too many messages before (resumed ...)\n", round );
+                    ok = 0;
+                    break;
+                }
+                held[n_held++] = message_seq( line );
+            }
+        }
+        if ( ! ok ) break;
+
+        qsort( held, n_held, sizeof( uint64_t ), compare_u64 );
+        for ( int i = 0; ok && i < n_held; ++i )
+        {
+            if ( held[i] < expected ) continue; // 重複
+            ok = check_seq( held[i], &expected, round );
+            ++n_received;
+        }
+    }
+
+    stopping = 1;
+    for ( int i = 0; i < n_senders; ++i )
+    {
+        pthread_join( senders[i], NULL );
+    }
+    free( senders );
+    close( reader.fd );
+
+    if ( ! ok )
+    {
+        fprintf( stdout, "resume-check: FAILED after %llu messages\n", (unsigned long long)n_received );
+        return 1;
+    }
+    fprintf( stdout, "resume-check: %d rounds, %llu messages, OK\n", n_rounds, (unsigned long long)n_received );
+    return 0;
+}
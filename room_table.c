@@ -0,0 +1,577 @@
+
+#include "room_table.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_SLOT_BITS 6
+#define MAX_LINE 256
+
+typedef struct {
+    uint32_t id;
+    char name[MAX_ROOM_NAME + 1];
+    size_t name_len;
+
+    // この部屋のメッセージのシーケンス番号の昇順リスト
+    uint64_t *seqs;
+    size_t n_seqs;
+    size_t seqs_capacity;
+} Room;
+
+struct RoomTable {
+    pthread_rwlock_t lock;
+
+    char *file; // 対応表。部屋を作るたびに "番号 名前" の行を追記する
+
+    // まだファイルに書いていない行。room_table_flush がまとめて書き出す
+    pthread_mutex_t pending_lock;
+    char *pending;
+    size_t pending_len;
+    size_t pending_capacity;
+    pthread_mutex_t write_lock; // ファイルへの書き出しを1つずつにする
+
+    // 番号を添字とする部屋の配列。Room 自体は閉じるまで動かさない
+    Room **rooms;
+    uint32_t n_rooms;
+    uint32_t rooms_capacity;
+
+    // 部屋名 -> 番号のオープンアドレス法のハッシュ表。0 は空きを表す
+    uint32_t *slots;
+    uint32_t slot_bits;
+};
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+hash_name( const char * name,
+           const size_t len,
+           const uint32_t bits )
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        h = ( h ^ (unsigned char)name[i] ) * 16777619u;
+    }
+    return ( h * 2654435761u ) >> ( 32 - bits );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  名前の部屋を探す。見つからなければ空きのスロットを返す。ロックを持った状態で呼ぶ
+ */
+static uint32_t *
+find_slot( const RoomTable * table,
+           const char * name,
+           const size_t len )
+{
+    const uint32_t mask = ( 1u << table->slot_bits ) - 1;
+    uint32_t i = hash_name( name, len, table->slot_bits );
+    for ( ;; )
+    {
+        uint32_t *slot = &table->slots[i];
+        if ( *slot == 0 )
+        {
+            return slot;
+        }
+
+        const Room *room = table->rooms[*slot];
+        if ( room->name_len == len
+             && memcmp( room->name, name, len ) == 0 )
+        {
+            return slot;
+        }
+        i = ( i + 1 ) & mask;
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  部屋数に対してハッシュ表が半分を超えたら倍に広げる。ロックを持った状態で呼ぶ
+ */
+static int
+grow_slots( RoomTable * table )
+{
+    if ( table->n_rooms * 2 < ( 1u << table->slot_bits ) )
+    {
+        return 1;
+    }
+
+    const uint32_t new_bits = table->slot_bits + 1;
+    uint32_t *slots = calloc( 1u << new_bits, sizeof( uint32_t ) );
+    if ( slots == NULL )
+    {
+        perror( "calloc" );
+        return 0;
+    }
+
+    free( table->slots );
+    table->slots = slots;
+    table->slot_bits = new_bits;
+    for ( uint32_t id = 1; id < table->n_rooms; ++id )
+    {
+        *find_slot( table, table->rooms[id]->name, table->rooms[id]->name_len ) = id;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  次の番号で部屋を配列に加える。ロックを持った状態で呼ぶ
+ */
+static Room *
+add_room( RoomTable * table,
+          const char * name,
+          const size_t len )
+{
+    if ( table->n_rooms >= table->rooms_capacity )
+    {
+        const uint32_t new_capacity = ( table->rooms_capacity == 0 ? 16 : table->rooms_capacity * 2 );
+        Room **p = realloc( table->rooms, new_capacity * sizeof( Room * ) );
+        if ( p == NULL )
+        {
+            perror( "realloc" );
+            return NULL;
+        }
+        table->rooms = p;
+        table->rooms_capacity = new_capacity;
+    }
+
+    Room *room = calloc( 1, sizeof( Room ) );
+    if ( room == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    room->id = table->n_rooms;
+    memcpy( room->name, name, len );
+    room->name[len] = '\0';
+    room->name_len = len;
+
+    table->rooms[table->n_rooms++] = room;
+    if ( room->id != GLOBAL_ROOM )
+    {
+        if ( ! grow_slots( table ) )
+        {
+            return NULL;
+        }
+        *find_slot( table, name, len ) = room->id;
+    }
+    return room;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  まだ書き出していない行に data を足す。front なら先頭に、そうでなければ末尾に足す
+ */
+static int
+push_pending( RoomTable * table,
+              const char * data,
+              const size_t len,
+              const int front )
+{
+    pthread_mutex_lock( &table->pending_lock );
+    if ( table->pending_len + len > table->pending_capacity )
+    {
+        size_t new_capacity = ( table->pending_capacity == 0 ? MAX_LINE : table->pending_capacity * 2 );
+        while ( new_capacity < table->pending_len + len ) new_capacity *= 2;
+        char *p = realloc( table->pending, new_capacity );
+        if ( p == NULL )
+        {
+            perror( "realloc" );
+            pthread_mutex_unlock( &table->pending_lock );
+            return 0;
+        }
+        table->pending = p;
+        table->pending_capacity = new_capacity;
+    }
+
+    if ( front )
+    {
+        memmove( table->pending + len, table->pending, table->pending_len );
+        memcpy( table->pending, data, len );
+    }
+    else
+    {
+        memcpy( table->pending + table->pending_len, data, len );
+    }
+    table->pending_len += len;
+    pthread_mutex_unlock( &table->pending_lock );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  対応表のファイルを読む。行の番号が順に並んでいなければそこで打ち切る
+ */
+static int
+load( RoomTable * table )
+{
+    FILE *fp = fopen( table->file, "r" );
+    if ( fp == NULL )
+    {
+        return 1; // まだ部屋が無い
+    }
+
+    char line[MAX_LINE];
+    while ( fgets( line, sizeof( line ), fp ) != NULL )
+    {
+        unsigned id;
+        char name[MAX_LINE];
+        if ( sscanf( line, "%u %255s", &id, name ) != 2
+             || id != table->n_rooms
+             || ! room_table_valid_name( name, strlen( name ) ) )
+        {
+            fprintf( stderr, "rooms: ignored a broken line in %s\n", table->file );
+            break;
+        }
+
+        if ( add_room( table, name, strlen( name ) ) == NULL )
+        {
+            fclose( fp );
+            return 0;
+        }
+    }
+
+    fclose( fp );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+append_seq( Room * room,
+            const uint64_t seq )
+{
+    if ( room->n_seqs >= room->seqs_capacity )
+    {
+        const size_t new_capacity = ( room->seqs_capacity == 0 ? 16 : room->seqs_capacity * 2 );
+        uint64_t *p = realloc( room->seqs, new_capacity * sizeof( uint64_t ) );
+        if ( p == NULL )
+        {
+            perror( "realloc" );
+            return 0;
+        }
+        room->seqs = p;
+        room->seqs_capacity = new_capacity;
+    }
+
+    // シーケンス番号は追加順なので末尾に足すだけで昇順が保たれる
+    room->seqs[room->n_seqs++] = seq;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  ログを先頭から読み、各メッセージを部屋の一覧に加える
+ */
+static int
+scan_log( RoomTable * table,
+          MessageLog * log )
+{
+    LogCursor cur;
+    if ( ! message_log_seek( log, 1, &cur ) )
+    {
+        return 1;
+    }
+
+    LogRecord rec;
+    uint64_t n_unknown = 0;
+    while ( message_log_next( &cur, &rec ) )
+    {
+        if ( rec.room >= table->n_rooms )
+        {
+            ++n_unknown; // 対応表に無い部屋
+            continue;
+        }
+        if ( ! append_seq( table->rooms[rec.room], rec.seq ) )
+        {
+            return 0;
+        }
+    }
+
+    if ( n_unknown > 0 )
+    {
+        fprintf( stderr, "rooms: %llu messages belong to rooms missing from %s\n",
+                 (unsigned long long)n_unknown, table->file );
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+RoomTable *
+room_table_open( const char * file,
+                 MessageLog * log )
+{
+    RoomTable *table = calloc( 1, sizeof( RoomTable ) );
+    if ( table == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    pthread_rwlock_init( &table->lock, NULL );
+    pthread_mutex_init( &table->pending_lock, NULL );
+    pthread_mutex_init( &table->write_lock, NULL );
+
+    table->file = strdup( file );
+    table->slot_bits = INITIAL_SLOT_BITS;
+    table->slots = calloc( 1u << table->slot_bits, sizeof( uint32_t ) );
+    if ( table->file == NULL
+         || table->slots == NULL )
+    {
+        perror( "calloc" );
+        room_table_close( table );
+        return NULL;
+    }
+
+    // 番号0は全員宛ての部屋で、ファイルには書かない
+    if ( add_room( table, "", 0 ) == NULL
+         || ! load( table )
+         || ! scan_log( table, log ) )
+    {
+        room_table_close( table );
+        return NULL;
+    }
+
+    fprintf( stderr, "rooms: %u rooms, %zu messages to everyone\n",
+             table->n_rooms - 1, table->rooms[GLOBAL_ROOM]->n_seqs );
+    return table;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+room_table_close( RoomTable * table )
+{
+    if ( table == NULL )
+    {
+        return;
+    }
+
+    room_table_flush( table );
+
+    for ( uint32_t i = 0; i < table->n_rooms; ++i )
+    {
+        free( table->rooms[i]->seqs );
+        free( table->rooms[i] );
+    }
+    free( table->rooms );
+    free( table->slots );
+    free( table->file );
+    free( table->pending );
+    pthread_mutex_destroy( &table->write_lock );
+    pthread_mutex_destroy( &table->pending_lock );
+    pthread_rwlock_destroy( &table->lock );
+    free( table );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+room_table_valid_name( const char * name,
+                       const size_t len )
+{
+    if ( len == 0
+         || MAX_ROOM_NAME < len
+         || ! isalpha( (unsigned char)name[0] ) )
+    {
+        return 0;
+    }
+
+    for ( size_t i = 1; i < len; ++i )
+    {
+        const unsigned char c = name[i];
+        if ( ! isalnum( c )
+             && c != '-'
+             && c != '_' )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+uint32_t
+room_table_lookup( RoomTable * table,
+                   const char * name,
+                   const size_t len )
+{
+    if ( ! room_table_valid_name( name, len ) )
+    {
+        return GLOBAL_ROOM;
+    }
+
+    pthread_rwlock_rdlock( &table->lock );
+    const uint32_t id = *find_slot( table, name, len );
+    pthread_rwlock_unlock( &table->lock );
+    return id;
+}
+
+/* --------------------------------------------------------------------------- */
+uint32_t
+room_table_create( RoomTable * table,
+                   const char * name,
+                   const size_t len )
+{
+    const uint32_t found = room_table_lookup( table, name, len );
+    if ( found != GLOBAL_ROOM
+         || ! room_table_valid_name( name, len ) )
+    {
+        return found;
+    }
+
+    pthread_rwlock_wrlock( &table->lock );
+
+    // ロックを取り直す間に他のスレッドが作っているかもしれない
+    uint32_t id = *find_slot( table, name, len );
+    if ( id == GLOBAL_ROOM
+         && table->n_rooms < MAX_ROOMS )
+    {
+        // ファイルにはここで書かず、番号がログに残る前に room_table_flush で書き出す
+        char line[MAX_LINE];
+        const int line_len = snprintf( line, sizeof( line ), "%u %.*s\n", table->n_rooms, (int)len, name );
+        Room *room = add_room( table, name, len );
+        if ( room != NULL )
+        {
+            id = room->id;
+            if ( ! push_pending( table, line, line_len, 0 ) )
+            {
+                fprintf( stderr, "rooms: could not keep room %u for %s\n", id, table->file );
+            }
+        }
+    }
+
+    pthread_rwlock_unlock( &table->lock );
+    return id;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+room_table_flush( RoomTable * table )
+{
+    pthread_mutex_lock( &table->write_lock );
+
+    pthread_mutex_lock( &table->pending_lock );
+    char *data = table->pending;
+    const size_t len = table->pending_len;
+    table->pending = NULL;
+    table->pending_len = table->pending_capacity = 0;
+    pthread_mutex_unlock( &table->pending_lock );
+
+    int ok = 1;
+    if ( len > 0 )
+    {
+        FILE *fp = fopen( table->file, "a" );
+        if ( fp == NULL )
+        {
+            perror( "fopen" );
+            ok = 0;
+        }
+        else
+        {
+            // 途中まで書けた場合は書き直すときに行が重ならないよう元の長さに戻す
+            const long start = ( fseek( fp, 0, SEEK_END ) == 0 ? ftell( fp ) : -1 );
+            ok = ( start >= 0
+                   && fwrite( data, 1, len, fp ) == len
+                   && fflush( fp ) == 0
+                   && fdatasync( fileno( fp ) ) == 0 );
+            if ( ! ok )
+            {
+                perror( "rooms" );
+                if ( start >= 0 && ftruncate( fileno( fp ), start ) != 0 )
+                {
+                    perror( "ftruncate" );
+                }
+            }
+            fclose( fp );
+        }
+
+        // 書けなかった行は次に書き出すときに回す
+        if ( ! ok
+             && ! push_pending( table, data, len, 1 ) )
+        {
+            fprintf( stderr, "rooms: lost %zu bytes of %s\n", len, table->file );
+        }
+    }
+    free( data );
+
+    pthread_mutex_unlock( &table->write_lock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+const char *
+room_table_name( RoomTable * table,
+                 const uint32_t room )
+{
+    pthread_rwlock_rdlock( &table->lock );
+    const char *name = ( room < table->n_rooms ? table->rooms[room]->name : "" );
+    pthread_rwlock_unlock( &table->lock );
+    return name;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+room_table_add( RoomTable * table,
+                const uint32_t room,
+                const uint64_t seq )
+{
+    pthread_rwlock_wrlock( &table->lock );
+    const int ok = ( room < table->n_rooms
+                     && append_seq( table->rooms[room], seq ) );
+    pthread_rwlock_unlock( &table->lock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+room_table_recent( RoomTable * table,
+                   const uint32_t room,
+                   uint64_t * out,
+                   const int n )
+{
+    int count = 0;
+    pthread_rwlock_rdlock( &table->lock );
+    if ( room < table->n_rooms
+         && n > 0 )
+    {
+        const Room *r = table->rooms[room];
+        count = ( r->n_seqs < (size_t)n ? (int)r->n_seqs : n );
+        memcpy( out, r->seqs + r->n_seqs - count, count * sizeof( uint64_t ) );
+    }
+    pthread_rwlock_unlock( &table->lock );
+    return count;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+room_table_since( RoomTable * table,
+                  const uint32_t room,
+                  const uint64_t first_seq,
+                  uint64_t * out,
+                  const int n )
+{
+    int count = 0;
+    pthread_rwlock_rdlock( &table->lock );
+    if ( room < table->n_rooms
+         && n > 0 )
+    {
+        // first_seq 以上の最初の位置を二分探索する
+        const Room *r = table->rooms[room];
+        size_t lo = 0;
+        size_t hi = r->n_seqs;
+        while ( lo < hi )
+        {
+            const size_t mid = ( lo + hi ) / 2;
+            if ( r->seqs[mid] < first_seq ) lo = mid + 1;
+            else hi = mid;
+        }
+
+        const size_t rest = r->n_seqs - lo;
+        count = ( rest < (size_t)n ? (int)rest : n );
+        memcpy( out, r->seqs + lo, count * sizeof( uint64_t ) );
+    }
+    pthread_rwlock_unlock( &table->lock );
+    return count;
+}
@@ -0,0 +1,87 @@
+#ifndef ROOM_TABLE_H
+#define ROOM_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "message_log.h"
+
+/*!
+  ¥brief 部屋の名前と番号の対応表と、部屋ごとのメッセージの一覧。
+  番号はログのレコードに記録されるので、対応表はファイルに追記して再起動後も同じ番号を使う。
+  追記は room_table_create では行わず、room_table_flush がまとめて書き出す。
+  各部屋はその部屋のメッセージのシーケンス番号を昇順に持ち、部屋ごとの履歴の取り出しに使う。
+  一覧はファイルには残さず、開くときにログを先頭から読んで作る。
+  番号0は名前を持たない全員宛ての部屋で、部屋を指定しないメッセージが属する。
+  どの関数も複数スレッドから呼んでよい。
+ */
+typedef struct RoomTable RoomTable;
+
+#define GLOBAL_ROOM 0
+#define MAX_ROOM_NAME 32
+#define MAX_ROOMS 4096
+
+/*!
+  ¥brief 対応表を読み込み、ログから部屋ごとのメッセージの一覧を作る
+  ¥param file 対応表のファイル。無ければ作成する
+  ¥param log 一覧を作るために読むメッセージログ
+  ¥return 作成された表。エラーの場合は NULL
+ */
+RoomTable * room_table_open( const char * file, MessageLog * log );
+
+/*!
+  ¥brief 表を閉じてメモリを解放する
+ */
+void room_table_close( RoomTable * table );
+
+/*!
+  ¥brief 部屋名として使えるか。英字で始まり、英数字と - _ だけからなる MAX_ROOM_NAME 文字以内の名前
+ */
+int room_table_valid_name( const char * name, const size_t len );
+
+/*!
+  ¥brief 部屋名から番号を引く
+  ¥return 部屋の番号。無い場合は GLOBAL_ROOM
+ */
+uint32_t room_table_lookup( RoomTable * table, const char * name, const size_t len );
+
+/*!
+  ¥brief 部屋名から番号を引き、無ければ作成する。対応表への追記は room_table_flush まで遅らせるので、
+  ファイルには触れない
+  ¥return 部屋の番号。名前が正しくない・部屋数が上限に達した・メモリが足りない場合は GLOBAL_ROOM
+ */
+uint32_t room_table_create( RoomTable * table, const char * name, const size_t len );
+
+/*!
+  ¥brief 作成した部屋の行を対応表に書き出して fdatasync する。
+  番号を含むレコードより先に書き出す必要があるので、メッセージログの書き出しの前に呼ぶ
+  ¥return 成功した場合は1。書けなかった行は次の呼び出しで書き直す
+ */
+int room_table_flush( RoomTable * table );
+
+/*!
+  ¥brief 部屋の名前を返す。表を閉じるまで有効
+  ¥return 部屋名。GLOBAL_ROOM と知らない番号では空文字列
+ */
+const char * room_table_name( RoomTable * table, const uint32_t room );
+
+/*!
+  ¥brief 部屋のメッセージとしてシーケンス番号を登録する。番号は昇順に登録すること
+  ¥return 成功した場合は1
+ */
+int room_table_add( RoomTable * table, const uint32_t room, const uint64_t seq );
+
+/*!
+  ¥brief 部屋の直近のメッセージのシーケンス番号を古い順に n 件まで out に書き出す
+  ¥return 書き出した件数
+ */
+int room_table_recent( RoomTable * table, const uint32_t room, uint64_t * out, const int n );
+
+/*!
+  ¥brief 部屋のメッセージのうち、シーケンス番号が first_seq 以上のものを古い順に n 件まで out に書き出す
+  ¥return 書き出した件数
+ */
+int room_table_since( RoomTable * table, const uint32_t room, const uint64_t first_seq,
+                      uint64_t * out, const int n );
+
+#endif
@@ -0,0 +1,325 @@
+
+#define _GNU_SOURCE // strerror_r が文字列を返す版を使う
+
+#include "server_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#define LOG_RING_SIZE 4096 // 2のべき乗
+#define LOG_LINE_MAX 256 // これより長い行は切り詰める
+#define DRAIN_INTERVAL_MS 10 // リングが空のときに出力スレッドが眠る時間
+
+// リングの1要素。seq は Vyukov 方式の有界キューの番号で、
+// pos に書き込める状態なら pos、pos の内容が読める状態なら pos + 1 になる
+typedef struct {
+    uint64_t seq;
+    uint64_t time_ns;
+    uint8_t category;
+    uint8_t level;
+    uint16_t len;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static LogSlot ring[LOG_RING_SIZE];
+static uint64_t ring_tail = 0; // 次に書き込む位置。書き込むスレッドが CAS で進める
+static uint64_t ring_head = 0; // 次に読む位置。出力スレッドだけが触る
+static uint64_t dropped = 0; // リングが一杯で捨てた行数
+
+static FILE *log_out = NULL;
+static int running = 0;
+static pthread_t drain_thread;
+
+static int levels[N_LOG_CATEGORIES] = {
+    [LOG_CAT_SERVER] = LOG_LEVEL_INFO,
+    [LOG_CAT_CONN] = LOG_LEVEL_INFO,
+    [LOG_CAT_COMMAND] = LOG_LEVEL_INFO,
+    [LOG_CAT_BROADCAST] = LOG_LEVEL_INFO,
+    [LOG_CAT_QUERY] = LOG_LEVEL_INFO,
+    [LOG_CAT_STORAGE] = LOG_LEVEL_INFO,
+};
+
+static const char *level_names[N_LOG_LEVELS] = { "error", "warn", "info", "debug" };
+static const char *category_names[N_LOG_CATEGORIES] = {
+    "server", "conn", "command", "broadcast", "query", "storage",
+};
+
+/* --------------------------------------------------------------------------- */
+static uint64_t
+realtime_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_REALTIME_COARSE, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+write_line( FILE * out,
+            const LogSlot * slot )
+{
+    const time_t sec = (time_t)( slot->time_ns / 1000000000 );
+    struct tm tm;
+    char time_str[32];
+    localtime_r( &sec, &tm );
+    strftime( time_str, sizeof( time_str ), "%Y-%m-%d %H:%M:%S", &tm );
+
+    fprintf( out, "%s.%03d %-5s %s: %.*s\n", time_str, (int)( slot->time_ns / 1000000 % 1000 ),
+             level_names[slot->level], category_names[slot->category], (int)slot->len, slot->text );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  読める行をすべて出力する。出力スレッドからのみ呼ぶ。出力した行数を返す
+ */
+static int
+drain( FILE * out )
+{
+    int n = 0;
+    for ( ;; )
+    {
+        LogSlot *slot = &ring[ring_head & ( LOG_RING_SIZE - 1 )];
+        if ( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != ring_head + 1 )
+        {
+            break;
+        }
+        write_line( out, slot );
+        __atomic_store_n( &slot->seq, ring_head + LOG_RING_SIZE, __ATOMIC_RELEASE );
+        ++ring_head;
+        ++n;
+    }
+
+    const uint64_t n_dropped = __atomic_exchange_n( &dropped, 0, __ATOMIC_RELAXED );
+    if ( n_dropped > 0 )
+    {
+        fprintf( out, "(log ring was full: %llu lines dropped)\n", (unsigned long long)n_dropped );
+    }
+
+    if ( n > 0 || n_dropped > 0 )
+    {
+        fflush( out );
+    }
+    return n;
+}
+
+/* --------------------------------------------------------------------------- */
+static void *
+drain_main( void * arg )
+{
+    (void)arg;
+    const struct timespec interval = { 0, DRAIN_INTERVAL_MS * 1000000 };
+    while ( __atomic_load_n( &running, __ATOMIC_ACQUIRE ) )
+    {
+        if ( drain( log_out ) == 0 )
+        {
+            nanosleep( &interval, NULL );
+        }
+    }
+    drain( log_out );
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+server_log_start( FILE * out )
+{
+    for ( uint64_t i = 0; i < LOG_RING_SIZE; ++i )
+    {
+        ring[i].seq = i;
+    }
+    ring_head = ring_tail = 0;
+    log_out = out;
+
+    __atomic_store_n( &running, 1, __ATOMIC_RELEASE );
+    const int err = pthread_create( &drain_thread, NULL, drain_main, NULL );
+    if ( err != 0 )
+    {
+        __atomic_store_n( &running, 0, __ATOMIC_RELEASE );
+        fprintf( stderr, "pthread_create: %s\n", strerror( err ) );
+        return 0;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+server_log_stop()
+{
+    if ( ! __atomic_load_n( &running, __ATOMIC_ACQUIRE ) )
+    {
+        return;
+    }
+    __atomic_store_n( &running, 0, __ATOMIC_RELEASE );
+    pthread_join( drain_thread, NULL );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+server_log_set_levels( const char * spec )
+{
+    int new_levels[N_LOG_CATEGORIES];
+    for ( int c = 0; c < N_LOG_CATEGORIES; ++c )
+    {
+        new_levels[c] = __atomic_load_n( &levels[c], __ATOMIC_RELAXED );
+    }
+
+    char buf[256];
+    snprintf( buf, sizeof( buf ), "%s", spec );
+    char *save = NULL;
+    for ( char *item = strtok_r( buf, ",", &save ); item != NULL; item = strtok_r( NULL, ",", &save ) )
+    {
+        // "level" だけならすべてのカテゴリ
+        const char *category = "all";
+        char *level = item;
+        char *eq = strchr( item, '=' );
+        if ( eq != NULL )
+        {
+            *eq = '\0';
+            category = item;
+            level = eq + 1;
+        }
+
+        int l = 0;
+        while ( l < N_LOG_LEVELS && strcmp( level, level_names[l] ) != 0 ) ++l;
+        if ( l == N_LOG_LEVELS )
+        {
+            return 0;
+        }
+
+        int found = 0;
+        for ( int c = 0; c < N_LOG_CATEGORIES; ++c )
+        {
+            if ( strcmp( category, "all" ) == 0
+                 || strcmp( category, category_names[c] ) == 0 )
+            {
+                new_levels[c] = l;
+                found = 1;
+            }
+        }
+        if ( ! found )
+        {
+            return 0;
+        }
+    }
+
+    for ( int c = 0; c < N_LOG_CATEGORIES; ++c )
+    {
+        __atomic_store_n( &levels[c], new_levels[c], __ATOMIC_RELAXED );
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+server_log_enabled( const LogCategory category,
+                    const LogLevel level )
+{
+    return (int)level <= __atomic_load_n( &levels[category], __ATOMIC_RELAXED );
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+server_log_v( const LogCategory category,
+              const LogLevel level,
+              const char * format,
+              va_list ap )
+{
+    if ( ! __atomic_load_n( &running, __ATOMIC_ACQUIRE ) )
+    {
+        // 出力スレッドが無い間はその場で書く
+        LogSlot slot;
+        const int len = vsnprintf( slot.text, sizeof( slot.text ), format, ap );
+        slot.time_ns = realtime_ns();
+        slot.category = (uint8_t)category;
+        slot.level = (uint8_t)level;
+        slot.len = (uint16_t)( len < 0 ? 0 : len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1 );
+        write_line( stderr, &slot );
+        return;
+    }
+
+    // 書き込む位置を CAS で確保する。一杯なら待たずに捨てる
+    uint64_t pos = __atomic_load_n( &ring_tail, __ATOMIC_RELAXED );
+    LogSlot *slot;
+    for ( ;; )
+    {
+        slot = &ring[pos & ( LOG_RING_SIZE - 1 )];
+        const uint64_t seq = __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE );
+        const int64_t diff = (int64_t)( seq - pos );
+        if ( diff == 0 )
+        {
+            if ( __atomic_compare_exchange_n( &ring_tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+            {
+                break;
+            }
+        }
+        else if ( diff < 0 )
+        {
+            __atomic_add_fetch( &dropped, 1, __ATOMIC_RELAXED );
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n( &ring_tail, __ATOMIC_RELAXED );
+        }
+    }
+
+    const int len = vsnprintf( slot->text, sizeof( slot->text ), format, ap );
+    slot->time_ns = realtime_ns();
+    slot->category = (uint8_t)category;
+    slot->level = (uint8_t)level;
+    slot->len = (uint16_t)( len < 0 ? 0 : len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1 );
+    __atomic_store_n( &slot->seq, pos + 1, __ATOMIC_RELEASE );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+server_log( const LogCategory category,
+            const LogLevel level,
+            const char * format,
+            ... )
+{
+    va_list ap;
+    va_start( ap, format );
+    server_log_v( category, level, format, ap );
+    va_end( ap );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+server_log_errno( LogSite * site,
+                  const LogCategory category,
+                  const char * what )
+{
+    const int err = errno;
+    if ( ! server_log_enabled( category, LOG_LEVEL_ERROR ) )
+    {
+        return;
+    }
+
+    // 区間の最初の1回だけが CAS に成功して出力し、他は件数を数えるだけにする
+    const uint64_t now = realtime_ns();
+    uint64_t start = __atomic_load_n( &site->window_start_ns, __ATOMIC_RELAXED );
+    if ( now - start < (uint64_t)LOG_REPEAT_WINDOW_MS * 1000000
+         || ! __atomic_compare_exchange_n( &site->window_start_ns, &start, now, 0,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+        __atomic_add_fetch( &site->suppressed, 1, __ATOMIC_RELAXED );
+        return;
+    }
+
+    char err_str[128];
+    const char *msg = strerror_r( err, err_str, sizeof( err_str ) );
+    const uint64_t n = __atomic_exchange_n( &site->suppressed, 0, __ATOMIC_RELAXED );
+    if ( n > 0 )
+    {
+        server_log( category, LOG_LEVEL_ERROR, "%s: %s (%llu more since the last report)",
+                    what, msg, (unsigned long long)n );
+    }
+    else
+    {
+        server_log( category, LOG_LEVEL_ERROR, "%s: %s", what, msg );
+    }
+}
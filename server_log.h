@@ -0,0 +1,95 @@
+#ifndef SERVER_LOG_H
+#define SERVER_LOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*!
+  ¥brief サーバの動作ログ。
+  書き込みはロックを取らずに固定長のリングへ1行を積むだけで、ファイルへの出力は
+  バックグラウンドのスレッドがまとめて行う。リングが一杯なら行を捨てて件数だけ数える。
+  カテゴリごとにレベルを持ち、実行中に変更できる。
+  server_log_start を呼ぶ前と server_log_stop の後は、その場で出力する。
+ */
+
+typedef enum {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+    N_LOG_LEVELS,
+} LogLevel;
+
+typedef enum {
+    LOG_CAT_SERVER, //!< 起動・終了・設定
+    LOG_CAT_CONN, //!< 接続・切断・送受信のエラー
+    LOG_CAT_COMMAND, //!< 受け取ったコマンドとその返信
+    LOG_CAT_BROADCAST, //!< メッセージの配送
+    LOG_CAT_QUERY, //!< history と find
+    LOG_CAT_STORAGE, //!< ログ・インデックスなどの保存
+    N_LOG_CATEGORIES,
+} LogCategory;
+
+/*!
+  ¥brief 同じ場所で続けて起きたエラーをまとめるための状態。呼び出し箇所ごとに static で持つ
+ */
+typedef struct {
+    uint64_t window_start_ns;
+    uint64_t suppressed;
+} LogSite;
+
+#define LOG_REPEAT_WINDOW_MS 1000 // 同じ場所のエラーはこの間隔に1回だけ出力し、残りは件数にまとめる
+
+/*!
+  ¥brief レベルが有効なときだけ引数を評価して1行を書き込む
+ */
+#define SERVER_LOG( category, level, ... ) \
+    do { \
+        if ( server_log_enabled( category, level ) ) server_log( category, level, __VA_ARGS__ ); \
+    } while ( 0 )
+
+/*!
+  ¥brief perror の代わり。errno の説明を付けて LOG_LEVEL_ERROR で書き込む。
+  同じ場所で LOG_REPEAT_WINDOW_MS の間に繰り返し起きた分は、次に出力する行に件数として付ける
+ */
+#define SERVER_LOG_ERRNO( category, what ) \
+    do { \
+        static LogSite log_site_; \
+        server_log_errno( &log_site_, category, what ); \
+    } while ( 0 )
+
+/*!
+  ¥brief 出力用のスレッドを起動する
+  ¥param out 出力先。server_log_stop まで開いておくこと
+  ¥return 成功した場合は1
+ */
+int server_log_start( FILE * out );
+
+/*!
+  ¥brief リングに残った行を出力してからスレッドを止める
+ */
+void server_log_stop();
+
+/*!
+  ¥brief "info" や "conn=debug,broadcast=warn" の形式でレベルを設定する。all はすべてのカテゴリ
+  ¥return 書式が正しければ1。正しくなければ何も変更しない
+ */
+int server_log_set_levels( const char * spec );
+
+/*!
+  ¥brief カテゴリで level の行を出力するか
+ */
+int server_log_enabled( const LogCategory category, const LogLevel level );
+
+/*!
+  ¥brief 1行を書き込む。改行は付けなくてよい。どのスレッドから呼んでもよい
+ */
+void server_log( const LogCategory category, const LogLevel level, const char * format, ... )
+    __attribute__(( format( printf, 3, 4 ) ));
+
+/*!
+  ¥brief SERVER_LOG_ERRNO の本体
+ */
+void server_log_errno( LogSite * site, const LogCategory category, const char * what );
+
+#endif
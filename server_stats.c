@@ -0,0 +1,116 @@
+
+#include "server_stats.h"
+
+#include <stdio.h>
+
+#define STATS_LINE_SIZE 1024
+
+/* --------------------------------------------------------------------------- */
+static uint64_t
+load( const uint64_t * counter )
+{
+    return __atomic_load_n( counter, __ATOMIC_RELAXED );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+server_stats_merge( ServerStats * dst,
+                    const ServerStats * src )
+{
+    dst->accepted += load( &src->accepted );
+    dst->closed += load( &src->closed );
+    dst->idle_closed += load( &src->idle_closed );
+    dst->bytes_in += load( &src->bytes_in );
+    dst->bytes_out += load( &src->bytes_out );
+    dst->recv_calls += load( &src->recv_calls );
+    dst->writev_calls += load( &src->writev_calls );
+    dst->queued_bytes += load( &src->queued_bytes );
+    dst->slow_dropped += load( &src->slow_dropped );
+    dst->slow_closed += load( &src->slow_closed );
+    dst->rate_limited += load( &src->rate_limited );
+    dst->shed += load( &src->shed );
+    dst->resumed += load( &src->resumed );
+    dst->watch_matches += load( &src->watch_matches );
+
+    for ( int i = 0; i < N_COMMAND_TYPES; ++i )
+    {
+        histogram_merge( &dst->commands[i], &src->commands[i] );
+    }
+    histogram_merge( &dst->log_append, &src->log_append );
+    histogram_merge( &dst->loop, &src->loop );
+    histogram_merge( &dst->out_queue_depth, &src->out_queue_depth );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  ナノ秒のヒストグラムを1行にする。分位点はマイクロ秒で書く
+ */
+static void
+report_latency( const char * kind,
+                const char * name,
+                const Histogram * h,
+                ServerStatsEmit emit,
+                void * arg )
+{
+    char line[STATS_LINE_SIZE];
+    snprintf( line, sizeof( line ),
+              "(stats %s%s%s count %llu mean_us %.1f p50_us %.1f p90_us %.1f p99_us %.1f p999_us %.1f max_us %.1f)",
+              kind, ( name != NULL ? " " : "" ), ( name != NULL ? name : "" ),
+              (unsigned long long)h->count,
+              ( h->count > 0 ? (double)h->sum / h->count / 1000.0 : 0.0 ),
+              histogram_percentile( h, 50.0 ) / 1000.0,
+              histogram_percentile( h, 90.0 ) / 1000.0,
+              histogram_percentile( h, 99.0 ) / 1000.0,
+              histogram_percentile( h, 99.9 ) / 1000.0,
+              h->max / 1000.0 );
+    emit( line, arg );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+server_stats_report( const ServerStats * stats,
+                     const int connections,
+                     const double uptime,
+                     ServerStatsEmit emit,
+                     void * arg )
+{
+    char line[STATS_LINE_SIZE];
+    snprintf( line, sizeof( line ),
+              "(stats uptime %.1f connections %d accepted %llu closed %llu idle_closed %llu bytes_in %llu bytes_out %llu"
+              " recv_calls %llu writev_calls %llu queued_bytes %llu slow_dropped %llu slow_closed %llu"
+              " rate_limited %llu shed %llu resumed %llu watch_matches %llu)",
+              uptime, connections,
+              (unsigned long long)stats->accepted, (unsigned long long)stats->closed,
+              (unsigned long long)stats->idle_closed,
+              (unsigned long long)stats->bytes_in, (unsigned long long)stats->bytes_out,
+              (unsigned long long)stats->recv_calls, (unsigned long long)stats->writev_calls,
+              (unsigned long long)stats->queued_bytes,
+              (unsigned long long)stats->slow_dropped, (unsigned long long)stats->slow_closed,
+              (unsigned long long)stats->rate_limited, (unsigned long long)stats->shed,
+              (unsigned long long)stats->resumed,
+              (unsigned long long)stats->watch_matches );
+    emit( line, arg );
+
+    // 一度も届いていないコマンドは省く
+    for ( int i = 0; i < N_COMMAND_TYPES; ++i )
+    {
+        if ( stats->commands[i].count > 0 )
+        {
+            report_latency( "command", command_name( (Command)i ), &stats->commands[i], emit, arg );
+        }
+    }
+    report_latency( "log_append", NULL, &stats->log_append, emit, arg );
+    report_latency( "loop", NULL, &stats->loop, emit, arg );
+
+    const Histogram *depth = &stats->out_queue_depth;
+    snprintf( line, sizeof( line ),
+              "(stats out_queue_depth count %llu p50 %llu p99 %llu p999 %llu max %llu)",
+              (unsigned long long)depth->count,
+              (unsigned long long)histogram_percentile( depth, 50.0 ),
+              (unsigned long long)histogram_percentile( depth, 99.0 ),
+              (unsigned long long)histogram_percentile( depth, 99.9 ),
+              (unsigned long long)depth->max );
+    emit( line, arg );
+
+    emit( "(stats end)", arg );
+}
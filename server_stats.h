@@ -0,0 +1,61 @@
+#ifndef SERVER_STATS_H
+#define SERVER_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "command_parser.h"
+#include "histogram.h"
+
+/*!
+  ¥brief サーバの計測値。シャードごとに1つ持ち、そのシャードのスレッドだけが更新する。
+  更新はロックもアトミックな読み書き変更も使わないので、常に有効にしておいてよい。
+  読み出すときは server_stats_merge で各シャードの分を足し合わせる。
+  時間はすべてナノ秒で記録する。
+ */
+typedef struct {
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t idle_closed; //!< closed のうち無通信で切断した数
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t recv_calls;
+    uint64_t writev_calls;
+    uint64_t queued_bytes; //!< 送信キューに積まれてまだ送れていないバイト数
+    uint64_t slow_dropped; //!< 送信キューが上限を超えたため捨てたブロードキャストの数
+    uint64_t slow_closed; //!< 送信キューが上限を超えたため切断した数
+    uint64_t rate_limited; //!< トークンが足りずに断ったコマンドの数
+    uint64_t shed; //!< ループが遅れているため断った重いコマンドの数
+    uint64_t resumed; //!< (resume) でセッションを引き継いだ数
+    uint64_t watch_matches; //!< (watch) したクライアントへ送った (match ...) の数
+
+    Histogram commands[N_COMMAND_TYPES]; //!< コマンドの解析から、ループの最後の送信を終えるまで
+    Histogram log_append; //!< メッセージログへの追記
+    Histogram loop; //!< epoll_wait（io_uring では io_uring_enter）から戻ってからループの最後まで
+    Histogram out_queue_depth; //!< 送信を始めるときの送信キューの要素数
+} ServerStats;
+
+// 計測値を更新する。書き込むのは持ち主のスレッドだけなので、読み出し側に途中の値が見えなければよい
+#define STATS_ADD( counter, n ) __atomic_store_n( &( counter ), ( counter ) + ( n ), __ATOMIC_RELAXED )
+#define STATS_SUB( counter, n ) __atomic_store_n( &( counter ), ( counter ) - ( n ), __ATOMIC_RELAXED )
+
+/*!
+  ¥brief 計測値を1行ずつ受け取るコールバック
+  ¥param line "(stats ...)" 形式の1行。改行は含まない
+ */
+typedef void (*ServerStatsEmit)( const char * line, void * arg );
+
+/*!
+  ¥brief src の内容を dst に足し込む。src は他のスレッドが更新中でもよい
+ */
+void server_stats_merge( ServerStats * dst, const ServerStats * src );
+
+/*!
+  ¥brief 計測値を "(stats ...)" 形式の行にして emit へ順に渡す。最後の行は "(stats end)"
+  ¥param connections 現在の接続数
+  ¥param uptime 起動してからの秒数
+ */
+void server_stats_report( const ServerStats * stats, const int connections, const double uptime,
+                          ServerStatsEmit emit, void * arg );
+
+#endif
@@ -0,0 +1,331 @@
+
+#include "session_table.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+typedef struct {
+    char token[SESSION_TOKEN_LEN];
+    int next; // 同じバケットの次の要素、未使用なら空き一覧の次の要素。-1 で終わり
+    int in_use;
+    int attached; // 接続中。切断したら detached_ms から ttl の間だけ残す
+    uint64_t generation;
+    uint64_t detached_ms;
+    SessionState state;
+} Session;
+
+struct SessionTable {
+    pthread_mutex_t lock;
+    uint64_t ttl_ms;
+    uint64_t last_generation; // 世代番号はセッションをまたいで増やし、使い回した要素でも重ならないようにする
+
+    Session *sessions;
+    int capacity;
+    int count;
+    int free_head;
+
+    // トークンのハッシュ -> sessions の添字の連鎖。-1 は空
+    int *buckets;
+    uint32_t bucket_mask;
+};
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+hash_token( const char * token )
+{
+    // FNV-1a。トークンは乱数なので偏らない
+    uint32_t h = 2166136261u;
+    for ( int i = 0; i < SESSION_TOKEN_LEN; ++i )
+    {
+        h = ( h ^ (unsigned char)token[i] ) * 16777619u;
+    }
+    return h;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  トークンのセッションを探す。link には見つかった要素を指している位置を返す。ロックを持った状態で呼ぶ
+  ¥return 添字。見つからなければ-1
+ */
+static int
+find_locked( SessionTable * table,
+             const char * token,
+             int ** link )
+{
+    int *p = &table->buckets[hash_token( token ) & table->bucket_mask];
+    while ( *p >= 0 )
+    {
+        if ( memcmp( table->sessions[*p].token, token, SESSION_TOKEN_LEN ) == 0 )
+        {
+            if ( link != NULL ) *link = p;
+            return *p;
+        }
+        p = &table->sessions[*p].next;
+    }
+    return -1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  link が指す要素を連鎖から外して空き一覧に戻す。ロックを持った状態で呼ぶ
+ */
+static void
+remove_locked( SessionTable * table,
+               int * link )
+{
+    const int i = *link;
+    Session *s = &table->sessions[i];
+    *link = s->next;
+    s->in_use = 0;
+    s->next = table->free_head;
+    table->free_head = i;
+    --table->count;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+expired( const SessionTable * table,
+         const Session * s,
+         const uint64_t now_ms )
+{
+    return ! s->attached
+           && now_ms >= s->detached_ms + table->ttl_ms;
+}
+
+/* --------------------------------------------------------------------------- */
+SessionTable *
+session_table_create( const int capacity,
+                      const uint64_t ttl_ms )
+{
+    SessionTable *table = calloc( 1, sizeof( SessionTable ) );
+    if ( table == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+
+    uint32_t n_buckets = 16;
+    while ( n_buckets < (uint32_t)capacity ) n_buckets *= 2;
+
+    table->sessions = calloc( capacity, sizeof( Session ) );
+    table->buckets = malloc( n_buckets * sizeof( int ) );
+    if ( table->sessions == NULL
+         || table->buckets == NULL )
+    {
+        perror( "malloc" );
+        free( table->sessions );
+        free( table->buckets );
+        free( table );
+        return NULL;
+    }
+
+    pthread_mutex_init( &table->lock, NULL );
+    table->ttl_ms = ttl_ms;
+    table->capacity = capacity;
+    table->bucket_mask = n_buckets - 1;
+    for ( uint32_t i = 0; i < n_buckets; ++i )
+    {
+        table->buckets[i] = -1;
+    }
+    for ( int i = 0; i < capacity; ++i )
+    {
+        table->sessions[i].next = ( i + 1 < capacity ? i + 1 : -1 );
+    }
+    table->free_head = ( capacity > 0 ? 0 : -1 );
+    return table;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+session_table_destroy( SessionTable * table )
+{
+    if ( table == NULL )
+    {
+        return;
+    }
+    pthread_mutex_destroy( &table->lock );
+    free( table->sessions );
+    free( table->buckets );
+    free( table );
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+session_table_open( SessionTable * table,
+                    const int client_id,
+                    const uint64_t first_seq,
+                    const uint64_t now_ms,
+                    char * token )
+{
+    // トークンを知っていればそのセッションを名乗れるので、推測できない乱数から作る
+    unsigned char bytes[SESSION_TOKEN_LEN / 2];
+    if ( getrandom( bytes, sizeof( bytes ), 0 ) != (ssize_t)sizeof( bytes ) )
+    {
+        perror( "getrandom" );
+        return 0;
+    }
+    static const char hex[] = "0123456789abcdef";
+    for ( size_t i = 0; i < sizeof( bytes ); ++i )
+    {
+        token[i * 2] = hex[bytes[i] >> 4];
+        token[i * 2 + 1] = hex[bytes[i] & 15];
+    }
+    token[SESSION_TOKEN_LEN] = '\0';
+
+    pthread_mutex_lock( &table->lock );
+
+    // 一杯なら期限切れのものを捨ててから空きを探す
+    if ( table->free_head < 0 )
+    {
+        pthread_mutex_unlock( &table->lock );
+        session_table_expire( table, now_ms );
+        pthread_mutex_lock( &table->lock );
+    }
+    if ( table->free_head < 0
+         || find_locked( table, token, NULL ) >= 0 )
+    {
+        pthread_mutex_unlock( &table->lock );
+        return 0;
+    }
+
+    const int i = table->free_head;
+    Session *s = &table->sessions[i];
+    table->free_head = s->next;
+
+    memcpy( s->token, token, SESSION_TOKEN_LEN );
+    s->in_use = 1;
+    s->attached = 1;
+    s->generation = ++table->last_generation;
+    s->detached_ms = 0;
+    memset( &s->state, 0, sizeof( s->state ) );
+    s->state.client_id = client_id;
+    s->state.first_seq = first_seq;
+
+    int *bucket = &table->buckets[hash_token( token ) & table->bucket_mask];
+    s->next = *bucket;
+    *bucket = i;
+    ++table->count;
+
+    const uint64_t generation = s->generation;
+    pthread_mutex_unlock( &table->lock );
+    return generation;
+}
+
+/* --------------------------------------------------------------------------- */
+uint64_t
+session_table_resume( SessionTable * table,
+                      const char * token,
+                      const size_t len,
+                      const uint64_t now_ms,
+                      SessionState * state )
+{
+    if ( len != SESSION_TOKEN_LEN )
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock( &table->lock );
+    int *link;
+    const int i = find_locked( table, token, &link );
+    if ( i < 0 )
+    {
+        pthread_mutex_unlock( &table->lock );
+        return 0;
+    }
+
+    Session *s = &table->sessions[i];
+    if ( expired( table, s, now_ms ) )
+    {
+        remove_locked( table, link );
+        pthread_mutex_unlock( &table->lock );
+        return 0;
+    }
+
+    s->attached = 1;
+    s->generation = ++table->last_generation;
+    *state = s->state;
+
+    const uint64_t generation = s->generation;
+    pthread_mutex_unlock( &table->lock );
+    return generation;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+session_table_detach( SessionTable * table,
+                      const char * token,
+                      const uint64_t generation,
+                      const uint32_t * rooms,
+                      const int n_rooms,
+                      const uint64_t now_ms )
+{
+    pthread_mutex_lock( &table->lock );
+    const int i = find_locked( table, token, NULL );
+    if ( i >= 0
+         && table->sessions[i].generation == generation )
+    {
+        Session *s = &table->sessions[i];
+        s->attached = 0;
+        s->detached_ms = now_ms;
+        s->state.n_rooms = ( n_rooms < SESSION_MAX_ROOMS ? n_rooms : SESSION_MAX_ROOMS );
+        memcpy( s->state.rooms, rooms, s->state.n_rooms * sizeof( uint32_t ) );
+    }
+    pthread_mutex_unlock( &table->lock );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+session_table_close( SessionTable * table,
+                     const char * token,
+                     const uint64_t generation )
+{
+    pthread_mutex_lock( &table->lock );
+    int *link;
+    const int i = find_locked( table, token, &link );
+    if ( i >= 0
+         && table->sessions[i].generation == generation )
+    {
+        remove_locked( table, link );
+    }
+    pthread_mutex_unlock( &table->lock );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+session_table_expire( SessionTable * table,
+                      const uint64_t now_ms )
+{
+    int n_expired = 0;
+    pthread_mutex_lock( &table->lock );
+    for ( uint32_t b = 0; b <= table->bucket_mask; ++b )
+    {
+        int *link = &table->buckets[b];
+        while ( *link >= 0 )
+        {
+            if ( expired( table, &table->sessions[*link], now_ms ) )
+            {
+                remove_locked( table, link );
+                ++n_expired;
+            }
+            else
+            {
+                link = &table->sessions[*link].next;
+            }
+        }
+    }
+    pthread_mutex_unlock( &table->lock );
+    return n_expired;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+session_table_count( SessionTable * table )
+{
+    pthread_mutex_lock( &table->lock );
+    const int n = table->count;
+    pthread_mutex_unlock( &table->lock );
+    return n;
+}
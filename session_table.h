@@ -0,0 +1,80 @@
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+  ¥brief 再接続で引き継げるセッションの表。
+  (hello) のたびに推測できないトークンを発行し、切断した後も ttl の間はクライアントIDと参加中の部屋を覚えておく。
+  別の接続（別のシャードでもよい）が (resume トークン ...) でそれを引き継ぐ。
+  引き継ぐたびに世代が進み、古い世代の接続が後から切断や終了を伝えても無視する。
+  どの関数も複数スレッドから呼んでよい。
+ */
+typedef struct SessionTable SessionTable;
+
+#define SESSION_TOKEN_LEN 32 //!< トークンの文字数。128ビットの乱数を16進数で表す
+#define SESSION_MAX_ROOMS 16
+
+/*!
+  ¥brief セッションが引き継ぐ内容
+ */
+typedef struct {
+    int client_id;
+    uint64_t first_seq; //!< 発行した時点の最後のシーケンス番号。これより前のメッセージは送り直さない
+    uint32_t rooms[SESSION_MAX_ROOMS]; //!< 最後に切断した時点で参加していた部屋
+    int n_rooms;
+} SessionState;
+
+/*!
+  ¥brief 表を作る
+  ¥param capacity 覚えておくセッションの数の上限
+  ¥param ttl_ms 切断してから引き継げる時間
+  ¥return 作成された表。エラーの場合は NULL
+ */
+SessionTable * session_table_create( const int capacity, const uint64_t ttl_ms );
+
+/*!
+  ¥brief 表を解放する
+ */
+void session_table_destroy( SessionTable * table );
+
+/*!
+  ¥brief 接続中のセッションを発行する
+  ¥param token 発行したトークンを終端文字付きで書き込む SESSION_TOKEN_LEN + 1 バイトの領域
+  ¥return 世代番号。表が一杯・乱数が得られない場合は0
+ */
+uint64_t session_table_open( SessionTable * table, const int client_id, const uint64_t first_seq,
+                             const uint64_t now_ms, char * token );
+
+/*!
+  ¥brief セッションを引き継ぐ。接続中のものも引き継げ、それまでの接続は古い世代になる
+  ¥param state 引き継ぐ内容
+  ¥return 新しい世代番号。トークンが無い・期限切れの場合は0
+ */
+uint64_t session_table_resume( SessionTable * table, const char * token, const size_t len,
+                               const uint64_t now_ms, SessionState * state );
+
+/*!
+  ¥brief 接続が切れたことを記録し、参加中の部屋を覚えておく。ttl の間は引き継げる
+ */
+void session_table_detach( SessionTable * table, const char * token, const uint64_t generation,
+                           const uint32_t * rooms, const int n_rooms, const uint64_t now_ms );
+
+/*!
+  ¥brief セッションを捨てる。(quit) で終えた場合など、もう引き継がないときに呼ぶ
+ */
+void session_table_close( SessionTable * table, const char * token, const uint64_t generation );
+
+/*!
+  ¥brief 切断から ttl を過ぎたセッションを捨てる
+  ¥return 捨てた数
+ */
+int session_table_expire( SessionTable * table, const uint64_t now_ms );
+
+/*!
+  ¥brief 覚えているセッションの数
+ */
+int session_table_count( SessionTable * table );
+
+#endif
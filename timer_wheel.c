@@ -0,0 +1,285 @@
+
+#include "timer_wheel.h"
+
+#include <stddef.h>
+
+#define SLOT_MASK ( TIMER_WHEEL_SLOTS - 1 )
+#define MAX_TICKS ( ( (uint64_t)1 << ( TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS ) ) - 1 )
+
+/* --------------------------------------------------------------------------- */
+static void
+list_init( TimerNode * head )
+{
+    head->next = head->prev = head;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+list_add( TimerNode * head,
+          TimerNode * node )
+{
+    node->prev = head->prev;
+    node->next = head;
+    head->prev->next = node;
+    head->prev = node;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  タイマーを期限に合った段とスロットに置く。期限を過ぎていれば次の刻みで発火させる
+ */
+static void
+place( TimerWheel * wheel,
+       TimerNode * timer )
+{
+    uint64_t expires = ( timer->expires < wheel->current ? wheel->current : timer->expires );
+    if ( expires - wheel->current > MAX_TICKS )
+    {
+        expires = wheel->current + MAX_TICKS; // 最上段より先は最上段の端に置き、振り分け直すときに延ばす
+    }
+
+    const uint64_t delta = expires - wheel->current;
+    int level = 0;
+    while ( level < TIMER_WHEEL_LEVELS - 1
+            && delta >= ( (uint64_t)1 << ( TIMER_WHEEL_BITS * ( level + 1 ) ) ) )
+    {
+        ++level;
+    }
+
+    const int slot = (int)( ( expires >> ( TIMER_WHEEL_BITS * level ) ) & SLOT_MASK );
+    list_add( &wheel->slots[level][slot], timer );
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+unlink_timer( TimerWheel * wheel,
+              TimerNode * timer )
+{
+    TimerNode *next = timer->next;
+    timer->prev->next = next;
+    next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+
+    // 番兵だけになったらスロットのビットを下ろす。番兵は slots の中にあるので位置から段とスロットが分かる
+    if ( next == next->next )
+    {
+        const TimerNode *base = &wheel->slots[0][0];
+        if ( next >= base && next < base + TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS )
+        {
+            const ptrdiff_t i = next - base;
+            wheel->occupied[i / TIMER_WHEEL_SLOTS] &= ~( (uint64_t)1 << ( i % TIMER_WHEEL_SLOTS ) );
+        }
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  スロットの中身を head へ移す
+ */
+static void
+take_slot( TimerWheel * wheel,
+           const int level,
+           const int slot,
+           TimerNode * head )
+{
+    TimerNode *s = &wheel->slots[level][slot];
+    list_init( head );
+    if ( s->next != s )
+    {
+        head->next = s->next;
+        head->prev = s->prev;
+        head->next->prev = head;
+        head->prev->next = head;
+        list_init( s );
+    }
+    wheel->occupied[level] &= ~( (uint64_t)1 << slot );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+timer_wheel_init( TimerWheel * wheel,
+                  const uint64_t now_ms )
+{
+    for ( int level = 0; level < TIMER_WHEEL_LEVELS; ++level )
+    {
+        for ( int slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot )
+        {
+            list_init( &wheel->slots[level][slot] );
+        }
+        wheel->occupied[level] = 0;
+    }
+    wheel->current = now_ms / TIMER_TICK_MS;
+    wheel->count = 0;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+timer_init( TimerNode * timer,
+            TimerCallback callback,
+            void * arg )
+{
+    timer->next = timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+timer_wheel_arm( TimerWheel * wheel,
+                 TimerNode * timer,
+                 const uint64_t expires_ms )
+{
+    timer_wheel_cancel( wheel, timer );
+    timer->expires = ( expires_ms + TIMER_TICK_MS - 1 ) / TIMER_TICK_MS; // 早く発火しないよう切り上げる
+    place( wheel, timer );
+    ++wheel->count;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+timer_wheel_cancel( TimerWheel * wheel,
+                    TimerNode * timer )
+{
+    if ( timer->prev == NULL )
+    {
+        return;
+    }
+    unlink_timer( wheel, timer );
+    --wheel->count;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+timer_armed( const TimerNode * timer )
+{
+    return timer->prev != NULL;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+timer_wheel_advance( TimerWheel * wheel,
+                     const uint64_t now_ms )
+{
+    const uint64_t target = now_ms / TIMER_TICK_MS;
+    if ( wheel->count == 0 )
+    {
+        if ( wheel->current <= target ) wheel->current = target + 1;
+        return 0;
+    }
+
+    int n_fired = 0;
+    TimerNode head;
+    while ( wheel->current <= target )
+    {
+        const int slot = (int)( wheel->current & SLOT_MASK );
+
+        // 下の段が一周したら、上の段の今のスロットを振り分け直す
+        if ( slot == 0 )
+        {
+            for ( int level = 1; level < TIMER_WHEEL_LEVELS; ++level )
+            {
+                const int s = (int)( ( wheel->current >> ( TIMER_WHEEL_BITS * level ) ) & SLOT_MASK );
+                take_slot( wheel, level, s, &head );
+                while ( head.next != &head )
+                {
+                    TimerNode *timer = head.next;
+                    unlink_timer( wheel, timer );
+                    place( wheel, timer );
+                }
+                if ( s != 0 )
+                {
+                    break;
+                }
+            }
+        }
+
+        // コールバックの中での登録・取り消しに備え、先にスロットから外して刻みを進める
+        take_slot( wheel, 0, slot, &head );
+        ++wheel->current;
+        while ( head.next != &head )
+        {
+            TimerNode *timer = head.next;
+            unlink_timer( wheel, timer );
+            --wheel->count;
+            ++n_fired;
+            timer->callback( timer, timer->arg );
+        }
+
+        if ( wheel->count == 0 )
+        {
+            if ( wheel->current <= target ) wheel->current = target + 1;
+            break;
+        }
+    }
+    return n_fired;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  pos から見て次に空でないスロットまでの距離。pos 自身も含める
+ */
+static int
+next_occupied( const uint64_t bits,
+               const int pos )
+{
+    const uint64_t rotated = ( pos == 0 ? bits : ( bits >> pos ) | ( bits << ( TIMER_WHEEL_SLOTS - pos ) ) );
+    return __builtin_ctzll( rotated );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+timer_wheel_timeout( const TimerWheel * wheel,
+                     const uint64_t now_ms,
+                     const int max_ms )
+{
+    if ( wheel->count == 0 )
+    {
+        return max_ms;
+    }
+
+    uint64_t next = UINT64_MAX; // 次に処理が必要な刻み
+    if ( wheel->occupied[0] != 0 )
+    {
+        next = wheel->current + next_occupied( wheel->occupied[0], (int)( wheel->current & SLOT_MASK ) );
+    }
+
+    // 上の段は、空でないスロットを振り分け直す刻み
+    for ( int level = 1; level < TIMER_WHEEL_LEVELS; ++level )
+    {
+        uint64_t bits = wheel->occupied[level];
+        if ( bits == 0 )
+        {
+            continue;
+        }
+
+        const int shift = TIMER_WHEEL_BITS * level;
+        const uint64_t pos = wheel->current >> shift;
+        const int idx = (int)( pos & SLOT_MASK );
+        const int partial = ( wheel->current & ( ( (uint64_t)1 << shift ) - 1 ) ) != 0;
+
+        // 今のスロットは、この周回の途中なら振り分けが済んでいるので次の周回になる
+        uint64_t d;
+        if ( partial && ( bits & ( (uint64_t)1 << idx ) ) )
+        {
+            bits &= ~( (uint64_t)1 << idx );
+            d = ( bits != 0 ? (uint64_t)next_occupied( bits, idx ) : TIMER_WHEEL_SLOTS );
+        }
+        else
+        {
+            d = (uint64_t)next_occupied( bits, idx );
+            if ( d == 0 && partial ) d = TIMER_WHEEL_SLOTS;
+        }
+
+        const uint64_t tick = ( pos + d ) << shift;
+        if ( tick < next ) next = tick;
+    }
+
+    const uint64_t at_ms = next * TIMER_TICK_MS;
+    if ( at_ms <= now_ms )
+    {
+        return 0;
+    }
+    return ( at_ms - now_ms < (uint64_t)max_ms ? (int)( at_ms - now_ms ) : max_ms );
+}
@@ -0,0 +1,84 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdint.h>
+
+/*!
+  ¥brief 階層型のタイマーホイール。
+  TIMER_WHEEL_SLOTS 個のスロットを持つ輪を TIMER_WHEEL_LEVELS 段重ね、
+  期限までの残りが短いタイマーほど細かい段に置く。上の段のスロットは、下の段が一周するたびに
+  1つずつ下の段へ振り分け直す。登録・取り消しは O(1) で、時間を進めるときは
+  期限の来たスロットだけを見るので、タイマーの総数に比例する走査は発生しない。
+  1つのホイールは1つのスレッドからだけ使うこと。
+ */
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS ( 1 << TIMER_WHEEL_BITS )
+#define TIMER_WHEEL_LEVELS 4 // 1刻み10msなら最上段は約46時間先まで
+#define TIMER_TICK_MS 10
+
+struct TimerNode;
+
+/*!
+  ¥brief 期限が来たときに呼ばれる。コールバックの中でタイマーを登録し直してもよい
+ */
+typedef void (*TimerCallback)( struct TimerNode * timer, void * arg );
+
+/*!
+  ¥brief タイマー1つ分。使う側の構造体に埋め込んで使う
+ */
+typedef struct TimerNode {
+    struct TimerNode *next;
+    struct TimerNode *prev; // 登録されていなければ NULL
+    uint64_t expires; // 期限（刻み）
+    TimerCallback callback;
+    void *arg;
+} TimerNode;
+
+typedef struct {
+    TimerNode slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; // 循環リストの番兵
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // 空でないスロットのビット
+    uint64_t current; // 次に処理する刻み
+    int count; // 登録中のタイマーの数
+} TimerWheel;
+
+/*!
+  ¥brief ホイールを空の状態に初期化する
+  ¥param now_ms 現在時刻（ミリ秒）。以後も同じ時計を使うこと
+ */
+void timer_wheel_init( TimerWheel * wheel, const uint64_t now_ms );
+
+/*!
+  ¥brief 登録前のタイマーを初期化する
+ */
+void timer_init( TimerNode * timer, TimerCallback callback, void * arg );
+
+/*!
+  ¥brief タイマーを expires_ms に発火するよう登録する。登録済みなら登録し直す
+ */
+void timer_wheel_arm( TimerWheel * wheel, TimerNode * timer, const uint64_t expires_ms );
+
+/*!
+  ¥brief タイマーを取り消す。登録されていなければ何もしない
+ */
+void timer_wheel_cancel( TimerWheel * wheel, TimerNode * timer );
+
+/*!
+  ¥brief タイマーが登録中か
+ */
+int timer_armed( const TimerNode * timer );
+
+/*!
+  ¥brief now_ms までに期限の来たタイマーのコールバックを呼ぶ
+  ¥return 呼んだ数
+ */
+int timer_wheel_advance( TimerWheel * wheel, const uint64_t now_ms );
+
+/*!
+  ¥brief 次に時間を進める必要がある時刻までのミリ秒数。
+  上の段のタイマーは振り分け直す時刻を返すので、実際の期限より早いことがある
+  ¥param max_ms タイマーが無い場合や、それより先の場合に返す値
+ */
+int timer_wheel_timeout( const TimerWheel * wheel, const uint64_t now_ms, const int max_ms );
+
+#endif
@@ -0,0 +1,762 @@
+
+#define _GNU_SOURCE // memmem
+
+#include "trigram_index.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define INDEX_MAGIC 0x49475254 // "TRGI"
+#define INDEX_VERSION 2
+#define INITIAL_TABLE_BITS 12
+#define MAX_LINE 4096
+
+// インデックスファイルの先頭
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+} IndexFileHeader;
+
+// メッセージ1件分のレコード。この後に n_trigrams 個の uint32_t が続く
+typedef struct {
+    uint64_t seq; // ログ中のシーケンス番号
+    uint32_t n_trigrams;
+    uint32_t reserved;
+} IndexRecord;
+
+// 1つの 3-gram を含むメッセージのシーケンス番号の昇順リスト
+typedef struct {
+    uint32_t key; // 3-gram + 1。0 は空きを表す
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *ids;
+} Posting;
+
+struct TrigramIndex {
+    pthread_rwlock_t lock;
+
+    MessageLog *log; // 候補の本文を読むためのログ
+    FILE *index_fp; // レコードの追記用 (write_lock)
+    pthread_mutex_t write_lock;
+
+    // まだファイルに書いていないレコード。trigram_index_flush がまとめて書き出す
+    pthread_mutex_t pending_lock;
+    char *pending;
+    size_t pending_len;
+    size_t pending_capacity;
+
+    // 3-gram -> Posting のオープンアドレス法のハッシュ表
+    Posting *table;
+    uint32_t table_bits;
+    uint32_t n_keys;
+
+    uint32_t n_docs;
+    uint64_t covered; // インデックス済みの最後のシーケンス番号
+};
+
+static int rebuild( TrigramIndex * idx, const char * index_file );
+static int load( TrigramIndex * idx, const char * index_file );
+static int catch_up( TrigramIndex * idx );
+static int add_document( TrigramIndex * idx, const uint64_t seq,
+                         const uint32_t * trigrams, const uint32_t n_trigrams );
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+hash_key( const uint32_t key,
+          const uint32_t bits )
+{
+    return ( key * 2654435761u ) >> ( 32 - bits );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+compare_u32( const void * a,
+             const void * b )
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return ( x < y ? -1 : x > y ? 1 : 0 );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  文字列に含まれる 3-gram を重複なしで out に格納し、その個数を返す。
+  out には len 個分の領域が必要
+ */
+static uint32_t
+extract_trigrams( const char * text,
+                  const size_t len,
+                  uint32_t * out )
+{
+    const unsigned char *p = (const unsigned char *)text;
+    if ( len < 3 )
+    {
+        return 0;
+    }
+
+    uint32_t n = 0;
+    for ( size_t i = 0; i + 2 < len; ++i )
+    {
+        out[n++] = ( (uint32_t)p[i] << 16 ) | ( (uint32_t)p[i + 1] << 8 ) | p[i + 2];
+    }
+
+    qsort( out, n, sizeof( uint32_t ), compare_u32 );
+
+    uint32_t uniq = 1;
+    for ( uint32_t i = 1; i < n; ++i )
+    {
+        if ( out[i] != out[uniq - 1] )
+        {
+            out[uniq++] = out[i];
+        }
+    }
+    return uniq;
+}
+
+/* --------------------------------------------------------------------------- */
+static Posting *
+find_posting( const TrigramIndex * idx,
+              const uint32_t trigram )
+{
+    const uint32_t key = trigram + 1;
+    const uint32_t mask = ( 1u << idx->table_bits ) - 1;
+    for ( uint32_t h = hash_key( key, idx->table_bits ); ; h = ( h + 1 ) & mask )
+    {
+        Posting *p = &idx->table[h];
+        if ( p->key == key ) return p;
+        if ( p->key == 0 ) return NULL;
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+grow_table( TrigramIndex * idx )
+{
+    const uint32_t new_bits = idx->table_bits + 1;
+    Posting *new_table = calloc( (size_t)1 << new_bits, sizeof( Posting ) );
+    if ( new_table == NULL )
+    {
+        perror( "calloc" );
+        return 0;
+    }
+
+    const uint32_t old_size = 1u << idx->table_bits;
+    const uint32_t mask = ( 1u << new_bits ) - 1;
+    for ( uint32_t i = 0; i < old_size; ++i )
+    {
+        if ( idx->table[i].key == 0 ) continue;
+
+        uint32_t h = hash_key( idx->table[i].key, new_bits );
+        while ( new_table[h].key != 0 ) h = ( h + 1 ) & mask;
+        new_table[h] = idx->table[i];
+    }
+
+    free( idx->table );
+    idx->table = new_table;
+    idx->table_bits = new_bits;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static Posting *
+get_or_create_posting( TrigramIndex * idx,
+                       const uint32_t trigram )
+{
+    // 使用率が7割を超えたら表を倍にする
+    if ( ( idx->n_keys + 1 ) * 10 > ( 1u << idx->table_bits ) * 7
+         && ! grow_table( idx ) )
+    {
+        return NULL;
+    }
+
+    const uint32_t key = trigram + 1;
+    const uint32_t mask = ( 1u << idx->table_bits ) - 1;
+    uint32_t h = hash_key( key, idx->table_bits );
+    while ( idx->table[h].key != 0 )
+    {
+        if ( idx->table[h].key == key ) return &idx->table[h];
+        h = ( h + 1 ) & mask;
+    }
+
+    idx->table[h].key = key;
+    ++idx->n_keys;
+    return &idx->table[h];
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+free_memory( TrigramIndex * idx )
+{
+    if ( idx->table != NULL )
+    {
+        const uint32_t size = 1u << idx->table_bits;
+        for ( uint32_t i = 0; i < size; ++i )
+        {
+            free( idx->table[i].ids );
+        }
+    }
+    free( idx->table );
+    idx->table = NULL;
+    idx->n_keys = idx->n_docs = 0;
+    idx->covered = 0;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+reset_memory( TrigramIndex * idx )
+{
+    free_memory( idx );
+    idx->table_bits = INITIAL_TABLE_BITS;
+    idx->table = calloc( (size_t)1 << idx->table_bits, sizeof( Posting ) );
+    if ( idx->table == NULL )
+    {
+        perror( "calloc" );
+        return 0;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+TrigramIndex *
+trigram_index_open( const char * index_file,
+                    MessageLog * log )
+{
+    TrigramIndex *idx = calloc( 1, sizeof( TrigramIndex ) );
+    if ( idx == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    pthread_rwlock_init( &idx->lock, NULL );
+    pthread_mutex_init( &idx->write_lock, NULL );
+    pthread_mutex_init( &idx->pending_lock, NULL );
+    idx->log = log;
+
+    if ( ! reset_memory( idx ) )
+    {
+        trigram_index_close( idx );
+        return NULL;
+    }
+
+    // インデックスがログより先に進んでいる場合はログが差し替えられたとみなす
+    if ( ! load( idx, index_file )
+         || idx->covered > message_log_last_seq( log ) )
+    {
+        if ( ! rebuild( idx, index_file ) )
+        {
+            trigram_index_close( idx );
+            return NULL;
+        }
+    }
+
+    // 前回の終了後にログへ追記された分をインデックスに取り込む
+    const uint32_t before = idx->n_docs;
+    if ( ! catch_up( idx ) )
+    {
+        trigram_index_close( idx );
+        return NULL;
+    }
+    fflush( idx->index_fp );
+
+    fprintf( stderr, "trigram index: %u messages, %u trigrams (%u added from the log)\n",
+             idx->n_docs, idx->n_keys, idx->n_docs - before );
+    return idx;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+trigram_index_close( TrigramIndex * idx )
+{
+    if ( idx == NULL )
+    {
+        return;
+    }
+
+    if ( idx->index_fp != NULL )
+    {
+        trigram_index_flush( idx );
+        fclose( idx->index_fp );
+    }
+    free_memory( idx );
+    free( idx->pending );
+    pthread_mutex_destroy( &idx->pending_lock );
+    pthread_mutex_destroy( &idx->write_lock );
+    pthread_rwlock_destroy( &idx->lock );
+    free( idx );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  インデックスファイルを読み込む。末尾の書きかけのレコードは切り捨てる。
+  ファイルが無い、または形式が違う場合は0を返す
+ */
+static int
+load( TrigramIndex * idx,
+      const char * index_file )
+{
+    FILE *fp = fopen( index_file, "r+b" );
+    if ( fp == NULL )
+    {
+        return 0;
+    }
+
+    IndexFileHeader header;
+    if ( fread( &header, sizeof( header ), 1, fp ) != 1
+         || header.magic != INDEX_MAGIC
+         || header.version != INDEX_VERSION )
+    {
+        fprintf( stderr, "trigram index: %s has unknown format\n", index_file );
+        fclose( fp );
+        return 0;
+    }
+
+    uint32_t trigrams[MAX_LINE];
+    off_t good_end = sizeof( header );
+    IndexRecord rec;
+    while ( fread( &rec, sizeof( rec ), 1, fp ) == 1 )
+    {
+        if ( rec.n_trigrams > MAX_LINE
+             || rec.seq <= idx->covered
+             || rec.seq > UINT32_MAX
+             || fread( trigrams, sizeof( uint32_t ), rec.n_trigrams, fp ) != rec.n_trigrams )
+        {
+            break;
+        }
+
+        if ( ! add_document( idx, rec.seq, trigrams, rec.n_trigrams ) )
+        {
+            fclose( fp );
+            return 0;
+        }
+        good_end = ftello( fp );
+    }
+
+    // 書きかけのレコードを捨ててから追記を始める
+    if ( ftruncate( fileno( fp ), good_end ) != 0 )
+    {
+        perror( "ftruncate" );
+    }
+    fclose( fp );
+
+    idx->index_fp = fopen( index_file, "ab" );
+    if ( idx->index_fp == NULL )
+    {
+        perror( "fopen" );
+        return 0;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+rebuild( TrigramIndex * idx,
+         const char * index_file )
+{
+    fprintf( stderr, "trigram index: rebuilding %s from the log\n", index_file );
+
+    if ( idx->index_fp != NULL )
+    {
+        fclose( idx->index_fp );
+        idx->index_fp = NULL;
+    }
+
+    if ( ! reset_memory( idx ) )
+    {
+        return 0;
+    }
+
+    idx->index_fp = fopen( index_file, "wb" );
+    if ( idx->index_fp == NULL )
+    {
+        perror( "fopen" );
+        return 0;
+    }
+
+    IndexFileHeader header = { INDEX_MAGIC, INDEX_VERSION };
+    if ( fwrite( &header, sizeof( header ), 1, idx->index_fp ) != 1 )
+    {
+        perror( "fwrite" );
+        return 0;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  ログの covered より後のメッセージをすべてインデックスに追加する
+ */
+static int
+catch_up( TrigramIndex * idx )
+{
+    LogCursor cur;
+    if ( ! message_log_seek( idx->log, idx->covered + 1, &cur ) )
+    {
+        return 1;
+    }
+
+    LogRecord rec;
+    while ( message_log_next( &cur, &rec ) )
+    {
+        // サーバが書くことのない長さのメッセージは索引しない
+        if ( rec.len <= MAX_LINE
+             && ! trigram_index_add( idx, rec.seq, rec.msg, rec.len ) )
+        {
+            return 0;
+        }
+        idx->covered = rec.seq;
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+add_document( TrigramIndex * idx,
+              const uint64_t seq,
+              const uint32_t * trigrams,
+              const uint32_t n_trigrams )
+{
+    const uint32_t doc = (uint32_t)seq;
+    for ( uint32_t i = 0; i < n_trigrams; ++i )
+    {
+        Posting *p = get_or_create_posting( idx, trigrams[i] );
+        if ( p == NULL )
+        {
+            return 0;
+        }
+
+        if ( p->count >= p->cap )
+        {
+            const uint32_t new_cap = ( p->cap == 0 ? 4 : p->cap * 2 );
+            uint32_t *ids = realloc( p->ids, new_cap * sizeof( uint32_t ) );
+            if ( ids == NULL )
+            {
+                perror( "realloc" );
+                return 0;
+            }
+            p->ids = ids;
+            p->cap = new_cap;
+        }
+
+        // シーケンス番号は追加順なので末尾に足すだけで昇順が保たれる
+        p->ids[p->count++] = doc;
+    }
+
+    ++idx->n_docs;
+    idx->covered = seq;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  まだ書き出していないレコードの末尾に data を足す
+ */
+static int
+push_pending( TrigramIndex * idx,
+              const void * data,
+              const size_t len )
+{
+    if ( idx->pending_len + len > idx->pending_capacity )
+    {
+        size_t new_capacity = ( idx->pending_capacity == 0 ? MAX_LINE : idx->pending_capacity * 2 );
+        while ( new_capacity < idx->pending_len + len ) new_capacity *= 2;
+        char *p = realloc( idx->pending, new_capacity );
+        if ( p == NULL )
+        {
+            perror( "realloc" );
+            return 0;
+        }
+        idx->pending = p;
+        idx->pending_capacity = new_capacity;
+    }
+    memcpy( idx->pending + idx->pending_len, data, len );
+    idx->pending_len += len;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+trigram_index_add( TrigramIndex * idx,
+                   const uint64_t seq,
+                   const char * msg,
+                   const size_t len )
+{
+    uint32_t trigrams[MAX_LINE];
+    if ( len > MAX_LINE
+         || seq > UINT32_MAX )
+    {
+        return 0;
+    }
+
+    const uint32_t n_trigrams = extract_trigrams( msg, len, trigrams );
+
+    pthread_rwlock_wrlock( &idx->lock );
+
+    int ok = add_document( idx, seq, trigrams, n_trigrams );
+    if ( ok )
+    {
+        // インデックスファイルにはここで書かず、trigram_index_flush に任せる。
+        // 書き込めずに終了しても次回の起動時にログから補われる
+        IndexRecord rec = { seq, n_trigrams, 0 };
+        pthread_mutex_lock( &idx->pending_lock );
+        const size_t mark = idx->pending_len;
+        if ( ! push_pending( idx, &rec, sizeof( rec ) )
+             || ! push_pending( idx, trigrams, sizeof( uint32_t ) * n_trigrams ) )
+        {
+            idx->pending_len = mark; // 書きかけのレコードを残さない
+        }
+        pthread_mutex_unlock( &idx->pending_lock );
+    }
+
+    pthread_rwlock_unlock( &idx->lock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+trigram_index_flush( TrigramIndex * idx )
+{
+    pthread_mutex_lock( &idx->write_lock );
+
+    pthread_mutex_lock( &idx->pending_lock );
+    char *data = idx->pending;
+    const size_t len = idx->pending_len;
+    idx->pending = NULL;
+    idx->pending_len = idx->pending_capacity = 0;
+    pthread_mutex_unlock( &idx->pending_lock );
+
+    int ok = 1;
+    if ( len > 0 )
+    {
+        ok = ( fwrite( data, 1, len, idx->index_fp ) == len
+               && fflush( idx->index_fp ) == 0 );
+        if ( ! ok )
+        {
+            perror( "trigram index" );
+        }
+    }
+    free( data );
+
+    pthread_mutex_unlock( &idx->write_lock );
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+match_record( const LogRecord * rec,
+              const char * keyword,
+              const size_t keyword_len,
+              TrigramIndexCallback callback,
+              void * arg )
+{
+    if ( memmem( rec->msg, rec->len, keyword, keyword_len ) == NULL )
+    {
+        return 0; // 3-gram はすべて含むが連続していなかった
+    }
+    return callback( rec, arg );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+read_and_match( TrigramIndex * idx,
+                const uint32_t seq,
+                const char * keyword,
+                const size_t keyword_len,
+                TrigramIndexCallback callback,
+                void * arg )
+{
+    // まだ書き出されていないメッセージは読めないので飛ばす
+    LogRecord rec;
+    if ( ! message_log_read( idx->log, seq, &rec ) )
+    {
+        return 0;
+    }
+    return match_record( &rec, keyword, keyword_len, callback, arg );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+compare_posting_size( const void * a,
+                      const void * b )
+{
+    const Posting *x = *(Posting * const *)a;
+    const Posting *y = *(Posting * const *)b;
+    return ( x->count < y->count ? -1 : x->count > y->count ? 1 : 0 );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  昇順リスト ids[from..count) の中で value 以上の最初の位置を指数探索で求める
+ */
+static uint32_t
+gallop( const uint32_t * ids,
+        const uint32_t count,
+        uint32_t from,
+        const uint32_t value )
+{
+    uint32_t step = 1;
+    uint32_t hi = from;
+    while ( hi < count && ids[hi] < value )
+    {
+        from = hi + 1;
+        hi += step;
+        step *= 2;
+    }
+    if ( hi > count ) hi = count;
+
+    while ( from < hi )
+    {
+        const uint32_t mid = from + ( hi - from ) / 2;
+        if ( ids[mid] < value ) from = mid + 1;
+        else hi = mid;
+    }
+    return from;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+trigram_index_find( TrigramIndex * idx,
+                    const char * keyword,
+                    TrigramIndexCallback callback,
+                    void * arg )
+{
+    uint64_t next;
+    return trigram_index_find_page( idx, keyword, 1, 0, callback, arg, &next );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+trigram_index_find_page( TrigramIndex * idx,
+                         const char * keyword,
+                         const uint64_t from,
+                         const int limit,
+                         TrigramIndexCallback callback,
+                         void * arg,
+                         uint64_t * next )
+{
+    *next = 0;
+    const size_t keyword_len = strlen( keyword );
+    if ( keyword_len > MAX_LINE )
+    {
+        return 0;
+    }
+
+    // ロックはインデックスを引く間だけ持ち、ログを読む間は追加を止めない
+    int n_found = 0;
+    pthread_rwlock_rdlock( &idx->lock );
+
+    if ( keyword_len < 3 )
+    {
+        // 3-gram が作れないので from 以降の全メッセージを確かめる
+        const uint64_t covered = idx->covered;
+        pthread_rwlock_unlock( &idx->lock );
+
+        LogCursor cur;
+        LogRecord rec;
+        if ( message_log_seek( idx->log, ( from > 0 ? from : 1 ), &cur ) )
+        {
+            while ( message_log_next( &cur, &rec )
+                    && rec.seq <= covered )
+            {
+                n_found += match_record( &rec, keyword, keyword_len, callback, arg );
+                if ( limit > 0
+                     && n_found >= limit )
+                {
+                    *next = ( rec.seq < covered ? rec.seq + 1 : 0 );
+                    break;
+                }
+            }
+        }
+        return n_found;
+    }
+
+    // インデックスのシーケンス番号は32ビット
+    if ( from > UINT32_MAX )
+    {
+        pthread_rwlock_unlock( &idx->lock );
+        return 0;
+    }
+
+    uint32_t trigrams[MAX_LINE];
+    const uint32_t n_trigrams = extract_trigrams( keyword, keyword_len, trigrams );
+
+    Posting **lists = malloc( n_trigrams * sizeof( Posting * ) );
+    if ( lists == NULL )
+    {
+        perror( "malloc" );
+        pthread_rwlock_unlock( &idx->lock );
+        return -1;
+    }
+
+    for ( uint32_t i = 0; i < n_trigrams; ++i )
+    {
+        lists[i] = find_posting( idx, trigrams[i] );
+        if ( lists[i] == NULL )
+        {
+            // どのメッセージにも現れない 3-gram がある
+            free( lists );
+            pthread_rwlock_unlock( &idx->lock );
+            return 0;
+        }
+    }
+
+    // 短いリストから順に積集合をとる。from より前は候補にしない
+    qsort( lists, n_trigrams, sizeof( Posting * ), compare_posting_size );
+
+    const uint32_t first = gallop( lists[0]->ids, lists[0]->count, 0, (uint32_t)from );
+    uint32_t *cand = malloc( ( lists[0]->count - first + 1 ) * sizeof( uint32_t ) );
+    if ( cand == NULL )
+    {
+        perror( "malloc" );
+        free( lists );
+        pthread_rwlock_unlock( &idx->lock );
+        return -1;
+    }
+    memcpy( cand, lists[0]->ids + first, ( lists[0]->count - first ) * sizeof( uint32_t ) );
+    uint32_t n_cand = lists[0]->count - first;
+
+    for ( uint32_t i = 1; i < n_trigrams && n_cand > 0; ++i )
+    {
+        const Posting *p = lists[i];
+        uint32_t pos = 0;
+        uint32_t n_keep = 0;
+        for ( uint32_t c = 0; c < n_cand; ++c )
+        {
+            pos = gallop( p->ids, p->count, pos, cand[c] );
+            if ( pos >= p->count ) break;
+            if ( p->ids[pos] == cand[c] ) cand[n_keep++] = cand[c];
+        }
+        n_cand = n_keep;
+    }
+    pthread_rwlock_unlock( &idx->lock );
+    free( lists );
+
+    // 候補は cand に写してあるので、本文の確認はロックの外で行う
+    for ( uint32_t c = 0; c < n_cand; ++c )
+    {
+        n_found += read_and_match( idx, cand[c], keyword, keyword_len, callback, arg );
+        if ( limit > 0
+             && n_found >= limit )
+        {
+            *next = ( c + 1 < n_cand ? (uint64_t)cand[c + 1] : 0 );
+            break;
+        }
+    }
+
+    free( cand );
+    return n_found;
+}
+
+/* --------------------------------------------------------------------------- */
+uint32_t
+trigram_index_size( TrigramIndex * idx )
+{
+    pthread_rwlock_rdlock( &idx->lock );
+    const uint32_t n = idx->n_docs;
+    pthread_rwlock_unlock( &idx->lock );
+    return n;
+}
@@ -0,0 +1,81 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "message_log.h"
+
+/*!
+  ¥brief メッセージログに対する 3-gram の転置インデックス。
+  メッセージ本文に含まれる3バイトの並びごとに、それを含むメッセージのシーケンス番号を
+  昇順に持つ。インデックスファイルはメッセージごとのレコードを追記していく形式で、
+  起動時に読み込んでメモリ上に展開する。ファイルが無い・壊れている場合はログから作り直す。
+  追加したレコードはメモリに溜めておき、trigram_index_flush がまとめてファイルに書く。
+ */
+typedef struct TrigramIndex TrigramIndex;
+
+/*!
+  ¥brief 検索で見つかったメッセージを受け取るコールバック
+  ¥param rec ログから読んだメッセージ
+  ¥param arg trigram_index_find に渡した引数
+  ¥return 結果として数える場合は1。部屋が違うなどで除いた場合は0
+ */
+typedef int (*TrigramIndexCallback)( const LogRecord * rec, void * arg );
+
+/*!
+  ¥brief インデックスを開く。ログにあってインデックスに無いメッセージはここで追加される
+  ¥param index_file インデックスファイルのパス
+  ¥param log 本文を読むメッセージログ。インデックスより長く開いておくこと
+  ¥return 作成されたインデックス。エラーの場合は NULL
+ */
+TrigramIndex * trigram_index_open( const char * index_file, MessageLog * log );
+
+/*!
+  ¥brief インデックスを閉じてメモリを解放する
+ */
+void trigram_index_close( TrigramIndex * idx );
+
+/*!
+  ¥brief ログに追記したメッセージをインデックスに追加する
+  ¥param seq ログでのシーケンス番号
+  ¥param msg メッセージ本文
+  ¥param len 本文の長さ
+  ¥return 成功した場合は1
+ */
+int trigram_index_add( TrigramIndex * idx, const uint64_t seq, const char * msg, const size_t len );
+
+/*!
+  ¥brief 追加したレコードをインデックスファイルに書き出す。
+  書き出さずに終了しても次回の起動時にログから補われるので、fsync はしない
+  ¥return 成功した場合は1
+ */
+int trigram_index_flush( TrigramIndex * idx );
+
+/*!
+  ¥brief keyword を含むメッセージを古い順にすべて callback へ渡す。
+  インデックスで候補を絞り込み、ログから読んだ本文で実際に含むかを確かめる。
+  3バイトより短い keyword ではログ全体を走査する
+  ¥return 見つかった件数。エラーの場合は-1
+ */
+int trigram_index_find( TrigramIndex * idx, const char * keyword, TrigramIndexCallback callback, void * arg );
+
+/*!
+  ¥brief trigram_index_find と同じだが、シーケンス番号 from 以降だけを調べ、
+  callback が1を返した件数が limit に達したらそこで止める。
+  続きは *next から始めればよく、調べ終えたメッセージを読み直すことはない
+  ¥param from 調べ始めるシーケンス番号
+  ¥param limit 返す件数の上限。0 なら上限なし
+  ¥param next 続きのシーケンス番号。最後まで調べた場合は0
+  ¥return 見つかった件数。エラーの場合は-1
+ */
+int trigram_index_find_page( TrigramIndex * idx, const char * keyword, const uint64_t from, const int limit,
+                             TrigramIndexCallback callback, void * arg, uint64_t * next );
+
+/*!
+  ¥brief インデックスに登録されているメッセージ数を返す
+ */
+uint32_t trigram_index_size( TrigramIndex * idx );
+
+#endif
@@ -0,0 +1,405 @@
+
+#include "uring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* --------------------------------------------------------------------------- */
+static int
+sys_setup( const unsigned entries,
+           struct io_uring_params * p )
+{
+    return (int)syscall( __NR_io_uring_setup, entries, p );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+sys_enter( const int fd,
+           const unsigned to_submit,
+           const unsigned min_complete,
+           const unsigned flags,
+           const void * arg,
+           const size_t argsz )
+{
+    return (int)syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz );
+}
+
+/* --------------------------------------------------------------------------- */
+static int
+sys_register( const int fd,
+              const unsigned opcode,
+              void * arg,
+              const unsigned nr_args )
+{
+    return (int)syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+uring_init( Uring * ring,
+            const unsigned entries )
+{
+    memset( ring, 0, sizeof( *ring ) );
+    ring->fd = -1;
+
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    // マルチショットの recv は1回の受信ごとに CQE を出すので、CQ は大きめに取る
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 4;
+
+    const int fd = sys_setup( entries, &p );
+    if ( fd < 0 )
+    {
+        return 0;
+    }
+
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG
+                              | IORING_FEAT_LINKED_FILE;
+    if ( ( p.features & required ) != required )
+    {
+        close( fd );
+        errno = ENOSYS;
+        return 0;
+    }
+
+    // FEAT_SINGLE_MMAP なので SQ と CQ のリングは1回の mmap で両方見える
+    const size_t sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    const size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    ring->ring_size = ( sq_size > cq_size ? sq_size : cq_size );
+    ring->ring_ptr = mmap( NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           fd, IORING_OFF_SQ_RING );
+    if ( ring->ring_ptr == MAP_FAILED )
+    {
+        ring->ring_ptr = NULL;
+        close( fd );
+        return 0;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       fd, IORING_OFF_SQES );
+    if ( ring->sqes == MAP_FAILED )
+    {
+        const int err = errno;
+        munmap( ring->ring_ptr, ring->ring_size );
+        ring->ring_ptr = NULL;
+        ring->sqes = NULL;
+        close( fd );
+        errno = err;
+        return 0;
+    }
+
+    char *sq = ring->ring_ptr;
+    ring->sq_head = (unsigned *)( sq + p.sq_off.head );
+    ring->sq_tail = (unsigned *)( sq + p.sq_off.tail );
+    ring->sq_array = (unsigned *)( sq + p.sq_off.array );
+    ring->sq_mask = *(unsigned *)( sq + p.sq_off.ring_mask );
+    ring->sq_entries = p.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+
+    char *cq = ring->ring_ptr;
+    ring->cq_head = (unsigned *)( cq + p.cq_off.head );
+    ring->cq_tail = (unsigned *)( cq + p.cq_off.tail );
+    ring->cq_mask = *(unsigned *)( cq + p.cq_off.ring_mask );
+    ring->cqes = (struct io_uring_cqe *)( cq + p.cq_off.cqes );
+
+    ring->fd = fd;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+uring_supported()
+{
+    Uring ring;
+    if ( ! uring_init( &ring, 8 ) )
+    {
+        return 0;
+    }
+
+    UringBufRing br;
+    const int ok = uring_buf_ring_init( &ring, &br, 0, 8, 64 );
+    const int err = errno;
+    uring_buf_ring_destroy( &ring, &br );
+    uring_destroy( &ring );
+    errno = err;
+    return ok;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_destroy( Uring * ring )
+{
+    if ( ring->sqes != NULL ) munmap( ring->sqes, ring->sqes_size );
+    if ( ring->ring_ptr != NULL ) munmap( ring->ring_ptr, ring->ring_size );
+    if ( ring->fd != -1 ) close( ring->fd );
+    memset( ring, 0, sizeof( *ring ) );
+    ring->fd = -1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  確保済みの SQE をカーネルに見せる。見せた数を返す
+ */
+static unsigned
+publish( Uring * ring )
+{
+    const unsigned tail = *ring->sq_tail;
+    if ( tail == ring->sqe_tail )
+    {
+        return 0;
+    }
+    __atomic_store_n( ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE );
+    return ring->sqe_tail - tail;
+}
+
+/* --------------------------------------------------------------------------- */
+struct io_uring_sqe *
+uring_get_sqe( Uring * ring )
+{
+    unsigned head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+    if ( ring->sqe_tail - head >= ring->sq_entries )
+    {
+        // 一杯なので待たずに投入して空きを作る
+        const unsigned n = publish( ring );
+        if ( n > 0 && sys_enter( ring->fd, n, 0, 0, NULL, 0 ) < 0 )
+        {
+            return NULL;
+        }
+        head = __atomic_load_n( ring->sq_head, __ATOMIC_ACQUIRE );
+        if ( ring->sqe_tail - head >= ring->sq_entries )
+        {
+            return NULL;
+        }
+    }
+
+    const unsigned idx = ring->sqe_tail & ring->sq_mask;
+    ring->sq_array[idx] = idx;
+    ++ring->sqe_tail;
+
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset( sqe, 0, sizeof( *sqe ) );
+    return sqe;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+uring_submit_and_wait( Uring * ring,
+                       const int timeout_ms )
+{
+    const unsigned n = publish( ring );
+
+    // 既に CQE があれば待たずに投入だけする
+    const unsigned min_complete = ( uring_peek_cqe( ring ) != NULL ? 0 : 1 );
+
+    int ret;
+    if ( timeout_ms < 0 )
+    {
+        ret = sys_enter( ring->fd, n, min_complete, IORING_ENTER_GETEVENTS, NULL, 0 );
+    }
+    else
+    {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)( timeout_ms % 1000 ) * 1000000;
+
+        struct io_uring_getevents_arg arg;
+        memset( &arg, 0, sizeof( arg ) );
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        ret = sys_enter( ring->fd, n, min_complete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                         &arg, sizeof( arg ) );
+    }
+
+    if ( ret < 0 )
+    {
+        return ( errno == ETIME ? 0 : -errno );
+    }
+    return ret;
+}
+
+/* --------------------------------------------------------------------------- */
+struct io_uring_cqe *
+uring_peek_cqe( Uring * ring )
+{
+    const unsigned head = *ring->cq_head;
+    if ( head == __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) )
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_cqe_seen( Uring * ring )
+{
+    __atomic_store_n( ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+uring_buf_ring_init( Uring * ring,
+                     UringBufRing * br,
+                     const uint16_t bgid,
+                     const unsigned entries,
+                     const unsigned buf_size )
+{
+    memset( br, 0, sizeof( *br ) );
+
+    br->br_size = entries * sizeof( struct io_uring_buf );
+    br->br = mmap( NULL, br->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( br->br == MAP_FAILED )
+    {
+        br->br = NULL;
+        return 0;
+    }
+
+    br->bufs = malloc( (size_t)entries * buf_size );
+    if ( br->bufs == NULL )
+    {
+        munmap( br->br, br->br_size );
+        br->br = NULL;
+        return 0;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = (uint64_t)(uintptr_t)br->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if ( sys_register( ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    {
+        const int err = errno;
+        free( br->bufs );
+        munmap( br->br, br->br_size );
+        memset( br, 0, sizeof( *br ) );
+        errno = err;
+        return 0;
+    }
+
+    br->entries = entries;
+    br->buf_size = buf_size;
+    br->bgid = bgid;
+    for ( unsigned i = 0; i < entries; ++i )
+    {
+        uring_buf_ring_recycle( br, (uint16_t)i );
+    }
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_buf_ring_destroy( Uring * ring,
+                        UringBufRing * br )
+{
+    if ( br->br == NULL )
+    {
+        return;
+    }
+
+    if ( ring->fd != -1 )
+    {
+        struct io_uring_buf_reg reg;
+        memset( &reg, 0, sizeof( reg ) );
+        reg.bgid = br->bgid;
+        sys_register( ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1 );
+    }
+    free( br->bufs );
+    munmap( br->br, br->br_size );
+    memset( br, 0, sizeof( *br ) );
+}
+
+/* --------------------------------------------------------------------------- */
+char *
+uring_buf_ring_data( UringBufRing * br,
+                     const uint16_t bid )
+{
+    return br->bufs + (size_t)bid * br->buf_size;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_buf_ring_recycle( UringBufRing * br,
+                        const uint16_t bid )
+{
+    struct io_uring_buf *buf = &br->br->bufs[br->tail & ( br->entries - 1 )];
+    buf->addr = (uint64_t)(uintptr_t)uring_buf_ring_data( br, bid );
+    buf->len = br->buf_size;
+    buf->bid = bid;
+    ++br->tail;
+    __atomic_store_n( &br->br->tail, br->tail, __ATOMIC_RELEASE );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_prep_multishot_accept( struct io_uring_sqe * sqe,
+                             const int fd,
+                             const uint64_t user_data )
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_prep_multishot_recv( struct io_uring_sqe * sqe,
+                           const int fd,
+                           const uint16_t bgid,
+                           const uint64_t user_data )
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_prep_sendmsg( struct io_uring_sqe * sqe,
+                    const int fd,
+                    const struct msghdr * msg,
+                    const uint64_t user_data )
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_prep_poll( struct io_uring_sqe * sqe,
+                 const int fd,
+                 const unsigned events,
+                 const uint64_t user_data )
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+uring_prep_cancel_fd( struct io_uring_sqe * sqe,
+                      const int fd,
+                      const uint64_t user_data )
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = user_data;
+}
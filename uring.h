@@ -0,0 +1,127 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*!
+  ¥brief io_uring をシステムコールで直接使うための薄いラッパー。
+  SQ/CQ のリングを mmap し、SQE の確保・まとめての投入・CQE の刈り取りを行う。
+  1つの Uring は1つのスレッドからだけ使うこと。
+  マルチショットの recv と提供バッファリングを使うので、Linux 6.3 以降を前提とする
+  (IORING_FEAT_LINKED_FILE の有無で判定する)。
+ */
+typedef struct {
+    int fd;
+
+    // 投入側のリング。sqe_tail はまだカーネルに見せていない末尾
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    struct io_uring_sqe *sqes;
+
+    // 完了側のリング
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring_ptr; // SQ と CQ のリングを1回で mmap した領域
+    size_t ring_size;
+    size_t sqes_size;
+} Uring;
+
+/*!
+  ¥brief 提供バッファリング。カーネルが受信のたびに1つ選んで使い、
+  使い終わったら uring_buf_ring_recycle で返す
+ */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    char *bufs;
+    unsigned entries; // 2のべき乗
+    unsigned buf_size;
+    uint16_t bgid;
+    uint16_t tail;
+} UringBufRing;
+
+/*!
+  ¥brief リングを作る
+  ¥param entries SQ の要素数。CQ はその4倍にする
+  ¥return 成功した場合は1。カーネルが対応していない場合も0で、errno を設定する
+ */
+int uring_init( Uring * ring, const unsigned entries );
+
+/*!
+  ¥brief このカーネルで uring_init と uring_buf_ring_init が使えるかを試す
+  ¥return 使える場合は1。使えない場合は0で、errno に理由を設定する
+ */
+int uring_supported();
+
+/*!
+  ¥brief リングを閉じる。処理中の操作はカーネルが取り消す
+ */
+void uring_destroy( Uring * ring );
+
+/*!
+  ¥brief 空の SQE を1つ確保する。リングが一杯ならそれまでの分を先に投入する
+  ¥return 確保できなければ NULL
+ */
+struct io_uring_sqe * uring_get_sqe( Uring * ring );
+
+/*!
+  ¥brief 溜まった SQE を投入し、CQE が1つ以上届くか timeout_ms が過ぎるまで待つ
+  ¥param timeout_ms 負なら無期限に待つ
+  ¥return 成功またはタイムアウトなら0以上、失敗なら -errno
+ */
+int uring_submit_and_wait( Uring * ring, const int timeout_ms );
+
+/*!
+  ¥brief 先頭の CQE を返す。無ければ NULL。使い終わったら uring_cqe_seen を呼ぶ
+ */
+struct io_uring_cqe * uring_peek_cqe( Uring * ring );
+
+/*!
+  ¥brief 先頭の CQE を消費する
+ */
+void uring_cqe_seen( Uring * ring );
+
+/*!
+  ¥brief 提供バッファリングを作ってリングに登録し、すべてのバッファを渡す
+  ¥param entries バッファの数。2のべき乗
+  ¥return 成功した場合は1
+ */
+int uring_buf_ring_init( Uring * ring, UringBufRing * br, const uint16_t bgid,
+                         const unsigned entries, const unsigned buf_size );
+
+/*!
+  ¥brief 提供バッファリングの登録を外して解放する
+ */
+void uring_buf_ring_destroy( Uring * ring, UringBufRing * br );
+
+/*!
+  ¥brief バッファ番号 bid のバッファの先頭
+ */
+char * uring_buf_ring_data( UringBufRing * br, const uint16_t bid );
+
+/*!
+  ¥brief 使い終わったバッファをカーネルへ返す
+ */
+void uring_buf_ring_recycle( UringBufRing * br, const uint16_t bid );
+
+/* 各操作の SQE を埋める。user_data は CQE にそのまま返る */
+void uring_prep_multishot_accept( struct io_uring_sqe * sqe, const int fd, const uint64_t user_data );
+void uring_prep_multishot_recv( struct io_uring_sqe * sqe, const int fd, const uint16_t bgid,
+                                const uint64_t user_data );
+void uring_prep_sendmsg( struct io_uring_sqe * sqe, const int fd, const struct msghdr * msg,
+                         const uint64_t user_data );
+void uring_prep_poll( struct io_uring_sqe * sqe, const int fd, const unsigned events,
+                      const uint64_t user_data );
+void uring_prep_cancel_fd( struct io_uring_sqe * sqe, const int fd, const uint64_t user_data );
+
+#endif
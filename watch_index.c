@@ -0,0 +1,680 @@
+
+#include "watch_index.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_NODE UINT32_MAX
+#define ROOT 0
+
+typedef struct {
+    uint8_t byte;
+    uint32_t child;
+} Edge;
+
+typedef struct {
+    Edge *edges; // byte の昇順。二分探索で子を探す
+    uint16_t n_edges;
+    uint16_t edge_capacity;
+    uint8_t byte; // 親からこのノードへの文字
+    uint32_t parent; // 未使用なら空き一覧の次のノード
+    uint32_t fail; // このノードの文字列の最長の真の接尾辞に当たるノード
+    uint32_t output; // fail を辿って最初に見つかる、キーワードが終わるノード。無ければ ROOT
+    int32_t pattern; // ここで終わるキーワードの番号。無ければ-1
+} Node;
+
+typedef struct {
+    char *keyword;
+    size_t len;
+    uint32_t node;
+    int refcount; // 0 なら未使用
+    int next_free; // 未使用なら空き一覧の次の要素。-1 で終わり
+    uint64_t serial;
+} Pattern;
+
+// 照合用のオートマトンの状態。トライのノードを幅優先の順に詰めたもの
+typedef struct {
+    uint32_t first_edge; // Automaton.edges の中で子の辺が始まる位置
+    uint16_t n_edges;
+    int32_t output_index; // ここで終わるキーワードの Automaton.outputs の添字。無ければ-1
+    uint32_t fail;
+    uint32_t output;
+} State;
+
+typedef struct {
+    uint32_t id;
+    uint64_t serial;
+    const char *keyword; // Automaton.keywords の中を指す
+    size_t len;
+    uint64_t stamp; // 最後に見つかった照合。1回の照合で同じキーワードを二度渡さない
+} Output;
+
+// 作り終えた後は書き換えない、照合専用のオートマトン
+typedef struct {
+    State *states; // states[ROOT] が根
+    Edge *edges; // child は states の添字
+    Output *outputs;
+    char *keywords;
+    uint64_t stamp;
+} Automaton;
+
+struct WatchIndex {
+    pthread_mutex_t lock; // トライとキーワードの書き換え
+
+    // 照合に使うオートマトン。キーワードが無ければ NULL。
+    // 差し替えと照合は match_lock で守るので、差し替えた後は古い方をすぐ解放してよい
+    pthread_mutex_t match_lock;
+    Automaton *automaton;
+
+    Node *nodes; // nodes[ROOT] が根
+    uint32_t n_nodes;
+    uint32_t node_capacity;
+    uint32_t free_node; // 空き一覧の先頭。NO_NODE で終わり
+
+    Pattern *patterns;
+    int n_patterns; // 使ったことのある要素の数
+    int pattern_capacity;
+    int free_pattern;
+    int count; // 登録中のキーワードの数
+
+    uint64_t last_serial;
+
+    // トライを書き換えてからオートマトンを作り直せていない
+    int dirty;
+    uint32_t *queue; // 張り直しの幅優先探索で使う
+    uint32_t *state_of; // ノード -> 状態の番号
+    uint32_t queue_capacity;
+    uint32_t n_queued;
+};
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+find_child( const Node * node,
+            const uint8_t byte )
+{
+    int lo = 0;
+    int hi = node->n_edges;
+    while ( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if ( node->edges[mid].byte < byte ) lo = mid + 1;
+        else hi = mid;
+    }
+    return ( lo < node->n_edges && node->edges[lo].byte == byte
+             ? node->edges[lo].child
+             : NO_NODE );
+}
+
+/* --------------------------------------------------------------------------- */
+static uint32_t
+find_next_state( const Automaton * a,
+                 const State * state,
+                 const uint8_t byte )
+{
+    const Edge *edges = a->edges + state->first_edge;
+    int lo = 0;
+    int hi = state->n_edges;
+    while ( lo < hi )
+    {
+        const int mid = ( lo + hi ) / 2;
+        if ( edges[mid].byte < byte ) lo = mid + 1;
+        else hi = mid;
+    }
+    return ( lo < state->n_edges && edges[lo].byte == byte
+             ? edges[lo].child
+             : NO_NODE );
+}
+
+/* --------------------------------------------------------------------------- */
+static void
+free_automaton( Automaton * a )
+{
+    if ( a == NULL )
+    {
+        return;
+    }
+    free( a->states );
+    free( a->edges );
+    free( a->outputs );
+    free( a->keywords );
+    free( a );
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  parent の下に byte の子を作る。ロックを持った状態で呼ぶ
+  ¥return 作ったノード。メモリ不足なら NO_NODE
+ */
+static uint32_t
+add_child( WatchIndex * index,
+           const uint32_t parent,
+           const uint8_t byte )
+{
+    Node *p = &index->nodes[parent];
+    if ( p->n_edges >= p->edge_capacity )
+    {
+        const uint16_t new_capacity = ( p->edge_capacity == 0 ? 2 : p->edge_capacity * 2 );
+        Edge *edges = realloc( p->edges, new_capacity * sizeof( Edge ) );
+        if ( edges == NULL )
+        {
+            perror( "realloc" );
+            return NO_NODE;
+        }
+        p->edges = edges;
+        p->edge_capacity = new_capacity;
+    }
+
+    uint32_t n = index->free_node;
+    if ( n != NO_NODE )
+    {
+        index->free_node = index->nodes[n].parent;
+    }
+    else
+    {
+        if ( index->n_nodes >= index->node_capacity )
+        {
+            const uint32_t new_capacity = index->node_capacity * 2;
+            Node *nodes = realloc( index->nodes, new_capacity * sizeof( Node ) );
+            if ( nodes == NULL )
+            {
+                perror( "realloc" );
+                return NO_NODE;
+            }
+            index->nodes = nodes;
+            index->node_capacity = new_capacity;
+        }
+        n = index->n_nodes++;
+    }
+
+    Node *node = &index->nodes[n];
+    memset( node, 0, sizeof( Node ) );
+    node->byte = byte;
+    node->parent = parent;
+    node->pattern = -1;
+
+    // nodes を realloc したかもしれないので親を取り直す
+    p = &index->nodes[parent];
+    int i = p->n_edges;
+    while ( i > 0 && p->edges[i - 1].byte > byte )
+    {
+        p->edges[i] = p->edges[i - 1];
+        --i;
+    }
+    p->edges[i].byte = byte;
+    p->edges[i].child = n;
+    ++p->n_edges;
+    return n;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  子もキーワードも無くなったノードを根に向かって取り除く。ロックを持った状態で呼ぶ
+ */
+static void
+prune( WatchIndex * index,
+       uint32_t n )
+{
+    while ( n != ROOT
+            && index->nodes[n].n_edges == 0
+            && index->nodes[n].pattern < 0 )
+    {
+        Node *node = &index->nodes[n];
+        const uint32_t parent = node->parent;
+        Node *p = &index->nodes[parent];
+        for ( int i = 0; i < p->n_edges; ++i )
+        {
+            if ( p->edges[i].child == n )
+            {
+                memmove( &p->edges[i], &p->edges[i + 1], ( p->n_edges - i - 1 ) * sizeof( Edge ) );
+                --p->n_edges;
+                break;
+            }
+        }
+
+        free( node->edges );
+        node->edges = NULL;
+        node->edge_capacity = 0;
+        node->parent = index->free_node;
+        index->free_node = n;
+        n = parent;
+    }
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  幅優先にすべてのノードの失敗リンクと出力リンクを張り直す。ロックを持った状態で呼ぶ。
+  キーワードの総長に比例する手間で、根以外のノードを訪れた順に queue に残す
+ */
+static int
+build_links( WatchIndex * index )
+{
+    if ( index->queue_capacity < index->n_nodes )
+    {
+        uint32_t *queue = realloc( index->queue, index->node_capacity * sizeof( uint32_t ) );
+        if ( queue != NULL ) index->queue = queue;
+        uint32_t *state_of = realloc( index->state_of, index->node_capacity * sizeof( uint32_t ) );
+        if ( state_of != NULL ) index->state_of = state_of;
+        if ( queue == NULL
+             || state_of == NULL )
+        {
+            perror( "realloc" );
+            return 0;
+        }
+        index->queue_capacity = index->node_capacity;
+    }
+
+    uint32_t head = 0;
+    uint32_t tail = 0;
+    Node *root = &index->nodes[ROOT];
+    root->fail = ROOT;
+    root->output = ROOT;
+    for ( int i = 0; i < root->n_edges; ++i )
+    {
+        Node *child = &index->nodes[root->edges[i].child];
+        child->fail = ROOT;
+        child->output = ROOT;
+        index->queue[tail++] = root->edges[i].child;
+    }
+
+    while ( head < tail )
+    {
+        const Node *node = &index->nodes[index->queue[head++]];
+        for ( int i = 0; i < node->n_edges; ++i )
+        {
+            const uint8_t byte = node->edges[i].byte;
+            Node *child = &index->nodes[node->edges[i].child];
+
+            // 親の失敗リンクを辿り、同じ文字の子を持つノードを探す
+            uint32_t f = node->fail;
+            uint32_t next;
+            while ( ( next = find_child( &index->nodes[f], byte ) ) == NO_NODE
+                    && f != ROOT )
+            {
+                f = index->nodes[f].fail;
+            }
+            child->fail = ( next != NO_NODE ? next : ROOT );
+
+            const Node *fail = &index->nodes[child->fail];
+            child->output = ( fail->pattern >= 0 ? child->fail : fail->output );
+            index->queue[tail++] = node->edges[i].child;
+        }
+    }
+
+    index->n_queued = tail;
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  張り直したトライを、照合専用のオートマトンに写す。ロックを持った状態で build_links の後に呼ぶ
+  ¥return 作ったオートマトン。メモリ不足なら NULL
+ */
+static Automaton *
+make_automaton( WatchIndex * index )
+{
+    const uint32_t n_states = index->n_queued + 1;
+    index->state_of[ROOT] = ROOT;
+    for ( uint32_t k = 0; k < index->n_queued; ++k )
+    {
+        index->state_of[index->queue[k]] = k + 1;
+    }
+
+    size_t keyword_bytes = 0;
+    for ( int i = 0; i < index->n_patterns; ++i )
+    {
+        if ( index->patterns[i].refcount > 0 ) keyword_bytes += index->patterns[i].len;
+    }
+
+    Automaton *a = calloc( 1, sizeof( Automaton ) );
+    if ( a == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    a->states = malloc( n_states * sizeof( State ) );
+    a->edges = malloc( n_states * sizeof( Edge ) ); // 辺は根以外の状態の数だけある
+    a->outputs = malloc( index->count * sizeof( Output ) );
+    a->keywords = malloc( keyword_bytes );
+    if ( a->states == NULL
+         || a->edges == NULL
+         || a->outputs == NULL
+         || a->keywords == NULL )
+    {
+        perror( "malloc" );
+        free_automaton( a );
+        return NULL;
+    }
+
+    uint32_t n_edges = 0;
+    int n_outputs = 0;
+    size_t keyword_pos = 0;
+    for ( uint32_t k = 0; k < n_states; ++k )
+    {
+        const Node *node = &index->nodes[k == 0 ? ROOT : index->queue[k - 1]];
+        State *state = &a->states[k];
+        state->first_edge = n_edges;
+        state->n_edges = node->n_edges;
+        state->fail = index->state_of[node->fail];
+        state->output = index->state_of[node->output];
+        for ( int i = 0; i < node->n_edges; ++i )
+        {
+            a->edges[n_edges].byte = node->edges[i].byte;
+            a->edges[n_edges].child = index->state_of[node->edges[i].child];
+            ++n_edges;
+        }
+
+        state->output_index = -1;
+        if ( node->pattern >= 0 )
+        {
+            const Pattern *p = &index->patterns[node->pattern];
+            Output *o = &a->outputs[n_outputs];
+            memcpy( a->keywords + keyword_pos, p->keyword, p->len );
+            o->id = (uint32_t)node->pattern;
+            o->serial = p->serial;
+            o->keyword = a->keywords + keyword_pos;
+            o->len = p->len;
+            o->stamp = 0;
+            keyword_pos += p->len;
+            state->output_index = n_outputs++;
+        }
+    }
+    return a;
+}
+
+/* --------------------------------------------------------------------------- */
+/*!
+  トライからオートマトンを作り直し、照合に使うものと差し替える。ロックを持った状態で呼ぶ。
+  照合は差し替えの間だけ待つ。作り直せなければ古いオートマトンを使い続け、次の変更のときにやり直す
+ */
+static void
+publish( WatchIndex * index )
+{
+    Automaton *a = NULL;
+    if ( index->count > 0 )
+    {
+        if ( ! build_links( index )
+             || ( a = make_automaton( index ) ) == NULL )
+        {
+            index->dirty = 1;
+            return;
+        }
+    }
+
+    pthread_mutex_lock( &index->match_lock );
+    Automaton *old = index->automaton;
+    index->automaton = a;
+    pthread_mutex_unlock( &index->match_lock );
+
+    free_automaton( old );
+    index->dirty = 0;
+}
+
+/* --------------------------------------------------------------------------- */
+WatchIndex *
+watch_index_create( void )
+{
+    WatchIndex *index = calloc( 1, sizeof( WatchIndex ) );
+    if ( index == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+
+    index->node_capacity = 64;
+    index->nodes = calloc( index->node_capacity, sizeof( Node ) );
+    if ( index->nodes == NULL )
+    {
+        perror( "calloc" );
+        free( index );
+        return NULL;
+    }
+
+    pthread_mutex_init( &index->lock, NULL );
+    pthread_mutex_init( &index->match_lock, NULL );
+    index->n_nodes = 1;
+    index->nodes[ROOT].pattern = -1;
+    index->free_node = NO_NODE;
+    index->free_pattern = -1;
+    return index;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+watch_index_destroy( WatchIndex * index )
+{
+    if ( index == NULL )
+    {
+        return;
+    }
+    pthread_mutex_destroy( &index->lock );
+    pthread_mutex_destroy( &index->match_lock );
+    free_automaton( index->automaton );
+    for ( uint32_t i = 0; i < index->n_nodes; ++i )
+    {
+        free( index->nodes[i].edges );
+    }
+    for ( int i = 0; i < index->n_patterns; ++i )
+    {
+        free( index->patterns[i].keyword );
+    }
+    free( index->nodes );
+    free( index->patterns );
+    free( index->queue );
+    free( index->state_of );
+    free( index );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+watch_index_add( WatchIndex * index,
+                 const char * keyword,
+                 const size_t len,
+                 uint32_t * id,
+                 uint64_t * serial )
+{
+    if ( len == 0 )
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock( &index->lock );
+
+    // 途中で失敗したら作ったノードを取り除く
+    uint32_t n = ROOT;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        uint32_t child = find_child( &index->nodes[n], (uint8_t)keyword[i] );
+        if ( child == NO_NODE )
+        {
+            child = add_child( index, n, (uint8_t)keyword[i] );
+            if ( child == NO_NODE )
+            {
+                prune( index, n );
+                pthread_mutex_unlock( &index->lock );
+                return 0;
+            }
+        }
+        n = child;
+    }
+
+    Node *node = &index->nodes[n];
+    if ( node->pattern >= 0 )
+    {
+        // 参照が増えるだけならオートマトンは変わらない
+        Pattern *p = &index->patterns[node->pattern];
+        ++p->refcount;
+        *id = (uint32_t)node->pattern;
+        *serial = p->serial;
+        if ( index->dirty ) publish( index );
+        pthread_mutex_unlock( &index->lock );
+        return 1;
+    }
+
+    char *copy = malloc( len );
+    int i = index->free_pattern;
+    if ( i < 0
+         && copy != NULL
+         && index->n_patterns >= index->pattern_capacity )
+    {
+        const int new_capacity = ( index->pattern_capacity == 0 ? 16 : index->pattern_capacity * 2 );
+        Pattern *patterns = realloc( index->patterns, new_capacity * sizeof( Pattern ) );
+        if ( patterns != NULL )
+        {
+            index->patterns = patterns;
+            index->pattern_capacity = new_capacity;
+        }
+    }
+    if ( copy == NULL
+         || ( i < 0 && index->n_patterns >= index->pattern_capacity ) )
+    {
+        perror( "malloc" );
+        free( copy );
+        prune( index, n );
+        pthread_mutex_unlock( &index->lock );
+        return 0;
+    }
+
+    if ( i >= 0 )
+    {
+        index->free_pattern = index->patterns[i].next_free;
+    }
+    else
+    {
+        i = index->n_patterns++;
+    }
+
+    Pattern *p = &index->patterns[i];
+    memcpy( copy, keyword, len );
+    p->keyword = copy;
+    p->len = len;
+    p->node = n;
+    p->refcount = 1;
+    p->next_free = -1;
+    p->serial = ++index->last_serial;
+    index->nodes[n].pattern = i;
+    ++index->count;
+    publish( index );
+
+    *id = (uint32_t)i;
+    *serial = p->serial;
+    pthread_mutex_unlock( &index->lock );
+    return 1;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+watch_index_remove( WatchIndex * index,
+                    const uint32_t id )
+{
+    pthread_mutex_lock( &index->lock );
+    if ( (int)id >= index->n_patterns
+         || index->patterns[id].refcount == 0 )
+    {
+        pthread_mutex_unlock( &index->lock );
+        return;
+    }
+
+    Pattern *p = &index->patterns[id];
+    if ( --p->refcount == 0 )
+    {
+        index->nodes[p->node].pattern = -1;
+        prune( index, p->node );
+        free( p->keyword );
+        p->keyword = NULL;
+        p->next_free = index->free_pattern;
+        index->free_pattern = (int)id;
+        --index->count;
+        publish( index );
+    }
+    pthread_mutex_unlock( &index->lock );
+}
+
+/* --------------------------------------------------------------------------- */
+int
+watch_index_lookup( WatchIndex * index,
+                    const char * keyword,
+                    const size_t len,
+                    uint32_t * id )
+{
+    pthread_mutex_lock( &index->lock );
+    uint32_t n = ROOT;
+    for ( size_t i = 0; i < len && n != NO_NODE; ++i )
+    {
+        n = find_child( &index->nodes[n], (uint8_t)keyword[i] );
+    }
+    const int found = ( len > 0 && n != NO_NODE && index->nodes[n].pattern >= 0 );
+    if ( found )
+    {
+        *id = (uint32_t)index->nodes[n].pattern;
+    }
+    pthread_mutex_unlock( &index->lock );
+    return found;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+watch_index_match( WatchIndex * index,
+                   const char * text,
+                   const size_t len,
+                   WatchIndexCallback callback,
+                   void * arg )
+{
+    // 作り終えたオートマトンを読むだけで、ここでは作り直さない
+    pthread_mutex_lock( &index->match_lock );
+    Automaton *a = index->automaton;
+    if ( a == NULL )
+    {
+        pthread_mutex_unlock( &index->match_lock );
+        return 0;
+    }
+
+    const uint64_t stamp = ++a->stamp;
+    int n_matched = 0;
+    uint32_t s = ROOT;
+    for ( size_t i = 0; i < len; ++i )
+    {
+        const uint8_t byte = (uint8_t)text[i];
+        uint32_t next;
+        while ( ( next = find_next_state( a, &a->states[s], byte ) ) == NO_NODE
+                && s != ROOT )
+        {
+            s = a->states[s].fail;
+        }
+        s = ( next != NO_NODE ? next : ROOT );
+
+        // ここで終わるキーワードを出力リンクで辿る。
+        // 渡し済みのキーワードに当たったら、その先はそれの接尾辞なのでやはり渡し済み
+        uint32_t t = ( a->states[s].output_index >= 0 ? s : a->states[s].output );
+        while ( t != ROOT )
+        {
+            Output *o = &a->outputs[a->states[t].output_index];
+            if ( o->stamp == stamp )
+            {
+                break;
+            }
+            o->stamp = stamp;
+            ++n_matched;
+            if ( ! callback( o->id, o->serial, o->keyword, o->len, arg ) )
+            {
+                pthread_mutex_unlock( &index->match_lock );
+                return n_matched;
+            }
+            t = a->states[t].output;
+        }
+    }
+
+    pthread_mutex_unlock( &index->match_lock );
+    return n_matched;
+}
+
+/* --------------------------------------------------------------------------- */
+int
+watch_index_count( WatchIndex * index )
+{
+    pthread_mutex_lock( &index->lock );
+    const int n = index->count;
+    pthread_mutex_unlock( &index->lock );
+    return n;
+}
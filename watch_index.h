@@ -0,0 +1,73 @@
+#ifndef WATCH_INDEX_H
+#define WATCH_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*!
+  ¥brief (watch "kw") で登録されたキーワードの集合。
+  全キーワードを1つの Aho-Corasick オートマトンにまとめ、メッセージを1回走査するだけで
+  含まれるキーワードをすべて見つける。走査の手間はメッセージの長さに比例し、キーワードの数にはよらない。
+  キーワードの追加・削除はトライを書き換えた後、その場で照合専用のオートマトンを作り直して差し替える。
+  照合は作り終えたオートマトンを読むだけで、作り直しを待つのは差し替えの間だけになる。
+  同じキーワードは参照数で共有し、番号は参照が無くなると使い回す。
+  どの関数も複数スレッドから呼んでよい。
+ */
+typedef struct WatchIndex WatchIndex;
+
+/*!
+  ¥brief 照合で見つかったキーワードを受け取るコールバック。照合のロックを持った状態で呼ばれる
+  ¥param id キーワードの番号
+  ¥param serial 登録ごとに異なる番号。使い回された番号と取り違えないために使う
+  ¥param keyword キーワード。終端文字は無い
+  ¥param len キーワードの長さ
+  ¥param arg watch_index_match に渡した引数
+  ¥return 続ける場合は1。0 なら照合をそこで止める
+ */
+typedef int (*WatchIndexCallback)( const uint32_t id, const uint64_t serial,
+                                   const char * keyword, const size_t len, void * arg );
+
+/*!
+  ¥brief 空のインデックスを作る
+  ¥return 作成されたインデックス。エラーの場合は NULL
+ */
+WatchIndex * watch_index_create( void );
+
+/*!
+  ¥brief インデックスを解放する
+ */
+void watch_index_destroy( WatchIndex * index );
+
+/*!
+  ¥brief キーワードの参照を1つ増やす。無ければ登録し、オートマトンを作り直す
+  ¥param id キーワードの番号
+  ¥param serial キーワードを登録したときの番号
+  ¥return 成功した場合は1。空のキーワードやメモリ不足の場合は0
+ */
+int watch_index_add( WatchIndex * index, const char * keyword, const size_t len,
+                     uint32_t * id, uint64_t * serial );
+
+/*!
+  ¥brief キーワードの参照を1つ減らし、無くなれば登録を消してオートマトンを作り直す
+ */
+void watch_index_remove( WatchIndex * index, const uint32_t id );
+
+/*!
+  ¥brief 登録済みのキーワードの番号を探す
+  ¥return 見つかった場合は1
+ */
+int watch_index_lookup( WatchIndex * index, const char * keyword, const size_t len, uint32_t * id );
+
+/*!
+  ¥brief text に含まれるキーワードを、それぞれ1回ずつ callback へ渡す
+  ¥return callback へ渡したキーワードの数
+ */
+int watch_index_match( WatchIndex * index, const char * text, const size_t len,
+                       WatchIndexCallback callback, void * arg );
+
+/*!
+  ¥brief 登録されているキーワードの数
+ */
+int watch_index_count( WatchIndex * index );
+
+#endif
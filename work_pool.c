@@ -0,0 +1,116 @@
+
+#include "work_pool.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct WorkPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    WorkItem *head; // 次に取り出す仕事
+    WorkItem *tail;
+    int stopping;
+
+    int n_threads;
+    pthread_t threads[];
+};
+
+/* --------------------------------------------------------------------------- */
+static void *
+worker_main( void * arg )
+{
+    WorkPool *pool = arg;
+    pthread_mutex_lock( &pool->lock );
+    for ( ;; )
+    {
+        while ( pool->head == NULL
+                && ! pool->stopping )
+        {
+            pthread_cond_wait( &pool->cond, &pool->lock );
+        }
+        WorkItem *item = pool->head;
+        if ( item == NULL )
+        {
+            break; // 止める指示があり、残りの仕事も無い
+        }
+        pool->head = item->next;
+        if ( pool->head == NULL ) pool->tail = NULL;
+
+        pthread_mutex_unlock( &pool->lock );
+        item->run( item );
+        pthread_mutex_lock( &pool->lock );
+    }
+    pthread_mutex_unlock( &pool->lock );
+    return NULL;
+}
+
+/* --------------------------------------------------------------------------- */
+WorkPool *
+work_pool_create( const int n_threads )
+{
+    WorkPool *pool = calloc( 1, sizeof( WorkPool ) + n_threads * sizeof( pthread_t ) );
+    if ( pool == NULL )
+    {
+        perror( "calloc" );
+        return NULL;
+    }
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->cond, NULL );
+
+    for ( ; pool->n_threads < n_threads; ++pool->n_threads )
+    {
+        const int err = pthread_create( &pool->threads[pool->n_threads], NULL, worker_main, pool );
+        if ( err != 0 )
+        {
+            fprintf( stderr, "pthread_create: %s\n", strerror( err ) );
+            work_pool_destroy( pool );
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/* --------------------------------------------------------------------------- */
+void
+work_pool_submit( WorkPool * pool,
+                  WorkItem * item )
+{
+    item->next = NULL;
+    pthread_mutex_lock( &pool->lock );
+    if ( pool->tail != NULL )
+    {
+        pool->tail->next = item;
+    }
+    else
+    {
+        pool->head = item;
+    }
+    pool->tail = item;
+    pthread_cond_signal( &pool->cond );
+    pthread_mutex_unlock( &pool->lock );
+}
+
+/* --------------------------------------------------------------------------- */
+void
+work_pool_destroy( WorkPool * pool )
+{
+    if ( pool == NULL )
+    {
+        return;
+    }
+
+    pthread_mutex_lock( &pool->lock );
+    pool->stopping = 1;
+    pthread_cond_broadcast( &pool->cond );
+    pthread_mutex_unlock( &pool->lock );
+
+    for ( int i = 0; i < pool->n_threads; ++i )
+    {
+        pthread_join( pool->threads[i], NULL );
+    }
+    pthread_cond_destroy( &pool->cond );
+    pthread_mutex_destroy( &pool->lock );
+    free( pool );
+}
@@ -0,0 +1,32 @@
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+/*!
+  ¥brief イベントループの外で重い処理をするワーカースレッドの集まり。
+  投入した仕事は投入順に取り出され、空いているスレッドで実行される。
+  結果を返す方法は仕事の側で決める。要素の構造体の先頭に WorkItem を埋め込んで使う。
+ */
+typedef struct WorkPool WorkPool;
+
+typedef struct WorkItem {
+    struct WorkItem *next;
+    void (*run)( struct WorkItem * item ); //!< ワーカースレッドで呼ばれる
+} WorkItem;
+
+/*!
+  ¥brief n_threads 個のスレッドを起動する
+  ¥return 作成されたプール。エラーの場合は NULL
+ */
+WorkPool * work_pool_create( const int n_threads );
+
+/*!
+  ¥brief 仕事を投入する。どのスレッドから呼んでもよい
+ */
+void work_pool_submit( WorkPool * pool, WorkItem * item );
+
+/*!
+  ¥brief 投入済みの仕事をすべて実行してからスレッドを止め、プールを解放する
+ */
+void work_pool_destroy( WorkPool * pool );
+
+#endif